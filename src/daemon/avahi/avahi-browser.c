@@ -0,0 +1,281 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <avahi-client/lookup.h>
+#include <avahi-common/address.h>
+#include <avahi-common/strlst.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+#include "daemon-list.h"
+#include "avahi/avahi-browser.h"
+
+struct s_browser {
+  AvahiServiceBrowser *browser;
+  AvahiClient *client;
+  struct s_browser_funcs funcs;
+  struct s_list *resolvers;
+  struct s_hash *services;
+  void *userdata;
+};
+
+/**
+ * @brief Check the txt records of a service
+ * @param [in] txt: records to browse
+ * @return 0 if a record identifies a cerebrum service, -ENOENT otherwise
+ */
+static int _s_browser_check(AvahiStringList *txt)
+{
+  for (; txt; txt = avahi_string_list_get_next(txt))
+    if (s_service_check((const char *)avahi_string_list_get_text(txt)) == 0)
+      return 0;
+  return -ENOENT;
+}
+
+/**
+ * @brief Hash a service record, a service is announced once per interface and
+ * protocol, each record with its own address
+ * @param [in] key: record to hash
+ * @return the hash value
+ */
+static uint32_t _s_browser_hash(const void *key)
+{
+  const struct s_browser_data *data = key;
+
+  return s_str_hash(data->name) ^ ((uint32_t)data->interface << 8) ^
+    (uint32_t)data->protocol;
+}
+
+/**
+ * @brief Compare two service records
+ * @return a non zero value if both records are the same, 0 otherwise
+ */
+static int _s_browser_equal(const void *a, const void *b)
+{
+  const struct s_browser_data *first = a;
+  const struct s_browser_data *second = b;
+
+  return first->interface == second->interface &&
+    first->protocol == second->protocol &&
+    s_str_equal(first->name, second->name);
+}
+
+/**
+ * @brief Duplicate a browser data
+ * @param [in] data: data to copy
+ * @return a valid pointer on success, NULL on error
+ */
+static struct s_browser_data *_s_browser_data_dup(
+  const struct s_browser_data *data)
+{
+  struct s_browser_data *copy = daemon_malloc(sizeof(struct s_browser_data));
+  copy->address = strdup(data->address);
+  copy->domain = strdup(data->domain);
+  copy->host = strdup(data->host);
+  copy->interface = data->interface;
+  copy->name = strdup(data->name);
+  copy->port = data->port;
+  copy->protocol = data->protocol;
+  copy->type = strdup(data->type);
+
+  if (!copy->address || !copy->domain || !copy->host || !copy->name ||
+      !copy->type) {
+    s_browser_data_free(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+/**
+ * @brief Avahi resolver callback, the resolver is released once it answered
+ */
+static void _s_browser_resolve_cbk(AvahiServiceResolver *resolver,
+  AvahiIfIndex interface, AvahiProtocol protocol, AvahiResolverEvent event,
+  const char *name, const char *type, const char *domain, const char *host,
+  const AvahiAddress *address, uint16_t port, AvahiStringList *txt,
+  AvahiLookupResultFlags flags, struct s_browser *browser)
+{
+  daemon_return_if_fail(resolver);
+  daemon_return_if_fail(browser);
+
+  browser->resolvers = s_list_remove(browser->resolvers, resolver);
+  if (event != AVAHI_RESOLVER_FOUND) {
+    daemon_log(LOG_WARNING, "failed to resolve '%s'\n", name);
+    goto end;
+  }
+  /* our own service and the foreign ones are ignored */
+  if ((flags & AVAHI_LOOKUP_RESULT_OUR_OWN) || _s_browser_check(txt) != 0)
+    goto end;
+
+  char text[AVAHI_ADDRESS_STR_MAX];
+  avahi_address_snprint(text, sizeof(text), address);
+  struct s_browser_data data = {
+    .address = text,
+    .domain = (char *)domain,
+    .host = (char *)host,
+    .interface = interface,
+    .name = (char *)name,
+    .port = port,
+    .protocol = protocol,
+    .type = (char *)type
+  };
+
+  struct s_browser_data *known = _s_browser_data_dup(&data);
+  struct s_browser_data *found = _s_browser_data_dup(&data);
+  struct s_browser_data *stale = s_hash_steal(browser->services, &data);
+  if (!known || !found || s_hash_insert(browser->services, known,
+      known) != 0) {
+    daemon_log(LOG_ERR, "failed to store the service '%s'\n", name);
+    if (known)
+      s_browser_data_free(known);
+    if (found)
+      s_browser_data_free(found);
+    known = NULL;
+  } else {
+    browser->funcs.find(browser->userdata, found);
+  }
+  /* a record resolved again may have moved, its new address is known first
+   * so the host keeps at least one */
+  if (stale && (!known || strcmp(stale->address, known->address) != 0))
+    browser->funcs.remove(browser->userdata, stale);
+  if (stale)
+    s_browser_data_free(stale);
+
+end:
+  avahi_service_resolver_free(resolver);
+}
+
+/**
+ * @brief Release a pending resolver
+ * @param [in] resolver: resolver to delete
+ */
+static void _s_browser_resolver_free(AvahiServiceResolver *resolver)
+{
+  avahi_service_resolver_free(resolver);
+}
+
+/**
+ * @brief Avahi service browser callback
+ */
+static void _s_browser_cbk(AvahiServiceBrowser *avahi_browser,
+  AvahiIfIndex interface, AvahiProtocol protocol, AvahiBrowserEvent event,
+  const char *name, const char *type, const char *domain,
+  daemon_unused AvahiLookupResultFlags flags, struct s_browser *browser)
+{
+  daemon_return_if_fail(avahi_browser);
+  daemon_return_if_fail(browser);
+
+  switch (event) {
+  case AVAHI_BROWSER_NEW: {
+    AvahiServiceResolver *resolver = avahi_service_resolver_new(
+      browser->client, interface, protocol, name, type, domain, protocol, 0,
+      (AvahiServiceResolverCallback)_s_browser_resolve_cbk, browser);
+    if (resolver)
+      browser->resolvers = s_list_append(browser->resolvers, resolver);
+    else
+      daemon_log(LOG_ERR, "failed to resolve '%s'\n", name);
+    break;
+  }
+  case AVAHI_BROWSER_REMOVE: {
+    struct s_browser_data record = {
+      .interface = interface,
+      .name = (char *)name,
+      .protocol = protocol
+    };
+    struct s_browser_data *data = s_hash_steal(browser->services, &record);
+    if (data) {
+      browser->funcs.remove(browser->userdata, data);
+      s_browser_data_free(data);
+    }
+    break;
+  }
+  case AVAHI_BROWSER_FAILURE:
+    browser->funcs.failure(browser->userdata,
+      avahi_client_errno(browser->client));
+    break;
+  case AVAHI_BROWSER_ALL_FOR_NOW:
+  case AVAHI_BROWSER_CACHE_EXHAUSTED:
+    break;
+  }
+}
+
+struct s_browser *s_browser_new(struct s_client *client, void *userdata,
+  const struct s_browser_funcs *funcs)
+{
+  daemon_return_val_if_fail(client, NULL);
+  daemon_return_val_if_fail(funcs, NULL);
+
+  AvahiClient *avahi_client = s_client_toavahi(client);
+  daemon_return_val_if_fail(avahi_client, NULL);
+
+  struct s_service_data *service = s_service_generate();
+  daemon_return_val_if_fail(service, NULL);
+
+  struct s_browser *browser = daemon_malloc(sizeof(struct s_browser));
+  browser->client = avahi_client;
+  browser->funcs = *funcs;
+  browser->services = s_hash_new(_s_browser_hash, _s_browser_equal, NULL,
+    (s_destroy_cbk)s_browser_data_free);
+  browser->userdata = userdata;
+  browser->browser = avahi_service_browser_new(avahi_client, AVAHI_IF_UNSPEC,
+    service->protocol, service->type, NULL, 0,
+    (AvahiServiceBrowserCallback)_s_browser_cbk, browser);
+  s_service_free(service);
+
+  if (!browser->browser || !browser->services)
+    goto error;
+
+  return browser;
+
+error:
+  daemon_log(LOG_ERR, "failed to create a browser\n");
+  s_browser_free(browser);
+  return NULL;
+}
+
+void s_browser_free(struct s_browser *browser)
+{
+  daemon_return_if_fail(browser);
+
+  /* pending resolvers would answer to a freed browser */
+  s_list_free_full(browser->resolvers,
+    (s_destroy_cbk)_s_browser_resolver_free);
+  if (browser->browser)
+    avahi_service_browser_free(browser->browser);
+  if (browser->services)
+    s_hash_free(browser->services);
+  daemon_free(browser);
+}
+
+void s_browser_data_free(struct s_browser_data *data)
+{
+  daemon_return_if_fail(data);
+
+  if (data->address)
+    daemon_free(data->address);
+  if (data->domain)
+    daemon_free(data->domain);
+  if (data->host)
+    daemon_free(data->host);
+  if (data->name)
+    daemon_free(data->name);
+  if (data->type)
+    daemon_free(data->type);
+  daemon_free(data);
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AVAHI_AVAHI_BROWSER_H_
+# define _AVAHI_AVAHI_BROWSER_H_
+
+# include <avahi-client/client.h>
+# include "avahi-client.h"
+# include "avahi-service.h"
+
+struct s_browser;
+
+/**
+ * @brief Resolved description of a cerebrum service
+ */
+struct s_browser_data {
+  char *address;
+  char *domain;
+  char *host;
+  int interface;
+  char *name;
+  uint16_t port;
+  int protocol;
+  char *type;
+};
+
+/**
+ * @brief Call when an error occured.
+ * @param [in] userdata: userdata passing through the allocation
+ * @param [in] error: the errno value
+ */
+typedef void (*s_browser_failure_cbk)(void *userdata, int error);
+
+/**
+ * @brief Call when a service is found and resolved
+ * @param [in] userdata: userdata passing through the allocation
+ * @param [in] data: service found, to release with #s_browser_data_free
+ */
+typedef void (*s_browser_find_cbk)(void *userdata,
+  struct s_browser_data *data);
+
+/**
+ * @brief Call when a service record previously found disappears. A service is
+ * found once per interface and protocol, each record goes away on its own
+ * @param [in] userdata: userdata passing through the allocation
+ * @param [in] data: service record removed, with the address it resolved to
+ */
+typedef void (*s_browser_remove_cbk)(void *userdata,
+  const struct s_browser_data *data);
+
+struct s_browser_funcs {
+  s_browser_failure_cbk failure;
+  s_browser_find_cbk find;
+  s_browser_remove_cbk remove;
+};
+
+/**
+ * @brief Allocate a new browser, looking for the cerebrum services published
+ * by the other hosts
+ * @param [in] client: client structure
+ * @param [in] userdata: user pointer
+ * @param [in] funcs: browser behavior structure
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_browser *s_browser_new(struct s_client *client, void *userdata,
+  const struct s_browser_funcs *funcs);
+
+/**
+ * @brief Deallocate a specific browser
+ * @param [in] browser: browser to delete
+ */
+void s_browser_free(struct s_browser *browser);
+
+/**
+ * @brief Deallocate a specific browser data
+ * @param [in] data: data to delete
+ */
+void s_browser_data_free(struct s_browser_data *data);
+
+#endif /* !_AVAHI_AVAHI_BROWSER_H_ */
@@ -37,7 +37,7 @@ struct s_service_data *s_service_generate(void)
   data->interface = AVAHI_IF_UNSPEC;
   data->name = strdup("cerebrum");
   data->port = 651;
-  data->protocol = AVAHI_PROTO_INET;
+  data->protocol = AVAHI_PROTO_UNSPEC;
   data->type = strdup("_http._tcp");
   return data;
 }
@@ -24,6 +24,7 @@
 struct s_avahi_timer {
   AvahiTimeoutCallback callback;
   struct event *event;
+  struct s_loop *loop;
   void *userdata;
 };
 
@@ -32,6 +33,7 @@ static void _s_avahi_timeout_cbk(daemon_unused evutil_socket_t fd,
 {
   daemon_return_if_fail(timer);
 
+  s_loop_account(timer->loop, e_loop_priority_discovery);
   timer->callback((AvahiTimeout *)timer, timer->userdata);
 }
 
@@ -45,6 +47,7 @@ struct s_avahi_timer *s_avahi_timer_new(const AvahiPoll *api,
 
   struct s_avahi_timer *timer = daemon_malloc(sizeof(struct s_avahi_timer));
   timer->callback = callback;
+  timer->loop = loop;
   timer->userdata = userdata;
 
   struct timeval now, e_tv;
@@ -56,7 +59,9 @@ struct s_avahi_timer *s_avahi_timer_new(const AvahiPoll *api,
     (void)gettimeofday(&now, NULL);
     evutil_timersub(tv, &now, &e_tv);
   }
-  if (!timer->event || evtimer_add(timer->event, &e_tv) < 0)
+  if (!timer->event ||
+      s_loop_set_priority(timer->event, e_loop_priority_discovery) != 0 ||
+      evtimer_add(timer->event, &e_tv) < 0)
     goto error;
 
   return timer;
@@ -26,6 +26,7 @@ struct s_avahi_watch {
   AvahiWatchCallback callback;
   struct event *event;
   int fd;
+  struct s_loop *loop;
   void *userdata;
 };
 
@@ -34,6 +35,7 @@ static void _s_avahi_watch_cbk(daemon_unused evutil_socket_t fd,
 {
   daemon_return_if_fail(watch);
 
+  s_loop_account(watch->loop, e_loop_priority_discovery);
   AvahiWatchEvent events = 0;
   if (what & EV_READ)
     events |= AVAHI_WATCH_IN;
@@ -51,6 +53,7 @@ struct s_avahi_watch *s_avahi_watch_new(const AvahiPoll *api, int fd,
 
   struct s_avahi_watch *watch = daemon_malloc(sizeof(struct s_avahi_watch));
   watch->base = s_loop_tolibevent(api->userdata);
+  watch->loop = api->userdata;
 
   short ev_events = EV_PERSIST;
   if (events & AVAHI_WATCH_IN)
@@ -64,7 +67,9 @@ struct s_avahi_watch *s_avahi_watch_new(const AvahiPoll *api, int fd,
   watch->fd = fd;
   watch->userdata = data;
 
-  if (!watch->event || event_add(watch->event, NULL) != 0)
+  if (!watch->event ||
+      s_loop_set_priority(watch->event, e_loop_priority_discovery) != 0 ||
+      event_add(watch->event, NULL) != 0)
     goto error;
 
   return watch;
@@ -91,7 +96,9 @@ void s_avahi_watch_update(struct s_avahi_watch *watch, AvahiWatchEvent events)
   watch->event = event_new(watch->base, watch->fd, ev_events,
     (event_callback_fn)_s_avahi_watch_cbk, watch);
 
-  if (!watch->event || event_add(watch->event, NULL))
+  if (!watch->event ||
+      s_loop_set_priority(watch->event, e_loop_priority_discovery) != 0 ||
+      event_add(watch->event, NULL))
     daemon_log(LOG_ERR, "failed to update an event");
 }
 
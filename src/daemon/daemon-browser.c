@@ -25,8 +25,6 @@
 #include "avahi/avahi-browser.h"
 #include "ssl/ssl-client.h"
 
-static const char *_g_cert_path = "/home/siroz/Project/mytank/certificate";
-
 /**
  * @brief Call when an error occured.
  * @param [in] daemon: userdata passing through the allocation
@@ -40,12 +38,41 @@ static void _s_daemon_ctx_failure(struct s_daemon_ctx *ctx, int error)
 }
 
 /**
- * @brief Call when a service is found
+ * @brief Convert the address of a service record
+ * @param [in] data: service record
+ * @param [out] sa: address to fill
+ * @param [out] len: address length
+ * @return 0 on success, -EINVAL if the address is malformed
+ */
+static int _s_daemon_ctx_address(const struct s_browser_data *data,
+  struct sockaddr_storage *sa, socklen_t *len)
+{
+  memset(sa, 0, sizeof(*sa));
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+  struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+  /* Convert IPv4 and IPv6 addresses from text to binary form */
+  if (inet_pton(AF_INET6, data->address, &sin6->sin6_addr) > 0) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(S_SSL_SERVER_PORT);
+    /* a link local address is only meaningful on its interface */
+    if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+      sin6->sin6_scope_id = data->interface;
+    *len = sizeof(struct sockaddr_in6);
+  } else if (inet_pton(AF_INET, data->address, &sin->sin_addr) > 0) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(S_SSL_SERVER_PORT);
+    *len = sizeof(struct sockaddr_in);
+  } else {
+    daemon_log(LOG_ERR, "inet_pton failed\n");
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * @brief Call when a service is found, the host is added to the peers
  * @param [in] ctx: userdata passing through the allocation
- * @param [in] domain: domain associated to the service
- * @param [in] address: address of the service
- * @param [in] port: port associated to the service
- * @param [in] txt: text data of the service
+ * @param [in] data: service data found
  */
 static void _s_daemon_ctx_find(struct s_daemon_ctx *ctx,
   struct s_browser_data *data)
@@ -55,19 +82,15 @@ static void _s_daemon_ctx_find(struct s_daemon_ctx *ctx,
 
   daemon_log(LOG_NOTICE, "cerebrum '%s' found\n", data->name);
 
-  struct sockaddr_in sin = { 0, };
-  memset(&sin, '0', sizeof(sin));
-  sin.sin_family = AF_INET;
-  sin.sin_port = htons(8000);
-  /* Convert IPv4 and IPv6 addresses from text to binary form */
-  if (inet_pton(AF_INET, data->address, &sin.sin_addr) <= 0) {
-    daemon_log(LOG_ERR, "inet_pton failed\n");
+  struct sockaddr_storage sa;
+  socklen_t len;
+  if (_s_daemon_ctx_address(data, &sa, &len) != 0)
     goto error;
-  }
 
-  ctx->connection = s_ssl_client_new(ctx->loop, s_daemon_ctx_ssl_get_funcs(),
-    ctx);
-  s_ssl_client_connect(ctx->connection, _g_cert_path, &sin);
+  /* a host is known once, each of its addresses joins the connection race */
+  if (s_ssl_client_add_peer(ctx->peers, data->host, (struct sockaddr *)&sa,
+      len) != 0)
+    daemon_log(LOG_ERR, "failed to add the peer '%s'\n", data->host);
 
 error:
   s_browser_data_free(data);
@@ -75,7 +98,8 @@ error:
 }
 
 /**
- * @brief Call when a service is removed
+ * @brief Call when a service record is removed, its address is forgotten.
+ * The host connection is closed with its last address
  * @param [in] ctx: userdata passing through the allocation
  * @param [in] data: service data to remove
  */
@@ -86,6 +110,13 @@ static void _s_daemon_ctx_remove(struct s_daemon_ctx *ctx,
   daemon_return_if_fail(data);
 
   daemon_log(LOG_NOTICE, "service removed\n");
+  struct sockaddr_storage sa;
+  socklen_t len;
+  if (_s_daemon_ctx_address(data, &sa, &len) != 0 ||
+      s_ssl_client_remove_address(ctx->peers, data->host,
+        (struct sockaddr *)&sa, len) != 0)
+    daemon_log(LOG_WARNING, "'%s' didn't know the address %s\n", data->host,
+      data->address);
 }
 
 const struct s_browser_funcs *s_daemon_ctx_browser_get_funcs(void)
@@ -31,6 +31,13 @@ static void _s_daemon_ctx_client_running(struct s_daemon_ctx *ctx)
 
   daemon_log(LOG_NOTICE, "cerebrum detection is running");
 
+  /* the peers resolve this daemon to its host name, it identifies it */
+  const char *host = avahi_client_get_host_name_fqdn(
+    s_client_toavahi(ctx->client));
+  if (!host || s_ssl_server_set_identity(ctx->connection, host) != 0 ||
+      s_ssl_client_set_identity(ctx->peers, host) != 0)
+    daemon_log(LOG_WARNING, "the peers name this daemon by its address\n");
+
   ctx->group = s_group_new(ctx->client, ctx, s_daemon_ctx_group_get_funcs());
   if (ctx->group) {
     struct s_service_data *data = s_service_generate();
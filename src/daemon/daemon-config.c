@@ -0,0 +1,253 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-config.h"
+#include "ssl/ssl-frame.h"
+
+/**
+ * @brief Remove the blank characters around a string, in place
+ * @param [in] str: string to modify
+ * @return the trimmed string
+ */
+static char *_s_config_trim(char *str)
+{
+  while (isspace((unsigned char)*str))
+    str++;
+  size_t len = strlen(str);
+  while (len && isspace((unsigned char)str[len - 1]))
+    str[--len] = '\0';
+  return str;
+}
+
+/**
+ * @brief Parse an unsigned integer value
+ * @param [in] value: text to parse
+ * @param [out] number: number to fill
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_config_number(const char *value, uint32_t *number)
+{
+  char *end = NULL;
+  errno = 0;
+  unsigned long parsed = strtoul(value, &end, 0);
+  if (errno || end == value || *end || value[0] == '-' ||
+      parsed > UINT32_MAX)
+    return -EINVAL;
+  *number = parsed;
+  return 0;
+}
+
+/**
+ * @brief Replace a string value
+ * @param [in] value: text to copy
+ * @param [out] str: string to replace
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_config_string(const char *value, char **str)
+{
+  if (!value[0])
+    return -EINVAL;
+  char *copy = strdup(value);
+  if (!copy)
+    return -ENOMEM;
+  if (*str)
+    daemon_free(*str);
+  *str = copy;
+  return 0;
+}
+
+/**
+ * @brief Parse a boolean value, 0 or 1
+ * @param [in] value: text to parse
+ * @param [out] flag: flag to fill
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_config_flag(const char *value, uint8_t *flag)
+{
+  uint32_t number = 0;
+  if (_s_config_number(value, &number) != 0 || number > 1)
+    return -EINVAL;
+  *flag = number;
+  return 0;
+}
+
+/**
+ * @brief Apply a setting
+ * @param [in] config: settings to modify
+ * @param [in] key: name of the setting
+ * @param [in] value: value of the setting
+ * @return 0 on success, -ENOENT if the key is unknown, an another -errno
+ * value on error
+ */
+static int _s_config_set(struct s_config *config, const char *key,
+  const char *value)
+{
+  if (strcmp(key, "authority") == 0)
+    return _s_config_string(value, &config->authority);
+  if (strcmp(key, "backpressure_high") == 0)
+    return _s_config_number(value, &config->backpressure.high);
+  if (strcmp(key, "backpressure_low") == 0)
+    return _s_config_number(value, &config->backpressure.low);
+  /* the former name of timeout_stall, see #s_config */
+  if (strcmp(key, "backpressure_stall") == 0)
+    return _s_config_number(value, &config->timeout.stall);
+  if (strcmp(key, "batch_delay") == 0)
+    return _s_config_number(value, &config->batch.delay);
+  if (strcmp(key, "batch_threshold") == 0)
+    return _s_config_number(value, &config->batch.threshold);
+  if (strcmp(key, "certificate") == 0)
+    return _s_config_string(value, &config->certificate);
+  if (strcmp(key, "local") == 0)
+    return _s_config_string(value, &config->local);
+  if (strcmp(key, "loop_batch") == 0)
+    return _s_config_flag(value, &config->loop.batch);
+  if (strcmp(key, "loop_method") == 0) {
+    if (strlen(value) >= sizeof(config->loop.method))
+      return -EINVAL;
+    strcpy(config->loop.method, value);
+    return 0;
+  }
+  if (strcmp(key, "loop_uring") == 0)
+    return _s_config_flag(value, &config->loop.uring);
+  if (strcmp(key, "private_key") == 0)
+    return _s_config_string(value, &config->private_key);
+  if (strcmp(key, "timeout_handshake") == 0)
+    return _s_config_number(value, &config->timeout.handshake);
+  if (strcmp(key, "timeout_idle") == 0)
+    return _s_config_number(value, &config->timeout.idle);
+  if (strcmp(key, "timeout_stall") == 0)
+    return _s_config_number(value, &config->timeout.stall);
+  if (strcmp(key, "transfers") == 0)
+    return _s_config_string(value, &config->transfers);
+  if (strcmp(key, "workers") == 0)
+    return _s_config_number(value, &config->workers);
+  return -ENOENT;
+}
+
+/**
+ * @brief Parse the settings of a file
+ * @param [in] config: settings to modify
+ * @param [in] file: file to read
+ * @param [in] path: path of the file, for the logs
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_config_parse(struct s_config *config, FILE *file,
+  const char *path)
+{
+  char *line = NULL;
+  size_t size = 0;
+  uint32_t number = 0;
+  int ret = 0;
+  while (ret == 0 && getline(&line, &size, file) >= 0) {
+    number++;
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    char *key = _s_config_trim(line);
+    if (!key[0])
+      continue;
+    char *value = strchr(key, '=');
+    if (!value) {
+      ret = -EINVAL;
+    } else {
+      *value = '\0';
+      key = _s_config_trim(key);
+      ret = _s_config_set(config, key, _s_config_trim(value + 1));
+    }
+    if (ret == -ENOENT)
+      daemon_log(LOG_ERR, "%s:%u: unknown setting '%s'\n", path, number, key);
+    else if (ret != 0)
+      daemon_log(LOG_ERR, "%s:%u: invalid setting\n", path, number);
+  }
+  free(line);
+  return ret;
+}
+
+struct s_config *s_config_new(const char *path)
+{
+  daemon_return_val_if_fail(path, NULL);
+
+  struct s_config *config = daemon_malloc(sizeof(struct s_config));
+  s_ssl_backpressure_init(&config->backpressure);
+  config->certificate = strdup(S_CONFIG_CERTIFICATE);
+  config->local = strdup(S_CONFIG_LOCAL);
+  config->private_key = strdup(S_CONFIG_PRIVATE_KEY);
+  config->timeout.handshake = S_CONFIG_TIMEOUT_HANDSHAKE;
+  config->timeout.idle = S_CONFIG_TIMEOUT_IDLE;
+  config->timeout.stall = S_CONFIG_TIMEOUT_STALL;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  config->workers = cpus > 0 ? cpus : 1;
+  if (!config->certificate || !config->local || !config->private_key)
+    goto error;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    if (errno != ENOENT)
+      goto error;
+    daemon_log(LOG_NOTICE, "no '%s', using the default settings\n", path);
+    return config;
+  }
+  int ret = _s_config_parse(config, file, path);
+  fclose(file);
+  if (ret != 0)
+    goto error;
+  config->backpressure.stall = config->timeout.stall;
+
+  /* the limits are checked as a whole, see #s_ssl_server_set_backpressure */
+  if (config->backpressure.high &&
+      config->backpressure.low >= config->backpressure.high) {
+    daemon_log(LOG_ERR, "%s: backpressure_low must be below "
+      "backpressure_high\n", path);
+    goto error;
+  }
+  if (config->batch.threshold > S_SSL_FRAME_MAX_SIZE) {
+    daemon_log(LOG_ERR, "%s: batch_threshold is above %u\n", path,
+      S_SSL_FRAME_MAX_SIZE);
+    goto error;
+  }
+  return config;
+
+error:
+  daemon_log(LOG_ERR, "failed to load the settings '%s'\n", path);
+  s_config_free(config);
+  return NULL;
+}
+
+void s_config_free(struct s_config *config)
+{
+  daemon_return_if_fail(config);
+
+  if (config->authority)
+    daemon_free(config->authority);
+  if (config->certificate)
+    daemon_free(config->certificate);
+  if (config->local)
+    daemon_free(config->local);
+  if (config->private_key)
+    daemon_free(config->private_key);
+  if (config->transfers)
+    daemon_free(config->transfers);
+  daemon_free(config);
+}
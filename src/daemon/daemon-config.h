@@ -0,0 +1,104 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _DAEMON_CONFIG_H_
+# define _DAEMON_CONFIG_H_
+
+# include <stdint.h>
+
+# include "daemon-loop.h"
+# include "ssl/ssl-connection.h"
+# include "ssl/ssl-handshake.h"
+
+/**
+ * @brief Default certificate path file
+ */
+# define S_CONFIG_CERTIFICATE "/etc/cerebrum/certificate"
+
+/**
+ * @brief Default private key path file
+ */
+# define S_CONFIG_PRIVATE_KEY "/etc/cerebrum/private.pem"
+
+/**
+ * @brief Default socket the local applications connect to
+ */
+# define S_CONFIG_LOCAL "@cerebrum"
+
+/**
+ * @brief Default delays, in milliseconds, of the timeout classes. The peers
+ * don't ping each other, so a silent peer is kept unless an idle delay is set
+ */
+# define S_CONFIG_TIMEOUT_HANDSHAKE S_SSL_HANDSHAKE_TIMEOUT
+# define S_CONFIG_TIMEOUT_IDLE 0
+# define S_CONFIG_TIMEOUT_STALL S_SSL_CONNECTION_STALL
+
+/**
+ * @brief Daemon settings. The file holds one "key = value" setting per line,
+ * '#' starts a comment. Known keys:
+ * - certificate, private_key: tls files of the daemon
+ * - authority: certificate authority the servers are verified against, the
+ *   servers must present the daemon certificate when unset
+ * - local: socket of the local applications, only read at start
+ * - workers: worker threads of the server, one per online cpu by default, 0
+ *   keeps the connections on the main loop, only read at start
+ * - loop_method, loop_batch, loop_uring: backend of the loops, see
+ *   #s_loop_backend, only read at start
+ * - backpressure_high, backpressure_low: output limits of the accepted
+ *   connections, see #s_ssl_backpressure
+ * - batch_threshold, batch_delay: frame batching of the accepted connections
+ * - timeout_handshake, timeout_idle, timeout_stall: read and write timeouts
+ *   of the connections, see #s_loop_timeouts. The stall delay is also the
+ *   one of the output limits: an output making no progress at all is closed
+ *   at the write timeout whatever the policy, a blocked output still
+ *   draining follows the policy. backpressure_stall is its former name
+ * - transfers: directory the bulk transfers offered by the peers are stored
+ *   in, they are refused when unset, only read at start
+ */
+struct s_config {
+  char *authority;
+  struct s_ssl_backpressure backpressure;
+  struct {
+    uint32_t delay;
+    uint32_t threshold;
+  } batch;
+  char *certificate;
+  char *local;
+  struct s_loop_backend loop;
+  char *private_key;
+  struct s_loop_timeouts timeout;
+  char *transfers;
+  uint32_t workers;
+};
+
+/**
+ * @brief Load the settings from a file. A missing file gives the default
+ * settings
+ * @param [in] path: path of the file
+ * @return a valid pointer on success, NULL if the file is malformed or on
+ * error
+ */
+struct s_config *s_config_new(const char *path);
+
+/**
+ * @brief Deallocate a specific settings instance
+ * @param [in] config: settings to delete
+ */
+void s_config_free(struct s_config *config);
+
+#endif /* !_DAEMON_CONFIG_H_ */
@@ -15,13 +15,72 @@
  * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <signal.h>
 #include <libdaemon/dlog.h>
+#include <libdaemon/dsignal.h>
+#include <event2/listener.h>
 #include "daemon-alloc.h"
 #include "daemon-cond.h"
 #include "daemon-ctx.h"
 
 /**
- * @brief Event callback raised if a signal is received
+ * @brief Apply the connection settings to the server and the loops, the
+ * connections accepted and the timeouts armed afterwards use them
+ * @param [in] ctx: context owning the server
+ * @param [in] config: settings to apply
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_daemon_ctx_configure(struct s_daemon_ctx *ctx,
+  const struct s_config *config)
+{
+  int ret = s_ssl_server_set_backpressure(ctx->connection,
+    &config->backpressure);
+  if (ret == 0)
+    ret = s_ssl_server_set_batching(ctx->connection, config->batch.threshold,
+      config->batch.delay);
+  if (ret == 0)
+    ret = s_loop_set_timeouts(&config->timeout);
+  return ret;
+}
+
+/**
+ * @brief Read the settings file again. The new certificate serves the next
+ * handshakes while the established connections keep the previous one, the
+ * running settings are kept if the file or the certificate is invalid
+ * @param [in] ctx: context to modify
+ */
+static void _s_daemon_ctx_reload(struct s_daemon_ctx *ctx)
+{
+  struct s_config *config = s_config_new(S_DAEMON_CTX_CONFIG_PATH);
+  if (!config)
+    goto error;
+
+  /* before the group runs, nothing is loaded yet */
+  int ret = s_ssl_server_reload(ctx->connection, config->certificate,
+    config->private_key);
+  if (ret != 0 && ret != -ENOTCONN)
+    goto error;
+  ret = s_ssl_client_reload(ctx->peers, config->certificate,
+    config->authority);
+  if (ret != 0 && ret != -ENOTCONN)
+    daemon_log(LOG_WARNING, "the peers keep the previous certificate\n");
+  if (_s_daemon_ctx_configure(ctx, config) != 0)
+    daemon_log(LOG_WARNING, "failed to apply the connection settings\n");
+
+  s_config_free(ctx->config);
+  ctx->config = config;
+  daemon_log(LOG_NOTICE, "settings reloaded\n");
+  return;
+
+error:
+  daemon_log(LOG_ERR, "reload failed, the running settings are kept\n");
+  if (config)
+    s_config_free(config);
+}
+
+/**
+ * @brief Event callback raised if a signal is received. A hangup reloads the
+ * settings, any other signal stops the daemon
  * @param [in] fd: file descriptor of the event
  * @param [in] evt: event received
  * @param [in] userdata: data passing through the event_new
@@ -31,23 +90,50 @@ static void _s_daemon_ctx_signal_received(daemon_unused evutil_socket_t fd,
 {
   daemon_return_if_fail(ctx);
 
+  s_loop_account(ctx->loop, e_loop_priority_control);
+  int sig = daemon_signal_next();
+  if (sig == SIGHUP) {
+    daemon_log(LOG_NOTICE, "reloading '%s'\n", S_DAEMON_CTX_CONFIG_PATH);
+    _s_daemon_ctx_reload(ctx);
+    return;
+  }
   s_daemon_ctx_quit(ctx);
 }
 
 struct s_daemon_ctx *s_daemon_ctx_new(int fd)
 {
   struct s_daemon_ctx *ctx = daemon_malloc(sizeof(struct s_daemon_ctx));
+  ctx->config = s_config_new(S_DAEMON_CTX_CONFIG_PATH);
+  /* the worker loops are allocated later on, on the same backend */
+  if (ctx->config && s_loop_set_backend(&ctx->config->loop) != 0)
+    daemon_log(LOG_WARNING, "the loops run on the default backend\n");
   ctx->loop = s_loop_new();
   ctx->client = s_client_new(s_loop_toavahi(ctx->loop),
     ctx, s_daemon_ctx_client_get_funcs());
-  ctx->event = event_new(s_loop_tolibevent(ctx->loop), fd, EV_READ,
-    (event_callback_fn)_s_daemon_ctx_signal_received, ctx);
+  ctx->connection = s_ssl_server_new(ctx->loop,
+    s_daemon_ctx_ssl_get_funcs(), ctx);
+  ctx->peers = s_ssl_client_new(ctx->loop, s_daemon_ctx_ssl_get_funcs(), ctx);
+  ctx->event = event_new(s_loop_tolibevent(ctx->loop), fd,
+    EV_READ | EV_PERSIST, (event_callback_fn)_s_daemon_ctx_signal_received,
+    ctx);
 
-  if (!ctx->client || !ctx->event || !ctx->loop ||
+  if (!ctx->client || !ctx->config || !ctx->connection || !ctx->event ||
+      !ctx->loop || !ctx->peers ||
+      s_ssl_server_set_workers(ctx->connection, ctx->config->workers) != 0 ||
+      _s_daemon_ctx_configure(ctx, ctx->config) != 0 ||
+      s_loop_set_priority(ctx->event, e_loop_priority_control) != 0 ||
+      s_daemon_ctx_ssl_register(ctx) != 0 ||
       event_add(ctx->event, NULL) != 0) {
     errno = EBADE;
     goto error;
   }
+  struct s_loop_backend backend;
+  if (s_loop_get_backend(ctx->loop, &backend) == 0)
+    daemon_log(LOG_NOTICE, "loops running on %s%s%s\n", backend.method,
+      backend.batch ? ", changes batched" : "",
+      backend.uring ? ", accepting through io_uring" : "");
+  /* without it, a reload is refused and this process keeps running */
+  s_daemon_ctx_handoff_listen(ctx);
 
   return ctx;
 
@@ -61,13 +147,34 @@ void s_daemon_ctx_free(struct s_daemon_ctx *ctx)
 {
   daemon_return_if_fail(ctx);
 
+  struct s_loop_stats stats;
+  if (ctx->loop && s_loop_get_stats(ctx->loop, &stats) == 0)
+    daemon_log(LOG_INFO, "loop callbacks: %llu control, %llu discovery, "
+      "%llu io\n", (unsigned long long)stats.callbacks[e_loop_priority_control],
+      (unsigned long long)stats.callbacks[e_loop_priority_discovery],
+      (unsigned long long)stats.callbacks[e_loop_priority_io]);
+
   event_del(ctx->event);
   event_free(ctx->event);
 
+  if (ctx->handoff)
+    evconnlistener_free(ctx->handoff);
+
+  if (ctx->browser)
+    s_browser_free(ctx->browser);
+  if (ctx->peers)
+    s_ssl_client_free(ctx->peers);
   if (ctx->connection)
     s_ssl_server_free(ctx->connection);
+  /* the routers of the server and of the peers dispatched to the engine */
+  if (ctx->transfers.engine)
+    s_ssl_transfers_free(ctx->transfers.engine);
+  if (ctx->transfers.path)
+    daemon_free(ctx->transfers.path);
   s_client_free(ctx->client);
   s_loop_free(ctx->loop);
+  if (ctx->config)
+    s_config_free(ctx->config);
 }
 
 int s_daemon_ctx_run(struct s_daemon_ctx *ctx)
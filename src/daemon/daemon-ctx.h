@@ -18,17 +18,47 @@
 #ifndef _DAEMON_CTX_H_
 # define _DAEMON_CTX_H_
 
+# include "daemon-config.h"
 # include "daemon-loop.h"
+# include "avahi/avahi-browser.h"
 # include "avahi/avahi-client.h"
 # include "avahi/avahi-group.h"
+# include "ssl/ssl-client.h"
 # include "ssl/ssl-server.h"
+# include "ssl/ssl-transfer.h"
+
+/**
+ * @brief Settings file of the daemon, read again on SIGHUP
+ */
+# define S_DAEMON_CTX_CONFIG_PATH "/etc/cerebrum/cerebrum.conf"
+
+/**
+ * @brief Socket a starting daemon connects to, to take over the running one
+ */
+# define S_DAEMON_CTX_HANDOFF_PATH "@cerebrum-handoff"
+
+/**
+ * @brief Message types exchanged between the daemons
+ */
+enum e_daemon_message {
+  e_daemon_message_ping = 1,
+  e_daemon_message_pong
+};
 
 struct s_daemon_ctx {
+  struct s_browser *browser;
   struct s_client *client;
+  struct s_config *config;
   struct s_ssl_server *connection;
   struct event *event;
   struct s_group *group;
+  struct evconnlistener *handoff;
   struct s_loop *loop;
+  struct s_ssl_client *peers;
+  struct {
+    struct s_ssl_transfers *engine;
+    char *path;
+  } transfers;
 };
 
 /**
@@ -58,6 +88,21 @@ int s_daemon_ctx_run(struct s_daemon_ctx *ctx);
  */
 int s_daemon_ctx_quit(struct s_daemon_ctx *ctx);
 
+/**
+ * @brief Listen for the process which will replace this one on a reload
+ * @param [in] ctx: context to modify
+ * @return 0 on success, an -errno value on error
+ */
+int s_daemon_ctx_handoff_listen(struct s_daemon_ctx *ctx);
+
+/**
+ * @brief Take the state of the running daemon over, its listening sockets
+ * and its ticket keys
+ * @param [out] handoff: state to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_daemon_ctx_handoff_receive(struct s_ssl_handoff *handoff);
+
 /**
  * @brief Get client behavior function
  * @return a valid pointer on success
@@ -68,6 +113,12 @@ const struct s_client_funcs *s_daemon_ctx_client_get_funcs(void);
  * @brief Get the browser behavior function
  * @return a valid pointer on success
  */
+const struct s_browser_funcs *s_daemon_ctx_browser_get_funcs(void);
+
+/**
+ * @brief Get the group behavior function
+ * @return a valid pointer on success
+ */
 const struct s_group_funcs *s_daemon_ctx_group_get_funcs(void);
 
 /**
@@ -76,4 +127,11 @@ const struct s_group_funcs *s_daemon_ctx_group_get_funcs(void);
  */
 const struct s_ssl_funcs *s_daemon_ctx_ssl_get_funcs(void);
 
+/**
+ * @brief Register the message handlers of the daemon in the ssl router
+ * @param [in] ctx: context owning the ssl server
+ * @return 0 on success, an -errno value on error
+ */
+int s_daemon_ctx_ssl_register(struct s_daemon_ctx *ctx);
+
 #endif /* !_DAEMON_CTX_H_ */
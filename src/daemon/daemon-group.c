@@ -20,9 +20,6 @@
 #include "daemon-ctx.h"
 #include "avahi/avahi-group.h"
 
-static const char *_g_cert_path = "/home/siroz/Project/mytank/certificate";
-static const char *_g_priv_path = "/home/siroz/Project/mytank/private.pem";
-
 /**
  * @brief Call after initialization when everything is done
  * @param [in] ctx: userdata passing through the allocation
@@ -33,7 +30,21 @@ static void _s_daemon_ctx_group_running(struct s_daemon_ctx *ctx)
 
   daemon_log(LOG_NOTICE, "cerebrum group is running");
 
-  s_ssl_server_connect(ctx->connection, _g_cert_path, _g_priv_path);
+  /* the applications of this host connect through the local socket */
+  if (s_ssl_server_connect(ctx->connection, ctx->config->certificate,
+        ctx->config->private_key) != 0 ||
+      s_ssl_server_listen_local(ctx->connection, ctx->config->local,
+        (gid_t)-1) != 0)
+    daemon_log(LOG_ERR, "failed to start the communication server\n");
+
+  /* the other daemons are browsed once we can connect to them */
+  if (s_ssl_client_connect(ctx->peers, ctx->config->certificate,
+      ctx->config->authority) == 0 &&
+      !ctx->browser)
+    ctx->browser = s_browser_new(ctx->client, ctx,
+      s_daemon_ctx_browser_get_funcs());
+  if (!ctx->browser)
+    daemon_log(LOG_ERR, "failed to browse the other daemons\n");
 
   daemon_log(LOG_NOTICE, "everything is ready");
 }
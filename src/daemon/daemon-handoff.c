@@ -0,0 +1,152 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* struct ucred */
+#endif /* !_GNU_SOURCE */
+#include <unistd.h>
+#include <event2/listener.h>
+#include <libdaemon/dlog.h>
+#include <libdaemon/dpid.h>
+#include <sys/socket.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-ctx.h"
+#include "ssl/ssl-handoff.h"
+
+/**
+ * @brief Call once the previous connections are closed, the process which
+ * took over serves everything from now on
+ * @param [in] ctx: userdata passing through the allocation
+ */
+static void _s_daemon_ctx_handoff_drained(struct s_daemon_ctx *ctx)
+{
+  daemon_return_if_fail(ctx);
+
+  daemon_log(LOG_NOTICE, "handoff done, terminating\n");
+  s_daemon_ctx_quit(ctx);
+}
+
+/**
+ * @brief Call when the process replacing this one connects. The listening
+ * sockets and the ticket keys are sent to it, then this process withdraws
+ * its service and drains its connections
+ */
+static void _s_daemon_ctx_handoff_accept(struct evconnlistener *listener,
+  int sockfd, daemon_unused struct sockaddr *sa, daemon_unused int sa_len,
+  struct s_daemon_ctx *ctx)
+{
+  daemon_return_if_fail(listener);
+  daemon_return_if_fail(ctx);
+
+  /* only the daemon user may take the sockets over */
+  struct ucred credentials;
+  socklen_t len = sizeof(credentials);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) != 0 ||
+      (credentials.uid != 0 && credentials.uid != geteuid())) {
+    daemon_log(LOG_WARNING, "handoff refused\n");
+    close(sockfd);
+    return;
+  }
+
+  struct s_ssl_handoff handoff;
+  if (s_ssl_server_export(ctx->connection, &handoff) != 0) {
+    daemon_log(LOG_WARNING, "nothing to hand off yet\n");
+    close(sockfd);
+    return;
+  }
+
+  /* the new process binds the handoff socket and creates the pid file once
+   * it received the state */
+  evconnlistener_free(ctx->handoff);
+  ctx->handoff = NULL;
+  daemon_pid_file_remove();
+  int ret = s_ssl_handoff_send(sockfd, &handoff);
+  close(sockfd);
+  if (ret != 0) {
+    daemon_log(LOG_ERR, "failed to hand off (%d)\n", ret);
+    if (daemon_pid_file_create() < 0 || s_daemon_ctx_handoff_listen(ctx) != 0)
+      daemon_log(LOG_ERR, "the next reload will restart the daemon\n");
+    return;
+  }
+  daemon_log(LOG_NOTICE, "handed off to pid %d\n", credentials.pid);
+
+  /* the new process publishes the service and browses the peers */
+  if (ctx->group) {
+    s_group_free(ctx->group);
+    ctx->group = NULL;
+  }
+  if (ctx->browser) {
+    s_browser_free(ctx->browser);
+    ctx->browser = NULL;
+  }
+  if (s_ssl_server_drain(ctx->connection, S_SSL_SERVER_DRAIN,
+      (s_ssl_drained_cbk)_s_daemon_ctx_handoff_drained, ctx) != 0)
+    s_daemon_ctx_quit(ctx);
+}
+
+int s_daemon_ctx_handoff_listen(struct s_daemon_ctx *ctx)
+{
+  daemon_return_val_if_fail(ctx, -EINVAL);
+  daemon_return_val_if_fail(!ctx->handoff, -EALREADY);
+
+  int fd = s_ssl_handoff_listen(S_DAEMON_CTX_HANDOFF_PATH);
+  if (fd < 0) {
+    daemon_log(LOG_ERR, "failed to listen for a handoff (%d)\n", fd);
+    return fd;
+  }
+  ctx->handoff = evconnlistener_new(s_loop_tolibevent(ctx->loop),
+    (evconnlistener_cb)_s_daemon_ctx_handoff_accept, ctx,
+    LEV_OPT_CLOSE_ON_FREE, 0, fd);
+  if (!ctx->handoff) {
+    close(fd);
+    return -EBADE;
+  }
+  return 0;
+}
+
+int s_daemon_ctx_handoff_receive(struct s_ssl_handoff *handoff)
+{
+  daemon_return_val_if_fail(handoff, -EINVAL);
+
+  int fd = s_ssl_handoff_connect(S_DAEMON_CTX_HANDOFF_PATH);
+  if (fd < 0) {
+    daemon_log(LOG_ERR, "failed to reach the running daemon (%d)\n", fd);
+    return fd;
+  }
+
+  /* the listening sockets are only taken from the daemon user, anybody could
+   * have bound the abstract socket first */
+  struct ucred credentials;
+  socklen_t len = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) != 0 ||
+      (credentials.uid != 0 && credentials.uid != geteuid())) {
+    daemon_log(LOG_ERR, "the handoff socket isn't held by the daemon user\n");
+    close(fd);
+    return -EPERM;
+  }
+  int ret = s_ssl_handoff_recv(fd, handoff);
+  close(fd);
+  if (ret != 0) {
+    daemon_log(LOG_ERR, "the running daemon refused the handoff (%d)\n", ret);
+    return ret;
+  }
+  daemon_log(LOG_NOTICE, "took over %u listener(s)\n", handoff->count);
+  return 0;
+}
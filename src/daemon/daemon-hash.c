@@ -0,0 +1,240 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+
+/**
+ * @brief Initial number of buckets, must be a power of two
+ */
+#define S_HASH_MIN_SIZE 16
+
+struct s_hash_node {
+  uint32_t hash;
+  void *key;
+  struct s_hash_node *next;
+  void *value;
+};
+
+struct s_hash {
+  struct s_hash_node **buckets;
+  s_equal_cbk equal;
+  s_hash_cbk hash;
+  s_destroy_cbk key_destroy;
+  uint32_t mask;
+  uint32_t size;
+  s_destroy_cbk value_destroy;
+};
+
+/**
+ * @brief Find the link pointing to the node holding a specific key
+ * @param hash[in] : hash table instance
+ * @param key[in] : the key to look up
+ * @param value[in] : hash value of the key
+ * @return the link address, which points to NULL if the key is not found
+ */
+static struct s_hash_node **_s_hash_lookup_node(struct s_hash *hash,
+  const void *key, uint32_t value)
+{
+  struct s_hash_node **node = &hash->buckets[value & hash->mask];
+
+  while (*node) {
+    if ((*node)->hash == value && hash->equal((*node)->key, key))
+      break;
+    node = &(*node)->next;
+  }
+  return node;
+}
+
+/**
+ * @brief Double the number of buckets once the load factor exceeds 3/4
+ * @param hash[in] : hash table instance
+ */
+static void _s_hash_resize(struct s_hash *hash)
+{
+  uint32_t count = hash->mask + 1;
+  if (hash->size < count - count / 4)
+    return;
+
+  struct s_hash_node **buckets = daemon_calloc(count * 2,
+    sizeof(struct s_hash_node *));
+  for (uint32_t i = 0; i < count; i++) {
+    struct s_hash_node *node = hash->buckets[i];
+    while (node) {
+      struct s_hash_node *next = node->next;
+      uint32_t index = node->hash & (count * 2 - 1);
+      node->next = buckets[index];
+      buckets[index] = node;
+      node = next;
+    }
+  }
+  daemon_free(hash->buckets);
+  hash->buckets = buckets;
+  hash->mask = count * 2 - 1;
+}
+
+/**
+ * @brief Destroy a node and its content
+ * @param hash[in] : hash table instance
+ * @param node[in] : node to delete
+ */
+static void _s_hash_node_free(struct s_hash *hash, struct s_hash_node *node)
+{
+  if (hash->key_destroy)
+    hash->key_destroy(node->key);
+  if (hash->value_destroy)
+    hash->value_destroy(node->value);
+  daemon_free(node);
+}
+
+struct s_hash *s_hash_new(s_hash_cbk hash, s_equal_cbk equal,
+  s_destroy_cbk key_destroy, s_destroy_cbk value_destroy)
+{
+  daemon_return_val_if_fail(hash, NULL);
+  daemon_return_val_if_fail(equal, NULL);
+
+  struct s_hash *table = daemon_malloc(sizeof(struct s_hash));
+  table->buckets = daemon_calloc(S_HASH_MIN_SIZE,
+    sizeof(struct s_hash_node *));
+  table->equal = equal;
+  table->hash = hash;
+  table->key_destroy = key_destroy;
+  table->mask = S_HASH_MIN_SIZE - 1;
+  table->value_destroy = value_destroy;
+  return table;
+}
+
+void s_hash_free(struct s_hash *hash)
+{
+  daemon_return_if_fail(hash);
+
+  for (uint32_t i = 0; i <= hash->mask; i++) {
+    struct s_hash_node *node = hash->buckets[i];
+    while (node) {
+      struct s_hash_node *next = node->next;
+      _s_hash_node_free(hash, node);
+      node = next;
+    }
+  }
+  daemon_free(hash->buckets);
+  daemon_free(hash);
+}
+
+int s_hash_insert(struct s_hash *hash, void *key, void *value)
+{
+  daemon_return_val_if_fail(hash, -EINVAL);
+
+  uint32_t code = hash->hash(key);
+  struct s_hash_node **link = _s_hash_lookup_node(hash, key, code);
+
+  if (*link) {
+    struct s_hash_node *node = *link;
+    if (hash->key_destroy)
+      hash->key_destroy(node->key);
+    if (hash->value_destroy)
+      hash->value_destroy(node->value);
+    node->key = key;
+    node->value = value;
+    return 0;
+  }
+
+  struct s_hash_node *node = daemon_malloc(sizeof(struct s_hash_node));
+  node->hash = code;
+  node->key = key;
+  node->value = value;
+  *link = node;
+  hash->size++;
+  _s_hash_resize(hash);
+  return 0;
+}
+
+void *s_hash_lookup(struct s_hash *hash, const void *key)
+{
+  daemon_return_val_if_fail(hash, NULL);
+
+  struct s_hash_node *node = *_s_hash_lookup_node(hash, key, hash->hash(key));
+  return node ? node->value : NULL;
+}
+
+int s_hash_remove(struct s_hash *hash, const void *key)
+{
+  daemon_return_val_if_fail(hash, -EINVAL);
+
+  struct s_hash_node **link = _s_hash_lookup_node(hash, key, hash->hash(key));
+  if (!*link)
+    return -ENOENT;
+
+  struct s_hash_node *node = *link;
+  *link = node->next;
+  hash->size--;
+  _s_hash_node_free(hash, node);
+  return 0;
+}
+
+void *s_hash_steal(struct s_hash *hash, const void *key)
+{
+  daemon_return_val_if_fail(hash, NULL);
+
+  struct s_hash_node **link = _s_hash_lookup_node(hash, key, hash->hash(key));
+  if (!*link)
+    return NULL;
+
+  struct s_hash_node *node = *link;
+  void *value = node->value;
+  *link = node->next;
+  hash->size--;
+  daemon_free(node);
+  return value;
+}
+
+uint32_t s_hash_size(struct s_hash *hash)
+{
+  daemon_return_val_if_fail(hash, 0);
+
+  return hash->size;
+}
+
+void s_hash_foreach(struct s_hash *hash, s_hash_foreach_cbk func,
+  void *user_data)
+{
+  daemon_return_if_fail(hash);
+  daemon_return_if_fail(func);
+
+  for (uint32_t i = 0; i <= hash->mask; i++) {
+    struct s_hash_node *node = hash->buckets[i];
+    for (; node; node = node->next)
+      func(node->key, node->value, user_data);
+  }
+}
+
+uint32_t s_str_hash(const void *key)
+{
+  const uint8_t *str = key;
+  uint32_t hash = 2166136261u;
+
+  for (; *str; str++) {
+    hash ^= *str;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+int s_str_equal(const void *a, const void *b)
+{
+  return strcmp(a, b) == 0;
+}
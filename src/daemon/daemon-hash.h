@@ -0,0 +1,141 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAEMON_HASH_H_
+# define _DAEMON_HASH_H_
+
+# include <stdint.h>
+# include "daemon-list.h"
+
+struct s_hash;
+
+/**
+ * @brief Specifies the type of the hash function which is passed to
+ * s_hash_new() when a s_hash is created.
+ * @param key[in] : a key
+ * @return the hash value corresponding to the key
+ */
+typedef uint32_t (*s_hash_cbk)(const void *key);
+
+/**
+ * @brief Specifies the type of a function used to test two keys for equality.
+ * @param a[in] : a key
+ * @param b[in] : a key to compare with a
+ * @return 1 if the keys are equal, 0 otherwise
+ */
+typedef int (*s_equal_cbk)(const void *a, const void *b);
+
+/**
+ * @brief Specifies the type of functions passed throw s_hash_foreach()
+ * @param key[in] : the element's key
+ * @param value[in] : the element's value
+ * @param user_data[in] : additional data
+ */
+typedef void (*s_hash_foreach_cbk)(void *key, void *value, void *user_data);
+
+/**
+ * @brief Creates a new hash table. Lookup, insertion and removal are done in
+ * constant time on average, the table grows automatically with its content.
+ * @param hash[in] : a function to create a hash value from a key
+ * @param equal[in] : a function to check two keys for equality
+ * @param key_destroy[in] : a function to free the memory allocated for the
+ * key used when removing the entry from the table, or NULL
+ * @param value_destroy[in] : a function to free the memory allocated for the
+ * value used when removing the entry from the table, or NULL
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_hash *s_hash_new(s_hash_cbk hash, s_equal_cbk equal,
+  s_destroy_cbk key_destroy, s_destroy_cbk value_destroy);
+
+/**
+ * @brief Destroys all keys and values in the hash table and frees the memory
+ * used by it.
+ * @param hash[in] : hash table instance
+ */
+void s_hash_free(struct s_hash *hash);
+
+/**
+ * @brief Inserts a new key and value into the hash table. If the key already
+ * exists, its previous key and value are destroyed and replaced.
+ * @param hash[in] : hash table instance
+ * @param key[in] : a key to insert
+ * @param value[in] : the value to associate with the key
+ * @return 0 on success, an -errno value on error
+ */
+int s_hash_insert(struct s_hash *hash, void *key, void *value);
+
+/**
+ * @brief Looks up a key in the hash table.
+ * @param hash[in] : hash table instance
+ * @param key[in] : the key to look up
+ * @return the associated value, or NULL if the key is not found
+ */
+void *s_hash_lookup(struct s_hash *hash, const void *key);
+
+/**
+ * @brief Removes a key and its associated value from the hash table. The key
+ * and the value are destroyed with the functions given to s_hash_new().
+ * @param hash[in] : hash table instance
+ * @param key[in] : the key to remove
+ * @return 0 on success, -ENOENT if the key is not found
+ */
+int s_hash_remove(struct s_hash *hash, const void *key);
+
+/**
+ * @brief Removes a key and its associated value from the hash table without
+ * calling the destroy functions.
+ * @param hash[in] : hash table instance
+ * @param key[in] : the key to remove
+ * @return the value which was associated with the key, NULL if not found
+ */
+void *s_hash_steal(struct s_hash *hash, const void *key);
+
+/**
+ * @brief Gets the number of elements in the hash table.
+ * @param hash[in] : hash table instance
+ * @return the number of key/value pairs stored
+ */
+uint32_t s_hash_size(struct s_hash *hash);
+
+/**
+ * @brief Calls the given function for each of the key/value pairs in the
+ * hash table. The table must not be modified while iterating over it.
+ * @param hash[in] : hash table instance
+ * @param func[in] : the function to call for each key/value pair
+ * @param user_data[in] : user data to pass to the function
+ */
+void s_hash_foreach(struct s_hash *hash, s_hash_foreach_cbk func,
+  void *user_data);
+
+/**
+ * @brief Converts a string to a hash value (FNV-1a). It can be passed to
+ * s_hash_new() as the hash parameter, when using non-NULL strings as keys.
+ * @param key[in] : a string key
+ * @return a hash value corresponding to the key
+ */
+uint32_t s_str_hash(const void *key);
+
+/**
+ * @brief Compares two strings for byte-by-byte equality. It can be passed to
+ * s_hash_new() as the equal parameter, when using non-NULL strings as keys.
+ * @param a[in] : a key
+ * @param b[in] : a key to compare with a
+ * @return 1 if the two keys match
+ */
+int s_str_equal(const void *a, const void *b);
+
+#endif /* !_DAEMON_HASH_H_ */
@@ -35,6 +35,7 @@ static void _s_task_idle_cbk(daemon_unused evutil_socket_t fd,
 {
   daemon_return_if_fail(loop);
 
+  s_loop_account(loop, e_loop_priority_control);
   event_base_loopexit(s_loop_tolibevent(loop), NULL);
 }
 
@@ -47,7 +48,9 @@ struct s_task_idle *s_task_idle_new(struct s_loop *loop)
   task->event = event_new(s_loop_tolibevent(loop), task->fd, EV_READ,
     (event_callback_fn)_s_task_idle_cbk, loop);
 
-  if (task->fd < 0 || !task->event || event_add(task->event, NULL) < 0)
+  if (task->fd < 0 || !task->event ||
+      s_loop_set_priority(task->event, e_loop_priority_control) != 0 ||
+      event_add(task->event, NULL) < 0)
     goto error;
 
   return task;
@@ -74,10 +74,8 @@ void s_list_free_full(struct s_list *list, s_destroy_cbk func)
     struct s_list *_list = s_list_first(list);
     while (_list) {
       struct s_list *_next = s_list_next(_list);
-      s_list_remove_link(list, _list);
-      if (func)
-        func((_list)->data);
-      s_list_free(_list);
+      func(_list->data);
+      daemon_free(_list);
       _list = _next;
     }
   }
@@ -15,24 +15,377 @@
  * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+#include <string.h>
 #include <libdaemon/dlog.h>
 #include <sys/signal.h>
+#include <event2/thread.h>
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+# include <sys/socket.h>
+#endif /* !HAVE_LIBURING */
 #include "daemon-alloc.h"
 #include "daemon-cond.h"
 #include "daemon-idle.h"
+#include "daemon-list.h"
 #include "daemon-loop.h"
 
+#ifdef HAVE_LIBURING
+/**
+ * @brief Number of submission entries of a ring, a multishot accept holds a
+ * single one whatever the number of peers
+ */
+# define S_LOOP_RING_ENTRIES 64
+
+struct s_loop_accept {
+  uint8_t armed;
+  s_loop_accept_cbk cbk;
+  uint8_t closed;
+  int fd;
+  struct s_loop *loop;
+  void *userdata;
+};
+#endif /* !HAVE_LIBURING */
+
 struct s_loop {
+  struct s_loop_backend backend;
   struct event_base *base;
+  uint64_t callbacks[e_loop_priority_count];
   struct event *signal;
   struct s_task_idle *idle;
+#ifdef HAVE_LIBURING
+  struct {
+    struct s_list *accepts;
+    struct event *completed;
+    int fd;
+    struct event *flush;
+    pthread_mutex_t lock;
+    uint32_t pending;
+    struct io_uring queue;
+    uint8_t ready;
+  } ring;
+#endif /* !HAVE_LIBURING */
+  struct {
+    uint32_t delay;
+    struct timeval plain;
+    const struct timeval *tv;
+  } timeouts[e_loop_timeout_count];
 };
 
+static struct s_loop_backend _g_backend;
+static uint32_t _g_timeouts[e_loop_timeout_count];
+
+/**
+ * @brief Enable the libevent locking, loops may be used by several threads
+ */
+static void _s_loop_thread_init(void)
+{
+  if (evthread_use_pthreads() != 0)
+    daemon_log(LOG_ERR, "failed to enable libevent threading\n");
+}
+
+/**
+ * @brief Check a method is available on this host
+ * @param [in] method: libevent method name
+ * @return 0 on success, -ENOTSUP otherwise
+ */
+static int _s_loop_method_check(const char *method)
+{
+  const char **methods = event_get_supported_methods();
+  for (uint32_t i = 0; methods && methods[i]; i++)
+    if (strcmp(methods[i], method) == 0)
+      return 0;
+  return -ENOTSUP;
+}
+
+/**
+ * @brief Allocate a libevent loop on the selected backend
+ * @return a valid pointer on success, NULL on error
+ */
+static struct event_base *_s_loop_base_new(void)
+{
+  struct event_config *config = event_config_new();
+  daemon_return_val_if_fail(config, NULL);
+
+  /* libevent has no way to require a method, the other ones are avoided */
+  const char **methods = event_get_supported_methods();
+  for (uint32_t i = 0; _g_backend.method[0] && methods && methods[i]; i++)
+    if (strcmp(methods[i], _g_backend.method) != 0)
+      event_config_avoid_method(config, methods[i]);
+  if (_g_backend.batch)
+    event_config_set_flag(config, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+  /* a burst of bulk traffic doesn't hold the control events back */
+  event_config_set_max_dispatch_interval(config, NULL, S_LOOP_DISPATCH_MAX,
+    e_loop_priority_io);
+
+  struct event_base *base = event_base_new_with_config(config);
+  event_config_free(config);
+  /* libevent gives every new event half the queue count as priority, one
+   * spare queue makes it io, bufferevents included */
+  if (base && event_base_priority_init(base, e_loop_priority_count + 1) != 0) {
+    event_base_free(base);
+    return NULL;
+  }
+  return base;
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * @brief Submit the entries prepared during an iteration at once, runs on
+ * the loop
+ */
+static void _s_loop_ring_flush(daemon_unused evutil_socket_t fd,
+  daemon_unused short what, struct s_loop *loop)
+{
+  daemon_return_if_fail(loop);
+
+  pthread_mutex_lock(&loop->ring.lock);
+  int ret = io_uring_submit(&loop->ring.queue);
+  if (ret < 0)
+    daemon_log(LOG_WARNING, "failed to submit to the ring (%d)\n", ret);
+  loop->ring.pending = 0;
+  pthread_mutex_unlock(&loop->ring.lock);
+}
+
+/**
+ * @brief Queue the submission of the entries prepared, the ring lock held
+ * @param [in] loop: loop owning the ring
+ */
+static void _s_loop_ring_push(struct s_loop *loop)
+{
+  if (!loop->ring.pending++)
+    event_active(loop->ring.flush, EV_TIMEOUT, 0);
+}
+
+/**
+ * @brief Post the multishot accept of a socket, the ring lock held
+ * @param [in] accept: accept to post
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_loop_accept_arm(struct s_loop_accept *accept)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&accept->loop->ring.queue);
+  if (!sqe)
+    return -EBUSY;
+
+  io_uring_prep_multishot_accept(sqe, accept->fd, NULL, NULL,
+    SOCK_NONBLOCK | SOCK_CLOEXEC);
+  io_uring_sqe_set_data(sqe, accept);
+  accept->armed = 1;
+  _s_loop_ring_push(accept->loop);
+  return 0;
+}
+
+/**
+ * @brief Handle the end of a multishot accept, the ring lock held. A stopped
+ * accept is released, a running one posted again unless the kernel refused it
+ * @param [in] accept: accept ended
+ * @param [in] status: result of the last completion
+ * @return 0 if the accept goes on, an -errno value otherwise
+ */
+static int _s_loop_accept_end(struct s_loop_accept *accept, int status)
+{
+  accept->armed = 0;
+  if (accept->closed) {
+    accept->loop->ring.accepts = s_list_remove(accept->loop->ring.accepts,
+      accept);
+    daemon_free(accept);
+    return -ECANCELED;
+  }
+  /* the kernel ends it when it runs short of resources, not otherwise */
+  if (status < 0 && status != -EMFILE && status != -ENFILE &&
+      status != -ENOBUFS && status != -ENOMEM)
+    return status;
+  return _s_loop_accept_arm(accept);
+}
+
+/**
+ * @brief Eventfd callback, runs on the loop. Reap the completions of the
+ * ring, the accepted peers are handed over without the ring lock
+ */
+static void _s_loop_ring_completed(daemon_unused evutil_socket_t fd,
+  daemon_unused short what, struct s_loop *loop)
+{
+  daemon_return_if_fail(loop);
+
+  uint64_t count;
+  if (read(loop->ring.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    daemon_log(LOG_WARNING, "failed to read the ring eventfd\n");
+
+  struct io_uring_cqe *cqe;
+  pthread_mutex_lock(&loop->ring.lock);
+  while (io_uring_peek_cqe(&loop->ring.queue, &cqe) == 0) {
+    struct s_loop_accept *accept = io_uring_cqe_get_data(cqe);
+    uint32_t flags = cqe->flags;
+    int res = cqe->res;
+    io_uring_cqe_seen(&loop->ring.queue, cqe);
+    /* the cancellations complete without data */
+    if (!accept)
+      continue;
+
+    s_loop_accept_cbk cbk = accept->cbk;
+    uint8_t closed = accept->closed;
+    void *userdata = accept->userdata;
+    if (res >= 0 && closed)
+      close(res);
+    int ret = 0;
+    if (!(flags & IORING_CQE_F_MORE))
+      ret = _s_loop_accept_end(accept, res);
+    /* nothing is reported for a stopped accept, its peers are closed */
+    if (closed)
+      continue;
+
+    pthread_mutex_unlock(&loop->ring.lock);
+    if (res >= 0) {
+      s_loop_account(loop, e_loop_priority_io);
+      cbk(res, userdata);
+    }
+    if (ret != 0) {
+      daemon_log(LOG_WARNING, "the ring stopped accepting (%d)\n", ret);
+      cbk(ret, userdata);
+    }
+    pthread_mutex_lock(&loop->ring.lock);
+  }
+  pthread_mutex_unlock(&loop->ring.lock);
+}
+
+/**
+ * @brief Release the ring of a loop, the loop stopped. The accepts left are
+ * released with it
+ * @param [in] loop: loop owning the ring
+ */
+static void _s_loop_ring_free(struct s_loop *loop)
+{
+  if (loop->ring.completed)
+    event_free(loop->ring.completed);
+  loop->ring.completed = NULL;
+  if (loop->ring.flush)
+    event_free(loop->ring.flush);
+  loop->ring.flush = NULL;
+  if (loop->ring.ready)
+    io_uring_queue_exit(&loop->ring.queue);
+  loop->ring.ready = 0;
+  if (loop->ring.fd >= 0)
+    close(loop->ring.fd);
+  loop->ring.fd = -1;
+  s_list_free_full(loop->ring.accepts, (s_destroy_cbk)daemon_free);
+  loop->ring.accepts = NULL;
+}
+
+/**
+ * @brief Set up the ring of a loop, its completions wake the loop up through
+ * an eventfd
+ * @param [in] loop: loop to set up
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_loop_ring_new(struct s_loop *loop)
+{
+  loop->ring.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->ring.fd < 0)
+    return -errno;
+  int ret = io_uring_queue_init(S_LOOP_RING_ENTRIES, &loop->ring.queue, 0);
+  if (ret < 0)
+    return ret;
+  loop->ring.ready = 1;
+  ret = io_uring_register_eventfd(&loop->ring.queue, loop->ring.fd);
+  if (ret < 0)
+    return ret;
+
+  loop->ring.completed = event_new(loop->base, loop->ring.fd,
+    EV_READ | EV_PERSIST, (event_callback_fn)_s_loop_ring_completed, loop);
+  loop->ring.flush = event_new(loop->base, -1, 0,
+    (event_callback_fn)_s_loop_ring_flush, loop);
+  if (!loop->ring.completed || !loop->ring.flush)
+    return -ENOMEM;
+  if (s_loop_set_priority(loop->ring.completed, e_loop_priority_io) != 0 ||
+      s_loop_set_priority(loop->ring.flush, e_loop_priority_io) != 0 ||
+      event_add(loop->ring.completed, NULL) != 0)
+    return -EBADE;
+  return 0;
+}
+#endif /* !HAVE_LIBURING */
+
+int s_loop_set_backend(const struct s_loop_backend *backend)
+{
+  daemon_return_val_if_fail(backend, -EINVAL);
+  daemon_return_val_if_fail(memchr(backend->method, '\0',
+    sizeof(backend->method)), -EINVAL);
+
+  if (backend->method[0] && _s_loop_method_check(backend->method) != 0) {
+    daemon_log(LOG_ERR, "loop method '%s' isn't available\n",
+      backend->method);
+    return -ENOTSUP;
+  }
+#ifndef HAVE_LIBURING
+  if (backend->uring) {
+    daemon_log(LOG_ERR, "io_uring isn't built in\n");
+    return -ENOTSUP;
+  }
+#endif /* !HAVE_LIBURING */
+  _g_backend = *backend;
+  return 0;
+}
+
+int s_loop_set_timeouts(const struct s_loop_timeouts *timeouts)
+{
+  daemon_return_val_if_fail(timeouts, -EINVAL);
+
+  __atomic_store_n(&_g_timeouts[e_loop_timeout_handshake],
+    timeouts->handshake, __ATOMIC_RELAXED);
+  __atomic_store_n(&_g_timeouts[e_loop_timeout_idle], timeouts->idle,
+    __ATOMIC_RELAXED);
+  __atomic_store_n(&_g_timeouts[e_loop_timeout_stall], timeouts->stall,
+    __ATOMIC_RELAXED);
+  return 0;
+}
+
+int s_loop_get_timeouts(struct s_loop_timeouts *timeouts)
+{
+  daemon_return_val_if_fail(timeouts, -EINVAL);
+
+  timeouts->handshake = __atomic_load_n(&_g_timeouts[e_loop_timeout_handshake],
+    __ATOMIC_RELAXED);
+  timeouts->idle = __atomic_load_n(&_g_timeouts[e_loop_timeout_idle],
+    __ATOMIC_RELAXED);
+  timeouts->stall = __atomic_load_n(&_g_timeouts[e_loop_timeout_stall],
+    __ATOMIC_RELAXED);
+  return 0;
+}
+
 struct s_loop *s_loop_new(void)
 {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, _s_loop_thread_init);
+
   struct s_loop *loop = daemon_malloc(sizeof(struct s_loop));
-  loop->base = event_base_new();
+  loop->base = _s_loop_base_new();
+  if (loop->base) {
+    /* libevent names the batched epoll "epoll (with changelist)" */
+    const char *method = event_base_get_method(loop->base);
+    size_t len = strcspn(method, " ");
+    if (len >= sizeof(loop->backend.method))
+      len = sizeof(loop->backend.method) - 1;
+    memcpy(loop->backend.method, method, len);
+    /* the flag is ignored by the other methods */
+    loop->backend.batch = _g_backend.batch &&
+      strcmp(loop->backend.method, "epoll") == 0;
+  }
   loop->idle = s_task_idle_new(loop);
+#ifdef HAVE_LIBURING
+  pthread_mutex_init(&loop->ring.lock, NULL);
+  loop->ring.fd = -1;
+  /* without a ring, the listeners accept through libevent */
+  if (loop->base && _g_backend.uring) {
+    int ret = _s_loop_ring_new(loop);
+    if (ret != 0) {
+      daemon_log(LOG_WARNING, "io_uring unavailable (%d)\n", ret);
+      _s_loop_ring_free(loop);
+    }
+    loop->backend.uring = ret == 0;
+  }
+#endif /* !HAVE_LIBURING */
 
   if (!loop->base || !loop->idle)
     goto error;
@@ -52,6 +405,16 @@ void s_loop_free(struct s_loop *loop)
   s_loop_quit(loop);
 
   s_task_idle_free(loop->idle);
+  /* a quit at control priority leaves the bulk callbacks queued, the
+   * bufferevents released meanwhile only go away once theirs ran. Each pass
+   * runs a single priority */
+  for (uint32_t i = 0; loop->base && i < S_LOOP_DISPATCH_MAX &&
+      event_base_get_num_events(loop->base, EVENT_BASE_COUNT_ACTIVE); i++)
+    event_base_loop(loop->base, EVLOOP_NONBLOCK);
+#ifdef HAVE_LIBURING
+  _s_loop_ring_free(loop);
+  pthread_mutex_destroy(&loop->ring.lock);
+#endif /* !HAVE_LIBURING */
   event_base_free(loop->base);
   daemon_free(loop);
 }
@@ -68,6 +431,125 @@ int s_loop_quit(struct s_loop *loop)
   return s_task_idle_wakeup(loop->idle);
 }
 
+int s_loop_get_backend(struct s_loop *loop, struct s_loop_backend *backend)
+{
+  daemon_return_val_if_fail(loop, -EINVAL);
+  daemon_return_val_if_fail(backend, -EINVAL);
+
+  *backend = loop->backend;
+  return 0;
+}
+
+struct s_loop_accept *s_loop_accept_new(struct s_loop *loop, int fd,
+  s_loop_accept_cbk cbk, daemon_unused void *userdata)
+{
+  daemon_return_val_if_fail(loop, NULL);
+  daemon_return_val_if_fail(fd >= 0, NULL);
+  daemon_return_val_if_fail(cbk, NULL);
+
+#ifdef HAVE_LIBURING
+  if (!loop->backend.uring)
+    return NULL;
+
+  struct s_loop_accept *accept = daemon_malloc(sizeof(struct s_loop_accept));
+  accept->cbk = cbk;
+  accept->fd = fd;
+  accept->loop = loop;
+  accept->userdata = userdata;
+
+  pthread_mutex_lock(&loop->ring.lock);
+  int ret = _s_loop_accept_arm(accept);
+  if (ret == 0)
+    loop->ring.accepts = s_list_prepend(loop->ring.accepts, accept);
+  pthread_mutex_unlock(&loop->ring.lock);
+  if (ret != 0) {
+    daemon_free(accept);
+    return NULL;
+  }
+  return accept;
+#else
+  return NULL;
+#endif /* !HAVE_LIBURING */
+}
+
+void s_loop_accept_free(struct s_loop_accept *accept)
+{
+  daemon_return_if_fail(accept);
+
+#ifdef HAVE_LIBURING
+  struct s_loop *loop = accept->loop;
+  pthread_mutex_lock(&loop->ring.lock);
+  accept->closed = 1;
+  if (!accept->armed) {
+    loop->ring.accepts = s_list_remove(loop->ring.accepts, accept);
+    daemon_free(accept);
+  } else {
+    /* the accept is released once its last completion is reaped, with a
+     * full ring it is left to the loop release */
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&loop->ring.queue);
+    if (sqe) {
+      io_uring_prep_cancel(sqe, accept, 0);
+      io_uring_sqe_set_data(sqe, NULL);
+      _s_loop_ring_push(loop);
+    }
+  }
+  pthread_mutex_unlock(&loop->ring.lock);
+#endif /* !HAVE_LIBURING */
+}
+
+int s_loop_set_priority(struct event *event, enum e_loop_priority priority)
+{
+  daemon_return_val_if_fail(event, -EINVAL);
+  daemon_return_val_if_fail(priority < e_loop_priority_count, -EINVAL);
+
+  return event_priority_set(event, priority) == 0 ? 0 : -EBUSY;
+}
+
+void s_loop_account(struct s_loop *loop, enum e_loop_priority priority)
+{
+  daemon_return_if_fail(loop);
+  daemon_return_if_fail(priority < e_loop_priority_count);
+
+  __atomic_add_fetch(&loop->callbacks[priority], 1, __ATOMIC_RELAXED);
+}
+
+const struct timeval *s_loop_get_timeout(struct s_loop *loop,
+  enum e_loop_timeout timeout)
+{
+  daemon_return_val_if_fail(loop, NULL);
+  daemon_return_val_if_fail(timeout < e_loop_timeout_count, NULL);
+
+  uint32_t delay = __atomic_load_n(&_g_timeouts[timeout], __ATOMIC_RELAXED);
+  if (!delay)
+    return NULL;
+  if (delay == loop->timeouts[timeout].delay)
+    return loop->timeouts[timeout].tv;
+
+  /* libevent hands back the queue of a delay the loop already knows */
+  loop->timeouts[timeout].delay = delay;
+  loop->timeouts[timeout].plain.tv_sec = delay / 1000;
+  loop->timeouts[timeout].plain.tv_usec = (delay % 1000) * 1000;
+  loop->timeouts[timeout].tv = event_base_init_common_timeout(loop->base,
+    &loop->timeouts[timeout].plain);
+  if (!loop->timeouts[timeout].tv) {
+    /* a loop holds 256 queues at most, the timer heap takes over */
+    daemon_log(LOG_WARNING, "no timeout queue left for %u ms\n", delay);
+    loop->timeouts[timeout].tv = &loop->timeouts[timeout].plain;
+  }
+  return loop->timeouts[timeout].tv;
+}
+
+int s_loop_get_stats(struct s_loop *loop, struct s_loop_stats *stats)
+{
+  daemon_return_val_if_fail(loop, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  for (uint32_t i = 0; i < e_loop_priority_count; i++)
+    stats->callbacks[i] = __atomic_load_n(&loop->callbacks[i],
+      __ATOMIC_RELAXED);
+  return 0;
+}
+
 struct event_base *s_loop_tolibevent(struct s_loop *loop)
 {
   daemon_return_val_if_fail(loop, NULL);
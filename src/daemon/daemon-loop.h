@@ -18,11 +18,119 @@
 #ifndef _DAEMON_LOOP_H_
 # define _DAEMON_LOOP_H_
 
+# include <stdint.h>
 # include <avahi-common/watch.h>
 # include <event2/event.h>
 
+/**
+ * @brief Maximum length of a backend method name
+ */
+# define S_LOOP_METHOD_SIZE 16
+
+/**
+ * @brief Number of bulk callbacks run in a row before the loop polls again,
+ * so that the events of a higher priority raised meanwhile run first
+ */
+# define S_LOOP_DISPATCH_MAX 16
+
+/**
+ * @brief Priority of the events of a loop, from the most urgent. An active
+ * event only runs once no event of a higher priority is active. The events
+ * left without a priority, the bufferevents and the listeners among them, run
+ * as io
+ */
+enum e_loop_priority {
+  e_loop_priority_control,
+  e_loop_priority_discovery,
+  e_loop_priority_io,
+  e_loop_priority_count
+};
+
+/**
+ * @brief Number of callbacks run by a loop, per priority
+ */
+struct s_loop_stats {
+  uint64_t callbacks[e_loop_priority_count];
+};
+
+/**
+ * @brief Timeout classes of the loops. The events of a class all wait the
+ * same delay, so libevent keeps them in a queue ordered by expiry instead of
+ * its timer heap, and arming one costs O(1) whatever the number of events
+ */
+enum e_loop_timeout {
+  e_loop_timeout_handshake,
+  e_loop_timeout_idle,
+  e_loop_timeout_stall,
+  e_loop_timeout_count
+};
+
+/**
+ * @brief Delays of the timeout classes in milliseconds, 0 disables a class.
+ * The handshake delay bounds a connection until it is established, the idle
+ * delay a silent peer, and the stall delay a pending output making no
+ * progress
+ */
+struct s_loop_timeouts {
+  uint32_t handshake;
+  uint32_t idle;
+  uint32_t stall;
+};
+
 struct s_loop;
 
+/**
+ * @brief Backend of the loops. The method is the libevent one polling the
+ * descriptors, an empty method picks the fastest one of the host. With the
+ * batch flag, an epoll loop submits the changes made during an iteration at
+ * once before waiting, instead of one epoll_ctl per change; it must not be
+ * used if a loop watches several dup()ed descriptors of the same file. With
+ * the uring flag, on a build with liburing, each loop also owns an io_uring
+ * ring serving the accepts only, see #s_loop_accept_new. The accepted
+ * connections are still read and written by their openssl bufferevents, on
+ * the libevent method
+ */
+struct s_loop_backend {
+  uint8_t batch;
+  char method[S_LOOP_METHOD_SIZE];
+  uint8_t uring;
+};
+
+struct s_loop_accept;
+
+/**
+ * @brief Callback of the peers accepted by a loop, on the loop thread
+ * @param [in] fd: non blocking socket of the peer, owned by the callback, or
+ * an -errno value once the ring stopped accepting, the accept should then be
+ * freed
+ * @param [in] userdata: user data given to #s_loop_accept_new
+ */
+typedef void (*s_loop_accept_cbk)(int fd, void *userdata);
+
+/**
+ * @brief Select the backend of the loops allocated afterwards, usually once
+ * at startup before any thread runs
+ * @param [in] backend: backend to use
+ * @return 0 on success, -ENOTSUP if the method isn't available on this host,
+ * an another -errno value on error
+ */
+int s_loop_set_backend(const struct s_loop_backend *backend);
+
+/**
+ * @brief Set the delays of the timeout classes, from any thread. The events
+ * armed afterwards use the new delays, the pending ones keep theirs
+ * @param [in] timeouts: delays to use
+ * @return 0 on success, an -errno value on error
+ */
+int s_loop_set_timeouts(const struct s_loop_timeouts *timeouts);
+
+/**
+ * @brief Get the delays of the timeout classes, from any thread
+ * @param [out] timeouts: delays to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_loop_get_timeouts(struct s_loop_timeouts *timeouts);
+
 /**
  * @brief Allocate a new module loop
  * @return a valid pointer on success, NULL on error
@@ -49,6 +157,69 @@ int s_loop_run(struct s_loop *loop);
  */
 int s_loop_quit(struct s_loop *loop);
 
+/**
+ * @brief Get the backend a loop runs on
+ * @param [in] loop: loop to browse
+ * @param [out] backend: backend to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_loop_get_backend(struct s_loop *loop, struct s_loop_backend *backend);
+
+/**
+ * @brief Accept the peers of a listening socket through the ring of a loop,
+ * from any thread. A single multishot accept serves all of them, the
+ * submissions of an iteration go to the kernel at once and the completions
+ * are signalled to the loop through an eventfd
+ * @param [in] loop: loop owning the ring
+ * @param [in] fd: listening socket, still owned by the caller
+ * @param [in] cbk: callback of the accepted peers
+ * @param [in] userdata: user data of the callback
+ * @return a valid pointer on success, NULL if the loop has no ring or on error
+ */
+struct s_loop_accept *s_loop_accept_new(struct s_loop *loop, int fd,
+  s_loop_accept_cbk cbk, void *userdata);
+
+/**
+ * @brief Stop accepting, from any thread, before the loop is freed. The
+ * peers accepted afterwards are closed, the socket can be closed right away
+ * @param [in] accept: accept to stop
+ */
+void s_loop_accept_free(struct s_loop_accept *accept);
+
+/**
+ * @brief Set the priority of an event, before it is added
+ * @param [in] event: event to modify
+ * @param [in] priority: priority of the event
+ * @return 0 on success, an -errno value on error
+ */
+int s_loop_set_priority(struct event *event, enum e_loop_priority priority);
+
+/**
+ * @brief Count a callback run by a loop, from the loop thread
+ * @param [in] loop: loop running the callback
+ * @param [in] priority: priority of the event
+ */
+void s_loop_account(struct s_loop *loop, enum e_loop_priority priority);
+
+/**
+ * @brief Get the timeval to arm an event of a timeout class with, from the
+ * loop thread. It may be copied, bufferevent_set_timeouts included
+ * @param [in] loop: loop running the event
+ * @param [in] timeout: class of the event
+ * @return a valid pointer on success, NULL if the class is disabled or on
+ * error
+ */
+const struct timeval *s_loop_get_timeout(struct s_loop *loop,
+  enum e_loop_timeout timeout);
+
+/**
+ * @brief Get the callback counters of a loop, from any thread
+ * @param [in] loop: loop to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_loop_get_stats(struct s_loop *loop, struct s_loop_stats *stats);
+
 /**
  * @brief Convert the module loop into libevent loop
  * @param [in] loop: loop to convert
@@ -33,13 +33,15 @@
 
 /**
  * @brief Start the daemon process
+ * @param [in] handoff: non zero to replace the running daemon, which hands
+ * its sockets over instead of being killed
  * @return 0 on success, an errno value on error
  */
-static int _daemon_fork_process(void)
+static int _daemon_fork_process(int handoff)
 {
   int ret = 0;
 
-  if (daemon_check_process() == 1) {
+  if (handoff || daemon_check_process() == 1) {
     pid_t pid = daemon_fork();
     /* Do the fork */
     if (pid < 0) {
@@ -57,7 +59,7 @@ static int _daemon_fork_process(void)
       daemon_log(LOG_INFO, "daemon returned value '%d'", ret);
       return ret;
     } else {
-      return daemon_load_process();
+      return daemon_load_process(handoff);
     }
   }
   daemon_log(LOG_ERR, "process already started");
@@ -116,12 +118,13 @@ int main(int argc, char *argv[])
       ret = daemon_kill_process();
       break;
     case e_process_option_start:
-      ret = _daemon_fork_process();
+      ret = _daemon_fork_process(0);
+      break;
+    case e_process_option_reload:
+      /* the running daemon keeps listening until the new one took its
+       * sockets over, then drains its connections */
+      ret = _daemon_fork_process(daemon_check_process() == 0);
       break;
-    case e_process_option_reload: {
-      ret = daemon_kill_process();
-      ret |= _daemon_fork_process();
-    }
     default:
       daemon_log(LOG_ERR, "an error occured...");
       ret = -EBADE;
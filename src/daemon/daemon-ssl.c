@@ -15,12 +15,23 @@
  * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include <libdaemon/dlog.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "daemon-alloc.h"
 #include "daemon-cond.h"
 #include "daemon-ctx.h"
 #include "ssl/ssl.h"
+#include "ssl/ssl-connection.h"
+#include "ssl/ssl-router.h"
+#include "ssl/ssl-rpc.h"
+
+static const char *_g_dictionary_path = "/etc/cerebrum/dictionary";
 
 /**
  * @brief Connection status callback
@@ -54,23 +65,21 @@ static void _s_daemon_ctx_ssl_connection(struct s_daemon_ctx *ctx,
  * @param [in] error: error received from ssl
  */
 static void _s_daemon_ctx_ssl_error(struct s_daemon_ctx *ctx,
-  enum e_ssl_error type, daemon_unused int error,
-  const struct s_ssl_packet *packet)
+  enum e_ssl_error type, int error,
+  daemon_unused const struct s_ssl_packet *packet)
 {
   daemon_return_if_fail(ctx);
 
   switch (type) {
   case e_ssl_error_connection:
-    daemon_log(LOG_ERR, "failed ssl connection\n");
-    s_daemon_ctx_quit(ctx);
+    /* a single peer failed, the client retries it on its own */
+    daemon_log(LOG_WARNING, "failed ssl connection (%d)\n", error);
     break;
   case e_ssl_error_read:
     daemon_log(LOG_ERR, "failed ssl read\n");
-    daemon_return_if_fail(packet);
     break;
   case e_ssl_error_write:
     daemon_log(LOG_ERR, "failed ssl write\n");
-    daemon_return_if_fail(packet);
     break;
   default:
     daemon_log(LOG_ERR, "strange state... better to assert\n");
@@ -81,15 +90,188 @@ static void _s_daemon_ctx_ssl_error(struct s_daemon_ctx *ctx,
 /**
  * @brief Read callback, called whenever a packet is received
  * @param [in] ctx: userdata passing through the allocation
- * @param [in] packet: payload received
+ * @param [in] view: payload received
  */
 static void _s_daemon_ctx_ssl_read(struct s_daemon_ctx *ctx,
-  const struct s_ssl_packet *packet)
+  struct s_ssl_packet_view *view)
 {
   daemon_return_if_fail(ctx);
-  daemon_return_if_fail(packet);
+  daemon_return_if_fail(view);
 
   daemon_log(LOG_NOTICE, "a packet is received");
+  s_ssl_packet_view_release(view);
+}
+
+/**
+ * @brief Ping handler, the payload is sent back in a pong message, as the
+ * response of the call when the ping is a request
+ * @param [in] ctx: userdata passing through the registration
+ * @param [in] connection: connection which received the ping
+ * @param [in] view: ping received
+ */
+static void _s_daemon_ctx_ssl_ping(struct s_daemon_ctx *ctx,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
+{
+  daemon_return_if_fail(ctx);
+  daemon_return_if_fail(view);
+
+  uint8_t request = (view->flags & S_SSL_FRAME_FLAG_REQUEST) != 0;
+  uint64_t id = view->id;
+  struct s_ssl_packet *packet = s_ssl_packet_view_copy(view);
+  s_ssl_packet_view_release(view);
+  daemon_return_if_fail(packet);
+
+  packet->flags = 0;
+  packet->type = e_daemon_message_pong;
+  int ret = request ? s_ssl_rpc_reply(connection, id, packet) :
+    s_ssl_connection_write(connection, packet);
+  if (ret != 0)
+    daemon_log(LOG_WARNING, "failed to answer a ping\n");
+  s_ssl_packet_free(packet);
+}
+
+/**
+ * @brief Build the path of a transfer file
+ * @param [in] ctx: userdata passing through the allocation
+ * @param [in] id: transfer identifier
+ * @param [in] part: non zero for the file of a transfer still running
+ * @param [out] path: path to fill
+ * @param [in] size: size of the path
+ * @return 0 on success, -ENAMETOOLONG if the path doesn't fit
+ */
+static int _s_daemon_ctx_transfer_path(struct s_daemon_ctx *ctx, uint64_t id,
+  int part, char *path, size_t size)
+{
+  int len = snprintf(path, size, "%s/%016llx%s", ctx->transfers.path,
+    (unsigned long long)id, part ? ".part" : "");
+  return len < 0 || (size_t)len >= size ? -ENAMETOOLONG : 0;
+}
+
+/**
+ * @brief Offer callback, a transfer is stored in a part file of the transfer
+ * directory, an interrupted one resumes from the size of its file
+ * @param [in] ctx: userdata passing through the allocation
+ * @param [in] id: transfer identifier
+ * @param [in] size: transfer size
+ * @param [in, out] offset: bytes already stored
+ * @return the file descriptor of the part file, an -errno value on error
+ */
+static int _s_daemon_ctx_transfer_offer(struct s_daemon_ctx *ctx, uint64_t id,
+  uint64_t size, uint64_t *offset)
+{
+  daemon_return_val_if_fail(ctx, -EINVAL);
+
+  char path[PATH_MAX];
+  int ret = _s_daemon_ctx_transfer_path(ctx, id, 1, path, sizeof(path));
+  if (ret != 0)
+    return ret;
+  int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    ret = -errno;
+    daemon_log(LOG_ERR, "failed to open '%s': %s\n", path, strerror(errno));
+    return ret;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (uint64_t)st.st_size <= size)
+    *offset = st.st_size;
+  return fd;
+}
+
+/**
+ * @brief Received callback, a complete transfer loses its part suffix
+ * @param [in] ctx: userdata passing through the allocation
+ * @param [in] id: transfer identifier
+ * @param [in] fd: file descriptor returned by the offer callback
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+static void _s_daemon_ctx_transfer_received(struct s_daemon_ctx *ctx,
+  uint64_t id, int fd, int status)
+{
+  daemon_return_if_fail(ctx);
+
+  close(fd);
+  char part[PATH_MAX];
+  char path[PATH_MAX];
+  if (status == 0)
+    status = _s_daemon_ctx_transfer_path(ctx, id, 1, part, sizeof(part));
+  if (status == 0)
+    status = _s_daemon_ctx_transfer_path(ctx, id, 0, path, sizeof(path));
+  if (status == 0 && rename(part, path) != 0)
+    status = -errno;
+  if (status != 0)
+    daemon_log(LOG_WARNING, "transfer %016llx failed: %s\n",
+      (unsigned long long)id, strerror(-status));
+}
+
+/**
+ * @brief Sent callback, the daemon doesn't send any transfer on its own
+ * @param [in] ctx: userdata passing through the allocation
+ * @param [in] id: transfer identifier
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+static void _s_daemon_ctx_transfer_sent(struct s_daemon_ctx *ctx, uint64_t id,
+  int status)
+{
+  daemon_return_if_fail(ctx);
+
+  daemon_log(LOG_NOTICE, "transfer %016llx sent (%d)\n",
+    (unsigned long long)id, status);
+}
+
+/**
+ * @brief Start the transfer engine when a transfer directory is set, its
+ * handlers serve the connections of the server and the ones of the peers
+ * @param [in] ctx: daemon context
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_daemon_ctx_transfer_register(struct s_daemon_ctx *ctx)
+{
+  static const struct s_ssl_transfer_funcs funcs = {
+    .offer = (s_ssl_transfer_offer_cbk)_s_daemon_ctx_transfer_offer,
+    .received = (s_ssl_transfer_received_cbk)_s_daemon_ctx_transfer_received,
+    .sent = (s_ssl_transfer_sent_cbk)_s_daemon_ctx_transfer_sent,
+  };
+
+  if (!ctx->config->transfers)
+    return 0;
+  ctx->transfers.path = strdup(ctx->config->transfers);
+  daemon_return_val_if_fail(ctx->transfers.path, -ENOMEM);
+  ctx->transfers.engine = s_ssl_transfers_new(ctx->loop, &funcs, ctx);
+  daemon_return_val_if_fail(ctx->transfers.engine, -ENOMEM);
+
+  int ret = s_ssl_transfers_register(ctx->transfers.engine,
+    s_ssl_server_get_router(ctx->connection));
+  if (ret == 0)
+    ret = s_ssl_transfers_register(ctx->transfers.engine,
+      s_ssl_client_get_router(ctx->peers));
+  if (ret == 0)
+    daemon_log(LOG_NOTICE, "transfers stored in '%s'\n",
+      ctx->transfers.path);
+  return ret;
+}
+
+int s_daemon_ctx_ssl_register(struct s_daemon_ctx *ctx)
+{
+  daemon_return_val_if_fail(ctx, -EINVAL);
+  daemon_return_val_if_fail(ctx->connection, -EBADE);
+
+  /* the dictionary is optional, both peers must share the same one */
+  struct s_ssl_compress_config config;
+  s_ssl_compress_config_init(&config);
+  if (access(_g_dictionary_path, R_OK) == 0)
+    config.dictionary = s_ssl_dictionary_load(_g_dictionary_path);
+  int ret = s_ssl_server_set_compression(ctx->connection, &config);
+  if (config.dictionary)
+    s_ssl_dictionary_unref(config.dictionary);
+  if (ret != 0)
+    return ret;
+
+  struct s_ssl_router *router = s_ssl_server_get_router(ctx->connection);
+  ret = s_ssl_router_register(router, e_daemon_message_ping,
+    (s_ssl_route_cbk)_s_daemon_ctx_ssl_ping, ctx);
+  if (ret != 0)
+    return ret;
+  return _s_daemon_ctx_transfer_register(ctx);
 }
 
 const struct s_ssl_funcs *s_daemon_ctx_ssl_get_funcs(void)
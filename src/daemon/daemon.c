@@ -31,6 +31,7 @@
 #include "daemon.h"
 #include "daemon-ctx.h"
 #include "daemon-loop.h"
+#include "ssl/ssl-handoff.h"
 
 static struct s_daemon_ctx *_g_ctx;
 
@@ -63,18 +64,30 @@ int daemon_kill_process(void)
   return -EALREADY;
 }
 
-int daemon_load_process(void)
+int daemon_load_process(int handoff)
 {
+  int pid_file = 0;
+  int ret;
   if (daemon_close_all(-1) < 0) {
     daemon_log(LOG_ERR, "failed to close all file descriptors: %s",
       strerror(errno));
     goto finish;
   }
 
+  /* the running daemon releases its pid file once the state is sent, it
+   * keeps it and goes on serving otherwise */
+  struct s_ssl_handoff state;
+  s_ssl_handoff_init(&state);
+  if (handoff && s_daemon_ctx_handoff_receive(&state) != 0) {
+    errno = ECONNREFUSED;
+    goto finish;
+  }
+
   if (daemon_pid_file_create() < 0) {
     daemon_log(LOG_ERR, "failed to create PID file (%s).", strerror(errno));
     goto finish;
   }
+  pid_file = 1;
 
   if (daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, 0) < 0) {
     daemon_log(LOG_ERR, "failed to register signal handlers (%s).",
@@ -83,6 +96,9 @@ int daemon_load_process(void)
   }
 
   _g_ctx = s_daemon_ctx_new(daemon_signal_fd());
+  if (_g_ctx && s_ssl_server_import(_g_ctx->connection, &state) != 0)
+    daemon_log(LOG_ERR, "failed to take the sockets over\n");
+  s_ssl_handoff_clear(&state);
   daemon_retval_send(_g_ctx ? 0 : EBADE);
 
   s_daemon_ctx_run(_g_ctx);
@@ -91,10 +107,13 @@ int daemon_load_process(void)
   return errno;
 
 finish:
+  ret = -errno;
   daemon_retval_send(errno);
   daemon_log(LOG_INFO, "terminating...");
   daemon_retval_send(255);
   daemon_signal_done();
-  daemon_pid_file_remove();
-  return 0;
+  /* the pid file still belongs to the running daemon after a failed handoff */
+  if (pid_file)
+    daemon_pid_file_remove();
+  return ret;
 }
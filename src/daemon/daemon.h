@@ -34,8 +34,10 @@ int daemon_kill_process(void);
 
 /**
  * @brief Start the daemon process
+ * @param [in] handoff: non zero to take the sockets of the running daemon
+ * over, which then drains its connections and terminates
  * @return a valid pointer on success, an errno value on error
  */
-int daemon_load_process(void);
+int daemon_load_process(int handoff);
 
 #endif /* !_DAEMON_H_ */
@@ -0,0 +1,772 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <event2/bufferevent_ssl.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+#include "ssl-client.h"
+#include "ssl-router.h"
+#include "ssl-worker.h"
+
+/**
+ * @brief Scale of the token bucket: a token is split in thousandths, so one
+ * millisecond at a rate of one attempt per second refills one unit
+ */
+#define S_SSL_CLIENT_TOKEN 1000
+
+struct s_ssl_client_peer;
+
+/**
+ * @brief Connection attempt to one address of a peer
+ */
+struct s_ssl_client_attempt {
+  struct s_ssl_connection *connection;
+  uint8_t index;
+  struct s_ssl_client_peer *peer;
+  uint64_t start;
+};
+
+struct s_ssl_client_peer {
+  struct {
+    struct sockaddr_storage sa;
+    socklen_t len;
+  } addresses[S_SSL_CLIENT_ADDRESSES];
+  struct s_ssl_client_attempt attempts[S_SSL_CLIENT_ADDRESSES];
+  uint32_t backoff;
+  struct s_ssl_client *client;
+  uint64_t connected;
+  struct s_ssl_connection *connection;
+  uint8_t count;
+  char *name;
+  struct {
+    uint8_t count;
+    uint8_t next;
+    uint8_t order[S_SSL_CLIENT_ADDRESSES];
+    uint8_t pending;
+    struct event *stagger;
+  } race;
+  struct event *retry;
+};
+
+struct s_ssl_client {
+  struct {
+    uint64_t last;
+    uint64_t tokens;
+  } bucket;
+  SSL_CTX *context;
+  struct {
+    uint64_t attempts;
+    uint64_t failures;
+    uint64_t throttled;
+  } counters;
+  struct s_ssl_funcs funcs;
+  char *identity;
+  struct s_loop *loop;
+  struct s_hash *peers;
+  struct s_ssl_reconnect reconnect;
+  struct s_ssl_router *router;
+  void *userdata;
+  struct s_ssl_worker *worker;
+};
+
+/**
+ * @brief Get the monotonic time
+ * @return the time in milliseconds
+ */
+static uint64_t _s_ssl_client_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Spread a delay, so the peers which lost their connection together
+ * don't retry together. Half of the delay is kept, the other half is random
+ * @param [in] delay: delay in milliseconds
+ * @return the delay to wait
+ */
+static uint32_t _s_ssl_client_jitter(uint32_t delay)
+{
+  uint32_t random = 0;
+  if (delay < 2 || RAND_bytes((unsigned char *)&random, sizeof(random)) != 1)
+    return delay;
+  return delay / 2 + random % (delay / 2 + 1);
+}
+
+/**
+ * @brief Take a token from the bucket shared by every peer
+ * @param [in] client: client to modify
+ * @return 0 if the attempt may start, otherwise the time in milliseconds
+ * until the next token
+ */
+static uint32_t _s_ssl_client_token(struct s_ssl_client *client)
+{
+  uint64_t now = _s_ssl_client_now();
+  uint64_t capacity = (uint64_t)client->reconnect.burst * S_SSL_CLIENT_TOKEN;
+
+  client->bucket.tokens += (now - client->bucket.last) *
+    client->reconnect.rate;
+  if (client->bucket.tokens > capacity)
+    client->bucket.tokens = capacity;
+  client->bucket.last = now;
+
+  if (client->bucket.tokens >= S_SSL_CLIENT_TOKEN) {
+    client->bucket.tokens -= S_SSL_CLIENT_TOKEN;
+    return 0;
+  }
+  return (S_SSL_CLIENT_TOKEN - client->bucket.tokens +
+    client->reconnect.rate - 1) / client->reconnect.rate;
+}
+
+/**
+ * @brief Arm a timer of a peer
+ * @param [in] timer: timer to arm
+ * @param [in] delay: delay in milliseconds
+ */
+static void _s_ssl_client_schedule(struct event *timer, uint32_t delay)
+{
+  struct timeval tv = { .tv_sec = delay / 1000,
+    .tv_usec = (delay % 1000) * 1000 };
+  evtimer_add(timer, &tv);
+}
+
+/**
+ * @brief Log the outcome and the duration of a connection attempt
+ * @param [in] attempt: attempt concerned
+ * @param [in] result: outcome of the attempt
+ */
+static void _s_ssl_client_report(struct s_ssl_client_attempt *attempt,
+  const char *result)
+{
+  struct s_ssl_client_peer *peer = attempt->peer;
+  const struct sockaddr *sa =
+    (struct sockaddr *)&peer->addresses[attempt->index].sa;
+  char address[INET6_ADDRSTRLEN] = "?";
+
+  if (sa->sa_family == AF_INET6)
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr, address,
+      sizeof(address));
+  else if (sa->sa_family == AF_INET)
+    inet_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr, address,
+      sizeof(address));
+  daemon_log(LOG_INFO, "'%s' via %s %s after %lu ms\n", peer->name, address,
+    result, (unsigned long)(_s_ssl_client_now() - attempt->start));
+}
+
+/**
+ * @brief Order the addresses of a peer for a race: ipv6 first, then the
+ * families alternate so a broken family doesn't delay the other one
+ * @param [in] peer: peer to modify
+ */
+static void _s_ssl_client_order(struct s_ssl_client_peer *peer)
+{
+  uint8_t families[2][S_SSL_CLIENT_ADDRESSES];
+  uint8_t counts[2] = { 0, 0 };
+
+  for (uint8_t i = 0; i < peer->count; i++) {
+    uint8_t family = peer->addresses[i].sa.ss_family == AF_INET6 ? 0 : 1;
+    families[family][counts[family]++] = i;
+  }
+  peer->race.count = 0;
+  for (uint8_t i = 0; i < counts[0] || i < counts[1]; i++) {
+    if (i < counts[0])
+      peer->race.order[peer->race.count++] = families[0][i];
+    if (i < counts[1])
+      peer->race.order[peer->race.count++] = families[1][i];
+  }
+  peer->race.next = 0;
+  peer->race.pending = 0;
+}
+
+/**
+ * @brief Schedule the next attempt of a peer after a failure, the delay
+ * doubles on every consecutive failure
+ * @param [in] peer: peer to reconnect
+ */
+static void _s_ssl_client_backoff(struct s_ssl_client_peer *peer)
+{
+  const struct s_ssl_reconnect *reconnect = &peer->client->reconnect;
+  uint64_t backoff = peer->backoff ? (uint64_t)peer->backoff * 2 :
+    reconnect->min;
+
+  peer->backoff = backoff < reconnect->max ? backoff : reconnect->max;
+  _s_ssl_client_schedule(peer->retry, _s_ssl_client_jitter(peer->backoff));
+}
+
+/**
+ * @brief Read callback of the outbound connections, the packets are routed
+ * according to their message type
+ * @param [in] connection: connection which received the packet
+ * @param [in] view: payload received
+ */
+static void _s_ssl_client_read(struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  struct s_ssl_client_attempt *attempt =
+    s_ssl_connection_get_userdata(connection);
+  daemon_return_if_fail(attempt);
+
+  s_ssl_router_dispatch(attempt->peer->client->router, connection, view);
+}
+
+/**
+ * @brief Default route: the packets without a registered handler reach the
+ * read callback of the client
+ * @param [in] client: client which received the packet
+ * @param [in] connection: connection originated by the packet
+ * @param [in] view: packet received
+ */
+static void _s_ssl_client_unrouted(struct s_ssl_client *client,
+  daemon_unused struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  client->funcs.read(client->userdata, view);
+}
+
+/**
+ * @brief Error callback of the outbound connections. A failed connect or
+ * handshake is left to the race and the backoff of the peer
+ */
+static void _s_ssl_client_error(struct s_ssl_connection *connection,
+  enum e_ssl_error type, int error, const struct s_ssl_packet *packet)
+{
+  struct s_ssl_client_attempt *attempt =
+    s_ssl_connection_get_userdata(connection);
+  daemon_return_if_fail(attempt);
+
+  if (type == e_ssl_error_connection)
+    return;
+  struct s_ssl_client *client = attempt->peer->client;
+  client->funcs.error(client->userdata, type, error, packet);
+}
+
+static void _s_ssl_client_status(struct s_ssl_connection *connection,
+  enum e_ssl_connection state);
+
+/**
+ * @brief Open a connection to one address of a peer
+ * @param [in] attempt: attempt to start
+ * @return a valid pointer on success, NULL on error
+ */
+static struct s_ssl_connection *_s_ssl_client_open(
+  struct s_ssl_client_attempt *attempt)
+{
+  struct s_ssl_client_peer *peer = attempt->peer;
+  struct s_ssl_client *client = peer->client;
+
+  SSL *ssl = SSL_new(client->context);
+  struct bufferevent *buffer = ssl ? bufferevent_openssl_socket_new(
+    s_loop_tolibevent(client->loop), -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+    BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE) : NULL;
+  if (!buffer) {
+    if (ssl)
+      SSL_free(ssl);
+    return NULL;
+  }
+
+  struct s_ssl_connection *connection = s_ssl_connection_new(client->worker,
+    buffer, (s_ssl_read_cbk)_s_ssl_client_read,
+    (s_ssl_error_cbk)_s_ssl_client_error);
+  if (!connection)
+    return NULL;
+  if (s_ssl_connection_set_name(connection, peer->name) != 0 ||
+      (client->identity &&
+        s_ssl_connection_set_identity(connection, client->identity) != 0) ||
+      s_ssl_connection_set_status(connection,
+        (s_ssl_connection_cbk)_s_ssl_client_status, attempt) != 0 ||
+      bufferevent_socket_connect(buffer,
+        (struct sockaddr *)&peer->addresses[attempt->index].sa,
+        peer->addresses[attempt->index].len) != 0) {
+    s_ssl_connection_free(connection);
+    return NULL;
+  }
+  return connection;
+}
+
+/**
+ * @brief Start the next attempt of the race. The following one starts after
+ * the stagger delay, or as soon as an attempt fails. A peer whose every
+ * attempt failed backs off
+ * @param [in] peer: peer to connect to
+ */
+static void _s_ssl_client_race(struct s_ssl_client_peer *peer)
+{
+  struct s_ssl_client *client = peer->client;
+
+  while (peer->race.next < peer->race.count) {
+    struct s_ssl_client_attempt *attempt =
+      &peer->attempts[peer->race.next];
+    attempt->index = peer->race.order[peer->race.next++];
+    attempt->peer = peer;
+    attempt->start = _s_ssl_client_now();
+    client->counters.attempts++;
+
+    attempt->connection = _s_ssl_client_open(attempt);
+    if (attempt->connection) {
+      peer->race.pending++;
+      if (peer->race.next < peer->race.count)
+        _s_ssl_client_schedule(peer->race.stagger, client->reconnect.stagger);
+      return;
+    }
+    _s_ssl_client_report(attempt, "failed");
+  }
+
+  if (peer->race.pending)
+    return;
+  daemon_log(LOG_WARNING, "failed to connect to '%s'\n", peer->name);
+  client->counters.failures++;
+  _s_ssl_client_backoff(peer);
+}
+
+/**
+ * @brief Close the attempts still running once the race is over
+ * @param [in] peer: peer to modify
+ */
+static void _s_ssl_client_abort(struct s_ssl_client_peer *peer)
+{
+  evtimer_del(peer->race.stagger);
+  for (uint8_t i = 0; i < peer->race.next; i++) {
+    struct s_ssl_client_attempt *attempt = &peer->attempts[i];
+    if (!attempt->connection || attempt->connection == peer->connection)
+      continue;
+    s_ssl_connection_set_status(attempt->connection, NULL, NULL);
+    s_ssl_connection_close(attempt->connection);
+    attempt->connection = NULL;
+  }
+  peer->race.pending = 0;
+}
+
+/**
+ * @brief Status callback of the outbound connections. The first attempt
+ * completing its handshake wins the race and the others are closed. A lost
+ * connection is reopened after the peer backoff; the backoff is reset only
+ * when the connection stayed up long enough, so a flapping peer keeps
+ * backing off
+ * @param [in] connection: connection concerned
+ * @param [in] state: current connection status
+ */
+static void _s_ssl_client_status(struct s_ssl_connection *connection,
+  enum e_ssl_connection state)
+{
+  struct s_ssl_client_attempt *attempt =
+    s_ssl_connection_get_userdata(connection);
+  daemon_return_if_fail(attempt);
+
+  struct s_ssl_client_peer *peer = attempt->peer;
+  struct s_ssl_client *client = peer->client;
+  if (state == e_ssl_connection_connected) {
+    _s_ssl_client_report(attempt, "connected");
+    peer->connection = connection;
+    peer->connected = _s_ssl_client_now();
+    _s_ssl_client_abort(peer);
+    client->funcs.connection(client->userdata, state);
+    return;
+  }
+
+  attempt->connection = NULL;
+  if (connection != peer->connection) {
+    /* a lost attempt lets the next address start without waiting */
+    _s_ssl_client_report(attempt, "failed");
+    peer->race.pending--;
+    evtimer_del(peer->race.stagger);
+    _s_ssl_client_race(peer);
+    return;
+  }
+
+  daemon_log(LOG_NOTICE, "connection to '%s' lost\n", peer->name);
+  if (_s_ssl_client_now() - peer->connected >= S_SSL_CLIENT_STABLE)
+    peer->backoff = 0;
+  peer->connected = 0;
+  peer->connection = NULL;
+  _s_ssl_client_backoff(peer);
+  client->funcs.connection(client->userdata, state);
+}
+
+/**
+ * @brief Race the addresses of a peer, once the token bucket allows it
+ * @param [in] peer: peer to connect to
+ */
+static void _s_ssl_client_peer_connect(struct s_ssl_client_peer *peer)
+{
+  struct s_ssl_client *client = peer->client;
+
+  uint32_t wait = _s_ssl_client_token(client);
+  if (wait) {
+    /* the attempt is postponed without growing the peer backoff */
+    client->counters.throttled++;
+    _s_ssl_client_schedule(peer->retry, wait + _s_ssl_client_jitter(wait));
+    return;
+  }
+  _s_ssl_client_order(peer);
+  _s_ssl_client_race(peer);
+}
+
+/**
+ * @brief Retry timer callback
+ */
+static void _s_ssl_client_retry(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_client_peer *peer)
+{
+  daemon_return_if_fail(peer);
+
+  s_loop_account(peer->client->loop, e_loop_priority_discovery);
+  if (!peer->connection && !peer->race.pending)
+    _s_ssl_client_peer_connect(peer);
+}
+
+/**
+ * @brief Stagger timer callback, the running attempts are too slow
+ */
+static void _s_ssl_client_stagger(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_client_peer *peer)
+{
+  daemon_return_if_fail(peer);
+
+  s_loop_account(peer->client->loop, e_loop_priority_discovery);
+  if (!peer->connection)
+    _s_ssl_client_race(peer);
+}
+
+/**
+ * @brief Forget an address of a peer, the last address takes its slot. The
+ * attempt running on it is closed, an established connection is kept
+ * @param [in] peer: peer to modify
+ * @param [in] index: index of the address
+ */
+static void _s_ssl_client_forget(struct s_ssl_client_peer *peer,
+  uint8_t index)
+{
+  uint8_t last = peer->count - 1;
+  uint8_t aborted = 0;
+  for (uint8_t i = 0; i < peer->race.next; i++) {
+    struct s_ssl_client_attempt *attempt = &peer->attempts[i];
+    if (attempt->index == index && attempt->connection &&
+        attempt->connection != peer->connection) {
+      s_ssl_connection_set_status(attempt->connection, NULL, NULL);
+      s_ssl_connection_close(attempt->connection);
+      attempt->connection = NULL;
+      peer->race.pending--;
+      aborted = 1;
+    } else if (attempt->index == last) {
+      attempt->index = index;
+    }
+  }
+  /* the attempts not started yet skip the address */
+  uint8_t count = peer->race.next;
+  for (uint8_t i = peer->race.next; i < peer->race.count; i++)
+    if (peer->race.order[i] != index)
+      peer->race.order[count++] = peer->race.order[i] == last ? index :
+        peer->race.order[i];
+  peer->race.count = count;
+
+  peer->addresses[index] = peer->addresses[last];
+  peer->count--;
+  /* the race goes on without the closed attempt */
+  if (aborted && !peer->connection && !peer->race.pending) {
+    evtimer_del(peer->race.stagger);
+    _s_ssl_client_race(peer);
+  }
+}
+
+/**
+ * @brief Deallocate a peer, its connections are closed
+ * @param [in] peer: peer to delete
+ */
+static void _s_ssl_client_peer_free(struct s_ssl_client_peer *peer)
+{
+  daemon_return_if_fail(peer);
+
+  if (peer->race.stagger) {
+    _s_ssl_client_abort(peer);
+    event_free(peer->race.stagger);
+  }
+  if (peer->connection) {
+    s_ssl_connection_set_status(peer->connection, NULL, NULL);
+    s_ssl_connection_close(peer->connection);
+  }
+  if (peer->retry) {
+    event_del(peer->retry);
+    event_free(peer->retry);
+  }
+  if (peer->name)
+    daemon_free(peer->name);
+  daemon_free(peer);
+}
+
+/**
+ * @brief Count the established connections
+ */
+static void _s_ssl_client_count(daemon_unused void *name,
+  struct s_ssl_client_peer *peer, struct s_ssl_client_stats *stats)
+{
+  if (peer->connected)
+    stats->connected++;
+}
+
+struct s_ssl_client *s_ssl_client_new(struct s_loop *loop,
+  const struct s_ssl_funcs *funcs, void *userdata)
+{
+  daemon_return_val_if_fail(loop, NULL);
+  daemon_return_val_if_fail(funcs, NULL);
+  daemon_return_val_if_fail(s_ssl_funcs_check(funcs) == 0, NULL);
+
+  struct s_ssl_client *client = daemon_malloc(sizeof(struct s_ssl_client));
+  client->funcs = *funcs;
+  client->loop = loop;
+  client->peers = s_hash_new(s_str_hash, s_str_equal, NULL,
+    (s_destroy_cbk)_s_ssl_client_peer_free);
+  client->router = s_ssl_router_new((s_ssl_route_cbk)_s_ssl_client_unrouted,
+    client);
+  client->userdata = userdata;
+
+  struct s_ssl_reconnect reconnect;
+  s_ssl_reconnect_init(&reconnect);
+  if (!client->peers || !client->router ||
+      s_ssl_client_set_reconnect(client, &reconnect) != 0)
+    goto error;
+
+  return client;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a client\n");
+  s_ssl_client_free(client);
+  return NULL;
+}
+
+void s_ssl_client_free(struct s_ssl_client *client)
+{
+  daemon_return_if_fail(client);
+
+  /* peers close their connections before the worker goes away */
+  if (client->peers)
+    s_hash_free(client->peers);
+  if (client->worker)
+    s_ssl_worker_free(client->worker);
+  if (client->router)
+    s_ssl_router_free(client->router);
+  if (client->context)
+    SSL_CTX_free(client->context);
+  if (client->identity)
+    daemon_free(client->identity);
+  daemon_free(client);
+}
+
+int s_ssl_client_set_reconnect(struct s_ssl_client *client,
+  const struct s_ssl_reconnect *reconnect)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(reconnect, -EINVAL);
+  daemon_return_val_if_fail(reconnect->min > 0, -EINVAL);
+  daemon_return_val_if_fail(reconnect->min <= reconnect->max, -EINVAL);
+  daemon_return_val_if_fail(reconnect->rate > 0, -EINVAL);
+  daemon_return_val_if_fail(reconnect->burst > 0, -EINVAL);
+
+  client->reconnect = *reconnect;
+  client->bucket.last = _s_ssl_client_now();
+  client->bucket.tokens = (uint64_t)reconnect->burst * S_SSL_CLIENT_TOKEN;
+  return 0;
+}
+
+int s_ssl_client_set_identity(struct s_ssl_client *client,
+  const char *identity)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(identity, -EINVAL);
+  daemon_return_val_if_fail(strlen(identity) <= S_SSL_CONNECTION_IDENTITY_SIZE,
+    -EINVAL);
+
+  char *copy = strdup(identity);
+  daemon_return_val_if_fail(copy, -ENOMEM);
+  if (client->identity)
+    daemon_free(client->identity);
+  client->identity = copy;
+  return 0;
+}
+
+int s_ssl_client_connect(struct s_ssl_client *client, const char *certificate,
+  const char *authority)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(certificate, -EINVAL);
+  daemon_return_val_if_fail(!client->context, -EALREADY);
+
+  client->context = s_ssl_context_client_new(certificate, authority);
+  daemon_return_val_if_fail(client->context, -EBADE);
+
+  /* the outbound connections run on the client loop */
+  client->worker = s_ssl_worker_new(NULL, client->loop);
+  if (!client->worker) {
+    SSL_CTX_free(client->context);
+    client->context = NULL;
+    return -EBADE;
+  }
+  return 0;
+}
+
+int s_ssl_client_reload(struct s_ssl_client *client, const char *certificate,
+  const char *authority)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(certificate, -EINVAL);
+  /* nothing to replace before the first connect */
+  if (!client->context)
+    return -ENOTCONN;
+
+  SSL_CTX *context = s_ssl_context_client_new(certificate, authority);
+  daemon_return_val_if_fail(context, -EBADE);
+
+  /* the established connections hold a reference until they close */
+  SSL_CTX_free(client->context);
+  client->context = context;
+  daemon_log(LOG_NOTICE, "ssl client reloaded '%s'\n", certificate);
+  return 0;
+}
+
+int s_ssl_client_add_peer(struct s_ssl_client *client, const char *name,
+  const struct sockaddr *sa, socklen_t len)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(name, -EINVAL);
+  daemon_return_val_if_fail(sa, -EINVAL);
+  daemon_return_val_if_fail(len <= sizeof(struct sockaddr_storage), -EINVAL);
+  daemon_return_val_if_fail(client->context, -ENOTCONN);
+
+  struct s_ssl_client_peer *peer = s_hash_lookup(client->peers, name);
+  if (!peer) {
+    peer = daemon_malloc(sizeof(struct s_ssl_client_peer));
+    peer->client = client;
+    peer->name = strdup(name);
+    peer->race.stagger = evtimer_new(s_loop_tolibevent(client->loop),
+      (event_callback_fn)_s_ssl_client_stagger, peer);
+    peer->retry = evtimer_new(s_loop_tolibevent(client->loop),
+      (event_callback_fn)_s_ssl_client_retry, peer);
+    if (!peer->name || !peer->race.stagger || !peer->retry ||
+        s_loop_set_priority(peer->race.stagger,
+          e_loop_priority_discovery) != 0 ||
+        s_loop_set_priority(peer->retry, e_loop_priority_discovery) != 0 ||
+        s_hash_insert(client->peers, peer->name, peer) != 0) {
+      _s_ssl_client_peer_free(peer);
+      return -ENOMEM;
+    }
+  }
+
+  uint8_t i = 0;
+  while (i < peer->count && (peer->addresses[i].len != len ||
+      memcmp(&peer->addresses[i].sa, sa, len) != 0))
+    i++;
+  if (i == peer->count) {
+    if (peer->count == S_SSL_CLIENT_ADDRESSES)
+      return -ENOSPC;
+    memcpy(&peer->addresses[i].sa, sa, len);
+    peer->addresses[i].len = len;
+    peer->count++;
+    /* the addresses are often discovered one by one, a new one joins the
+     * race in progress */
+    if (peer->race.pending && !peer->connection) {
+      peer->race.order[peer->race.count++] = i;
+      if (!evtimer_pending(peer->race.stagger, NULL))
+        _s_ssl_client_schedule(peer->race.stagger, client->reconnect.stagger);
+    }
+  }
+
+  /* a known peer keeps its connection, or waits for its next attempt */
+  if (!peer->connection && !peer->race.pending &&
+      !evtimer_pending(peer->retry, NULL))
+    _s_ssl_client_peer_connect(peer);
+  return 0;
+}
+
+int s_ssl_client_remove_peer(struct s_ssl_client *client, const char *name)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(name, -EINVAL);
+
+  return s_hash_remove(client->peers, name);
+}
+
+int s_ssl_client_remove_address(struct s_ssl_client *client, const char *name,
+  const struct sockaddr *sa, socklen_t len)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(name, -EINVAL);
+  daemon_return_val_if_fail(sa, -EINVAL);
+
+  struct s_ssl_client_peer *peer = s_hash_lookup(client->peers, name);
+  if (!peer)
+    return -ENOENT;
+  uint8_t i = 0;
+  while (i < peer->count && (peer->addresses[i].len != len ||
+      memcmp(&peer->addresses[i].sa, sa, len) != 0))
+    i++;
+  if (i == peer->count)
+    return -ENOENT;
+
+  /* the peer goes away with its last address */
+  if (peer->count == 1)
+    return s_hash_remove(client->peers, name);
+  _s_ssl_client_forget(peer, i);
+  return 0;
+}
+
+struct s_ssl_connection *s_ssl_client_get_connection(
+  struct s_ssl_client *client, const char *name)
+{
+  daemon_return_val_if_fail(client, NULL);
+  daemon_return_val_if_fail(name, NULL);
+
+  struct s_ssl_client_peer *peer = s_hash_lookup(client->peers, name);
+  return peer && peer->connected ? peer->connection : NULL;
+}
+
+int s_ssl_client_write(struct s_ssl_client *client, const char *name,
+  const struct s_ssl_packet *packet)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(client->worker, -ENOTCONN);
+
+  return s_ssl_worker_write(client->worker, name, packet);
+}
+
+struct s_ssl_router *s_ssl_client_get_router(struct s_ssl_client *client)
+{
+  daemon_return_val_if_fail(client, NULL);
+
+  return client->router;
+}
+
+int s_ssl_client_get_stats(struct s_ssl_client *client,
+  struct s_ssl_client_stats *stats)
+{
+  daemon_return_val_if_fail(client, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  memset(stats, 0, sizeof(struct s_ssl_client_stats));
+  stats->attempts = client->counters.attempts;
+  stats->failures = client->counters.failures;
+  stats->peers = s_hash_size(client->peers);
+  stats->throttled = client->counters.throttled;
+  s_hash_foreach(client->peers, (s_hash_foreach_cbk)_s_ssl_client_count,
+    stats);
+  return 0;
+}
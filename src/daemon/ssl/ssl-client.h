@@ -0,0 +1,247 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_CLIENT_H_
+# define _SSL_SSL_CLIENT_H_
+
+# include <stdint.h>
+# include <sys/socket.h>
+
+# include "daemon-loop.h"
+# include "ssl.h"
+# include "ssl-connection.h"
+# include "ssl-router.h"
+
+/**
+ * @brief Default delay, in milliseconds, before the first reconnection
+ */
+# define S_SSL_CLIENT_BACKOFF_MIN 250
+
+/**
+ * @brief Default maximum delay, in milliseconds, between two reconnections
+ */
+# define S_SSL_CLIENT_BACKOFF_MAX 60000
+
+/**
+ * @brief Default number of connection attempts allowed per second, over every
+ * peer of the client
+ */
+# define S_SSL_CLIENT_RATE 10
+
+/**
+ * @brief Default number of connection attempts allowed at once
+ */
+# define S_SSL_CLIENT_BURST 20
+
+/**
+ * @brief Default delay, in milliseconds, before the next address of a peer is
+ * tried while the previous attempts are still running
+ */
+# define S_SSL_CLIENT_STAGGER 250
+
+/**
+ * @brief Maximum number of addresses known for a peer
+ */
+# define S_SSL_CLIENT_ADDRESSES 8
+
+/**
+ * @brief Time, in milliseconds, a connection must stay up before its peer
+ * backoff is reset
+ */
+# define S_SSL_CLIENT_STABLE 10000
+
+struct s_ssl_client;
+
+/**
+ * @brief Reconnection settings of a client
+ */
+struct s_ssl_reconnect {
+  uint32_t burst;
+  uint32_t max;
+  uint32_t min;
+  uint32_t rate;
+  uint32_t stagger;
+};
+
+/**
+ * @brief Client counters
+ */
+struct s_ssl_client_stats {
+  uint64_t attempts;
+  uint32_t connected;
+  uint64_t failures;
+  uint32_t peers;
+  uint64_t throttled;
+};
+
+/**
+ * @brief Fill the reconnection settings with the default values
+ * @param [out] reconnect: settings to fill
+ */
+static inline void s_ssl_reconnect_init(struct s_ssl_reconnect *reconnect)
+{
+  daemon_return_if_fail(reconnect);
+
+  reconnect->burst = S_SSL_CLIENT_BURST;
+  reconnect->max = S_SSL_CLIENT_BACKOFF_MAX;
+  reconnect->min = S_SSL_CLIENT_BACKOFF_MIN;
+  reconnect->rate = S_SSL_CLIENT_RATE;
+  reconnect->stagger = S_SSL_CLIENT_STAGGER;
+}
+
+/**
+ * @brief Allocate a new client. A client keeps one connection open to each of
+ * its peers and reopens it whenever it terminates
+ * @param [in] loop: loop running the outbound connections
+ * @param [in] funcs: behavior functions, called with userdata
+ * @param [in] userdata: user pointer
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_client *s_ssl_client_new(struct s_loop *loop,
+  const struct s_ssl_funcs *funcs, void *userdata);
+
+/**
+ * @brief Deallocate a specific client. Every connection is closed
+ * @param [in] client: client to delete
+ */
+void s_ssl_client_free(struct s_ssl_client *client);
+
+/**
+ * @brief Set the reconnection settings. Each peer waits an exponential,
+ * jittered, delay between two attempts; a token bucket shared by every peer
+ * bounds the rate of the attempts, so a network flap doesn't cause a
+ * handshake storm. Within an attempt, the addresses of the peer are raced:
+ * ipv6 first, the next address starting after the stagger delay
+ * @param [in] client: client to modify
+ * @param [in] reconnect: settings to apply, delays in milliseconds
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_client_set_reconnect(struct s_ssl_client *client,
+  const struct s_ssl_reconnect *reconnect);
+
+/**
+ * @brief Set the identity of the local daemon, advertised to every server the
+ * client connects to. The server names the connection after it
+ * @param [in] client: client to modify
+ * @param [in] identity: identity to copy, the host name of the daemon
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_client_set_identity(struct s_ssl_client *client,
+  const char *identity);
+
+/**
+ * @brief Initialize the ssl layer of the client. The servers are only
+ * accepted when their certificate is issued by the authority, or is the
+ * certificate itself when there is no authority
+ * @param [in] client: client to start
+ * @param [in] certificate: certificate path file
+ * @param [in] authority: certificate authority path file, NULL to pin the
+ * certificate
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_client_connect(struct s_ssl_client *client, const char *certificate,
+  const char *authority);
+
+/**
+ * @brief Replace the certificate of a connected client, from the client loop.
+ * The next connection attempts use it, the established connections keep the
+ * previous one until they close
+ * @param [in] client: client to modify
+ * @param [in] certificate: certificate path file
+ * @param [in] authority: certificate authority path file, NULL to pin the
+ * certificate
+ * @return 0 on success, an -errno value on error and the previous certificate
+ * is kept
+ */
+int s_ssl_client_reload(struct s_ssl_client *client, const char *certificate,
+  const char *authority);
+
+/**
+ * @brief Add a peer, or an address to a known peer, and connect to it. The
+ * first address completing the handshake keeps the connection, each attempt
+ * is logged with its duration
+ * @param [in] client: client to modify
+ * @param [in] name: name identifying the peer, also used as connection name
+ * @param [in] sa: address of the peer
+ * @param [in] len: address length
+ * @return 0 on success, -ENOSPC if the peer knows too many addresses, an
+ * another -errno value on error
+ */
+int s_ssl_client_add_peer(struct s_ssl_client *client, const char *name,
+  const struct sockaddr *sa, socklen_t len);
+
+/**
+ * @brief Remove a peer, its connection is closed
+ * @param [in] client: client to modify
+ * @param [in] name: name identifying the peer
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_client_remove_peer(struct s_ssl_client *client, const char *name);
+
+/**
+ * @brief Remove an address of a peer. The attempt running on it is closed,
+ * an established connection is kept; the peer is removed along with its last
+ * address
+ * @param [in] client: client to modify
+ * @param [in] name: name identifying the peer
+ * @param [in] sa: address to remove
+ * @param [in] len: address length
+ * @return 0 on success, -ENOENT if the peer doesn't know the address, an
+ * another -errno value on error
+ */
+int s_ssl_client_remove_address(struct s_ssl_client *client, const char *name,
+  const struct sockaddr *sa, socklen_t len);
+
+/**
+ * @brief Get the established connection to a peer, from the client loop
+ * @param [in] client: client to browse
+ * @param [in] name: name identifying the peer
+ * @return a valid pointer if the peer is connected, NULL otherwise
+ */
+struct s_ssl_connection *s_ssl_client_get_connection(
+  struct s_ssl_client *client, const char *name);
+
+/**
+ * @brief Write a packet to a peer, from any thread
+ * @param [in] client: client to use
+ * @param [in] name: name identifying the peer
+ * @param [in] packet: payload to send
+ * @return 0 on success, -ENOTCONN if the peer isn't connected, an another
+ * -errno value on error
+ */
+int s_ssl_client_write(struct s_ssl_client *client, const char *name,
+  const struct s_ssl_packet *packet);
+
+/**
+ * @brief Get the router dispatching the packets received from the peers by
+ * message type. The packets without a registered handler reach the read
+ * callback of the client
+ * @param [in] client: client to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_router *s_ssl_client_get_router(struct s_ssl_client *client);
+
+/**
+ * @brief Get the client counters
+ * @param [in] client: client to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_client_get_stats(struct s_ssl_client *client,
+  struct s_ssl_client_stats *stats);
+
+#endif /* !_SSL_SSL_CLIENT_H_ */
@@ -0,0 +1,423 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include <libdaemon/dlog.h>
+#ifdef HAVE_LZ4
+# include <lz4.h>
+#endif /* !HAVE_LZ4 */
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-compress.h"
+#include "ssl-frame.h"
+
+/**
+ * @brief Version of the capabilities message
+ */
+#define S_SSL_COMPRESS_VERSION 1
+
+/**
+ * @brief Size of the original payload size prefixing a compressed body
+ */
+#define S_SSL_COMPRESS_PREFIX 4
+
+struct s_ssl_compress {
+  struct s_ssl_compress_config config;
+  struct {
+    uint16_t codec;
+    uint8_t dictionary;
+  } peer;
+  struct {
+    z_stream deflate;
+    z_stream inflate;
+    pthread_mutex_t lock;
+  } zlib;
+#ifdef HAVE_LZ4
+  LZ4_stream_t lz4;
+#endif /* !HAVE_LZ4 */
+  struct s_ssl_compress_stats stats;
+};
+
+/**
+ * @brief Get the cpu time consumed by the calling thread
+ * @return the time in nanoseconds
+ */
+static uint64_t _s_ssl_compress_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct s_ssl_dictionary *s_ssl_dictionary_load(const char *path)
+{
+  daemon_return_val_if_fail(path, NULL);
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    daemon_log(LOG_WARNING, "failed to open the dictionary '%s'\n", path);
+    return NULL;
+  }
+
+  struct s_ssl_dictionary *dictionary =
+    daemon_malloc(sizeof(struct s_ssl_dictionary));
+  if (fseek(file, 0, SEEK_END) != 0)
+    goto error;
+  long size = ftell(file);
+  if (size <= 0 || size > S_SSL_FRAME_MAX_SIZE ||
+      fseek(file, 0, SEEK_SET) != 0)
+    goto error;
+
+  dictionary->data = daemon_malloc(sizeof(uint8_t) * size);
+  dictionary->size = size;
+  if (fread(dictionary->data, 1, size, file) != (size_t)size)
+    goto error;
+  fclose(file);
+
+  dictionary->id = adler32(adler32(0, NULL, 0), dictionary->data,
+    dictionary->size);
+  dictionary->refcount = 1;
+  return dictionary;
+
+error:
+  daemon_log(LOG_ERR, "failed to load the dictionary '%s'\n", path);
+  fclose(file);
+  daemon_free(dictionary->data);
+  daemon_free(dictionary);
+  return NULL;
+}
+
+struct s_ssl_dictionary *s_ssl_dictionary_ref(
+  struct s_ssl_dictionary *dictionary)
+{
+  daemon_return_val_if_fail(dictionary, NULL);
+
+  __atomic_add_fetch(&dictionary->refcount, 1, __ATOMIC_RELAXED);
+  return dictionary;
+}
+
+void s_ssl_dictionary_unref(struct s_ssl_dictionary *dictionary)
+{
+  daemon_return_if_fail(dictionary);
+
+  if (__atomic_sub_fetch(&dictionary->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  daemon_free(dictionary->data);
+  daemon_free(dictionary);
+}
+
+uint8_t s_ssl_compress_get_codecs(void)
+{
+#ifdef HAVE_LZ4
+  return S_SSL_COMPRESS_ZLIB | S_SSL_COMPRESS_LZ4;
+#else
+  return S_SSL_COMPRESS_ZLIB;
+#endif /* !HAVE_LZ4 */
+}
+
+void s_ssl_compress_config_init(struct s_ssl_compress_config *config)
+{
+  daemon_return_if_fail(config);
+
+  config->codecs = s_ssl_compress_get_codecs();
+  config->dictionary = NULL;
+  config->level = Z_DEFAULT_COMPRESSION;
+  config->threshold = S_SSL_COMPRESS_THRESHOLD;
+}
+
+struct s_ssl_compress *s_ssl_compress_new(
+  const struct s_ssl_compress_config *config)
+{
+  daemon_return_val_if_fail(config, NULL);
+
+  struct s_ssl_compress *compress =
+    daemon_malloc(sizeof(struct s_ssl_compress));
+  compress->config = *config;
+  compress->config.codecs &= s_ssl_compress_get_codecs();
+  if (config->dictionary)
+    s_ssl_dictionary_ref(config->dictionary);
+  pthread_mutex_init(&compress->zlib.lock, NULL);
+
+  if (deflateInit(&compress->zlib.deflate, config->level) != Z_OK)
+    goto error;
+  if (inflateInit(&compress->zlib.inflate) != Z_OK) {
+    deflateEnd(&compress->zlib.deflate);
+    goto error;
+  }
+  return compress;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a compression context\n");
+  pthread_mutex_destroy(&compress->zlib.lock);
+  if (compress->config.dictionary)
+    s_ssl_dictionary_unref(compress->config.dictionary);
+  daemon_free(compress);
+  return NULL;
+}
+
+void s_ssl_compress_free(struct s_ssl_compress *compress)
+{
+  daemon_return_if_fail(compress);
+
+  deflateEnd(&compress->zlib.deflate);
+  inflateEnd(&compress->zlib.inflate);
+  pthread_mutex_destroy(&compress->zlib.lock);
+  if (compress->config.dictionary)
+    s_ssl_dictionary_unref(compress->config.dictionary);
+  daemon_free(compress);
+}
+
+void s_ssl_compress_hello(struct s_ssl_compress *compress, uint8_t *data)
+{
+  daemon_return_if_fail(compress);
+  daemon_return_if_fail(data);
+
+  struct s_ssl_dictionary *dictionary = compress->config.dictionary;
+  uint32_t id = htonl(dictionary ? dictionary->id : 0);
+
+  data[0] = S_SSL_COMPRESS_VERSION;
+  data[1] = compress->config.codecs;
+  data[2] = 0;
+  data[3] = 0;
+  memcpy(data + 4, &id, sizeof(uint32_t));
+}
+
+int s_ssl_compress_negotiate(struct s_ssl_compress *compress,
+  const uint8_t *data, uint32_t size)
+{
+  daemon_return_val_if_fail(compress, -EINVAL);
+  daemon_return_val_if_fail(data, -EINVAL);
+  daemon_return_val_if_fail(size >= S_SSL_COMPRESS_HELLO_SIZE, -EBADMSG);
+
+  uint32_t id;
+  memcpy(&id, data + 4, sizeof(uint32_t));
+  id = ntohl(id);
+
+  /* lz4 is preferred, its cpu cost is far lower */
+  uint8_t codecs = data[1] & compress->config.codecs;
+  uint16_t codec = (codecs & S_SSL_COMPRESS_LZ4) ? S_SSL_FRAME_FLAG_LZ4 :
+    (codecs & S_SSL_COMPRESS_ZLIB) ? S_SSL_FRAME_FLAG_ZLIB : 0;
+  struct s_ssl_dictionary *dictionary = compress->config.dictionary;
+
+  pthread_mutex_lock(&compress->zlib.lock);
+  compress->peer.codec = codec;
+  compress->peer.dictionary = dictionary && id == dictionary->id;
+  pthread_mutex_unlock(&compress->zlib.lock);
+  return 0;
+}
+
+int s_ssl_compress_wanted(struct s_ssl_compress *compress, uint32_t size)
+{
+  return compress && __atomic_load_n(&compress->peer.codec,
+    __ATOMIC_RELAXED) && size >= compress->config.threshold;
+}
+
+/**
+ * @brief Compress a payload with zlib, the state must be locked. Every
+ * payload is compressed on its own so that any frame can be dropped
+ * @return the compressed size on success, 0 on error
+ */
+static size_t _s_ssl_compress_zlib(struct s_ssl_compress *compress,
+  const uint8_t *payload, uint32_t size, uint8_t *data, size_t capacity,
+  uint8_t dictionary)
+{
+  z_stream *stream = &compress->zlib.deflate;
+
+  if (deflateReset(stream) != Z_OK || (dictionary && deflateSetDictionary(
+      stream, compress->config.dictionary->data,
+      compress->config.dictionary->size) != Z_OK))
+    return 0;
+
+  stream->next_in = (Bytef *)payload;
+  stream->avail_in = size;
+  stream->next_out = data;
+  stream->avail_out = capacity;
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+    return 0;
+  return capacity - stream->avail_out;
+}
+
+#ifdef HAVE_LZ4
+/**
+ * @brief Compress a payload with lz4, the state must be locked
+ * @return the compressed size on success, 0 on error
+ */
+static size_t _s_ssl_compress_lz4(struct s_ssl_compress *compress,
+  const uint8_t *payload, uint32_t size, uint8_t *data, size_t capacity,
+  uint8_t dictionary)
+{
+  struct s_ssl_dictionary *preset = compress->config.dictionary;
+
+  LZ4_resetStream(&compress->lz4);
+  if (dictionary)
+    LZ4_loadDict(&compress->lz4, (const char *)preset->data, preset->size);
+  int ret = LZ4_compress_fast_continue(&compress->lz4, (const char *)payload,
+    (char *)data, size, capacity, 1);
+  return ret > 0 ? (size_t)ret : 0;
+}
+#endif /* !HAVE_LZ4 */
+
+int s_ssl_compress_encode(struct s_ssl_compress *compress,
+  const uint8_t *payload, uint32_t size, struct evbuffer *output,
+  uint16_t *flags)
+{
+  daemon_return_val_if_fail(compress, -EINVAL);
+  daemon_return_val_if_fail(payload, -EINVAL);
+  daemon_return_val_if_fail(output, -EINVAL);
+  daemon_return_val_if_fail(flags, -EINVAL);
+
+  uint64_t start = _s_ssl_compress_now();
+  pthread_mutex_lock(&compress->zlib.lock);
+  uint16_t codec = compress->peer.codec;
+  uint8_t dictionary = compress->peer.dictionary;
+
+  size_t capacity = 0;
+  if (codec == S_SSL_FRAME_FLAG_ZLIB)
+    capacity = deflateBound(&compress->zlib.deflate, size);
+#ifdef HAVE_LZ4
+  else if (codec == S_SSL_FRAME_FLAG_LZ4)
+    capacity = LZ4_compressBound(size);
+#endif /* !HAVE_LZ4 */
+
+  /* body: | payload size (32 bits) | compressed payload | */
+  struct evbuffer_iovec vec;
+  size_t length = 0;
+  if (capacity && evbuffer_reserve_space(output,
+      S_SSL_COMPRESS_PREFIX + capacity, &vec, 1) == 1) {
+    uint8_t *data = (uint8_t *)vec.iov_base + S_SSL_COMPRESS_PREFIX;
+    if (codec == S_SSL_FRAME_FLAG_ZLIB)
+      length = _s_ssl_compress_zlib(compress, payload, size, data, capacity,
+        dictionary);
+#ifdef HAVE_LZ4
+    else
+      length = _s_ssl_compress_lz4(compress, payload, size, data, capacity,
+        dictionary);
+#endif /* !HAVE_LZ4 */
+  }
+  pthread_mutex_unlock(&compress->zlib.lock);
+
+  int ret = 0;
+  if (!length || S_SSL_COMPRESS_PREFIX + length >= size) {
+    __atomic_add_fetch(&compress->stats.skipped, 1, __ATOMIC_RELAXED);
+    ret = -EAGAIN;
+  } else {
+    uint32_t prefix = htonl(size);
+    memcpy(vec.iov_base, &prefix, sizeof(uint32_t));
+    vec.iov_len = S_SSL_COMPRESS_PREFIX + length;
+    evbuffer_commit_space(output, &vec, 1);
+    *flags = codec | (dictionary ? S_SSL_FRAME_FLAG_DICTIONARY : 0);
+    __atomic_add_fetch(&compress->stats.raw_out, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compress->stats.wire_out, vec.iov_len,
+      __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&compress->stats.encode_ns,
+    _s_ssl_compress_now() - start, __ATOMIC_RELAXED);
+  return ret;
+}
+
+int s_ssl_compress_decode(struct s_ssl_compress *compress,
+  struct evbuffer *input, uint32_t size, uint16_t flags,
+  struct evbuffer *output)
+{
+  daemon_return_val_if_fail(compress, -EINVAL);
+  daemon_return_val_if_fail(input, -EINVAL);
+  daemon_return_val_if_fail(output, -EINVAL);
+  daemon_return_val_if_fail(size > S_SSL_COMPRESS_PREFIX, -EBADMSG);
+
+  struct s_ssl_dictionary *dictionary = compress->config.dictionary;
+  if ((flags & S_SSL_FRAME_FLAG_DICTIONARY) && !dictionary)
+    return -EPROTO;
+
+  uint64_t start = _s_ssl_compress_now();
+  const uint8_t *data = evbuffer_pullup(input, size);
+  uint32_t length;
+  memcpy(&length, data, sizeof(uint32_t));
+  length = ntohl(length);
+  data += S_SSL_COMPRESS_PREFIX;
+
+  /* the announced size bounds the output, nothing can inflate beyond it */
+  struct evbuffer_iovec vec;
+  if (length > S_SSL_FRAME_MAX_SIZE ||
+      evbuffer_reserve_space(output, length, &vec, 1) != 1)
+    return -EMSGSIZE;
+
+  int ret = -EBADMSG;
+  if (flags & S_SSL_FRAME_FLAG_ZLIB) {
+    z_stream *stream = &compress->zlib.inflate;
+    inflateReset(stream);
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = size - S_SSL_COMPRESS_PREFIX;
+    stream->next_out = vec.iov_base;
+    stream->avail_out = length;
+    int status = inflate(stream, Z_FINISH);
+    if (status == Z_NEED_DICT && dictionary &&
+        inflateSetDictionary(stream, dictionary->data,
+          dictionary->size) == Z_OK)
+      status = inflate(stream, Z_FINISH);
+    if (status == Z_STREAM_END && stream->avail_out == 0)
+      ret = length;
+  }
+#ifdef HAVE_LZ4
+  else if (flags & S_SSL_FRAME_FLAG_LZ4) {
+    int use = (flags & S_SSL_FRAME_FLAG_DICTIONARY) != 0;
+    int decoded = LZ4_decompress_safe_usingDict((const char *)data,
+      vec.iov_base, size - S_SSL_COMPRESS_PREFIX, length,
+      use ? (const char *)dictionary->data : NULL,
+      use ? (int)dictionary->size : 0);
+    if (decoded >= 0 && (uint32_t)decoded == length)
+      ret = length;
+  }
+#endif /* !HAVE_LZ4 */
+
+  if (ret < 0)
+    return ret;
+  vec.iov_len = length;
+  evbuffer_commit_space(output, &vec, 1);
+  evbuffer_drain(input, size);
+
+  __atomic_add_fetch(&compress->stats.raw_in, length, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&compress->stats.wire_in, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&compress->stats.decode_ns,
+    _s_ssl_compress_now() - start, __ATOMIC_RELAXED);
+  return ret;
+}
+
+int s_ssl_compress_get_stats(struct s_ssl_compress *compress,
+  struct s_ssl_compress_stats *stats)
+{
+  daemon_return_val_if_fail(compress, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  stats->raw_in = __atomic_load_n(&compress->stats.raw_in, __ATOMIC_RELAXED);
+  stats->raw_out = __atomic_load_n(&compress->stats.raw_out,
+    __ATOMIC_RELAXED);
+  stats->skipped = __atomic_load_n(&compress->stats.skipped,
+    __ATOMIC_RELAXED);
+  stats->wire_in = __atomic_load_n(&compress->stats.wire_in,
+    __ATOMIC_RELAXED);
+  stats->wire_out = __atomic_load_n(&compress->stats.wire_out,
+    __ATOMIC_RELAXED);
+  stats->decode_ns = __atomic_load_n(&compress->stats.decode_ns,
+    __ATOMIC_RELAXED);
+  stats->encode_ns = __atomic_load_n(&compress->stats.encode_ns,
+    __ATOMIC_RELAXED);
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_COMPRESS_H_
+# define _SSL_SSL_COMPRESS_H_
+
+# include <stdint.h>
+# include <event2/buffer.h>
+
+/**
+ * @brief Compression codecs, advertised as a bit mask
+ */
+# define S_SSL_COMPRESS_ZLIB (1 << 0)
+# define S_SSL_COMPRESS_LZ4 (1 << 1)
+
+/**
+ * @brief Default size under which the payloads are sent as is
+ */
+# define S_SSL_COMPRESS_THRESHOLD 512
+
+/**
+ * @brief Size of the capabilities exchanged once a connection is established:
+ * | version (8 bits) | codecs (8 bits) | reserved (16 bits) |
+ * | dictionary id (32 bits) |
+ */
+# define S_SSL_COMPRESS_HELLO_SIZE 8
+
+/**
+ * @brief Preset dictionary shared by every connection. Its id is the adler32
+ * of its content, both peers must load the same dictionary to use it
+ */
+struct s_ssl_dictionary {
+  uint8_t *data;
+  uint32_t id;
+  uint32_t refcount;
+  uint32_t size;
+};
+
+/**
+ * @brief Compression settings of a connection
+ */
+struct s_ssl_compress_config {
+  uint8_t codecs;
+  struct s_ssl_dictionary *dictionary;
+  int level;
+  uint32_t threshold;
+};
+
+/**
+ * @brief Compression counters of a connection. The ratio of each direction
+ * is given by wire / raw
+ */
+struct s_ssl_compress_stats {
+  uint64_t raw_in;
+  uint64_t raw_out;
+  uint64_t skipped;
+  uint64_t wire_in;
+  uint64_t wire_out;
+  uint64_t decode_ns;
+  uint64_t encode_ns;
+};
+
+struct s_ssl_compress;
+
+/**
+ * @brief Load a preset dictionary from a file
+ * @param [in] path: file to load
+ * @return a valid pointer holding one reference on success, NULL on error
+ */
+struct s_ssl_dictionary *s_ssl_dictionary_load(const char *path);
+
+/**
+ * @brief Take a reference on a dictionary
+ * @param [in] dictionary: dictionary to reference
+ * @return the dictionary
+ */
+struct s_ssl_dictionary *s_ssl_dictionary_ref(
+  struct s_ssl_dictionary *dictionary);
+
+/**
+ * @brief Drop a reference on a dictionary, the last one frees it
+ * @param [in] dictionary: dictionary to release
+ */
+void s_ssl_dictionary_unref(struct s_ssl_dictionary *dictionary);
+
+/**
+ * @brief Get the codecs available in this build
+ * @return a mask of S_SSL_COMPRESS_* values
+ */
+uint8_t s_ssl_compress_get_codecs(void);
+
+/**
+ * @brief Fill a configuration with the default settings: every available
+ * codec, the default level and threshold, no dictionary
+ * @param [out] config: configuration to fill
+ */
+void s_ssl_compress_config_init(struct s_ssl_compress_config *config);
+
+/**
+ * @brief Allocate the compression state of a connection. Nothing is
+ * compressed until the peer capabilities are known
+ * @param [in] config: compression settings
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_compress *s_ssl_compress_new(
+  const struct s_ssl_compress_config *config);
+
+/**
+ * @brief Deallocate a specific compression state
+ * @param [in] compress: state to delete
+ */
+void s_ssl_compress_free(struct s_ssl_compress *compress);
+
+/**
+ * @brief Encode the local capabilities
+ * @param [in] compress: state to browse
+ * @param [out] data: S_SSL_COMPRESS_HELLO_SIZE bytes buffer to fill
+ */
+void s_ssl_compress_hello(struct s_ssl_compress *compress, uint8_t *data);
+
+/**
+ * @brief Select the codec and the dictionary used to send, according to the
+ * peer capabilities
+ * @param [in] compress: state to modify
+ * @param [in] data: capabilities received
+ * @param [in] size: size of the capabilities
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_compress_negotiate(struct s_ssl_compress *compress,
+  const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Check whether a payload is worth compressing
+ * @param [in] compress: state to browse, may be NULL
+ * @param [in] size: payload size
+ * @return a non zero value if a codec was negotiated and the payload reaches
+ * the threshold, 0 otherwise
+ */
+int s_ssl_compress_wanted(struct s_ssl_compress *compress, uint32_t size);
+
+/**
+ * @brief Compress a payload, from any thread
+ * @param [in] compress: state to use
+ * @param [in] payload: payload to compress
+ * @param [in] size: payload size
+ * @param [out] output: buffer receiving the compressed frame body
+ * @param [out] flags: frame flags describing the encoding
+ * @return 0 on success, -EAGAIN if the payload doesn't shrink, an another
+ * -errno value on error
+ */
+int s_ssl_compress_encode(struct s_ssl_compress *compress,
+  const uint8_t *payload, uint32_t size, struct evbuffer *output,
+  uint16_t *flags);
+
+/**
+ * @brief Decompress a frame body, from the connection loop
+ * @param [in] compress: state to use
+ * @param [in] input: buffer holding the frame body, the body is drained
+ * @param [in] size: frame body size
+ * @param [in] flags: frame flags describing the encoding
+ * @param [out] output: buffer receiving the payload
+ * @return the payload size on success, an -errno value on error
+ */
+int s_ssl_compress_decode(struct s_ssl_compress *compress,
+  struct evbuffer *input, uint32_t size, uint16_t flags,
+  struct evbuffer *output);
+
+/**
+ * @brief Get the compression counters of a connection, from any thread
+ * @param [in] compress: state to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_compress_get_stats(struct s_ssl_compress *compress,
+  struct s_ssl_compress_stats *stats);
+
+#endif /* !_SSL_SSL_COMPRESS_H_ */
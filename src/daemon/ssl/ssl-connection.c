@@ -15,43 +15,281 @@
  * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
 #include <event.h>
+#include <arpa/inet.h>
+#include <event2/bufferevent_ssl.h>
+#include <linux/tls.h>
+#include <sys/socket.h>
 
 #include "daemon-alloc.h"
 #include "daemon-cond.h"
+#include "ssl-compress.h"
 #include "ssl-connection.h"
-#include "ssl-server.h"
+#include "ssl-frame.h"
+#include "ssl-payload.h"
+#include "ssl-rpc.h"
+#include "ssl-shm.h"
+#include "ssl-stream.h"
+#include "ssl-worker.h"
 
 struct s_ssl_connection {
+  struct {
+    struct event *deadline;
+    uint32_t delay;
+    struct evbuffer *staging;
+    uint32_t threshold;
+  } batch;
   struct bufferevent *buffer;
+  uint8_t closed;
+  struct s_ssl_compress *compress;
+  uint8_t connected;
   s_ssl_error_cbk error;
+  struct {
+    uint32_t consumed;
+    uint8_t dispatching;
+    struct s_ssl_frame_header header;
+    enum e_ssl_frame_state state;
+    struct evbuffer *scratch;
+    uint32_t stream;
+    struct s_ssl_packet_view view;
+  } frame;
+  char *identity;
+  uint8_t ktls;
+  char *name;
+  struct {
+    struct evbuffer *backlog;
+    uint8_t blocked;
+    uint64_t dropped;
+    struct s_ssl_backpressure limits;
+    struct event *stall;
+    uint64_t stalls;
+    s_ssl_writable_cbk writable;
+  } output;
   s_ssl_read_cbk read;
-  struct s_ssl_server *server;
+  uint32_t refcount;
+  struct s_ssl_rpc *rpc;
+  struct s_ssl_shm *shm;
+  s_ssl_connection_cbk status;
+  struct s_ssl_streams *streams;
+  struct s_ssl_shm *switching;
+  void *userdata;
+  struct s_ssl_worker *worker;
 };
 
 /**
- * @brief Generate a packet instance from the data gather inside the buffer
- * @param [in] buffer: buffer concerned by that process
- * @return a valid pointer on success, NULL on error
+ * @brief Number of bytes the frame parser needs before making progress
+ * @param [in] connection: connection to browse
+ * @return the amount of bytes expected in the input buffer
  */
-static struct s_ssl_packet *_s_ssl_packet_generate(struct bufferevent *buffer)
+static size_t _s_ssl_connection_expected(struct s_ssl_connection *connection)
 {
-  daemon_return_val_if_fail(buffer, NULL);
+  return connection->frame.state == e_ssl_frame_state_header ?
+    S_SSL_FRAME_HEADER_SIZE : connection->frame.header.size;
+}
+
+/**
+ * @brief Compute the name of an accepted connection whose peer advertises no
+ * identity: its address and port, unique among the live connections. The
+ * daemons share one certificate, its common name can't tell them apart
+ * @param [in] buffer: buffer associated to the connection
+ * @return a newly allocated string on success, NULL on error
+ */
+static char *_s_ssl_connection_name(struct bufferevent *buffer)
+{
+  char name[256];
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  char address[INET6_ADDRSTRLEN];
+  uint16_t port;
+  if (getpeername(bufferevent_getfd(buffer), (struct sockaddr *)&sa,
+      &len) != 0)
+    return NULL;
+
+  if (sa.ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+    /* the ipv4 peers of the dual stack listener are named as such */
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+      inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], address,
+        sizeof(address));
+    else
+      inet_ntop(AF_INET6, &sin6->sin6_addr, address, sizeof(address));
+    port = ntohs(sin6->sin6_port);
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+    inet_ntop(AF_INET, &sin->sin_addr, address, sizeof(address));
+    port = ntohs(sin->sin_port);
+  }
+  snprintf(name, sizeof(name), "%s:%u", address, port);
+  return strdup(name);
+}
+
+/**
+ * @brief Count a callback of the connection on the loop of its worker
+ * @param [in] connection: connection running the callback
+ */
+static void _s_ssl_connection_account(struct s_ssl_connection *connection)
+{
+  s_loop_account(s_ssl_worker_get_loop(connection->worker),
+    e_loop_priority_io);
+}
+
+/**
+ * @brief Close a connection and detach it from its worker
+ * @param [in] connection: connection to terminate
+ */
+static void _s_ssl_connection_terminate(struct s_ssl_connection *connection)
+{
+  if (connection->status)
+    connection->status(connection, e_ssl_connection_close);
+  s_ssl_worker_remove_connection(connection->worker, connection);
+  s_ssl_connection_free(connection);
+}
+
+/**
+ * @brief Name an accepted connection after the identity its peer advertises,
+ * after the address and port of the peer without one, and add it to its
+ * worker. The previous connection of the same peer is replaced
+ * @param [in] connection: connection to name
+ * @param [in] identity: identity advertised, not nul terminated, may be NULL
+ * @param [in] size: size of the identity
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_ssl_connection_register(struct s_ssl_connection *connection,
+  const uint8_t *identity, uint32_t size)
+{
+  if (size > S_SSL_CONNECTION_IDENTITY_SIZE ||
+      (identity && memchr(identity, '\0', size)))
+    return -EBADMSG;
+
+  connection->name = size ? strndup((const char *)identity, size) :
+    _s_ssl_connection_name(connection->buffer);
+  if (!connection->name)
+    return -ENOMEM;
+  return s_ssl_worker_add_connection(connection->worker, connection);
+}
 
-  struct evbuffer *event = evbuffer_new();
-  daemon_return_val_if_fail(bufferevent_read_buffer(buffer, event) == 0, NULL);
+static int _s_ssl_connection_shm(struct s_ssl_connection *connection,
+  const uint8_t *request);
+static int _s_ssl_connection_switch(struct s_ssl_connection *connection);
+static void _s_ssl_connection_commit(struct s_ssl_connection *connection);
+static void _s_ssl_connection_schedule(struct s_ssl_connection *connection);
 
-  struct s_ssl_packet *packet = s_ssl_packet_new(evbuffer_pullup(event, -1),
-    evbuffer_get_length(event));
+/**
+ * @brief Handle a control frame, consumed by the connection itself
+ * @param [in] connection: connection which received the frame
+ * @param [in] view: control frame received
+ * @return 0 on success, an -errno value on a malformed frame
+ */
+static int _s_ssl_connection_control(struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  int ret = 0;
+  if (view->type == S_SSL_FRAME_TYPE_HELLO) {
+    if (view->size < S_SSL_COMPRESS_HELLO_SIZE)
+      return -EBADMSG;
+    const uint8_t *hello = s_ssl_packet_view_pullup(view);
+    if (connection->compress)
+      ret = s_ssl_compress_negotiate(connection->compress, hello,
+        view->size);
+    if (ret == 0 && !connection->name)
+      ret = _s_ssl_connection_register(connection,
+        hello + S_SSL_COMPRESS_HELLO_SIZE,
+        view->size - S_SSL_COMPRESS_HELLO_SIZE);
+  } else if (view->type == S_SSL_FRAME_TYPE_SHM) {
+    if (view->size < S_SSL_SHM_REQUEST_SIZE)
+      return -EBADMSG;
+    ret = _s_ssl_connection_shm(connection, s_ssl_packet_view_pullup(view));
+  } else if (view->type == S_SSL_FRAME_TYPE_WINDOW) {
+    if (view->size < S_SSL_STREAM_UPDATE_SIZE)
+      return -EBADMSG;
+    if (s_ssl_streams_credit(connection->streams,
+        s_ssl_packet_view_pullup(view)))
+      _s_ssl_connection_schedule(connection);
+  }
+  connection->frame.dispatching = 1;
+  s_ssl_packet_view_release(view);
+  connection->frame.dispatching = 0;
+  return ret;
+}
 
-  evbuffer_free(event);
-  return packet;
+/**
+ * @brief Process a complete frame: control frames are consumed, the
+ * correlation id is stripped and a compressed payload is inflated in the
+ * scratch buffer. Responses then complete their call, the other frames reach
+ * the read callback
+ * @param [in] connection: connection which received the frame
+ * @param [in] view: frame received
+ * @return 0 on success, an -errno value on a malformed frame
+ */
+static int _s_ssl_connection_dispatch(struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  if (view->flags & S_SSL_FRAME_FLAG_CONTROL)
+    return _s_ssl_connection_control(connection, view);
+
+  /* a peer which sends data without a hello keeps its address */
+  if (!connection->name) {
+    int ret = _s_ssl_connection_register(connection, NULL, 0);
+    if (ret < 0)
+      return ret;
+  }
+
+  if (view->flags & (S_SSL_FRAME_FLAG_REQUEST | S_SSL_FRAME_FLAG_RESPONSE)) {
+    uint8_t data[S_SSL_FRAME_ID_SIZE];
+    if (view->size < sizeof(data))
+      return -EBADMSG;
+    evbuffer_remove(view->buffer, data, sizeof(data));
+    view->id = s_ssl_frame_id_decode(data);
+    view->size -= sizeof(data);
+  }
+
+  /* the credit of a stream frame is granted back once it is released */
+  if (view->flags & S_SSL_FRAME_FLAG_STREAM) {
+    uint32_t stream;
+    if (view->size < sizeof(stream))
+      return -EBADMSG;
+    evbuffer_remove(view->buffer, &stream, sizeof(stream));
+    view->stream = ntohl(stream);
+    view->size -= sizeof(stream);
+    int ret = s_ssl_streams_received(connection->streams, view->stream,
+      view->size, view->flags);
+    if (ret < 0)
+      return ret;
+    connection->frame.consumed = view->size;
+    connection->frame.stream = view->stream;
+  }
+
+  if (view->flags & S_SSL_FRAME_FLAG_COMPRESSED) {
+    if (!connection->compress)
+      return -EPROTO;
+    int ret = s_ssl_compress_decode(connection->compress, view->buffer,
+      view->size, view->flags, connection->frame.scratch);
+    if (ret < 0)
+      return ret;
+    view->buffer = connection->frame.scratch;
+    view->size = ret;
+  }
+
+  connection->frame.dispatching = 1;
+  if (view->flags & S_SSL_FRAME_FLAG_RESPONSE)
+    s_ssl_rpc_complete(connection->rpc, view);
+  else
+    connection->read(connection, view);
+  connection->frame.dispatching = 0;
+  return 0;
 }
 
 /**
  * @brief Read callback for a bufferevent.
  * The read callback is triggered when new data arrives in the input buffer and
- * the amount of readable data exceed the low watermark which is 0 by default.
+ * the amount of readable data exceed the low watermark. The low watermark is
+ * kept equal to the size needed by the frame parser to move forward, so the
+ * callback only wakes up once a full header or a full body is available.
+ * Each complete frame is delivered through its own read callback as a view
+ * over the input buffer; parsing stops until that view is released.
  * @param [in] buffer: buffer to read
  * @param [in] connection: ssl client representation
  */
@@ -61,9 +299,778 @@ static void _s_ssl_connection_read(struct bufferevent *buffer,
   daemon_return_if_fail(buffer);
   daemon_return_if_fail(connection);
 
-  struct s_ssl_packet *packet = _s_ssl_packet_generate(buffer);
-  connection->read(connection->server, packet);
-  s_ssl_packet_free(packet);
+  _s_ssl_connection_account(connection);
+  struct evbuffer *input = bufferevent_get_input(buffer);
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE];
+
+  /* the frames of a shared memory channel join the socket input, which is
+   * only open to the bufferevent otherwise */
+  int ret = 0;
+  if (connection->shm) {
+    evbuffer_unfreeze(input, 0);
+    ret = s_ssl_shm_receive(connection->shm, input);
+    evbuffer_freeze(input, 0);
+  }
+  if (ret < 0) {
+    daemon_log(LOG_ERR, "'%s' corrupted its channel\n", connection->name);
+    connection->error(connection, e_ssl_error_read, ret, NULL);
+    _s_ssl_connection_terminate(connection);
+    return;
+  }
+
+  while (!connection->frame.view.held && evbuffer_get_length(input) >=
+         _s_ssl_connection_expected(connection)) {
+    if (connection->frame.state == e_ssl_frame_state_header) {
+      evbuffer_remove(input, data, S_SSL_FRAME_HEADER_SIZE);
+      s_ssl_frame_header_decode(data, &connection->frame.header);
+      if (connection->frame.header.size > S_SSL_FRAME_MAX_SIZE) {
+        daemon_log(LOG_ERR, "frame too large (%u bytes)\n",
+          connection->frame.header.size);
+        connection->error(connection, e_ssl_error_read, -EMSGSIZE, NULL);
+        _s_ssl_connection_terminate(connection);
+        return;
+      }
+      connection->frame.state = e_ssl_frame_state_body;
+      continue;
+    }
+
+    struct s_ssl_packet_view *view = &connection->frame.view;
+    view->buffer = input;
+    view->flags = connection->frame.header.flags;
+    view->held = 1;
+    view->id = 0;
+    view->size = connection->frame.header.size;
+    view->stream = 0;
+    view->type = connection->frame.header.type;
+
+    ret = _s_ssl_connection_dispatch(connection, view);
+    if (ret < 0) {
+      daemon_log(LOG_ERR, "malformed frame received\n");
+      connection->error(connection, e_ssl_error_read, ret, NULL);
+      _s_ssl_connection_terminate(connection);
+      return;
+    }
+  }
+
+  if (connection->frame.view.held) {
+    /* the handler kept the view, stop reading until it is released */
+    bufferevent_disable(buffer, EV_READ);
+    return;
+  }
+  bufferevent_setwatermark(buffer, EV_READ,
+    _s_ssl_connection_expected(connection), 0);
+}
+
+/**
+ * @brief Write a control frame. Control frames bypass the batch and the
+ * backlog, and are never dropped: they go straight to the output, ahead of the
+ * frames held back by the output limits
+ * @param [in] connection: connection concerned by the frame
+ * @param [in] type: message type of the frame
+ * @param [in] payload: payload to send
+ * @param [in] size: size of the payload
+ * @return 0 on success, -ENOTCONN once the connection is closed, an another
+ * -errno value on error
+ */
+static int _s_ssl_connection_signal(struct s_ssl_connection *connection,
+  uint16_t type, const void *payload, uint32_t size)
+{
+  struct s_ssl_frame_header header = {
+    .size = size,
+    .type = type,
+    .flags = S_SSL_FRAME_FLAG_CONTROL
+  };
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE];
+  s_ssl_frame_header_encode(&header, data);
+
+  int ret = 0;
+  bufferevent_lock(connection->buffer);
+  struct evbuffer *output = bufferevent_get_output(connection->buffer);
+  if (connection->closed)
+    ret = -ENOTCONN;
+  else if (evbuffer_add(output, data, sizeof(data)) != 0 ||
+      evbuffer_add(output, payload, size) != 0)
+    ret = -ENOMEM;
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+/**
+ * @brief Release callback of the connection view. The payload is already
+ * drained, the parser is reset and restarted if the release happened outside
+ * of the read callback.
+ * @param [in] view: view released, embedded in the connection
+ */
+static void _s_ssl_connection_release(struct s_ssl_packet_view *view)
+{
+  daemon_return_if_fail(view);
+
+  struct s_ssl_connection *connection = (struct s_ssl_connection *)
+    ((uint8_t *)view - offsetof(struct s_ssl_connection, frame.view));
+  connection->frame.state = e_ssl_frame_state_header;
+
+  uint8_t data[S_SSL_STREAM_UPDATE_SIZE];
+  uint32_t stream = connection->frame.stream;
+  connection->frame.stream = 0;
+  if (stream && s_ssl_streams_consumed(connection->streams, stream,
+      connection->frame.consumed, data) &&
+      _s_ssl_connection_signal(connection, S_SSL_FRAME_TYPE_WINDOW, data,
+        sizeof(data)) != 0)
+    daemon_log(LOG_WARNING, "failed to update the window of %u\n", stream);
+
+  if (connection->frame.dispatching)
+    return;
+  /* the rings may hold frames while the socket input is empty */
+  if (connection->shm)
+    s_ssl_shm_schedule(connection->shm);
+  bufferevent_setwatermark(connection->buffer, EV_READ,
+    S_SSL_FRAME_HEADER_SIZE, 0);
+  bufferevent_enable(connection->buffer, EV_READ);
+  bufferevent_trigger(connection->buffer, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+static void _s_ssl_connection_event(struct bufferevent *buffer, short what,
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Arm the stall timer of a blocked connection
+ * @param [in] connection: connection blocked
+ */
+static void _s_ssl_connection_stall(struct s_ssl_connection *connection)
+{
+  uint32_t stall = connection->output.limits.stall;
+  struct timeval tv = { .tv_sec = stall / 1000,
+    .tv_usec = (stall % 1000) * 1000 };
+  if (stall)
+    evtimer_add(connection->output.stall, &tv);
+}
+
+/**
+ * @brief Output level waking up the write callback: the backpressure low
+ * watermark, or half the stream depth so the streams are refilled before the
+ * link idles
+ * @param [in] connection: connection to browse
+ * @return the write low watermark
+ */
+static size_t _s_ssl_connection_low(struct s_ssl_connection *connection)
+{
+  size_t low = connection->output.limits.low;
+  return low > S_SSL_STREAM_DEPTH / 2 ? low : S_SSL_STREAM_DEPTH / 2;
+}
+
+/**
+ * @brief Write callback for a bufferevent.
+ * The write callback is triggered once the output buffer is drained down to
+ * the low watermark. A blocked connection moves its backlog to the output and
+ * unblocks if the output stays below the high watermark. The streams then
+ * refill the output.
+ * @param [in] buffer: buffer drained
+ * @param [in] connection: ssl client representation
+ */
+static void _s_ssl_connection_drained(struct bufferevent *buffer,
+  struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(buffer);
+  daemon_return_if_fail(connection);
+
+  _s_ssl_connection_account(connection);
+  struct evbuffer *output = bufferevent_get_output(buffer);
+  /* a shared memory answer waits for the bytes queued before it */
+  if (connection->switching) {
+    if (evbuffer_get_length(output))
+      return;
+    int ret = _s_ssl_connection_switch(connection);
+    if (ret != 0) {
+      connection->error(connection, e_ssl_error_write, ret, NULL);
+      _s_ssl_connection_terminate(connection);
+      return;
+    }
+  }
+  if (!connection->output.blocked ||
+      evbuffer_get_length(output) > connection->output.limits.low)
+    goto schedule;
+
+  evbuffer_add_buffer(output, connection->output.backlog);
+  /* the peer makes progress, give it a new delay */
+  evtimer_del(connection->output.stall);
+  if (evbuffer_get_length(output) >= connection->output.limits.high) {
+    _s_ssl_connection_stall(connection);
+    return;
+  }
+  connection->output.blocked = 0;
+  if (connection->output.writable)
+    connection->output.writable(connection, 1);
+
+schedule:
+  _s_ssl_connection_schedule(connection);
+}
+
+/**
+ * @brief Doorbell of a shared memory channel: the client wrote frames or
+ * released space, or output was queued. The output moves to the ring as the
+ * socket would have drained it, then the input is parsed
+ * @param [in] connection: connection owning the channel
+ */
+static void _s_ssl_connection_doorbell(struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(connection);
+
+  struct bufferevent *buffer = connection->buffer;
+  struct evbuffer *output = bufferevent_get_output(buffer);
+
+  bufferevent_lock(buffer);
+  evbuffer_unfreeze(output, 1);
+  int ret = s_ssl_shm_send(connection->shm, output);
+  evbuffer_freeze(output, 1);
+  if (ret >= 0 && evbuffer_get_length(output) <=
+      _s_ssl_connection_low(connection))
+    _s_ssl_connection_drained(buffer, connection);
+  bufferevent_unlock(buffer);
+
+  if (ret < 0) {
+    daemon_log(LOG_ERR, "'%s' corrupted its channel\n", connection->name);
+    connection->error(connection, e_ssl_error_write, ret, NULL);
+    _s_ssl_connection_terminate(connection);
+    return;
+  }
+  if (!connection->frame.view.held)
+    _s_ssl_connection_read(buffer, connection);
+}
+
+/**
+ * @brief Output buffer callback of a shared memory channel, the ring is
+ * filled from the loop
+ */
+static void _s_ssl_connection_output(daemon_unused struct evbuffer *output,
+  const struct evbuffer_cb_info *info, struct s_ssl_connection *connection)
+{
+  if (info->n_added)
+    s_ssl_shm_schedule(connection->shm);
+}
+
+/**
+ * @brief Answer a refused shared memory request on the socket
+ * @param [in] connection: connection which received the request
+ * @param [in] status: reason of the refusal, an -errno value
+ * @return 0, the connection goes on with its socket
+ */
+static int _s_ssl_connection_refuse(struct s_ssl_connection *connection,
+  int32_t status)
+{
+  daemon_log(LOG_WARNING, "'%s' shared memory refused (%d)\n",
+    connection->name, status);
+  uint32_t answer = htonl((uint32_t)status);
+  _s_ssl_connection_signal(connection, S_SSL_FRAME_TYPE_SHM, &answer,
+    sizeof(answer));
+  return 0;
+}
+
+/**
+ * @brief Send the answer of an accepted shared memory request, once the
+ * socket output drained, then move the output to the rings. The frames held
+ * in the backlog meanwhile follow the answer. The connection must be locked
+ * @param [in] connection: connection switching to shared memory
+ * @return 0 on success, -EPIPE if the socket is unusable
+ */
+static int _s_ssl_connection_switch(struct s_ssl_connection *connection)
+{
+  struct s_ssl_shm *shm = connection->switching;
+  struct bufferevent *buffer = connection->buffer;
+  struct evbuffer *output = bufferevent_get_output(buffer);
+  connection->switching = NULL;
+  bufferevent_setwatermark(buffer, EV_WRITE, _s_ssl_connection_low(connection),
+    0);
+
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE + S_SSL_SHM_ANSWER_SIZE];
+  struct s_ssl_frame_header header = {
+    .size = S_SSL_SHM_ANSWER_SIZE,
+    .type = S_SSL_FRAME_TYPE_SHM,
+    .flags = S_SSL_FRAME_FLAG_CONTROL
+  };
+  s_ssl_frame_header_encode(&header, data);
+  uint32_t answer = htonl(0);
+  memcpy(data + S_SSL_FRAME_HEADER_SIZE, &answer, sizeof(answer));
+
+  int ret = s_ssl_shm_share(shm, bufferevent_getfd(buffer), data,
+    sizeof(data));
+  if (ret == 0) {
+    connection->shm = shm;
+    bufferevent_disable(buffer, EV_WRITE);
+    /* the file chains are mapped, the ring can't be fed by sendfile */
+    evbuffer_clear_flags(output, EVBUFFER_FLAG_DRAINS_TO_FD);
+    evbuffer_add_cb(output, (evbuffer_cb_func)_s_ssl_connection_output,
+      connection);
+    daemon_log(LOG_NOTICE, "'%s' switched to shared memory\n",
+      connection->name);
+  } else {
+    s_ssl_shm_free(shm);
+    if (ret == -EPIPE)
+      return ret;
+    _s_ssl_connection_refuse(connection, ret);
+    _s_ssl_connection_commit(connection);
+  }
+  /* a blocked connection moves its backlog once drained */
+  if (!connection->output.blocked)
+    evbuffer_add_buffer(output, connection->output.backlog);
+  if (connection->shm)
+    s_ssl_shm_schedule(connection->shm);
+  return 0;
+}
+
+/**
+ * @brief Switch a local connection to a shared memory channel, on the client
+ * request. The answer goes out on the socket with the channel attached, once
+ * the output queued before it reached the socket; every later frame waits in
+ * the backlog meanwhile, then goes through the rings. The socket only tells
+ * when the client leaves. The client must not write on the socket after its
+ * request. A refused request is answered on the socket
+ * @param [in] connection: connection which received the request
+ * @param [in] request: request payload
+ * @return 0 on success, an -errno value if the socket is unusable
+ */
+static int _s_ssl_connection_shm(struct s_ssl_connection *connection,
+  const uint8_t *request)
+{
+  uint32_t size, flags;
+  memcpy(&size, request, sizeof(uint32_t));
+  memcpy(&flags, request + 4, sizeof(uint32_t));
+  size = ntohl(size) ? ntohl(size) : S_SSL_SHM_SIZE;
+  flags = ntohl(flags);
+
+  /* shared memory only makes sense with a peer on the same host */
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  int fd = bufferevent_getfd(connection->buffer);
+  struct s_ssl_shm *shm = NULL;
+  int32_t status = 0;
+  if (connection->shm || connection->switching)
+    status = -EALREADY;
+  else if (bufferevent_openssl_get_ssl(connection->buffer) ||
+      getsockname(fd, (struct sockaddr *)&sa, &len) != 0 ||
+      sa.ss_family != AF_UNIX)
+    status = -EPERM;
+  else if (size < S_SSL_SHM_SIZE_MIN || size > S_SSL_SHM_SIZE_MAX ||
+      (size & (size - 1)))
+    status = -EINVAL;
+
+  if (status == 0) {
+    shm = s_ssl_shm_new(bufferevent_get_base(connection->buffer), size, flags,
+      (s_ssl_shm_cbk)_s_ssl_connection_doorbell, connection);
+    status = shm ? 0 : -ENOMEM;
+  }
+
+  if (status != 0)
+    return _s_ssl_connection_refuse(connection, status);
+
+  /* the batch goes out before the answer, the later frames after it */
+  int ret = 0;
+  bufferevent_lock(connection->buffer);
+  _s_ssl_connection_commit(connection);
+  connection->switching = shm;
+  bufferevent_setwatermark(connection->buffer, EV_WRITE, 0, 0);
+  if (!evbuffer_get_length(bufferevent_get_output(connection->buffer)))
+    ret = _s_ssl_connection_switch(connection);
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+/**
+ * @brief Stall timer callback, the peer didn't drain its output in time
+ */
+static void _s_ssl_connection_stalled(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(connection);
+
+  _s_ssl_connection_account(connection);
+  bufferevent_lock(connection->buffer);
+  uint8_t blocked = connection->output.blocked;
+  size_t queued = evbuffer_get_length(bufferevent_get_output(
+    connection->buffer)) + evbuffer_get_length(connection->output.backlog);
+  if (blocked)
+    connection->output.stalls++;
+  bufferevent_unlock(connection->buffer);
+  if (!blocked)
+    return;
+
+  if (connection->output.limits.policy != e_ssl_backpressure_disconnect) {
+    daemon_log(LOG_WARNING, "'%s' is stalled with %zu bytes queued\n",
+      connection->name, queued);
+    _s_ssl_connection_stall(connection);
+    return;
+  }
+  daemon_log(LOG_WARNING, "'%s' evicted with %zu bytes queued\n",
+    connection->name, queued);
+  connection->error(connection, e_ssl_error_write, -ETIMEDOUT, NULL);
+  _s_ssl_connection_terminate(connection);
+}
+
+/**
+ * @brief Drop the oldest frame of the backlog
+ * @param [in] connection: connection to modify
+ * @return the remaining size of the backlog
+ */
+static size_t _s_ssl_connection_drop(struct s_ssl_connection *connection)
+{
+  struct evbuffer *backlog = connection->output.backlog;
+  struct s_ssl_frame_header header;
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE];
+
+  /* the backlog only holds whole frames */
+  evbuffer_copyout(backlog, data, sizeof(data));
+  s_ssl_frame_header_decode(data, &header);
+  evbuffer_drain(backlog, S_SSL_FRAME_HEADER_SIZE + header.size);
+  connection->output.dropped++;
+  return evbuffer_get_length(backlog);
+}
+
+/**
+ * @brief Block the connection once its output went over the high watermark.
+ * The connection must be locked
+ * @param [in] connection: connection to check
+ */
+static void _s_ssl_connection_block(struct s_ssl_connection *connection)
+{
+  size_t high = connection->output.limits.high;
+  if (connection->output.blocked || !high || evbuffer_get_length(
+      bufferevent_get_output(connection->buffer)) < high)
+    return;
+
+  connection->output.blocked = 1;
+  _s_ssl_connection_stall(connection);
+  if (connection->output.writable)
+    connection->output.writable(connection, 0);
+}
+
+/**
+ * @brief Refill the output with stream frames, up to the stream depth. The
+ * connection must be locked
+ * @param [in] connection: connection to fill
+ */
+static void _s_ssl_connection_schedule(struct s_ssl_connection *connection)
+{
+  struct evbuffer *output = bufferevent_get_output(connection->buffer);
+  size_t length = evbuffer_get_length(output);
+  if (connection->closed || connection->output.blocked ||
+      connection->switching || length >= S_SSL_STREAM_DEPTH)
+    return;
+
+  if (s_ssl_streams_pop(connection->streams, output,
+      S_SSL_STREAM_DEPTH - length))
+    _s_ssl_connection_block(connection);
+}
+
+/**
+ * @brief Move the pending batch to the output. The batch is made contiguous
+ * first: the openssl bufferevent issues one SSL_write per chain, so the whole
+ * batch goes out as a single record. The connection must be locked
+ * @param [in] connection: connection to flush
+ */
+static void _s_ssl_connection_commit(struct s_ssl_connection *connection)
+{
+  struct evbuffer *staging = connection->batch.staging;
+  if (!evbuffer_get_length(staging))
+    return;
+
+  evtimer_del(connection->batch.deadline);
+  evbuffer_pullup(staging, -1);
+  evbuffer_add_buffer(bufferevent_get_output(connection->buffer), staging);
+  _s_ssl_connection_block(connection);
+}
+
+/**
+ * @brief Flush deadline callback, the pending batch didn't fill up in time
+ */
+static void _s_ssl_connection_deadline(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(connection);
+
+  _s_ssl_connection_account(connection);
+  bufferevent_lock(connection->buffer);
+  _s_ssl_connection_commit(connection);
+  bufferevent_unlock(connection->buffer);
+}
+
+/**
+ * @brief Select the buffer receiving a new frame. The connection must be
+ * locked until the frame is fully written
+ * @param [in] connection: connection concerned by the frame
+ * @param [in] size: size of the frame, header included
+ * @return the output or the backlog buffer, NULL when the frame is rejected
+ */
+static struct evbuffer *_s_ssl_connection_queue(
+  struct s_ssl_connection *connection, size_t size)
+{
+  /* a closed connection only waits for its last reference to go */
+  if (connection->closed)
+    return NULL;
+  /* the frames queued during a switch to shared memory follow its answer */
+  if (connection->switching && !connection->output.blocked)
+    return connection->output.backlog;
+
+  /* a frame which doesn't fit in the pending batch goes after it */
+  uint32_t threshold = connection->batch.threshold;
+  if (threshold && evbuffer_get_length(connection->batch.staging) + size >
+      threshold)
+    _s_ssl_connection_commit(connection);
+
+  if (!connection->output.blocked)
+    return threshold && size < threshold ? connection->batch.staging :
+      bufferevent_get_output(connection->buffer);
+
+  /* an empty backlog accepts a frame larger than the limit */
+  size_t high = connection->output.limits.high;
+  size_t length = evbuffer_get_length(connection->output.backlog);
+  if (length && length + size > high) {
+    if (connection->output.limits.policy != e_ssl_backpressure_drop_oldest) {
+      connection->output.dropped++;
+      return NULL;
+    }
+    while (length && length + size > high)
+      length = _s_ssl_connection_drop(connection);
+  }
+  return connection->output.backlog;
+}
+
+/**
+ * @brief Account a frame freshly queued: a full batch is flushed, a partial
+ * one waits for its deadline. The connection must be locked
+ * @param [in] connection: connection concerned by the frame
+ */
+static void _s_ssl_connection_queued(struct s_ssl_connection *connection)
+{
+  size_t pending = evbuffer_get_length(connection->batch.staging);
+  if (pending && pending < connection->batch.threshold) {
+    struct timeval tv = { .tv_sec = connection->batch.delay / 1000000,
+      .tv_usec = connection->batch.delay % 1000000 };
+    if (!evtimer_pending(connection->batch.deadline, NULL))
+      evtimer_add(connection->batch.deadline, &tv);
+    return;
+  }
+  _s_ssl_connection_commit(connection);
+  _s_ssl_connection_block(connection);
+}
+
+/**
+ * @brief Arm the read and write timeouts of a connection from the timeout
+ * classes of its loop. Until the connection is established, the handshake
+ * delay bounds both directions; afterwards the peer may stay silent up to the
+ * idle delay, and a pending output may wait up to the stall delay
+ * @param [in] connection: connection to modify
+ */
+static void _s_ssl_connection_timeouts(struct s_ssl_connection *connection)
+{
+  struct s_loop *loop = s_ssl_worker_get_loop(connection->worker);
+
+  if (!connection->connected) {
+    const struct timeval *handshake = s_loop_get_timeout(loop,
+      e_loop_timeout_handshake);
+    bufferevent_set_timeouts(connection->buffer, handshake, handshake);
+  } else {
+    bufferevent_set_timeouts(connection->buffer,
+      s_loop_get_timeout(loop, e_loop_timeout_idle),
+      s_loop_get_timeout(loop, e_loop_timeout_stall));
+  }
+}
+
+/**
+ * @brief Attach the connection callbacks to its bufferevent and start reading
+ * @param [in] connection: connection to set up
+ */
+static void _s_ssl_connection_setup(struct s_ssl_connection *connection)
+{
+  bufferevent_setcb(connection->buffer,
+    (bufferevent_data_cb)_s_ssl_connection_read,
+    (bufferevent_data_cb)_s_ssl_connection_drained,
+    (bufferevent_event_cb)_s_ssl_connection_event, connection);
+  bufferevent_setwatermark(connection->buffer, EV_READ,
+    _s_ssl_connection_expected(connection), 0);
+  bufferevent_setwatermark(connection->buffer, EV_WRITE,
+    _s_ssl_connection_low(connection), 0);
+  _s_ssl_connection_timeouts(connection);
+  bufferevent_enable(connection->buffer, EV_READ);
+}
+
+/**
+ * @brief Read the record the kernel won't hand over as plain data. With ktls
+ * the alerts and the post handshake messages stay queued in the socket, recv()
+ * fails with EIO until they are read along with their type
+ * @param [in] connection: connection switched to ktls
+ * @return 0 when the reading goes on, -ESHUTDOWN on a close notify, an -errno
+ * value otherwise
+ */
+static int _s_ssl_connection_record(
+  daemon_unused struct s_ssl_connection *connection)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  uint8_t record[SSL3_RT_MAX_PLAIN_LENGTH];
+  union {
+    struct cmsghdr header;
+    uint8_t data[CMSG_SPACE(sizeof(uint8_t))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = record, .iov_len = sizeof(record) };
+  struct msghdr msg = {
+    .msg_control = control.data,
+    .msg_controllen = sizeof(control.data),
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  ssize_t len = recvmsg(bufferevent_getfd(connection->buffer), &msg, 0);
+  if (len < 0)
+    return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+  if (len == 0)
+    return -ESHUTDOWN;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  uint8_t type = SSL3_RT_APPLICATION_DATA;
+  if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+      cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+    type = *CMSG_DATA(cmsg);
+
+  switch (type) {
+  case SSL3_RT_APPLICATION_DATA:
+    return evbuffer_add(bufferevent_get_input(connection->buffer), record,
+      len) == 0 ? 0 : -ENOMEM;
+  case SSL3_RT_ALERT:
+    if (len >= 2 && record[1] == SSL_AD_CLOSE_NOTIFY)
+      return -ESHUTDOWN;
+    daemon_log(LOG_WARNING, "'%s' received the alert %u\n", connection->name,
+      len >= 2 ? record[1] : 0);
+    return -ECONNRESET;
+  case SSL3_RT_HANDSHAKE:
+    /* the session tickets are dropped, the kernel can't follow a rekeying */
+    for (ssize_t i = 0; i + 4 <= len; i += 4 +
+        ((record[i + 1] << 16) | (record[i + 2] << 8) | record[i + 3])) {
+      if (record[i] == SSL3_MT_KEY_UPDATE) {
+        daemon_log(LOG_WARNING, "'%s' can't be rekeyed with ktls\n",
+          connection->name);
+        return -ENOTSUP;
+      } else if (record[i] != SSL3_MT_NEWSESSION_TICKET) {
+        return -EPROTO;
+      }
+    }
+    return 0;
+  default:
+    return -EPROTO;
+  }
+#else
+  return -ENOTSUP;
+#endif /* !SSL_OP_ENABLE_KTLS */
+}
+
+/**
+ * @brief Send the close notify of a connection switched to ktls, the alert is
+ * a record of its own type
+ * @param [in] connection: connection switched to ktls
+ * @return 0 on success, an -errno value otherwise
+ */
+static int _s_ssl_connection_notify(
+  daemon_unused struct s_ssl_connection *connection)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  uint8_t alert[2] = { SSL3_AL_WARNING, SSL_AD_CLOSE_NOTIFY };
+  union {
+    struct cmsghdr header;
+    uint8_t data[CMSG_SPACE(sizeof(uint8_t))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+  struct msghdr msg = {
+    .msg_control = control.data,
+    .msg_controllen = sizeof(control.data),
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  *CMSG_DATA(cmsg) = SSL3_RT_ALERT;
+
+  if (sendmsg(bufferevent_getfd(connection->buffer), &msg,
+      MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    return -errno;
+  return 0;
+#else
+  return -ENOTSUP;
+#endif /* !SSL_OP_ENABLE_KTLS */
+}
+
+/**
+ * @brief Switch an established connection to kernel TLS. When OpenSSL managed
+ * to install the negotiated keys in the kernel for both directions, the
+ * record layer is handled by the socket itself: the openssl bufferevent is
+ * replaced by a plain socket bufferevent, which also allows file payloads to
+ * go out through sendfile. OpenSSL is gone afterwards, the control records
+ * are read and the close notify sent by the connection itself. On any failure
+ * the connection keeps the userspace path.
+ * @param [in] connection: connection freshly established
+ * @return 0 on success, an -errno value when the userspace path is kept
+ */
+static int _s_ssl_connection_ktls(
+  daemon_unused struct s_ssl_connection *connection)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL *ssl = bufferevent_openssl_get_ssl(connection->buffer);
+  if (!ssl || !(SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS))
+    return -ENOTSUP;
+
+  if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+      !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+    daemon_log(LOG_INFO, "ktls unavailable for this connection\n");
+    return -ENOTSUP;
+  }
+  /* records still buffered by OpenSSL can't be handed to the kernel */
+  if (SSL_has_pending(ssl) ||
+      evbuffer_get_length(bufferevent_get_output(connection->buffer)))
+    return -EAGAIN;
+
+  /* the socket moves as is: a dup() would leave the loop watching two
+   * descriptors of the same file, which the batched epoll can't follow */
+  int fd = bufferevent_getfd(connection->buffer);
+  struct bufferevent *buffer = bufferevent_socket_new(
+    bufferevent_get_base(connection->buffer), fd,
+    BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+  if (!buffer)
+    return -ENOMEM;
+
+  /* the openssl bufferevent closes the descriptor of its BIO, detach it */
+  BIO_set_fd(SSL_get_wbio(ssl), -1, BIO_NOCLOSE);
+  evbuffer_add_buffer(bufferevent_get_input(buffer),
+    bufferevent_get_input(connection->buffer));
+  bufferevent_free(connection->buffer);
+  connection->buffer = buffer;
+  connection->ktls = 1;
+  _s_ssl_connection_setup(connection);
+  bufferevent_trigger(buffer, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+  return 0;
+#else
+  return -ENOTSUP;
+#endif /* !SSL_OP_ENABLE_KTLS */
+}
+
+/**
+ * @brief Advertise the compression capabilities of the connection, followed
+ * by the identity of the local daemon
+ * @param [in] connection: connection freshly established
+ */
+static void _s_ssl_connection_hello(struct s_ssl_connection *connection)
+{
+  uint8_t data[S_SSL_COMPRESS_HELLO_SIZE + S_SSL_CONNECTION_IDENTITY_SIZE];
+  uint32_t size = S_SSL_COMPRESS_HELLO_SIZE;
+  memset(data, 0, sizeof(data));
+  if (connection->compress)
+    s_ssl_compress_hello(connection->compress, data);
+  if (connection->identity) {
+    memcpy(data + size, connection->identity, strlen(connection->identity));
+    size += strlen(connection->identity);
+  }
+
+  if (_s_ssl_connection_signal(connection, S_SSL_FRAME_TYPE_HELLO, data,
+      size) != 0)
+    daemon_log(LOG_WARNING, "failed to send the capabilities\n");
 }
 
 /**
@@ -83,16 +1090,56 @@ static void _s_ssl_connection_event(struct bufferevent *buffer, short what,
   daemon_return_if_fail(buffer);
   daemon_return_if_fail(connection);
 
+  /* with ktls a control record fails the socket read with EIO */
+  if (connection->ktls && (what & BEV_EVENT_ERROR) == BEV_EVENT_ERROR &&
+      (what & BEV_EVENT_READING) == BEV_EVENT_READING &&
+      EVUTIL_SOCKET_ERROR() == EIO) {
+    int ret = _s_ssl_connection_record(connection);
+    if (ret == 0) {
+      _s_ssl_connection_account(connection);
+      bufferevent_enable(buffer, EV_READ);
+      bufferevent_trigger(buffer, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+      return;
+    } else if (ret == -ESHUTDOWN) {
+      what = BEV_EVENT_READING | BEV_EVENT_EOF;
+    }
+  }
+
+  _s_ssl_connection_account(connection);
   if ((what & BEV_EVENT_EOF) == BEV_EVENT_EOF) {
     daemon_log(LOG_WARNING, "a communication is terminated\n");
     goto terminated;
   } else if ((what & BEV_EVENT_TIMEOUT) == BEV_EVENT_TIMEOUT) {
     daemon_log(LOG_WARNING, "a communication timeout\n");
-    goto terminated;
+    /* the peer sees an end of file and reconnects */
+    s_ssl_connection_close(connection);
+    return;
   } else if ((what & BEV_EVENT_CONNECTED) == BEV_EVENT_CONNECTED) {
     daemon_log(LOG_NOTICE, "a communication succeed\n");
-    s_ssl_server_add_connection(connection->server, connection);
+    connection->connected = 1;
+    _s_ssl_connection_timeouts(connection);
+    if (_s_ssl_connection_ktls(connection) == 0)
+      daemon_log(LOG_NOTICE, "a communication switched to ktls\n");
+    /* an accepted connection is added once its peer is identified */
+    if (connection->name &&
+        s_ssl_worker_add_connection(connection->worker, connection) != 0)
+      goto terminated;
+    if (connection->compress || connection->identity)
+      _s_ssl_connection_hello(connection);
+    if (connection->status)
+      connection->status(connection, e_ssl_connection_connected);
     return;
+  } else if (!connection->connected) {
+    /* the connect or the handshake failed, nothing can be sent anymore */
+    daemon_log(LOG_WARNING, "a communication failed\n");
+    SSL *ssl = bufferevent_openssl_get_ssl(buffer);
+    long verify = ssl ? SSL_get_verify_result(ssl) : X509_V_OK;
+    if (verify != X509_V_OK)
+      daemon_log(LOG_WARNING, "the peer certificate is rejected: %s\n",
+        X509_verify_cert_error_string(verify));
+    connection->error(connection, e_ssl_error_connection,
+      -EVUTIL_SOCKET_ERROR(), NULL);
+    goto terminated;
   }
   enum e_ssl_error error = ((what & BEV_EVENT_WRITING) != BEV_EVENT_WRITING) ?
     e_ssl_error_read : ((what & BEV_EVENT_READING) != BEV_EVENT_READING) ?
@@ -102,20 +1149,18 @@ static void _s_ssl_connection_event(struct bufferevent *buffer, short what,
     daemon_log(LOG_NOTICE, "a communication ended\n");
     goto terminated;
   }
-  struct s_ssl_packet *packet = _s_ssl_packet_generate(buffer);
   /* TODO: get the ssl error code value directly */
-  connection->error(connection->server, error, 0, packet);
+  connection->error(connection, error, 0, NULL);
   return;
 
 terminated:
-  s_ssl_server_remove_connection(connection->server, connection);
-  s_ssl_connection_free(connection);
+  _s_ssl_connection_terminate(connection);
 }
 
-struct s_ssl_connection *s_ssl_connection_new(struct s_ssl_server *server,
+struct s_ssl_connection *s_ssl_connection_new(struct s_ssl_worker *worker,
   struct bufferevent *buffer, s_ssl_read_cbk read, s_ssl_error_cbk error)
 {
-  daemon_return_val_if_fail(server, NULL);
+  daemon_return_val_if_fail(worker, NULL);
   daemon_return_val_if_fail(buffer, NULL);
   daemon_return_val_if_fail(read, NULL);
   daemon_return_val_if_fail(error, NULL);
@@ -124,31 +1169,518 @@ struct s_ssl_connection *s_ssl_connection_new(struct s_ssl_server *server,
     daemon_malloc(sizeof(struct s_ssl_connection));
   connection->buffer = buffer;
   connection->error = error;
+  connection->frame.state = e_ssl_frame_state_header;
+  connection->frame.view.pool = s_ssl_worker_get_pool(worker);
+  connection->frame.view.release = _s_ssl_connection_release;
   connection->read = read;
-  connection->server = server;
-
-  bufferevent_setcb(buffer,
-    (bufferevent_data_cb)_s_ssl_connection_read, NULL,
-    (bufferevent_event_cb)_s_ssl_connection_event, connection);
-  bufferevent_enable(buffer, EV_READ);
+  connection->refcount = 1;
+  connection->rpc = s_ssl_rpc_new(s_ssl_worker_get_loop(worker));
+  connection->streams = s_ssl_streams_new(S_SSL_STREAM_WINDOW);
+  connection->worker = worker;
+  connection->batch.deadline = evtimer_new(bufferevent_get_base(buffer),
+    (event_callback_fn)_s_ssl_connection_deadline, connection);
+  connection->batch.staging = evbuffer_new();
+  connection->output.backlog = evbuffer_new();
+  s_ssl_backpressure_init(&connection->output.limits);
+  connection->output.stall = evtimer_new(bufferevent_get_base(buffer),
+    (event_callback_fn)_s_ssl_connection_stalled, connection);
+  if (!connection->batch.deadline || !connection->batch.staging ||
+      !connection->rpc || !connection->streams ||
+      !connection->output.backlog || !connection->output.stall)
+    goto error;
+  _s_ssl_connection_setup(connection);
 
   return connection;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a connection\n");
+  s_ssl_connection_free(connection);
+  return NULL;
 }
 
 void s_ssl_connection_free(struct s_ssl_connection *connection)
 {
   daemon_return_if_fail(connection);
 
+  /* the calls in flight complete before the connection disappears */
+  if (connection->rpc) {
+    s_ssl_rpc_free(connection->rpc);
+    connection->rpc = NULL;
+  }
+  if (connection->shm) {
+    s_ssl_shm_free(connection->shm);
+    connection->shm = NULL;
+  }
+  if (connection->switching) {
+    s_ssl_shm_free(connection->switching);
+    connection->switching = NULL;
+  }
+  /* a writer holding a reference finds the connection closed, the memory
+   * goes away with the last reference */
+  bufferevent_lock(connection->buffer);
+  connection->closed = 1;
+  bufferevent_setcb(connection->buffer, NULL, NULL, NULL, NULL);
+  bufferevent_disable(connection->buffer, EV_READ | EV_WRITE);
+  if (connection->batch.deadline)
+    event_del(connection->batch.deadline);
+  if (connection->output.stall)
+    event_del(connection->output.stall);
+  bufferevent_unlock(connection->buffer);
+  s_ssl_connection_unref(connection);
+}
+
+struct s_ssl_connection *s_ssl_connection_ref(
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  __atomic_add_fetch(&connection->refcount, 1, __ATOMIC_RELAXED);
+  return connection;
+}
+
+void s_ssl_connection_unref(struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(connection);
+
+  if (__atomic_sub_fetch(&connection->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
   bufferevent_free(connection->buffer);
+  if (connection->compress)
+    s_ssl_compress_free(connection->compress);
+  if (connection->streams)
+    s_ssl_streams_free(connection->streams);
+  if (connection->frame.scratch)
+    evbuffer_free(connection->frame.scratch);
+  if (connection->batch.deadline)
+    event_free(connection->batch.deadline);
+  if (connection->batch.staging)
+    evbuffer_free(connection->batch.staging);
+  if (connection->output.stall)
+    event_free(connection->output.stall);
+  if (connection->output.backlog)
+    evbuffer_free(connection->output.backlog);
+  if (connection->name)
+    daemon_free(connection->name);
+  if (connection->identity)
+    daemon_free(connection->identity);
   daemon_free(connection);
 }
 
+int s_ssl_connection_set_backpressure(struct s_ssl_connection *connection,
+  const struct s_ssl_backpressure *backpressure, s_ssl_writable_cbk writable)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(backpressure, -EINVAL);
+  daemon_return_val_if_fail(!backpressure->high ||
+    backpressure->low < backpressure->high, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  connection->output.limits = *backpressure;
+  connection->output.writable = writable;
+  bufferevent_setwatermark(connection->buffer, EV_WRITE,
+    _s_ssl_connection_low(connection), 0);
+  bufferevent_unlock(connection->buffer);
+  return 0;
+}
+
+int s_ssl_connection_set_batching(struct s_ssl_connection *connection,
+  uint32_t threshold, uint32_t delay)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(threshold <= S_SSL_FRAME_MAX_SIZE, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  connection->batch.threshold = threshold;
+  connection->batch.delay = delay;
+  if (!threshold)
+    _s_ssl_connection_commit(connection);
+  bufferevent_unlock(connection->buffer);
+  return 0;
+}
+
+int s_ssl_connection_flush(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  _s_ssl_connection_commit(connection);
+  bufferevent_unlock(connection->buffer);
+  return 0;
+}
+
+int s_ssl_connection_is_writable(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, 0);
+
+  return !__atomic_load_n(&connection->output.blocked, __ATOMIC_RELAXED);
+}
+
+int s_ssl_connection_get_stats(struct s_ssl_connection *connection,
+  struct s_ssl_connection_stats *stats)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  stats->blocked = connection->output.blocked;
+  stats->queued = evbuffer_get_length(bufferevent_get_output(
+    connection->buffer)) + evbuffer_get_length(connection->batch.staging);
+  stats->backlog = evbuffer_get_length(connection->output.backlog);
+  stats->dropped = connection->output.dropped;
+  stats->stalls = connection->output.stalls;
+  bufferevent_unlock(connection->buffer);
+  return 0;
+}
+
+int s_ssl_connection_set_compression(struct s_ssl_connection *connection,
+  const struct s_ssl_compress_config *config)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(config, -EINVAL);
+  daemon_return_val_if_fail(!connection->connected, -EBUSY);
+  daemon_return_val_if_fail(!connection->compress, -EALREADY);
+
+  connection->frame.scratch = evbuffer_new();
+  connection->compress = s_ssl_compress_new(config);
+  return connection->frame.scratch && connection->compress ? 0 : -ENOMEM;
+}
+
+struct s_ssl_compress *s_ssl_connection_get_compress(
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  return connection->compress;
+}
+
+struct s_ssl_worker *s_ssl_connection_get_worker(
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  return connection->worker;
+}
+
+struct s_ssl_rpc *s_ssl_connection_get_rpc(
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  return connection->rpc;
+}
+
+const char *s_ssl_connection_get_name(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  return connection->name;
+}
+
+int s_ssl_connection_set_name(struct s_ssl_connection *connection,
+  const char *name)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(name, -EINVAL);
+  daemon_return_val_if_fail(!connection->connected, -EBUSY);
+
+  char *copy = strdup(name);
+  daemon_return_val_if_fail(copy, -ENOMEM);
+  if (connection->name)
+    daemon_free(connection->name);
+  connection->name = copy;
+  return 0;
+}
+
+int s_ssl_connection_set_identity(struct s_ssl_connection *connection,
+  const char *identity)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(identity, -EINVAL);
+  daemon_return_val_if_fail(strlen(identity) <= S_SSL_CONNECTION_IDENTITY_SIZE,
+    -EINVAL);
+  daemon_return_val_if_fail(!connection->connected, -EBUSY);
+
+  char *copy = strdup(identity);
+  daemon_return_val_if_fail(copy, -ENOMEM);
+  if (connection->identity)
+    daemon_free(connection->identity);
+  connection->identity = copy;
+  return 0;
+}
+
+int s_ssl_connection_set_status(struct s_ssl_connection *connection,
+  s_ssl_connection_cbk status, void *userdata)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  connection->status = status;
+  connection->userdata = userdata;
+  return 0;
+}
+
+void *s_ssl_connection_get_userdata(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, NULL);
+
+  return connection->userdata;
+}
+
+void s_ssl_connection_close(struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(connection);
+
+  /* the close notify tells the peer the connection was closed on purpose,
+   * a bare socket close reaches it as a read error */
+  SSL *ssl = bufferevent_openssl_get_ssl(connection->buffer);
+  if (ssl && connection->connected)
+    SSL_shutdown(ssl);
+  else if (connection->ktls && _s_ssl_connection_notify(connection) != 0)
+    daemon_log(LOG_WARNING, "'%s' failed to send its close notify\n",
+      connection->name);
+  _s_ssl_connection_terminate(connection);
+}
+
 int s_ssl_connection_write(struct s_ssl_connection *connection,
   const struct s_ssl_packet *packet)
+{
+  return s_ssl_connection_write_id(connection, packet, 0, 0);
+}
+
+int s_ssl_connection_write_id(struct s_ssl_connection *connection,
+  const struct s_ssl_packet *packet, uint16_t flags, uint64_t id)
 {
   daemon_return_val_if_fail(connection, -EINVAL);
   daemon_return_val_if_fail(packet, -EINVAL);
 
-  return bufferevent_write(connection->buffer, packet->payload,
-    packet->size);
+  /* requests and responses carry their correlation id before the payload */
+  uint32_t prefix = (flags & (S_SSL_FRAME_FLAG_REQUEST |
+    S_SSL_FRAME_FLAG_RESPONSE)) ? S_SSL_FRAME_ID_SIZE : 0;
+  daemon_return_val_if_fail(packet->size + prefix <= S_SSL_FRAME_MAX_SIZE,
+    -EMSGSIZE);
+
+  /* the payload is compressed before locking, only its copy is serialized */
+  struct evbuffer *body = NULL;
+  uint16_t codec = 0;
+  if (s_ssl_compress_wanted(connection->compress, packet->size)) {
+    body = evbuffer_new();
+    if (body && s_ssl_compress_encode(connection->compress, packet->payload,
+        packet->size, body, &codec) != 0) {
+      evbuffer_free(body);
+      body = NULL;
+    }
+  }
+  uint32_t length = body ? evbuffer_get_length(body) : packet->size;
+
+  /* the protocol bits belong to the layers, whatever the caller set */
+  struct s_ssl_frame_header header = {
+    .size = length + prefix,
+    .type = packet->type,
+    .flags = s_ssl_frame_flags(packet->flags) | flags | codec
+  };
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE + S_SSL_FRAME_ID_SIZE];
+  s_ssl_frame_header_encode(&header, data);
+  if (prefix)
+    s_ssl_frame_id_encode(id, data + S_SSL_FRAME_HEADER_SIZE);
+
+  /* header and payload must not interleave with a write from another thread.
+   * A frame is queued whole or not at all: the compressed one is moved with
+   * its header, the room of the plain one is reserved first */
+  int ret = 0;
+  size_t size = S_SSL_FRAME_HEADER_SIZE + prefix;
+  bufferevent_lock(connection->buffer);
+  struct evbuffer *output = _s_ssl_connection_queue(connection,
+    size + length);
+  if (!output)
+    ret = connection->closed ? -ENOTCONN : -ENOBUFS;
+  else if (body ? evbuffer_prepend(body, data, size) != 0 ||
+      evbuffer_add_buffer(output, body) != 0 :
+      evbuffer_expand(output, size + length) != 0 ||
+      evbuffer_add(output, data, size) != 0 ||
+      evbuffer_add(output, packet->payload, packet->size) != 0)
+    ret = -ENOMEM;
+  else
+    _s_ssl_connection_queued(connection);
+  bufferevent_unlock(connection->buffer);
+
+  if (body)
+    evbuffer_free(body);
+  return ret;
+}
+
+int s_ssl_connection_write_buffer(struct s_ssl_connection *connection,
+  uint16_t type, struct evbuffer *body)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(body, -EINVAL);
+
+  size_t length = evbuffer_get_length(body);
+  daemon_return_val_if_fail(length <= S_SSL_FRAME_MAX_SIZE, -EMSGSIZE);
+
+  struct s_ssl_frame_header header = {
+    .size = length,
+    .type = type,
+    .flags = 0
+  };
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE];
+  s_ssl_frame_header_encode(&header, data);
+
+  /* the chains are moved, a mapped file region is never copied here. The
+   * header goes in front of the body so the frame is moved whole */
+  int ret = 0;
+  bufferevent_lock(connection->buffer);
+  struct evbuffer *output = _s_ssl_connection_queue(connection,
+    sizeof(data) + length);
+  if (!output) {
+    ret = connection->closed ? -ENOTCONN : -ENOBUFS;
+  } else if (evbuffer_prepend(body, data, sizeof(data)) != 0) {
+    ret = -ENOMEM;
+  } else if (evbuffer_add_buffer(output, body) != 0) {
+    evbuffer_drain(body, sizeof(data));
+    ret = -ENOMEM;
+  } else {
+    _s_ssl_connection_queued(connection);
+  }
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+int s_ssl_connection_sendfile(struct s_ssl_connection *connection,
+  uint16_t type, int fd, off_t offset, uint32_t size)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(fd >= 0, -EINVAL);
+  daemon_return_val_if_fail(size <= S_SSL_FRAME_MAX_SIZE, -EMSGSIZE);
+
+  struct s_ssl_frame_header header = {
+    .size = size,
+    .type = type,
+    .flags = 0
+  };
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE];
+  s_ssl_frame_header_encode(&header, data);
+
+  /* with ktls the file chain is sent with sendfile, without any userspace
+   * copy. Otherwise libevent maps the file for the openssl layer. The frame
+   * is built aside and moved whole */
+  struct evbuffer *frame = evbuffer_new();
+  int ret = 0;
+  bufferevent_lock(connection->buffer);
+  struct evbuffer *output = _s_ssl_connection_queue(connection,
+    sizeof(data) + size);
+  if (!output) {
+    close(fd);
+    ret = connection->closed ? -ENOTCONN : -ENOBUFS;
+  } else if (!frame || evbuffer_add(frame, data, sizeof(data)) != 0 ||
+      evbuffer_add_file(frame, fd, offset, size) != 0) {
+    close(fd);
+    ret = -ENOMEM;
+  } else if (evbuffer_add_buffer(output, frame) != 0) {
+    /* the file goes with the frame */
+    ret = -ENOMEM;
+  } else {
+    _s_ssl_connection_queued(connection);
+  }
+  bufferevent_unlock(connection->buffer);
+  if (frame)
+    evbuffer_free(frame);
+  return ret;
+}
+
+int s_ssl_connection_is_ktls(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, 0);
+
+  return connection->ktls;
+}
+
+int s_ssl_connection_is_shm(struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(connection, 0);
+
+  return connection->shm != NULL;
+}
+
+/**
+ * @brief Cleanup callback of a referenced chain: the output buffer is done
+ * with its part of the shared payload
+ */
+static void _s_ssl_connection_payload_cleanup(daemon_unused const void *data,
+  daemon_unused size_t size, struct s_ssl_payload *payload)
+{
+  s_ssl_payload_unref(payload);
+}
+
+int s_ssl_connection_write_payload(struct s_ssl_connection *connection,
+  struct s_ssl_payload *payload)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(payload, -EINVAL);
+
+  int ret = 0;
+  bufferevent_lock(connection->buffer);
+  struct evbuffer *output = _s_ssl_connection_queue(connection,
+    payload->size);
+  if (!output) {
+    ret = connection->closed ? -ENOTCONN : -ENOBUFS;
+  } else if (evbuffer_add_reference(output, payload->data, payload->size,
+      (evbuffer_ref_cleanup_cb)_s_ssl_connection_payload_cleanup,
+      s_ssl_payload_ref(payload)) != 0) {
+    s_ssl_payload_unref(payload);
+    ret = -ENOMEM;
+  } else {
+    _s_ssl_connection_queued(connection);
+  }
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+int s_ssl_connection_stream_open(struct s_ssl_connection *connection,
+  uint32_t id, uint16_t type, uint8_t weight)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  int ret = connection->closed ? -ENOTCONN :
+    s_ssl_streams_open(connection->streams, id, type, weight);
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+int s_ssl_connection_stream_write(struct s_ssl_connection *connection,
+  uint32_t id, const uint8_t *data, size_t size)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  int ret = connection->closed ? -ENOTCONN :
+    s_ssl_streams_push(connection->streams, id, data, size);
+  if (ret == 0)
+    _s_ssl_connection_schedule(connection);
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+int s_ssl_connection_stream_close(struct s_ssl_connection *connection,
+  uint32_t id)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  int ret = connection->closed ? -ENOTCONN :
+    s_ssl_streams_close(connection->streams, id);
+  if (ret == 0)
+    _s_ssl_connection_schedule(connection);
+  bufferevent_unlock(connection->buffer);
+  return ret;
+}
+
+int s_ssl_connection_get_stream_stats(struct s_ssl_connection *connection,
+  uint32_t id, struct s_ssl_stream_stats *stats)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  bufferevent_lock(connection->buffer);
+  int ret = s_ssl_streams_get_stats(connection->streams, id, stats);
+  bufferevent_unlock(connection->buffer);
+  return ret;
 }
@@ -22,37 +22,398 @@
 # include <event2/event.h>
 # include <event2/bufferevent.h>
 # include <netinet/in.h>
+# include <sys/types.h>
 
 # include "ssl.h"
+# include "ssl-compress.h"
 # include "ssl-packet.h"
-# include "ssl-server.h"
+# include "ssl-payload.h"
+# include "ssl-rpc.h"
+# include "ssl-stream.h"
+# include "ssl-worker.h"
+
+/**
+ * @brief Default output watermarks and stall delay of a connection
+ */
+# define S_SSL_CONNECTION_HIGH_WATERMARK (4 * 1024 * 1024)
+# define S_SSL_CONNECTION_LOW_WATERMARK (1024 * 1024)
+# define S_SSL_CONNECTION_STALL 10000
+
+/**
+ * @brief Default batch size, one full TLS record, and flush deadline in
+ * microseconds of a connection batching its frames
+ */
+# define S_SSL_CONNECTION_BATCH_SIZE (16 * 1024)
+# define S_SSL_CONNECTION_BATCH_DELAY 200
+
+/**
+ * @brief Longest identity advertised after the capabilities of the hello
+ */
+# define S_SSL_CONNECTION_IDENTITY_SIZE 255
 
 struct s_ssl_connection;
 
+/**
+ * @brief Behavior of a connection whose peer doesn't drain its output
+ */
+enum e_ssl_backpressure {
+  e_ssl_backpressure_disconnect,
+  e_ssl_backpressure_drop_newest,
+  e_ssl_backpressure_drop_oldest
+};
+
+/**
+ * @brief Output limits of a connection. Once the output buffer reaches the
+ * high watermark, the connection is blocked and the new frames wait in a
+ * backlog bounded to the same size. The connection unblocks when the output
+ * is drained down to the low watermark. A full backlog drops its oldest
+ * frames or rejects the newest one depending on the policy, and a peer
+ * blocked for longer than the stall delay is disconnected with the
+ * disconnect policy. The control frames of the connection itself, window
+ * updates and handshakes, are never held back nor dropped
+ */
+struct s_ssl_backpressure {
+  uint32_t high;
+  uint32_t low;
+  enum e_ssl_backpressure policy;
+  uint32_t stall;
+};
+
+/**
+ * @brief Queued bytes gauges of a connection
+ */
+struct s_ssl_connection_stats {
+  uint8_t blocked;
+  uint64_t queued;
+  uint64_t backlog;
+  uint64_t dropped;
+  uint64_t stalls;
+};
+
+/**
+ * @brief Fill the default output limits
+ * @param [out] backpressure: limits to initialize
+ */
+static inline void s_ssl_backpressure_init(
+  struct s_ssl_backpressure *backpressure)
+{
+  daemon_return_if_fail(backpressure);
+
+  backpressure->high = S_SSL_CONNECTION_HIGH_WATERMARK;
+  backpressure->low = S_SSL_CONNECTION_LOW_WATERMARK;
+  backpressure->policy = e_ssl_backpressure_disconnect;
+  backpressure->stall = S_SSL_CONNECTION_STALL;
+}
+
 /**
  * @brief Allocate a new ssl connection
- * @param [in] server: server instance
+ * @param [in] worker: worker owning the connection
  * @param [in] buffer: buffer event instance
  * @param [in] read: incoming packet callback
  * @param [in] error: error receiving/transmitting packet callback
  * @return a valid pointer on success, NULL on error
  */
-struct s_ssl_connection *s_ssl_connection_new(struct s_ssl_server *server,
+struct s_ssl_connection *s_ssl_connection_new(struct s_ssl_worker *worker,
   struct bufferevent *buffer, s_ssl_read_cbk read, s_ssl_error_cbk error);
 
 /**
- * @brief Deallocate a specific ssl connection
+ * @brief Deallocate a specific ssl connection, from the loop running it. The
+ * connection is closed at once, its memory is released with the last
+ * reference
  * @param [in] connection: connection to delete
  */
 void s_ssl_connection_free(struct s_ssl_connection *connection);
 
+/**
+ * @brief Take a reference on a connection, from any thread. The connection
+ * can be written without holding the lock of the set it was found in; once it
+ * is closed, its writes fail with -ENOTCONN
+ * @param [in] connection: connection to reference
+ * @return the connection
+ */
+struct s_ssl_connection *s_ssl_connection_ref(
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Drop a reference taken with #s_ssl_connection_ref, the last one
+ * releases the connection memory
+ * @param [in] connection: connection to release
+ */
+void s_ssl_connection_unref(struct s_ssl_connection *connection);
+
+/**
+ * @brief Set the output limits of a connection
+ * @param [in] connection: connection to modify
+ * @param [in] backpressure: output limits, the stall delay is given in
+ * milliseconds
+ * @param [in] writable: callback notified when the connection blocks and
+ * unblocks, may be NULL
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_backpressure(struct s_ssl_connection *connection,
+  const struct s_ssl_backpressure *backpressure, s_ssl_writable_cbk writable);
+
+/**
+ * @brief Batch the frames written to a connection. Frames smaller than the
+ * threshold are accumulated and sent together once the batch is full, once
+ * the deadline expires, or on #s_ssl_connection_flush. Larger frames flush
+ * the batch and go out directly
+ * @param [in] connection: connection to modify
+ * @param [in] threshold: batch size in bytes, 0 to send every frame at once
+ * @param [in] delay: flush deadline in microseconds
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_batching(struct s_ssl_connection *connection,
+  uint32_t threshold, uint32_t delay);
+
+/**
+ * @brief Send the pending batch of a connection now, for latency sensitive
+ * frames
+ * @param [in] connection: connection to flush
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_flush(struct s_ssl_connection *connection);
+
+/**
+ * @brief Check whether a connection accepts data without queuing it in its
+ * backlog
+ * @param [in] connection: connection to browse
+ * @return 1 if the connection is writable, 0 otherwise
+ */
+int s_ssl_connection_is_writable(struct s_ssl_connection *connection);
+
+/**
+ * @brief Get the queued bytes gauges of a connection, from any thread
+ * @param [in] connection: connection to browse
+ * @param [out] stats: gauges to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_get_stats(struct s_ssl_connection *connection,
+  struct s_ssl_connection_stats *stats);
+
+/**
+ * @brief Enable the frame compression of a connection, before it is
+ * established. Both peers exchange their capabilities, then each one
+ * compresses the payloads above the threshold with the best common codec
+ * @param [in] connection: connection to modify
+ * @param [in] config: compression settings
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_compression(struct s_ssl_connection *connection,
+  const struct s_ssl_compress_config *config);
+
+/**
+ * @brief Get the compression state of a connection, to read its counters
+ * @param [in] connection: connection to browse
+ * @return a valid pointer if the compression is enabled, NULL otherwise
+ */
+struct s_ssl_compress *s_ssl_connection_get_compress(
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Get the worker owning a connection
+ * @param [in] connection: connection to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_worker *s_ssl_connection_get_worker(
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Get the set of calls in flight on a connection
+ * @param [in] connection: connection to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_rpc *s_ssl_connection_get_rpc(
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Get the name identifying the peer of a connection. An outbound
+ * connection is named after the peer given to #s_ssl_connection_set_name, an
+ * accepted one after the identity its peer advertises in its hello, so a
+ * reconnecting peer replaces its previous connection. A peer which advertises
+ * none is named after its address and port, "address:port"
+ * @param [in] connection: connection to browse
+ * @return a valid pointer once the peer is identified, NULL otherwise
+ */
+const char *s_ssl_connection_get_name(struct s_ssl_connection *connection);
+
+/**
+ * @brief Name a connection before it is established, instead of deriving the
+ * name from its peer. Outbound connections are named after the peer they
+ * reach
+ * @param [in] connection: connection to modify
+ * @param [in] name: name to copy
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_name(struct s_ssl_connection *connection,
+  const char *name);
+
+/**
+ * @brief Set the identity of the local daemon, advertised to the peer in the
+ * hello once the connection is established
+ * @param [in] connection: connection to modify
+ * @param [in] identity: identity to copy, at most
+ * #S_SSL_CONNECTION_IDENTITY_SIZE characters
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_identity(struct s_ssl_connection *connection,
+  const char *identity);
+
+/**
+ * @brief Follow the lifetime of a connection. The callback is called with the
+ * connection once it is established, and right before it is released when it
+ * terminates, the handshake failures included
+ * @param [in] connection: connection to modify
+ * @param [in] status: status callback, NULL to stop following the connection
+ * @param [in] userdata: pointer returned by #s_ssl_connection_get_userdata
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_set_status(struct s_ssl_connection *connection,
+  s_ssl_connection_cbk status, void *userdata);
+
+/**
+ * @brief Get the pointer given with the status callback
+ * @param [in] connection: connection to browse
+ * @return the userdata, NULL if none was given
+ */
+void *s_ssl_connection_get_userdata(struct s_ssl_connection *connection);
+
+/**
+ * @brief Close a connection from the loop running it, the connection is
+ * released. A tls peer receives a close notify
+ * @param [in] connection: connection to close
+ */
+void s_ssl_connection_close(struct s_ssl_connection *connection);
+
 /**
  * @brief Write a packet in the connection
  * @param [in] connection: connection concerned by the packet
  * @param [in] packet: payload received
- * @return 0 on success, an -errno value on error
+ * @return 0 on success, -ENOBUFS when the backlog rejected the frame, an
+ * another -errno value on error
  */
 int s_ssl_connection_write(struct s_ssl_connection *connection,
   const struct s_ssl_packet *packet);
 
+/**
+ * @brief Write a packet carrying a correlation id in the connection
+ * @param [in] connection: connection concerned by the packet
+ * @param [in] packet: payload to send
+ * @param [in] flags: frame flags added to the packet ones,
+ * #S_SSL_FRAME_FLAG_REQUEST or #S_SSL_FRAME_FLAG_RESPONSE prefix the payload
+ * with the id. The flags of the packet owned by the protocol,
+ * #S_SSL_FRAME_FLAG_OWNED, are ignored
+ * @param [in] id: correlation id
+ * @return 0 on success, -ENOBUFS when the backlog rejected the frame, an
+ * another -errno value on error
+ */
+int s_ssl_connection_write_id(struct s_ssl_connection *connection,
+  const struct s_ssl_packet *packet, uint16_t flags, uint64_t id);
+
+/**
+ * @brief Write the content of a buffer as the payload of a frame, without
+ * copying it. The payload isn't compressed
+ * @param [in] connection: connection concerned by the payload
+ * @param [in] type: message type of the frame
+ * @param [in] body: payload to send, drained on success
+ * @return 0 on success, -ENOBUFS when the backlog rejected the frame, an
+ * another -errno value on error
+ */
+int s_ssl_connection_write_buffer(struct s_ssl_connection *connection,
+  uint16_t type, struct evbuffer *body);
+
+/**
+ * @brief Send a file region as the payload of a frame. The file descriptor is
+ * owned by the connection afterwards and closed once sent or rejected. When the
+ * connection runs over kernel TLS the region goes out through sendfile,
+ * without any userspace copy
+ * @param [in] connection: connection concerned by the payload
+ * @param [in] type: message type of the frame
+ * @param [in] fd: file descriptor to read
+ * @param [in] offset: offset of the region in the file
+ * @param [in] size: size of the region
+ * @return 0 on success, -ENOBUFS when the backlog rejected the frame, an
+ * another -errno value on error
+ */
+int s_ssl_connection_sendfile(struct s_ssl_connection *connection,
+  uint16_t type, int fd, off_t offset, uint32_t size);
+
+/**
+ * @brief Check whether the record layer of a connection is offloaded to the
+ * kernel
+ * @param [in] connection: connection to browse
+ * @return 1 if the connection runs over kernel TLS, 0 otherwise
+ */
+int s_ssl_connection_is_ktls(struct s_ssl_connection *connection);
+
+/**
+ * @brief Check whether a local connection switched to a shared memory
+ * channel. A local client asks for it with a #S_SSL_FRAME_TYPE_SHM control
+ * frame, see ssl-shm.h
+ * @param [in] connection: connection to browse
+ * @return 1 if the frames go through shared memory rings, 0 otherwise
+ */
+int s_ssl_connection_is_shm(struct s_ssl_connection *connection);
+
+/**
+ * @brief Queue a shared payload in the connection without copying it. The
+ * connection holds a reference on the payload until it has been flushed
+ * @param [in] connection: connection concerned by the payload
+ * @param [in] payload: encoded frame to send
+ * @return 0 on success, -ENOBUFS when the backlog rejected the frame, an
+ * another -errno value on error
+ */
+int s_ssl_connection_write_payload(struct s_ssl_connection *connection,
+  struct s_ssl_payload *payload);
+
+/**
+ * @brief Open a stream to the peer, from any thread. The frames of the
+ * streams share the connection with the other frames, which go out first: the
+ * streams only keep #S_SSL_STREAM_DEPTH bytes queued on the connection and
+ * are interleaved by weight. Each stream stops once it used the credit the
+ * peer granted, the peer grants it back as it releases the frames. The peer
+ * receives the frames with their stream id in the view
+ * @param [in] connection: connection to modify
+ * @param [in] id: stream id, not 0
+ * @param [in] type: message type of the stream frames
+ * @param [in] weight: share of the link, from 1 to 255
+ * @return 0 on success, -EEXIST if the stream is already open, an another
+ * -errno value on error
+ */
+int s_ssl_connection_stream_open(struct s_ssl_connection *connection,
+  uint32_t id, uint16_t type, uint8_t weight);
+
+/**
+ * @brief Queue data on a stream, from any thread. The data is copied and cut
+ * in frames of at most #S_SSL_STREAM_QUANTUM bytes
+ * @param [in] connection: connection owning the stream
+ * @param [in] id: stream id
+ * @param [in] data: bytes to send
+ * @param [in] size: number of bytes
+ * @return 0 on success, -ENOBUFS if the stream queue is full, an another
+ * -errno value on error
+ */
+int s_ssl_connection_stream_write(struct s_ssl_connection *connection,
+  uint32_t id, const uint8_t *data, size_t size);
+
+/**
+ * @brief Close a stream, from any thread. The queued data is still sent, the
+ * last frame carries #S_SSL_FRAME_FLAG_FIN
+ * @param [in] connection: connection owning the stream
+ * @param [in] id: stream id
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_stream_close(struct s_ssl_connection *connection,
+  uint32_t id);
+
+/**
+ * @brief Get the counters of a stream
+ * @param [in] connection: connection owning the stream
+ * @param [in] id: stream id
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_connection_get_stream_stats(struct s_ssl_connection *connection,
+  uint32_t id, struct s_ssl_stream_stats *stats);
+
 #endif /* !_SSL_SSL_CONNECTION_H_ */
@@ -0,0 +1,187 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_FRAME_H_
+# define _SSL_SSL_FRAME_H_
+
+# include <stdint.h>
+# include <string.h>
+# include <endian.h>
+# include <arpa/inet.h>
+
+/**
+ * @brief Size of the header prefixing every message on the wire
+ */
+# define S_SSL_FRAME_HEADER_SIZE 8
+
+/**
+ * @brief Biggest payload accepted for a single message. Anything above is
+ * considered as a protocol error and the connection is closed
+ */
+# define S_SSL_FRAME_MAX_SIZE (16 * 1024 * 1024)
+
+/**
+ * @brief Frame flags: a request or a response payload starts with the 64 bits
+ * correlation id of the call, in network byte order
+ */
+# define S_SSL_FRAME_FLAG_REQUEST (1 << 0)
+# define S_SSL_FRAME_FLAG_RESPONSE (1 << 1)
+
+/**
+ * @brief Frame flags: the payload is compressed with the given codec, using
+ * the preset dictionary negotiated by both peers
+ */
+# define S_SSL_FRAME_FLAG_ZLIB (1 << 2)
+# define S_SSL_FRAME_FLAG_LZ4 (1 << 3)
+# define S_SSL_FRAME_FLAG_DICTIONARY (1 << 4)
+# define S_SSL_FRAME_FLAG_COMPRESSED \
+  (S_SSL_FRAME_FLAG_ZLIB | S_SSL_FRAME_FLAG_LZ4)
+
+/**
+ * @brief Frame flag: the frame is handled by the connection itself and its
+ * type is one of the S_SSL_FRAME_TYPE_* values
+ */
+# define S_SSL_FRAME_FLAG_CONTROL (1 << 5)
+
+/**
+ * @brief Frame flags: the payload starts with the 32 bits id of the stream
+ * it belongs to, in network byte order. The last frame of a stream carries
+ * the fin flag
+ */
+# define S_SSL_FRAME_FLAG_STREAM (1 << 6)
+# define S_SSL_FRAME_FLAG_FIN (1 << 7)
+
+/**
+ * @brief Frame flags owned by the protocol layers, a packet never sets them
+ */
+# define S_SSL_FRAME_FLAG_OWNED \
+  (S_SSL_FRAME_FLAG_REQUEST | S_SSL_FRAME_FLAG_RESPONSE | \
+   S_SSL_FRAME_FLAG_COMPRESSED | S_SSL_FRAME_FLAG_DICTIONARY | \
+   S_SSL_FRAME_FLAG_CONTROL | S_SSL_FRAME_FLAG_STREAM | S_SSL_FRAME_FLAG_FIN)
+
+/**
+ * @brief Control frame carrying the capabilities of a peer
+ */
+# define S_SSL_FRAME_TYPE_HELLO 1
+
+/**
+ * @brief Control frame requesting, or answering, a shared memory channel
+ */
+# define S_SSL_FRAME_TYPE_SHM 2
+
+/**
+ * @brief Control frame granting credit back to the sender of a stream
+ */
+# define S_SSL_FRAME_TYPE_WINDOW 3
+
+/**
+ * @brief Size of the correlation id prefixing requests and responses
+ */
+# define S_SSL_FRAME_ID_SIZE 8
+
+/**
+ * @brief Message header, every field is sent in network byte order:
+ * | size (32 bits) | type (16 bits) | flags (16 bits) | payload (size bytes) |
+ */
+struct s_ssl_frame_header {
+  uint32_t size;
+  uint16_t type;
+  uint16_t flags;
+};
+
+/**
+ * @brief State of the incremental frame parser
+ */
+enum e_ssl_frame_state {
+  e_ssl_frame_state_header,
+  e_ssl_frame_state_body
+};
+
+/**
+ * @brief Serialize a frame header in its wire representation
+ * @param [in] header: header to serialize
+ * @param [out] data: S_SSL_FRAME_HEADER_SIZE bytes buffer to fill
+ */
+static inline void s_ssl_frame_header_encode(
+  const struct s_ssl_frame_header *header, uint8_t *data)
+{
+  uint32_t size = htonl(header->size);
+  uint16_t type = htons(header->type);
+  uint16_t flags = htons(header->flags);
+
+  memcpy(data, &size, sizeof(uint32_t));
+  memcpy(data + 4, &type, sizeof(uint16_t));
+  memcpy(data + 6, &flags, sizeof(uint16_t));
+}
+
+/**
+ * @brief Deserialize a frame header from its wire representation
+ * @param [in] data: S_SSL_FRAME_HEADER_SIZE bytes buffer to read
+ * @param [out] header: header to fill
+ */
+static inline void s_ssl_frame_header_decode(const uint8_t *data,
+  struct s_ssl_frame_header *header)
+{
+  uint32_t size;
+  uint16_t type;
+  uint16_t flags;
+
+  memcpy(&size, data, sizeof(uint32_t));
+  memcpy(&type, data + 4, sizeof(uint16_t));
+  memcpy(&flags, data + 6, sizeof(uint16_t));
+  header->size = ntohl(size);
+  header->type = ntohs(type);
+  header->flags = ntohs(flags);
+}
+
+/**
+ * @brief Serialize a correlation id in its wire representation
+ * @param [in] id: correlation id to serialize
+ * @param [out] data: S_SSL_FRAME_ID_SIZE bytes buffer to fill
+ */
+static inline void s_ssl_frame_id_encode(uint64_t id, uint8_t *data)
+{
+  uint64_t value = htobe64(id);
+
+  memcpy(data, &value, sizeof(uint64_t));
+}
+
+/**
+ * @brief Deserialize a correlation id from its wire representation
+ * @param [in] data: S_SSL_FRAME_ID_SIZE bytes buffer to read
+ * @return the correlation id
+ */
+static inline uint64_t s_ssl_frame_id_decode(const uint8_t *data)
+{
+  uint64_t value;
+
+  memcpy(&value, data, sizeof(uint64_t));
+  return be64toh(value);
+}
+
+/**
+ * @brief Keep the flags of a packet which aren't owned by the protocol
+ * layers, a packet copied from a received view keeps none of them
+ * @param [in] flags: flags of the packet
+ * @return the flags the packet may set on its frame
+ */
+static inline uint16_t s_ssl_frame_flags(uint16_t flags)
+{
+  return flags & ~S_SSL_FRAME_FLAG_OWNED;
+}
+
+#endif /* !_SSL_SSL_FRAME_H_ */
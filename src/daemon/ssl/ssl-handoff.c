@@ -0,0 +1,244 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <libdaemon/dlog.h>
+#include <openssl/crypto.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon-cond.h"
+#include "ssl-handoff.h"
+#include "ssl-server.h"
+
+/**
+ * @brief Magic number opening a state, changes with its layout
+ */
+#define S_SSL_HANDOFF_MAGIC 0x63626831
+
+/**
+ * @brief Fixed part of a state on the wire, the sockets follow as ancillary
+ * data: the listeners first, then the local listener if any
+ */
+struct s_ssl_handoff_header {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t local;
+  struct s_ssl_session_key keys[S_SSL_SESSION_KEYS];
+};
+
+/**
+ * @brief Ancillary buffer large enough for every socket of a state
+ */
+union s_ssl_handoff_control {
+  struct cmsghdr header;
+  uint8_t data[CMSG_SPACE(sizeof(int) * (S_SSL_HANDOFF_LISTENERS + 1))];
+};
+
+/**
+ * @brief Fill a unix socket address
+ * @param [in] path: socket path, '@' prefixed for the abstract namespace
+ * @param [out] sun: address to fill
+ * @return the address length on success, 0 if the path is too long
+ */
+static socklen_t _s_ssl_handoff_address(const char *path,
+  struct sockaddr_un *sun)
+{
+  size_t size = strlen(path);
+  if (!size || size >= sizeof(sun->sun_path))
+    return 0;
+
+  memset(sun, 0, sizeof(struct sockaddr_un));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, path, size);
+  int abstract = path[0] == S_SSL_SERVER_ABSTRACT;
+  if (abstract)
+    sun->sun_path[0] = '\0';
+  return offsetof(struct sockaddr_un, sun_path) + size + !abstract;
+}
+
+void s_ssl_handoff_init(struct s_ssl_handoff *handoff)
+{
+  daemon_return_if_fail(handoff);
+
+  memset(handoff, 0, sizeof(struct s_ssl_handoff));
+  for (uint32_t i = 0; i < S_SSL_HANDOFF_LISTENERS; i++)
+    handoff->fds[i] = -1;
+  handoff->local = -1;
+}
+
+void s_ssl_handoff_clear(struct s_ssl_handoff *handoff)
+{
+  daemon_return_if_fail(handoff);
+
+  for (uint32_t i = 0; i < handoff->count; i++)
+    if (handoff->fds[i] >= 0)
+      close(handoff->fds[i]);
+  if (handoff->local >= 0)
+    close(handoff->local);
+  OPENSSL_cleanse(handoff->keys, sizeof(handoff->keys));
+  s_ssl_handoff_init(handoff);
+}
+
+int s_ssl_handoff_listen(const char *path)
+{
+  daemon_return_val_if_fail(path, -EINVAL);
+
+  struct sockaddr_un sun;
+  socklen_t len = _s_ssl_handoff_address(path, &sun);
+  daemon_return_val_if_fail(len, -ENAMETOOLONG);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+  if (bind(fd, (struct sockaddr *)&sun, len) != 0 || listen(fd, 4) != 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+  return fd;
+}
+
+int s_ssl_handoff_connect(const char *path)
+{
+  daemon_return_val_if_fail(path, -EINVAL);
+
+  struct sockaddr_un sun;
+  socklen_t len = _s_ssl_handoff_address(path, &sun);
+  daemon_return_val_if_fail(len, -ENAMETOOLONG);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+  /* a stuck process must not block its replacement forever */
+  struct timeval tv = {
+    .tv_sec = S_SSL_HANDOFF_TIMEOUT / 1000,
+    .tv_usec = (S_SSL_HANDOFF_TIMEOUT % 1000) * 1000
+  };
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+      connect(fd, (struct sockaddr *)&sun, len) != 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+  return fd;
+}
+
+int s_ssl_handoff_send(int sockfd, const struct s_ssl_handoff *handoff)
+{
+  daemon_return_val_if_fail(sockfd >= 0, -EINVAL);
+  daemon_return_val_if_fail(handoff, -EINVAL);
+  daemon_return_val_if_fail(handoff->count <= S_SSL_HANDOFF_LISTENERS,
+    -EINVAL);
+
+  struct s_ssl_handoff_header header = {
+    .magic = S_SSL_HANDOFF_MAGIC,
+    .count = handoff->count,
+    .local = handoff->local >= 0
+  };
+  memcpy(header.keys, handoff->keys, sizeof(header.keys));
+
+  int fds[S_SSL_HANDOFF_LISTENERS + 1];
+  uint32_t count = handoff->count;
+  memcpy(fds, handoff->fds, sizeof(int) * count);
+  if (header.local)
+    fds[count++] = handoff->local;
+
+  union s_ssl_handoff_control control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+  struct msghdr msg = {
+    .msg_control = count ? control.data : NULL,
+    .msg_controllen = count ? CMSG_SPACE(sizeof(int) * count) : 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  if (count) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  }
+
+  ssize_t ret = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  OPENSSL_cleanse(&header, sizeof(header));
+  if (ret < 0)
+    return -errno;
+  return (size_t)ret == sizeof(header) ? 0 : -EPIPE;
+}
+
+int s_ssl_handoff_recv(int sockfd, struct s_ssl_handoff *handoff)
+{
+  daemon_return_val_if_fail(sockfd >= 0, -EINVAL);
+  daemon_return_val_if_fail(handoff, -EINVAL);
+
+  s_ssl_handoff_init(handoff);
+
+  struct s_ssl_handoff_header header;
+  union s_ssl_handoff_control control;
+  struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+  struct msghdr msg = {
+    .msg_control = control.data,
+    .msg_controllen = sizeof(control.data),
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  ssize_t size = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  if (size < 0)
+    return -errno;
+
+  /* the received sockets are ours, even when the state is refused */
+  int fds[S_SSL_HANDOFF_LISTENERS + 1];
+  uint32_t count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    uint32_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (count + n > S_SSL_HANDOFF_LISTENERS + 1)
+      n = S_SSL_HANDOFF_LISTENERS + 1 - count;
+    memcpy(&fds[count], CMSG_DATA(cmsg), sizeof(int) * n);
+    count += n;
+  }
+
+  int ret = 0;
+  if ((size_t)size != sizeof(header) || (msg.msg_flags & MSG_CTRUNC) ||
+      header.magic != S_SSL_HANDOFF_MAGIC ||
+      header.count > S_SSL_HANDOFF_LISTENERS || header.local > 1 ||
+      count != header.count + header.local) {
+    daemon_log(LOG_ERR, "invalid handoff state\n");
+    for (uint32_t i = 0; i < count; i++)
+      close(fds[i]);
+    ret = -EPROTO;
+    goto end;
+  }
+
+  handoff->count = header.count;
+  memcpy(handoff->fds, fds, sizeof(int) * header.count);
+  if (header.local)
+    handoff->local = fds[header.count];
+  memcpy(handoff->keys, header.keys, sizeof(handoff->keys));
+
+end:
+  OPENSSL_cleanse(&header, sizeof(header));
+  return ret;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SSL_SSL_HANDOFF_H_
+# define _SSL_SSL_HANDOFF_H_
+
+# include <stdint.h>
+# include "ssl-session.h"
+
+/**
+ * @brief Maximum number of listening sockets handed over
+ */
+# define S_SSL_HANDOFF_LISTENERS 64
+
+/**
+ * @brief Delay, in milliseconds, a process waits for the state of the process
+ * it replaces
+ */
+# define S_SSL_HANDOFF_TIMEOUT 5000
+
+/**
+ * @brief State a server hands over to the process replacing it: its bound
+ * listening sockets and its ticket keys. The pending connections stay in the
+ * accept queues of the sockets, nothing is refused during the handover
+ */
+struct s_ssl_handoff {
+  uint32_t count;
+  int fds[S_SSL_HANDOFF_LISTENERS];
+  struct s_ssl_session_key keys[S_SSL_SESSION_KEYS];
+  int local;
+};
+
+/**
+ * @brief Initialize an empty state
+ * @param [out] handoff: state to initialize
+ */
+void s_ssl_handoff_init(struct s_ssl_handoff *handoff);
+
+/**
+ * @brief Close the sockets still owned by a state and wipe its keys
+ * @param [in] handoff: state to clear
+ */
+void s_ssl_handoff_clear(struct s_ssl_handoff *handoff);
+
+/**
+ * @brief Listen for the process which will replace this one
+ * @param [in] path: unix socket path, '@' prefixed for the abstract namespace
+ * @return a listening socket on success, an -errno value on error
+ */
+int s_ssl_handoff_listen(const char *path);
+
+/**
+ * @brief Connect to the process to replace
+ * @param [in] path: unix socket path, '@' prefixed for the abstract namespace
+ * @return a connected socket on success, an -errno value on error
+ */
+int s_ssl_handoff_connect(const char *path);
+
+/**
+ * @brief Send a state, the sockets are passed with SCM_RIGHTS. The sender
+ * keeps its own descriptors, the sockets are shared until it closes them
+ * @param [in] sockfd: connected unix socket
+ * @param [in] handoff: state to send
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_handoff_send(int sockfd, const struct s_ssl_handoff *handoff);
+
+/**
+ * @brief Receive a state, waits at most #S_SSL_HANDOFF_TIMEOUT
+ * @param [in] sockfd: connected unix socket
+ * @param [out] handoff: state to fill, cleared with #s_ssl_handoff_clear
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_handoff_recv(int sockfd, struct s_ssl_handoff *handoff);
+
+#endif /* !_SSL_SSL_HANDOFF_H_ */
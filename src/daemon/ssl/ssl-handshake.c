@@ -0,0 +1,460 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libdaemon/dlog.h>
+#include <openssl/err.h>
+#include <sys/eventfd.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-list.h"
+#include "ssl-handshake.h"
+
+/**
+ * @brief Handshake in progress, either waiting for its socket in the loop or
+ * for a thread in the pool
+ */
+struct s_ssl_handshake {
+  s_ssl_handshake_cbk done;
+  struct event *event;
+  int fd;
+  uint64_t deadline;
+  struct s_ssl_handshake *next;
+  struct s_ssl_handshake_queue *queue;
+  int result;
+  SSL *ssl;
+  uint64_t started;
+  void *userdata;
+};
+
+struct s_ssl_handshake_pool {
+  pthread_cond_t cond;
+  uint32_t depth;
+  struct {
+    struct s_ssl_handshake *first;
+    struct s_ssl_handshake *last;
+  } jobs;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  struct s_ssl_handshake_stats stats;
+  uint8_t stop;
+  struct {
+    uint32_t count;
+    pthread_t *list;
+  } threads;
+};
+
+struct s_ssl_handshake_queue {
+  struct s_ssl_handshake *done;
+  struct event *event;
+  int fd;
+  struct s_list *handshakes;
+  struct s_loop *loop;
+  struct s_ssl_handshake_pool *pool;
+  uint32_t running;
+};
+
+/**
+ * @brief Get the monotonic time
+ * @return the time in nanoseconds
+ */
+static uint64_t _s_ssl_handshake_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the latency bucket of a duration
+ * @param [in] duration: duration in nanoseconds
+ * @return the bucket index
+ */
+static uint32_t _s_ssl_handshake_bucket(uint64_t duration)
+{
+  uint64_t us = duration / 1000;
+  uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+  return bucket < S_SSL_HANDSHAKE_BUCKETS ? bucket :
+    S_SSL_HANDSHAKE_BUCKETS - 1;
+}
+
+/**
+ * @brief Queue a handshake step in the pool. The pool must be locked
+ * @param [in] pool: pool to modify
+ * @param [in] handshake: handshake to run
+ */
+static void _s_ssl_handshake_push(struct s_ssl_handshake_pool *pool,
+  struct s_ssl_handshake *handshake)
+{
+  handshake->next = NULL;
+  if (pool->jobs.last)
+    pool->jobs.last->next = handshake;
+  else
+    pool->jobs.first = handshake;
+  pool->jobs.last = handshake;
+  handshake->queue->running++;
+  if (++pool->stats.queued > pool->stats.high_water)
+    pool->stats.high_water = pool->stats.queued;
+  pthread_cond_signal(&pool->cond);
+}
+
+/**
+ * @brief Crypto thread entry point: run a step of each handshake and hand it
+ * back to its loop
+ * @param [in] pool: pool of the thread
+ * @return always NULL
+ */
+static void *_s_ssl_handshake_run(struct s_ssl_handshake_pool *pool)
+{
+  daemon_return_val_if_fail(pool, NULL);
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->stop && !pool->jobs.first)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->stop)
+      break;
+
+    struct s_ssl_handshake *handshake = pool->jobs.first;
+    pool->jobs.first = handshake->next;
+    if (!pool->jobs.first)
+      pool->jobs.last = NULL;
+    pool->stats.queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    uint64_t start = _s_ssl_handshake_now();
+    int ret = SSL_do_handshake(handshake->ssl);
+    int error = ret == 1 ? SSL_ERROR_NONE :
+      SSL_get_error(handshake->ssl, ret);
+    if (error == SSL_ERROR_NONE)
+      handshake->result = 1;
+    else if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+      handshake->result = error;
+    else
+      handshake->result = -ECONNABORTED;
+    /* the error queue belongs to the thread, the next step starts clean */
+    ERR_clear_error();
+    uint64_t busy = _s_ssl_handshake_now() - start;
+
+    struct s_ssl_handshake_queue *queue = handshake->queue;
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.busy += busy;
+    handshake->next = queue->done;
+    queue->done = handshake;
+    if (--queue->running == 0)
+      pthread_cond_broadcast(&pool->idle);
+    uint64_t u = 1;
+    if (write(queue->fd, &u, sizeof(uint64_t)) != sizeof(uint64_t))
+      daemon_log(LOG_ERR, "failed to wake up a handshake queue\n");
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/**
+ * @brief Release a handshake, its session and its socket when they are still
+ * owned
+ * @param [in] handshake: handshake to delete
+ */
+static void _s_ssl_handshake_free(struct s_ssl_handshake *handshake)
+{
+  if (handshake->event)
+    event_free(handshake->event);
+  if (handshake->ssl)
+    SSL_free(handshake->ssl);
+  if (handshake->fd >= 0)
+    close(handshake->fd);
+  daemon_free(handshake);
+}
+
+/**
+ * @brief Complete a handshake, from its loop
+ * @param [in] handshake: handshake to complete
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+static void _s_ssl_handshake_complete(struct s_ssl_handshake *handshake,
+  int status)
+{
+  struct s_ssl_handshake_queue *queue = handshake->queue;
+  struct s_ssl_handshake_pool *pool = queue->pool;
+  uint32_t bucket = _s_ssl_handshake_bucket(_s_ssl_handshake_now() -
+    handshake->started);
+
+  pthread_mutex_lock(&pool->lock);
+  if (status == 0) {
+    pool->stats.completed++;
+    pool->stats.latency[bucket]++;
+  } else {
+    pool->stats.failed++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  queue->handshakes = s_list_remove(queue->handshakes, handshake);
+  SSL *ssl = status == 0 ? handshake->ssl : NULL;
+  int fd = status == 0 ? handshake->fd : -1;
+  if (status == 0) {
+    handshake->ssl = NULL;
+    handshake->fd = -1;
+  }
+  s_ssl_handshake_cbk done = handshake->done;
+  void *userdata = handshake->userdata;
+  _s_ssl_handshake_free(handshake);
+  done(userdata, ssl, fd, status);
+}
+
+/**
+ * @brief Socket callback of a handshake: the peer answered, the next step
+ * goes to the pool
+ */
+static void _s_ssl_handshake_ready(daemon_unused evutil_socket_t fd, short e,
+  struct s_ssl_handshake *handshake)
+{
+  daemon_return_if_fail(handshake);
+
+  if (e & EV_TIMEOUT) {
+    _s_ssl_handshake_complete(handshake, -ETIMEDOUT);
+    return;
+  }
+  /* a handshake already started is never refused */
+  struct s_ssl_handshake_pool *pool = handshake->queue->pool;
+  pthread_mutex_lock(&pool->lock);
+  _s_ssl_handshake_push(pool, handshake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Handle a step run by the pool, from the loop
+ * @param [in] handshake: handshake to continue
+ */
+static void _s_ssl_handshake_step(struct s_ssl_handshake *handshake)
+{
+  if (handshake->result == 1) {
+    _s_ssl_handshake_complete(handshake, 0);
+    return;
+  }
+  uint64_t now = _s_ssl_handshake_now() / 1000000;
+  if (handshake->result < 0 ||
+      (handshake->deadline && now >= handshake->deadline)) {
+    _s_ssl_handshake_complete(handshake, handshake->result < 0 ?
+      handshake->result : -ETIMEDOUT);
+    return;
+  }
+
+  uint64_t remaining = handshake->deadline ? handshake->deadline - now : 0;
+  struct timeval tv = { .tv_sec = remaining / 1000,
+    .tv_usec = (remaining % 1000) * 1000 };
+  short what = handshake->result == SSL_ERROR_WANT_WRITE ? EV_WRITE : EV_READ;
+  event_assign(handshake->event, s_loop_tolibevent(handshake->queue->loop),
+    handshake->fd, what, (event_callback_fn)_s_ssl_handshake_ready,
+    handshake);
+  if (event_add(handshake->event, handshake->deadline ? &tv : NULL) != 0)
+    _s_ssl_handshake_complete(handshake, -ENOMEM);
+}
+
+/**
+ * @brief Eventfd callback of a queue: the pool handed steps back
+ */
+static void _s_ssl_handshake_wakeup(evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_handshake_queue *queue)
+{
+  daemon_return_if_fail(queue);
+
+  uint64_t u;
+  if (read(fd, &u, sizeof(uint64_t)) != sizeof(uint64_t))
+    return;
+
+  pthread_mutex_lock(&queue->pool->lock);
+  struct s_ssl_handshake *handshake = queue->done;
+  queue->done = NULL;
+  pthread_mutex_unlock(&queue->pool->lock);
+
+  while (handshake) {
+    struct s_ssl_handshake *next = handshake->next;
+    _s_ssl_handshake_step(handshake);
+    handshake = next;
+  }
+}
+
+struct s_ssl_handshake_pool *s_ssl_handshake_pool_new(uint32_t threads,
+  uint32_t depth)
+{
+  daemon_return_val_if_fail(threads, NULL);
+  daemon_return_val_if_fail(depth, NULL);
+
+  struct s_ssl_handshake_pool *pool = daemon_malloc(
+    sizeof(struct s_ssl_handshake_pool));
+  pthread_cond_init(&pool->cond, NULL);
+  pool->depth = depth;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->threads.list = daemon_calloc(threads, sizeof(pthread_t));
+
+  for (; pool->threads.count < threads; pool->threads.count++) {
+    int ret = pthread_create(&pool->threads.list[pool->threads.count], NULL,
+      (void *(*)(void *))_s_ssl_handshake_run, pool);
+    if (ret != 0) {
+      daemon_log(LOG_ERR, "failed to start a crypto thread '%s'\n",
+        strerror(ret));
+      s_ssl_handshake_pool_free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void s_ssl_handshake_pool_free(struct s_ssl_handshake_pool *pool)
+{
+  daemon_return_if_fail(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 0; i < pool->threads.count; i++)
+    pthread_join(pool->threads.list[i], NULL);
+
+  daemon_free(pool->threads.list);
+  pthread_cond_destroy(&pool->idle);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  daemon_free(pool);
+}
+
+int s_ssl_handshake_pool_get_stats(struct s_ssl_handshake_pool *pool,
+  struct s_ssl_handshake_stats *stats)
+{
+  daemon_return_val_if_fail(pool, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+struct s_ssl_handshake_queue *s_ssl_handshake_queue_new(
+  struct s_ssl_handshake_pool *pool, struct s_loop *loop)
+{
+  daemon_return_val_if_fail(pool, NULL);
+  daemon_return_val_if_fail(loop, NULL);
+
+  struct s_ssl_handshake_queue *queue = daemon_malloc(
+    sizeof(struct s_ssl_handshake_queue));
+  queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  queue->loop = loop;
+  queue->pool = pool;
+  if (queue->fd < 0)
+    goto error;
+
+  queue->event = event_new(s_loop_tolibevent(loop), queue->fd,
+    EV_READ | EV_PERSIST, (event_callback_fn)_s_ssl_handshake_wakeup, queue);
+  if (!queue->event || event_add(queue->event, NULL) != 0)
+    goto error;
+
+  return queue;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a handshake queue\n");
+  s_ssl_handshake_queue_free(queue);
+  return NULL;
+}
+
+void s_ssl_handshake_queue_free(struct s_ssl_handshake_queue *queue)
+{
+  daemon_return_if_fail(queue);
+
+  /* the steps still waiting are withdrawn, the running ones are awaited */
+  struct s_ssl_handshake_pool *pool = queue->pool;
+  pthread_mutex_lock(&pool->lock);
+  struct s_ssl_handshake **it = &pool->jobs.first;
+  pool->jobs.last = NULL;
+  while (*it) {
+    if ((*it)->queue == queue) {
+      *it = (*it)->next;
+      pool->stats.queued--;
+      queue->running--;
+      continue;
+    }
+    pool->jobs.last = *it;
+    it = &(*it)->next;
+  }
+  while (queue->running)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  s_list_free_full(queue->handshakes, (s_destroy_cbk)_s_ssl_handshake_free);
+  if (queue->event)
+    event_free(queue->event);
+  if (queue->fd >= 0)
+    close(queue->fd);
+  daemon_free(queue);
+}
+
+int s_ssl_handshake_start(struct s_ssl_handshake_queue *queue, SSL *ssl,
+  int fd, s_ssl_handshake_cbk done, void *userdata)
+{
+  daemon_return_val_if_fail(queue, -EINVAL);
+  daemon_return_val_if_fail(ssl, -EINVAL);
+  daemon_return_val_if_fail(fd >= 0, -EINVAL);
+  daemon_return_val_if_fail(done, -EINVAL);
+
+  struct s_loop_timeouts timeouts;
+  s_loop_get_timeouts(&timeouts);
+
+  struct s_ssl_handshake_pool *pool = queue->pool;
+  struct s_ssl_handshake *handshake = daemon_malloc(
+    sizeof(struct s_ssl_handshake));
+  handshake->done = done;
+  handshake->event = event_new(s_loop_tolibevent(queue->loop), fd, EV_READ,
+    (event_callback_fn)_s_ssl_handshake_ready, handshake);
+  handshake->fd = fd;
+  handshake->queue = queue;
+  handshake->started = _s_ssl_handshake_now();
+  /* a disabled handshake class leaves it unbounded, as on the loop */
+  if (timeouts.handshake)
+    handshake->deadline = handshake->started / 1000000 + timeouts.handshake;
+  handshake->userdata = userdata;
+  if (!handshake->event) {
+    daemon_free(handshake);
+    return -ENOMEM;
+  }
+
+  /* under a reconnection storm the new handshakes are refused before the
+   * queue delays the ones in progress */
+  int ret = 0;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->stats.queued >= pool->depth) {
+    pool->stats.rejected++;
+    ret = -EBUSY;
+  } else {
+    handshake->ssl = ssl;
+    _s_ssl_handshake_push(pool, handshake);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (ret != 0) {
+    event_free(handshake->event);
+    daemon_free(handshake);
+    return ret;
+  }
+  queue->handshakes = s_list_prepend(queue->handshakes, handshake);
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_HANDSHAKE_H_
+# define _SSL_SSL_HANDSHAKE_H_
+
+# include <stdint.h>
+# include <openssl/ssl.h>
+# include "daemon-loop.h"
+
+/**
+ * @brief Default number of crypto threads running the handshakes
+ */
+# define S_SSL_HANDSHAKE_THREADS 2
+
+/**
+ * @brief Default number of handshakes waiting for a crypto thread before the
+ * new ones are refused
+ */
+# define S_SSL_HANDSHAKE_DEPTH 1024
+
+/**
+ * @brief Default time, in milliseconds, a handshake may take. The handshake
+ * timeout class of the loops bounds them, a disabled class leaves them
+ * unbounded
+ */
+# define S_SSL_HANDSHAKE_TIMEOUT 10000
+
+/**
+ * @brief Number of latency buckets, bucket n counts the handshakes which
+ * completed in less than 2^n microseconds
+ */
+# define S_SSL_HANDSHAKE_BUCKETS 24
+
+struct s_ssl_handshake_pool;
+struct s_ssl_handshake_queue;
+
+/**
+ * @brief Handshake counters
+ */
+struct s_ssl_handshake_stats {
+  uint64_t busy;
+  uint64_t completed;
+  uint64_t failed;
+  uint32_t high_water;
+  uint64_t latency[S_SSL_HANDSHAKE_BUCKETS];
+  uint32_t queued;
+  uint64_t rejected;
+};
+
+/**
+ * @brief Completion callback of a handshake, called from the loop of its
+ * queue
+ * @param [in] userdata: userdata given with the handshake
+ * @param [in] ssl: established session, NULL on error
+ * @param [in] fd: socket of the session, -1 on error
+ * @param [in] status: 0 on success, -ETIMEDOUT when the peer was too slow,
+ * -ECONNABORTED when the handshake failed
+ */
+/* codecheck_ignore[SPACING] */
+typedef void (*s_ssl_handshake_cbk)(void *userdata, SSL *ssl, int fd,
+  int status);
+
+/**
+ * @brief Allocate a pool of crypto threads. The threads run the handshake
+ * steps, private key operations included, while the loops only wait for the
+ * sockets to be ready
+ * @param [in] threads: number of threads
+ * @param [in] depth: number of new handshakes allowed to wait for a thread
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_handshake_pool *s_ssl_handshake_pool_new(uint32_t threads,
+  uint32_t depth);
+
+/**
+ * @brief Deallocate a specific pool, its queues must be freed first
+ * @param [in] pool: pool to delete
+ */
+void s_ssl_handshake_pool_free(struct s_ssl_handshake_pool *pool);
+
+/**
+ * @brief Get the counters of a pool, busy is the time spent by the threads in
+ * nanoseconds
+ * @param [in] pool: pool to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_handshake_pool_get_stats(struct s_ssl_handshake_pool *pool,
+  struct s_ssl_handshake_stats *stats);
+
+/**
+ * @brief Allocate the queue bringing the handshake steps of a loop back to
+ * it. A thread signals its completions through an eventfd
+ * @param [in] pool: pool running the steps
+ * @param [in] loop: loop waiting for the sockets
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_handshake_queue *s_ssl_handshake_queue_new(
+  struct s_ssl_handshake_pool *pool, struct s_loop *loop);
+
+/**
+ * @brief Deallocate a specific queue, once its loop stopped. The steps still
+ * running are waited for, the pending handshakes are dropped without calling
+ * their callback
+ * @param [in] queue: queue to delete
+ */
+void s_ssl_handshake_queue_free(struct s_ssl_handshake_queue *queue);
+
+/**
+ * @brief Start a server handshake, from the loop of the queue
+ * @param [in] queue: queue of the loop
+ * @param [in] ssl: session to establish, owned by the handshake
+ * @param [in] fd: non blocking socket of the session, owned by the handshake
+ * @param [in] done: completion callback
+ * @param [in] userdata: userdata given to the completion callback
+ * @return 0 on success, -EBUSY when too many handshakes are waiting, an
+ * another -errno value on error. The session and the socket stay to the
+ * caller on error
+ */
+/* codecheck_ignore[SPACING] */
+int s_ssl_handshake_start(struct s_ssl_handshake_queue *queue, SSL *ssl,
+  int fd, s_ssl_handshake_cbk done, void *userdata);
+
+#endif /* !_SSL_SSL_HANDSHAKE_H_ */
@@ -19,42 +19,165 @@
 # define _SSL_SSL_PACKET_H_
 
 # include <stdint.h>
+# include <event2/buffer.h>
 # include "daemon-alloc.h"
 # include "daemon-cond.h"
+# include "ssl-pool.h"
 
 struct s_ssl_packet {
+  uint16_t flags;
   uint8_t *payload;
+  struct s_ssl_pool *pool;
   uint32_t size;
+  uint16_t type;
 };
 
 /**
  * @brief Allocate a ssl packet instance
+ * @param [in] type: message type carried in the frame header
  * @param [in] payload: data payload to store
  * @param [in] size: data's size to store
  * @return a valid pointer on success, NULL on error
  */
-static inline struct s_ssl_packet *s_ssl_packet_new(const uint8_t *payload,
-  uint32_t size)
+static inline struct s_ssl_packet *s_ssl_packet_new(uint16_t type,
+  const uint8_t *payload, uint32_t size)
 {
-  daemon_return_val_if_fail(payload, NULL);
+  daemon_return_val_if_fail(payload || size == 0, NULL);
 
-  struct s_ssl_packet *packet = daemon_malloc(sizeof(struct s_ssl_packet));
-  packet->payload = daemon_malloc(sizeof(uint8_t) * size);
-  memcpy(packet->payload, payload, size);
+  /* the payload follows the packet in the same allocation */
+  struct s_ssl_packet *packet = daemon_malloc(sizeof(struct s_ssl_packet) +
+    sizeof(uint8_t) * size);
+  packet->payload = (uint8_t *)(packet + 1);
+  if (size)
+    memcpy(packet->payload, payload, size);
   packet->size = size;
+  packet->type = type;
   return packet;
 }
 
 /**
- * @brief Deallocate a specific packet instance
+ * @brief Deallocate a specific packet instance, a pooled packet goes back to
+ * its pool
  * @param [in] packet: packet to delete
  */
 static inline void s_ssl_packet_free(struct s_ssl_packet *packet)
 {
   daemon_return_if_fail(packet);
 
-  daemon_free(packet->payload);
-  daemon_free(packet);
+  if (packet->pool)
+    s_ssl_pool_put(packet);
+  else
+    daemon_free(packet);
+}
+
+struct s_ssl_packet_view;
+
+/**
+ * @brief Called when the owner of a view hands it back to the connection
+ * @param [in] view: view released
+ */
+typedef void (*s_ssl_packet_view_release_cbk)(struct s_ssl_packet_view *view);
+
+/**
+ * @brief Read-only view over a message body which still lives in the chains
+ * of a libevent buffer. Nothing is copied until a contiguous buffer is
+ * explicitly requested, and the bytes are only drained from the buffer when
+ * the view is released. The correlation id of a request or a response, and
+ * the stream id of a stream frame, are stripped from the body.
+ */
+struct s_ssl_packet_view {
+  struct evbuffer *buffer;
+  uint16_t flags;
+  uint8_t held;
+  uint64_t id;
+  struct s_ssl_pool *pool;
+  s_ssl_packet_view_release_cbk release;
+  uint32_t size;
+  uint32_t stream;
+  uint16_t type;
+};
+
+/**
+ * @brief Get the chains holding the view payload, without any copy
+ * @param [in] view: view to browse
+ * @param [out] vec: array of iovec to fill, may be NULL to only count
+ * @param [in] nvec: number of elements available in vec
+ * @return the number of iovec needed to describe the whole payload, an
+ * -errno value on error
+ */
+static inline int s_ssl_packet_view_peek(const struct s_ssl_packet_view *view,
+  struct evbuffer_iovec *vec, int nvec)
+{
+  daemon_return_val_if_fail(view, -EINVAL);
+  daemon_return_val_if_fail(view->held, -EBADF);
+
+  if (view->size == 0)
+    return 0;
+  return evbuffer_peek(view->buffer, view->size, NULL, vec, nvec);
+}
+
+/**
+ * @brief Make the view payload contiguous. The payload is only moved when it
+ * is spread over several chains
+ * @param [in] view: view to linearize
+ * @return a pointer valid until the view is released, NULL on error
+ */
+static inline const uint8_t *s_ssl_packet_view_pullup(
+  struct s_ssl_packet_view *view)
+{
+  daemon_return_val_if_fail(view, NULL);
+  daemon_return_val_if_fail(view->held, NULL);
+
+  return evbuffer_pullup(view->buffer, view->size);
+}
+
+/**
+ * @brief Copy the view payload in a standalone packet, taken from the pool
+ * of the connection when it has one
+ * @param [in] view: view to copy
+ * @return a valid pointer on success, NULL on error
+ */
+static inline struct s_ssl_packet *s_ssl_packet_view_copy(
+  const struct s_ssl_packet_view *view)
+{
+  daemon_return_val_if_fail(view, NULL);
+  daemon_return_val_if_fail(view->held, NULL);
+
+  struct s_ssl_packet *packet = NULL;
+  if (view->pool) {
+    packet = s_ssl_pool_get(view->pool, view->size);
+    daemon_return_val_if_fail(packet, NULL);
+  } else {
+    packet = daemon_malloc(sizeof(struct s_ssl_packet) +
+      sizeof(uint8_t) * view->size);
+    packet->payload = (uint8_t *)(packet + 1);
+  }
+  packet->flags = view->flags;
+  packet->size = view->size;
+  packet->type = view->type;
+
+  if (evbuffer_copyout(view->buffer, packet->payload, view->size) !=
+      (ev_ssize_t)view->size) {
+    s_ssl_packet_free(packet);
+    return NULL;
+  }
+  return packet;
+}
+
+/**
+ * @brief Hand the view back to its connection. The payload is drained from
+ * the underlying buffer and the view must not be used anymore
+ * @param [in] view: view to release
+ */
+static inline void s_ssl_packet_view_release(struct s_ssl_packet_view *view)
+{
+  daemon_return_if_fail(view);
+  daemon_return_if_fail(view->held);
+
+  evbuffer_drain(view->buffer, view->size);
+  view->held = 0;
+  if (view->release)
+    view->release(view);
 }
 
 #endif /* !_SSL_SSL_PACKET_H_ */
@@ -0,0 +1,94 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_PAYLOAD_H_
+# define _SSL_SSL_PAYLOAD_H_
+
+# include <stdint.h>
+# include "daemon-alloc.h"
+# include "daemon-cond.h"
+# include "ssl-frame.h"
+# include "ssl-packet.h"
+
+/**
+ * @brief Frame encoded once and shared between several output buffers. The
+ * memory is released when the last reference is dropped.
+ */
+struct s_ssl_payload {
+  uint8_t *data;
+  uint32_t refcount;
+  uint32_t size;
+};
+
+/**
+ * @brief Encode a packet, header included, in a shared payload. As for a
+ * single write, the flags owned by the protocol are ignored
+ * @param [in] packet: packet to encode
+ * @return a valid pointer holding one reference on success, NULL on error
+ */
+static inline struct s_ssl_payload *s_ssl_payload_new(
+  const struct s_ssl_packet *packet)
+{
+  daemon_return_val_if_fail(packet, NULL);
+  daemon_return_val_if_fail(packet->size <= S_SSL_FRAME_MAX_SIZE, NULL);
+
+  struct s_ssl_frame_header header = {
+    .size = packet->size,
+    .type = packet->type,
+    .flags = s_ssl_frame_flags(packet->flags)
+  };
+
+  struct s_ssl_payload *payload = daemon_malloc(sizeof(struct s_ssl_payload));
+  payload->size = S_SSL_FRAME_HEADER_SIZE + packet->size;
+  payload->data = daemon_malloc(sizeof(uint8_t) * payload->size);
+  payload->refcount = 1;
+  s_ssl_frame_header_encode(&header, payload->data);
+  if (packet->size)
+    memcpy(payload->data + S_SSL_FRAME_HEADER_SIZE, packet->payload,
+      packet->size);
+  return payload;
+}
+
+/**
+ * @brief Take a reference on a shared payload
+ * @param [in] payload: payload to reference
+ * @return the payload
+ */
+static inline struct s_ssl_payload *s_ssl_payload_ref(
+  struct s_ssl_payload *payload)
+{
+  daemon_return_val_if_fail(payload, NULL);
+
+  __atomic_add_fetch(&payload->refcount, 1, __ATOMIC_RELAXED);
+  return payload;
+}
+
+/**
+ * @brief Drop a reference on a shared payload, the last one frees it
+ * @param [in] payload: payload to release
+ */
+static inline void s_ssl_payload_unref(struct s_ssl_payload *payload)
+{
+  daemon_return_if_fail(payload);
+
+  if (__atomic_sub_fetch(&payload->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  daemon_free(payload->data);
+  daemon_free(payload);
+}
+
+#endif /* !_SSL_SSL_PAYLOAD_H_ */
@@ -0,0 +1,212 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-packet.h"
+#include "ssl-pool.h"
+
+/**
+ * @brief Payload capacity of each size class. Larger packets are allocated
+ * on demand and never cached
+ */
+static const uint32_t _g_pool_classes[] = {
+  64, 256, 1024, 4096, 16384, 65536
+};
+
+#define S_SSL_POOL_CLASSES \
+  (sizeof(_g_pool_classes) / sizeof(_g_pool_classes[0]))
+
+/**
+ * @brief Single allocation holding a packet and its payload
+ */
+struct s_ssl_pool_block {
+  uint32_t index;
+  struct s_ssl_pool_block *next;
+  struct s_ssl_packet packet;
+  uint8_t data[];
+};
+
+struct s_ssl_pool {
+  uint8_t closed;
+  struct {
+    uint32_t count;
+    struct s_ssl_pool_block *head;
+  } classes[S_SSL_POOL_CLASSES];
+  uint32_t limit;
+  pthread_mutex_t lock;
+  struct s_ssl_pool_stats stats;
+};
+
+/**
+ * @brief Get the size class fitting a payload
+ * @param [in] size: payload size
+ * @return the class index, S_SSL_POOL_CLASSES when no class fits
+ */
+static uint32_t _s_ssl_pool_index(uint32_t size)
+{
+  uint32_t i = 0;
+  while (i < S_SSL_POOL_CLASSES && _g_pool_classes[i] < size)
+    i++;
+  return i;
+}
+
+/**
+ * @brief Release the free packets of every size class, the pool must be
+ * locked
+ * @param [in] pool: pool to drain
+ */
+static void _s_ssl_pool_drain(struct s_ssl_pool *pool)
+{
+  for (uint32_t i = 0; i < S_SSL_POOL_CLASSES; i++) {
+    while (pool->classes[i].head) {
+      struct s_ssl_pool_block *block = pool->classes[i].head;
+      pool->classes[i].head = block->next;
+      free(block);
+    }
+    pool->classes[i].count = 0;
+  }
+  pool->stats.cached = 0;
+}
+
+/**
+ * @brief Release the pool memory, once closed and unused
+ * @param [in] pool: pool to destroy
+ */
+static void _s_ssl_pool_destroy(struct s_ssl_pool *pool)
+{
+  pthread_mutex_destroy(&pool->lock);
+  daemon_free(pool);
+}
+
+struct s_ssl_pool *s_ssl_pool_new(uint32_t limit)
+{
+  struct s_ssl_pool *pool = daemon_malloc(sizeof(struct s_ssl_pool));
+  pool->limit = limit;
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+void s_ssl_pool_free(struct s_ssl_pool *pool)
+{
+  daemon_return_if_fail(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->closed = 1;
+  _s_ssl_pool_drain(pool);
+  /* the last packet released destroys the pool */
+  uint64_t outstanding = pool->stats.outstanding;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!outstanding)
+    _s_ssl_pool_destroy(pool);
+}
+
+struct s_ssl_packet *s_ssl_pool_get(struct s_ssl_pool *pool, uint32_t size)
+{
+  daemon_return_val_if_fail(pool, NULL);
+
+  uint32_t index = _s_ssl_pool_index(size);
+  struct s_ssl_pool_block *block = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (index < S_SSL_POOL_CLASSES && pool->classes[index].head) {
+    block = pool->classes[index].head;
+    pool->classes[index].head = block->next;
+    pool->classes[index].count--;
+    pool->stats.cached--;
+    pool->stats.hits++;
+  } else {
+    pool->stats.misses++;
+  }
+  if (++pool->stats.outstanding > pool->stats.high_water)
+    pool->stats.high_water = pool->stats.outstanding;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!block) {
+    /* the payload is overwritten by the caller, don't clear it */
+    size_t capacity = index < S_SSL_POOL_CLASSES ? _g_pool_classes[index] :
+      size;
+    block = malloc(sizeof(struct s_ssl_pool_block) + capacity);
+    if (!block) {
+      pthread_mutex_lock(&pool->lock);
+      pool->stats.outstanding--;
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    block->index = index;
+  }
+
+  block->next = NULL;
+  block->packet.flags = 0;
+  block->packet.payload = block->data;
+  block->packet.pool = pool;
+  block->packet.size = size;
+  block->packet.type = 0;
+  return &block->packet;
+}
+
+void s_ssl_pool_put(struct s_ssl_packet *packet)
+{
+  daemon_return_if_fail(packet);
+  daemon_return_if_fail(packet->pool);
+
+  struct s_ssl_pool *pool = packet->pool;
+  struct s_ssl_pool_block *block = (struct s_ssl_pool_block *)
+    ((uint8_t *)packet - offsetof(struct s_ssl_pool_block, packet));
+  uint32_t index = block->index;
+
+#ifdef DEBUG
+  /* any use after release reads garbage instead of stale data */
+  memset(block->data, S_SSL_POOL_POISON, index < S_SSL_POOL_CLASSES ?
+    _g_pool_classes[index] : packet->size);
+  memset(packet, S_SSL_POOL_POISON, sizeof(struct s_ssl_packet));
+#endif /* !DEBUG */
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.outstanding--;
+  if (!pool->closed && index < S_SSL_POOL_CLASSES &&
+      pool->classes[index].count < pool->limit) {
+    block->next = pool->classes[index].head;
+    pool->classes[index].head = block;
+    pool->classes[index].count++;
+    pool->stats.cached++;
+    block = NULL;
+  }
+  uint8_t last = pool->closed && !pool->stats.outstanding;
+  pthread_mutex_unlock(&pool->lock);
+
+  free(block);
+  if (last)
+    _s_ssl_pool_destroy(pool);
+}
+
+int s_ssl_pool_get_stats(struct s_ssl_pool *pool,
+  struct s_ssl_pool_stats *stats)
+{
+  daemon_return_val_if_fail(pool, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_POOL_H_
+# define _SSL_SSL_POOL_H_
+
+# include <stdint.h>
+
+/**
+ * @brief Default number of free packets kept per size class
+ */
+# define S_SSL_POOL_LIMIT 256
+
+/**
+ * @brief Byte written over the released packets in debug mode
+ */
+# define S_SSL_POOL_POISON 0x5a
+
+struct s_ssl_packet;
+struct s_ssl_pool;
+
+/**
+ * @brief Packet pool counters
+ */
+struct s_ssl_pool_stats {
+  uint64_t cached;
+  uint64_t high_water;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t outstanding;
+};
+
+/**
+ * @brief Allocate a new packet pool. A pool recycles the packets of a loop:
+ * each packet is one allocation holding the packet and its payload, kept in
+ * the free list of its size class once released
+ * @param [in] limit: number of free packets kept per size class
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_pool *s_ssl_pool_new(uint32_t limit);
+
+/**
+ * @brief Deallocate a specific packet pool. The packets still in use stay
+ * valid, the pool memory is released with the last of them
+ * @param [in] pool: pool to delete
+ */
+void s_ssl_pool_free(struct s_ssl_pool *pool);
+
+/**
+ * @brief Get a packet able to hold a payload of the given size. The payload
+ * content is undefined
+ * @param [in] pool: pool to use
+ * @param [in] size: payload size
+ * @return a valid pointer to release with #s_ssl_packet_free on success, NULL
+ * on error
+ */
+struct s_ssl_packet *s_ssl_pool_get(struct s_ssl_pool *pool, uint32_t size);
+
+/**
+ * @brief Give a packet back to its pool, from any thread. Use
+ * #s_ssl_packet_free instead
+ * @param [in] packet: packet allocated by #s_ssl_pool_get
+ */
+void s_ssl_pool_put(struct s_ssl_packet *packet);
+
+/**
+ * @brief Get the counters of a packet pool
+ * @param [in] pool: pool to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_pool_get_stats(struct s_ssl_pool *pool,
+  struct s_ssl_pool_stats *stats);
+
+#endif /* !_SSL_SSL_POOL_H_ */
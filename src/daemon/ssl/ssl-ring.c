@@ -0,0 +1,139 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-ring.h"
+
+/**
+ * @brief Shared header of a ring
+ */
+struct s_ssl_ring_shared {
+  uint64_t head;
+  uint8_t padding0[56];
+  uint64_t tail;
+  uint8_t padding1[56];
+  uint32_t waiting;
+  uint32_t size;
+};
+
+struct s_ssl_ring {
+  uint8_t *data;
+  uint32_t mask;
+  uint64_t position;
+  struct s_ssl_ring_shared *shared;
+};
+
+struct s_ssl_ring *s_ssl_ring_new(void *memory, uint32_t size)
+{
+  daemon_return_val_if_fail(memory, NULL);
+  daemon_return_val_if_fail(size && !(size & (size - 1)), NULL);
+
+  struct s_ssl_ring *ring = daemon_malloc(sizeof(struct s_ssl_ring));
+  ring->data = (uint8_t *)memory + S_SSL_RING_HEADER_SIZE;
+  ring->mask = size - 1;
+  ring->shared = memory;
+  /* the peer learns the size from the header */
+  ring->shared->size = size;
+  return ring;
+}
+
+void s_ssl_ring_free(struct s_ssl_ring *ring)
+{
+  daemon_return_if_fail(ring);
+
+  daemon_free(ring);
+}
+
+int s_ssl_ring_write(struct s_ssl_ring *ring, struct evbuffer *buffer)
+{
+  daemon_return_val_if_fail(ring, -EINVAL);
+  daemon_return_val_if_fail(buffer, -EINVAL);
+
+  uint64_t head = ring->position;
+  uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+  uint64_t size = (uint64_t)ring->mask + 1;
+  if (head - tail > size)
+    return -EPROTO;
+
+  size_t length = evbuffer_get_length(buffer);
+  size_t count = size - (head - tail) < length ? size - (head - tail) :
+    length;
+  size_t offset = head & ring->mask;
+  /* the copy wraps at most once */
+  size_t first = size - offset < count ? size - offset : count;
+  evbuffer_remove(buffer, ring->data + offset, first);
+  evbuffer_remove(buffer, ring->data, count - first);
+
+  ring->position = head + count;
+  __atomic_store_n(&ring->shared->head, ring->position, __ATOMIC_RELEASE);
+  return count;
+}
+
+int s_ssl_ring_read(struct s_ssl_ring *ring, struct evbuffer *buffer)
+{
+  daemon_return_val_if_fail(ring, -EINVAL);
+  daemon_return_val_if_fail(buffer, -EINVAL);
+
+  uint64_t tail = ring->position;
+  uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+  uint64_t size = (uint64_t)ring->mask + 1;
+  if (head - tail > size)
+    return -EPROTO;
+
+  size_t count = head - tail;
+  size_t offset = tail & ring->mask;
+  size_t first = size - offset < count ? size - offset : count;
+  if (evbuffer_add(buffer, ring->data + offset, first) != 0 ||
+      evbuffer_add(buffer, ring->data, count - first) != 0)
+    return -ENOMEM;
+
+  ring->position = tail + count;
+  __atomic_store_n(&ring->shared->tail, ring->position, __ATOMIC_RELEASE);
+  return count;
+}
+
+int s_ssl_ring_wait(struct s_ssl_ring *ring, uint32_t flag)
+{
+  daemon_return_val_if_fail(ring, -EINVAL);
+
+  __atomic_fetch_or(&ring->shared->waiting, flag, __ATOMIC_SEQ_CST);
+  /* pairs with the fence of the other side between its update and its
+   * check of the flags */
+  uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_SEQ_CST);
+  uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_SEQ_CST);
+  int ready = flag == S_SSL_RING_READER ? head != tail :
+    head - tail <= ring->mask;
+  if (!ready)
+    return 0;
+  __atomic_fetch_and(&ring->shared->waiting, ~flag, __ATOMIC_SEQ_CST);
+  return -EAGAIN;
+}
+
+int s_ssl_ring_notify(struct s_ssl_ring *ring, uint32_t flag)
+{
+  daemon_return_val_if_fail(ring, 0);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!(__atomic_load_n(&ring->shared->waiting, __ATOMIC_RELAXED) & flag))
+    return 0;
+  return (__atomic_fetch_and(&ring->shared->waiting, ~flag,
+    __ATOMIC_SEQ_CST) & flag) != 0;
+}
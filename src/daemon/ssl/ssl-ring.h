@@ -0,0 +1,114 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_RING_H_
+# define _SSL_SSL_RING_H_
+
+# include <stdint.h>
+# include <event2/buffer.h>
+
+/**
+ * @brief Size of the shared header preceding the data of a ring. The producer
+ * position, the consumer position and the wakeup flags live on their own
+ * cache lines:
+ *   0: uint64_t head, written by the producer
+ *  64: uint64_t tail, written by the consumer
+ * 128: uint32_t waiting flags, uint32_t data size
+ */
+# define S_SSL_RING_HEADER_SIZE 256
+
+/**
+ * @brief Waiting flag: the consumer sleeps and needs a doorbell once data is
+ * written
+ */
+# define S_SSL_RING_READER (1 << 0)
+
+/**
+ * @brief Waiting flag: the producer is blocked and needs a doorbell once space
+ * is released
+ */
+# define S_SSL_RING_WRITER (1 << 1)
+
+/**
+ * @brief Single producer, single consumer byte ring living in memory shared
+ * by two processes. Each side only trusts its own position, the position
+ * written by the peer is checked before use
+ */
+struct s_ssl_ring;
+
+/**
+ * @brief Compute the memory needed by a ring
+ * @param [in] size: data size, a power of two
+ * @return the size of the shared memory, header included
+ */
+static inline size_t s_ssl_ring_memory_size(uint32_t size)
+{
+  return S_SSL_RING_HEADER_SIZE + size;
+}
+
+/**
+ * @brief Allocate a ring over a zeroed shared memory area
+ * @param [in] memory: shared memory, of #s_ssl_ring_memory_size bytes
+ * @param [in] size: data size, a power of two
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_ring *s_ssl_ring_new(void *memory, uint32_t size);
+
+/**
+ * @brief Deallocate a specific ring, the shared memory is left untouched
+ * @param [in] ring: ring to delete
+ */
+void s_ssl_ring_free(struct s_ssl_ring *ring);
+
+/**
+ * @brief Move as many bytes as possible from a buffer to the ring, as its
+ * producer
+ * @param [in] ring: ring to fill
+ * @param [in] buffer: buffer to drain
+ * @return the number of bytes moved on success, -EPROTO if the consumer
+ * position is corrupted
+ */
+int s_ssl_ring_write(struct s_ssl_ring *ring, struct evbuffer *buffer);
+
+/**
+ * @brief Move every byte available in the ring to a buffer, as its consumer
+ * @param [in] ring: ring to drain
+ * @param [in] buffer: buffer to fill
+ * @return the number of bytes moved on success, -EPROTO if the producer
+ * position is corrupted
+ */
+int s_ssl_ring_read(struct s_ssl_ring *ring, struct evbuffer *buffer);
+
+/**
+ * @brief Announce that a side goes to sleep. The ring is checked again once
+ * the flag is visible, so a doorbell can't be missed
+ * @param [in] ring: ring concerned
+ * @param [in] flag: #S_SSL_RING_READER or #S_SSL_RING_WRITER
+ * @return 0 if the side can sleep, -EAGAIN if progress is possible already
+ */
+int s_ssl_ring_wait(struct s_ssl_ring *ring, uint32_t flag);
+
+/**
+ * @brief Check whether the other side waits for a doorbell, the flag is
+ * cleared
+ * @param [in] ring: ring concerned
+ * @param [in] flag: #S_SSL_RING_READER or #S_SSL_RING_WRITER
+ * @return 1 if the other side must be woken up, 0 otherwise
+ */
+int s_ssl_ring_notify(struct s_ssl_ring *ring, uint32_t flag);
+
+#endif /* !_SSL_SSL_RING_H_ */
@@ -0,0 +1,134 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-router.h"
+
+struct s_ssl_route {
+  s_ssl_route_cbk handler;
+  struct s_ssl_route_stats stats;
+  void *userdata;
+};
+
+struct s_ssl_router {
+  /* the last route is the default one */
+  struct s_ssl_route routes[S_SSL_ROUTER_OPCODES + 1];
+};
+
+/**
+ * @brief Get the current monotonic time
+ * @return the time in nanoseconds
+ */
+static uint64_t _s_ssl_router_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the latency bucket of a duration
+ * @param [in] duration: duration in nanoseconds
+ * @return the bucket index
+ */
+static uint32_t _s_ssl_router_bucket(uint64_t duration)
+{
+  uint64_t us = duration / 1000;
+  uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+  return bucket < S_SSL_ROUTER_BUCKETS ? bucket : S_SSL_ROUTER_BUCKETS - 1;
+}
+
+struct s_ssl_router *s_ssl_router_new(s_ssl_route_cbk fallback,
+  void *userdata)
+{
+  daemon_return_val_if_fail(fallback, NULL);
+
+  struct s_ssl_router *router = daemon_malloc(sizeof(struct s_ssl_router));
+  router->routes[S_SSL_ROUTER_OPCODES].handler = fallback;
+  router->routes[S_SSL_ROUTER_OPCODES].userdata = userdata;
+  return router;
+}
+
+void s_ssl_router_free(struct s_ssl_router *router)
+{
+  daemon_return_if_fail(router);
+
+  daemon_free(router);
+}
+
+int s_ssl_router_register(struct s_ssl_router *router, uint16_t type,
+  s_ssl_route_cbk handler, void *userdata)
+{
+  daemon_return_val_if_fail(router, -EINVAL);
+  daemon_return_val_if_fail(type < S_SSL_ROUTER_OPCODES, -ERANGE);
+
+  struct s_ssl_route *route = &router->routes[type];
+  if (handler && route->handler)
+    return -EEXIST;
+  route->handler = handler;
+  route->userdata = userdata;
+  return 0;
+}
+
+int s_ssl_router_set_default(struct s_ssl_router *router,
+  s_ssl_route_cbk fallback, void *userdata)
+{
+  daemon_return_val_if_fail(router, -EINVAL);
+  daemon_return_val_if_fail(fallback, -EINVAL);
+
+  router->routes[S_SSL_ROUTER_OPCODES].handler = fallback;
+  router->routes[S_SSL_ROUTER_OPCODES].userdata = userdata;
+  return 0;
+}
+
+void s_ssl_router_dispatch(struct s_ssl_router *router,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
+{
+  daemon_return_if_fail(router);
+  daemon_return_if_fail(view);
+
+  struct s_ssl_route *route = view->type < S_SSL_ROUTER_OPCODES ?
+    &router->routes[view->type] : NULL;
+  if (!route || !route->handler)
+    route = &router->routes[S_SSL_ROUTER_OPCODES];
+
+  uint64_t start = _s_ssl_router_now();
+  route->handler(route->userdata, connection, view);
+  uint32_t bucket = _s_ssl_router_bucket(_s_ssl_router_now() - start);
+
+  /* several workers may dispatch the same type at once */
+  __atomic_add_fetch(&route->stats.count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&route->stats.latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+int s_ssl_router_get_stats(struct s_ssl_router *router, uint16_t type,
+  struct s_ssl_route_stats *stats)
+{
+  daemon_return_val_if_fail(router, -EINVAL);
+  daemon_return_val_if_fail(type <= S_SSL_ROUTER_OPCODES, -ERANGE);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  struct s_ssl_route *route = &router->routes[type];
+  stats->count = __atomic_load_n(&route->stats.count, __ATOMIC_RELAXED);
+  for (uint32_t i = 0; i < S_SSL_ROUTER_BUCKETS; i++)
+    stats->latency[i] = __atomic_load_n(&route->stats.latency[i],
+      __ATOMIC_RELAXED);
+  return 0;
+}
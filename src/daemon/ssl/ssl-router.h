@@ -0,0 +1,114 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_ROUTER_H_
+# define _SSL_SSL_ROUTER_H_
+
+# include <stdint.h>
+# include "ssl-packet.h"
+
+/**
+ * @brief Number of message types routed, higher types reach the default
+ * handler
+ */
+# define S_SSL_ROUTER_OPCODES 256
+
+/**
+ * @brief Number of latency buckets, bucket n counts the handlers which ran
+ * in less than 2^n microseconds
+ */
+# define S_SSL_ROUTER_BUCKETS 24
+
+struct s_ssl_connection;
+struct s_ssl_router;
+
+/**
+ * @brief Message handler. The view must be released, immediately or later
+ * @param [in] userdata: userdata given at registration
+ * @param [in] connection: connection which received the message
+ * @param [in] view: message received
+ */
+typedef void (*s_ssl_route_cbk)(void *userdata,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view);
+
+/**
+ * @brief Counters of a message type
+ */
+struct s_ssl_route_stats {
+  uint64_t count;
+  uint64_t latency[S_SSL_ROUTER_BUCKETS];
+};
+
+/**
+ * @brief Allocate a new message router
+ * @param [in] fallback: handler of the messages without a registered handler
+ * @param [in] userdata: userdata given to the default handler
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_router *s_ssl_router_new(s_ssl_route_cbk fallback,
+  void *userdata);
+
+/**
+ * @brief Deallocate a specific message router
+ * @param [in] router: router to delete
+ */
+void s_ssl_router_free(struct s_ssl_router *router);
+
+/**
+ * @brief Register the handler of a message type. Handlers are registered
+ * before the connections are accepted, dispatching is not locked
+ * @param [in] router: router to modify
+ * @param [in] type: message type handled
+ * @param [in] handler: handler to call, NULL to unregister
+ * @param [in] userdata: userdata given to the handler
+ * @return 0 on success, -ERANGE if the type can't be routed, -EEXIST if a
+ * handler is already registered, an another -errno value on error
+ */
+int s_ssl_router_register(struct s_ssl_router *router, uint16_t type,
+  s_ssl_route_cbk handler, void *userdata);
+
+/**
+ * @brief Replace the handler of the messages without a registered handler
+ * @param [in] router: router to modify
+ * @param [in] fallback: handler to call
+ * @param [in] userdata: userdata given to the handler
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_router_set_default(struct s_ssl_router *router,
+  s_ssl_route_cbk fallback, void *userdata);
+
+/**
+ * @brief Hand a message to the handler of its type, from any thread
+ * @param [in] router: router to use
+ * @param [in] connection: connection which received the message
+ * @param [in] view: message received
+ */
+void s_ssl_router_dispatch(struct s_ssl_router *router,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view);
+
+/**
+ * @brief Get the counters of a message type
+ * @param [in] router: router to browse
+ * @param [in] type: message type, #S_SSL_ROUTER_OPCODES for the messages
+ * handled by the default handler
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_router_get_stats(struct s_ssl_router *router, uint16_t type,
+  struct s_ssl_route_stats *stats);
+
+#endif /* !_SSL_SSL_ROUTER_H_ */
@@ -0,0 +1,310 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <event2/event.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+#include "daemon-list.h"
+#include "ssl-connection.h"
+#include "ssl-frame.h"
+#include "ssl-rpc.h"
+
+struct s_ssl_rpc_call {
+  uint64_t deadline;
+  uint64_t id;
+  s_ssl_rpc_reply_cbk reply;
+  void *userdata;
+};
+
+struct s_ssl_rpc {
+  struct s_hash *calls;
+  struct {
+    uint64_t armed;
+    struct event *event;
+  } deadline;
+  pthread_mutex_t lock;
+  struct s_loop *loop;
+  uint64_t next;
+};
+
+/**
+ * @brief Get the monotonic time
+ * @return the time in milliseconds
+ */
+static uint64_t _s_ssl_rpc_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Hash a correlation id
+ * @param [in] key: pointer to the 64 bits id
+ * @return the hash value
+ */
+static uint32_t _s_ssl_rpc_hash(const void *key)
+{
+  uint64_t id = *(const uint64_t *)key;
+
+  /* ids are sequential, spread them over the buckets */
+  id *= 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(id >> 32);
+}
+
+/**
+ * @brief Compare two correlation ids
+ * @return a non zero value if both ids are equal, 0 otherwise
+ */
+static int _s_ssl_rpc_equal(const void *a, const void *b)
+{
+  return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+/**
+ * @brief Deallocate a call
+ * @param [in] call: call to delete
+ */
+static void _s_ssl_rpc_call_free(struct s_ssl_rpc_call *call)
+{
+  daemon_return_if_fail(call);
+  daemon_free(call);
+}
+
+/**
+ * @brief Remove a call from the set of calls in flight
+ * @param [in] rpc: set of calls
+ * @param [in] id: correlation id of the call
+ * @return the call if it was still in flight, NULL otherwise
+ */
+static struct s_ssl_rpc_call *_s_ssl_rpc_steal(struct s_ssl_rpc *rpc,
+  uint64_t id)
+{
+  pthread_mutex_lock(&rpc->lock);
+  struct s_ssl_rpc_call *call = s_hash_steal(rpc->calls, &id);
+  pthread_mutex_unlock(&rpc->lock);
+  return call;
+}
+
+/**
+ * @brief Arm the deadline of the set for an earlier call, under its lock
+ * @param [in] rpc: set of calls
+ * @param [in] deadline: expiry of the call in milliseconds
+ * @param [in] now: current time in milliseconds
+ */
+static void _s_ssl_rpc_arm(struct s_ssl_rpc *rpc, uint64_t deadline,
+  uint64_t now)
+{
+  if (rpc->deadline.armed && rpc->deadline.armed <= deadline)
+    return;
+
+  uint64_t delay = deadline > now ? deadline - now : 0;
+  struct timeval tv = { .tv_sec = delay / 1000,
+    .tv_usec = (delay % 1000) * 1000 };
+  rpc->deadline.armed = deadline;
+  evtimer_add(rpc->deadline.event, &tv);
+}
+
+/**
+ * @brief Expiry state of a deadline scan
+ */
+struct s_ssl_rpc_expiry {
+  struct s_list *expired;
+  uint64_t next;
+  uint64_t now;
+};
+
+/**
+ * @brief Sort a call in flight, expired or still waiting
+ * @param [in] id: correlation id of the call
+ * @param [in] call: call to check
+ * @param [in] expiry: scan state
+ */
+static void _s_ssl_rpc_expire(daemon_unused void *id,
+  struct s_ssl_rpc_call *call, struct s_ssl_rpc_expiry *expiry)
+{
+  if (!call->deadline)
+    return;
+  if (call->deadline <= expiry->now)
+    expiry->expired = s_list_prepend(expiry->expired, call);
+  else if (!expiry->next || call->deadline < expiry->next)
+    expiry->next = call->deadline;
+}
+
+/**
+ * @brief Deadline callback, complete the calls whose response didn't come in
+ * time. They are taken off the table before being touched, a response may
+ * complete them meanwhile from another thread
+ * @param [in] rpc: set of calls
+ */
+static void _s_ssl_rpc_timeout(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_rpc *rpc)
+{
+  daemon_return_if_fail(rpc);
+
+  struct s_ssl_rpc_expiry expiry = { .now = _s_ssl_rpc_now() };
+  pthread_mutex_lock(&rpc->lock);
+  s_hash_foreach(rpc->calls, (s_hash_foreach_cbk)_s_ssl_rpc_expire,
+    &expiry);
+  for (struct s_list *it = expiry.expired; it; it = it->next)
+    s_hash_steal(rpc->calls,
+      &((struct s_ssl_rpc_call *)it->data)->id);
+  rpc->deadline.armed = 0;
+  if (expiry.next)
+    _s_ssl_rpc_arm(rpc, expiry.next, expiry.now);
+  pthread_mutex_unlock(&rpc->lock);
+
+  for (struct s_list *it = expiry.expired; it; it = it->next) {
+    struct s_ssl_rpc_call *call = it->data;
+    call->reply(call->userdata, -ETIMEDOUT, NULL);
+    _s_ssl_rpc_call_free(call);
+  }
+  s_list_free(expiry.expired);
+}
+
+/**
+ * @brief Complete a call still in flight when its connection closes
+ */
+static void _s_ssl_rpc_reset(daemon_unused void *id,
+  struct s_ssl_rpc_call *call, daemon_unused void *userdata)
+{
+  call->reply(call->userdata, -ECONNRESET, NULL);
+}
+
+struct s_ssl_rpc *s_ssl_rpc_new(struct s_loop *loop)
+{
+  daemon_return_val_if_fail(loop, NULL);
+
+  struct s_ssl_rpc *rpc = daemon_malloc(sizeof(struct s_ssl_rpc));
+  rpc->calls = s_hash_new(_s_ssl_rpc_hash, _s_ssl_rpc_equal, NULL,
+    (s_destroy_cbk)_s_ssl_rpc_call_free);
+  rpc->deadline.event = evtimer_new(s_loop_tolibevent(loop),
+    (event_callback_fn)_s_ssl_rpc_timeout, rpc);
+  pthread_mutex_init(&rpc->lock, NULL);
+  rpc->loop = loop;
+  rpc->next = 1;
+  if (!rpc->calls || !rpc->deadline.event) {
+    s_ssl_rpc_free(rpc);
+    return NULL;
+  }
+  return rpc;
+}
+
+void s_ssl_rpc_free(struct s_ssl_rpc *rpc)
+{
+  daemon_return_if_fail(rpc);
+
+  /* a running deadline callback is waited for */
+  if (rpc->deadline.event)
+    event_free(rpc->deadline.event);
+  if (rpc->calls) {
+    s_hash_foreach(rpc->calls, (s_hash_foreach_cbk)_s_ssl_rpc_reset, NULL);
+    s_hash_free(rpc->calls);
+  }
+  pthread_mutex_destroy(&rpc->lock);
+  daemon_free(rpc);
+}
+
+void s_ssl_rpc_complete(struct s_ssl_rpc *rpc, struct s_ssl_packet_view *view)
+{
+  daemon_return_if_fail(rpc);
+  daemon_return_if_fail(view);
+  daemon_return_if_fail(view->held);
+
+  struct s_ssl_rpc_call *call = _s_ssl_rpc_steal(rpc, view->id);
+  if (!call) {
+    /* the call already timed out */
+    daemon_log(LOG_INFO, "late response %llu dropped\n",
+      (unsigned long long)view->id);
+    s_ssl_packet_view_release(view);
+    return;
+  }
+  call->reply(call->userdata, 0, view);
+  _s_ssl_rpc_call_free(call);
+}
+
+uint32_t s_ssl_rpc_get_pending(struct s_ssl_rpc *rpc)
+{
+  daemon_return_val_if_fail(rpc, 0);
+
+  pthread_mutex_lock(&rpc->lock);
+  uint32_t pending = s_hash_size(rpc->calls);
+  pthread_mutex_unlock(&rpc->lock);
+  return pending;
+}
+
+int s_ssl_rpc_call(struct s_ssl_connection *connection,
+  const struct s_ssl_packet *packet, uint32_t timeout,
+  s_ssl_rpc_reply_cbk reply, void *userdata)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(packet, -EINVAL);
+  daemon_return_val_if_fail(reply, -EINVAL);
+
+  struct s_ssl_rpc *rpc = s_ssl_connection_get_rpc(connection);
+  daemon_return_val_if_fail(rpc, -EBADE);
+
+  struct s_ssl_rpc_call *call = daemon_malloc(sizeof(struct s_ssl_rpc_call));
+  call->reply = reply;
+  call->userdata = userdata;
+
+  pthread_mutex_lock(&rpc->lock);
+  call->id = rpc->next++;
+  int ret = s_hash_insert(rpc->calls, &call->id, call);
+  pthread_mutex_unlock(&rpc->lock);
+  if (ret != 0) {
+    _s_ssl_rpc_call_free(call);
+    return ret;
+  }
+
+  uint64_t id = call->id;
+  ret = s_ssl_connection_write_id(connection, packet,
+    S_SSL_FRAME_FLAG_REQUEST, id);
+  if (ret != 0) {
+    _s_ssl_rpc_call_free(_s_ssl_rpc_steal(rpc, id));
+    return ret;
+  }
+
+  /* the deadline starts once the request is queued, unless the response
+   * already completed the call */
+  if (!timeout)
+    return 0;
+  uint64_t now = _s_ssl_rpc_now();
+  pthread_mutex_lock(&rpc->lock);
+  call = s_hash_lookup(rpc->calls, &id);
+  if (call) {
+    call->deadline = now + timeout;
+    _s_ssl_rpc_arm(rpc, call->deadline, now);
+  }
+  pthread_mutex_unlock(&rpc->lock);
+  return 0;
+}
+
+int s_ssl_rpc_reply(struct s_ssl_connection *connection, uint64_t id,
+  const struct s_ssl_packet *packet)
+{
+  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(packet, -EINVAL);
+
+  return s_ssl_connection_write_id(connection, packet,
+    S_SSL_FRAME_FLAG_RESPONSE, id);
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_RPC_H_
+# define _SSL_SSL_RPC_H_
+
+# include <stdint.h>
+# include "daemon-loop.h"
+# include "ssl-packet.h"
+
+struct s_ssl_connection;
+struct s_ssl_rpc;
+
+/**
+ * @brief Completion callback of a call, called once from the connection loop
+ * @param [in] userdata: userdata given with the call
+ * @param [in] error: 0 on success, -ETIMEDOUT when the deadline expired,
+ * -ECONNRESET when the connection closed
+ * @param [in] view: response received, to release, NULL on error
+ */
+typedef void (*s_ssl_rpc_reply_cbk)(void *userdata, int error,
+  struct s_ssl_packet_view *view);
+
+/**
+ * @brief Allocate the set of calls in flight on a connection
+ * @param [in] loop: loop running the call deadlines
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_rpc *s_ssl_rpc_new(struct s_loop *loop);
+
+/**
+ * @brief Deallocate a specific set of calls. The calls still in flight
+ * complete with -ECONNRESET
+ * @param [in] rpc: set of calls to delete
+ */
+void s_ssl_rpc_free(struct s_ssl_rpc *rpc);
+
+/**
+ * @brief Hand a received response to the completion callback of its call, or
+ * release it if the call is gone
+ * @param [in] rpc: set of calls of the connection
+ * @param [in] view: response received, its correlation id already stripped
+ */
+void s_ssl_rpc_complete(struct s_ssl_rpc *rpc, struct s_ssl_packet_view *view);
+
+/**
+ * @brief Get the number of calls in flight
+ * @param [in] rpc: set of calls to browse
+ * @return the number of calls waiting for a response
+ */
+uint32_t s_ssl_rpc_get_pending(struct s_ssl_rpc *rpc);
+
+/**
+ * @brief Send a request, from any thread. Many requests can be in flight on
+ * the same connection, responses are matched whatever their order
+ * @param [in] connection: connection to send the request on
+ * @param [in] packet: request to send
+ * @param [in] timeout: deadline of the call in milliseconds, 0 for none
+ * @param [in] reply: completion callback, not called when the request can't
+ * be sent
+ * @param [in] userdata: userdata given to the completion callback
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_rpc_call(struct s_ssl_connection *connection,
+  const struct s_ssl_packet *packet, uint32_t timeout,
+  s_ssl_rpc_reply_cbk reply, void *userdata);
+
+/**
+ * @brief Send the response of a request
+ * @param [in] connection: connection which received the request
+ * @param [in] id: correlation id of the request, given by its view
+ * @param [in] packet: response to send
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_rpc_reply(struct s_ssl_connection *connection, uint64_t id,
+  const struct s_ssl_packet *packet);
+
+#endif /* !_SSL_SSL_RPC_H_ */
@@ -15,7 +15,13 @@
  * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* struct ucred */
+#endif /* !_GNU_SOURCE */
+#include <pthread.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 #include <event.h>
 #include <arpa/inet.h>
 #include <event2/bufferevent_ssl.h>
@@ -23,83 +29,477 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "daemon-alloc.h"
 #include "daemon-cond.h"
-#include "daemon-list.h"
+#include "daemon-hash.h"
 #include "ssl-connection.h"
+#include "ssl-handoff.h"
+#include "ssl-router.h"
 #include "ssl-server.h"
+#include "ssl-session.h"
+#include "ssl-worker.h"
 
 struct s_ssl_server {
+  struct s_ssl_backpressure backpressure;
+  struct {
+    uint32_t delay;
+    uint32_t threshold;
+  } batch;
+  struct s_ssl_compress_config compress;
+  struct {
+    s_ssl_drained_cbk done;
+    struct event *event;
+    uint32_t pending;
+    void *userdata;
+  } drain;
   struct s_ssl_funcs funcs;
+  struct s_ssl_handoff handoff;
+  struct {
+    uint32_t depth;
+    struct s_ssl_handshake_pool *pool;
+    uint32_t threads;
+  } handshake;
+  char *identity;
+  struct {
+    gid_t group;
+    struct evconnlistener *listener;
+    char *path;
+  } local;
+  /* the workers read the context and the connection settings */
+  pthread_rwlock_t lock;
   struct s_loop *loop;
+  /* every named connection, whichever worker runs it */
+  struct {
+    struct s_hash *connections;
+    pthread_mutex_t lock;
+  } registry;
+  struct s_ssl_router *router;
 
   struct {
+    uint32_t cache_size;
     SSL_CTX *context;
-    struct evconnlistener *listener;
+    uint8_t ktls;
+    struct s_ssl_session *session;
   } ssl;
 
-  struct s_list *connections;
   void *userdata;
+  struct {
+    uint32_t count;
+    struct s_ssl_worker **list;
+  } workers;
 };
 
 /**
- * @brief Any packet received in a communication structure arrive here
+ * @brief Any packet received in a communication structure arrive here, it is
+ * routed according to its message type
  * @param [in] connection: connection originated by the packet
- * @param [in] packet: packet received
+ * @param [in] view: packet received
  */
 static void _s_ssl_server_communication_read(
-  struct s_ssl_connection *connection, struct s_ssl_packet *packet)
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
 {
   daemon_return_if_fail(connection);
-  daemon_return_if_fail(packet);
+  daemon_return_if_fail(view);
 
-  daemon_log(LOG_NOTICE, "incoming packet to process");
+  struct s_ssl_server *server = s_ssl_worker_get_server(
+    s_ssl_connection_get_worker(connection));
+  s_ssl_router_dispatch(server->router, connection, view);
 }
 
 /**
- * @brief Any packet received in a communication structure arrive here
+ * @brief Default route: the packets without a registered handler reach the
+ * read callback of the server
+ * @param [in] server: server which received the packet
  * @param [in] connection: connection originated by the packet
- * @param [in] packet: packet received
+ * @param [in] view: packet received
+ */
+static void _s_ssl_server_unrouted(struct s_ssl_server *server,
+  daemon_unused struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  server->funcs.read(server->userdata, view);
+}
+
+/**
+ * @brief Any error raised by a communication structure arrive here
+ * @param [in] connection: connection originated by the error
+ * @param [in] type: error type definition
+ * @param [in] error: error value
+ * @param [in] packet: packet concerned by the error, may be NULL
  */
 static void _s_ssl_server_communication_error(
   struct s_ssl_connection *connection, daemon_unused enum e_ssl_error type,
-  daemon_unused int error, const struct s_ssl_packet *packet)
+  daemon_unused int error, daemon_unused const struct s_ssl_packet *packet)
 {
   daemon_return_if_fail(connection);
-  daemon_return_if_fail(packet);
 
   daemon_log(LOG_ERR, "error transmiting a packet");
 }
 
 /**
- * @brief Connect event from the evconnect listener object
+ * @brief Any change of the output state of a communication structure arrive
+ * here
+ * @param [in] connection: connection concerned
+ * @param [in] writable: 0 when the connection blocks, 1 when it unblocks
+ */
+static void _s_ssl_server_communication_writable(
+  struct s_ssl_connection *connection, int writable)
+{
+  daemon_return_if_fail(connection);
+
+  daemon_log(LOG_INFO, "'%s' %s\n", s_ssl_connection_get_name(connection),
+    writable ? "is writable again" : "is blocked");
+}
+
+/**
+ * @brief Allocate a connection on an accepted socket, with the server settings
+ * @param [in] server: server accepting the connection
+ * @param [in] worker: worker running the connection
+ * @param [in] buffer: bufferevent of the accepted socket
+ * @return a valid pointer on success, NULL on error
+ */
+static struct s_ssl_connection *_s_ssl_server_connection_new(
+  struct s_ssl_server *server, struct s_ssl_worker *worker,
+  struct bufferevent *buffer)
+{
+  /* the connection will be added automatically if it succeed
+   * or delete if not */
+  struct s_ssl_connection *connection = s_ssl_connection_new(worker, buffer,
+    (s_ssl_read_cbk)_s_ssl_server_communication_read,
+    (s_ssl_error_cbk)_s_ssl_server_communication_error);
+  if (!connection) {
+    daemon_log(LOG_ERR, "failed to create the connection\n");
+    return NULL;
+  }
+  pthread_rwlock_rdlock(&server->lock);
+  struct s_ssl_backpressure backpressure = server->backpressure;
+  uint32_t delay = server->batch.delay;
+  uint32_t threshold = server->batch.threshold;
+  pthread_rwlock_unlock(&server->lock);
+
+  s_ssl_connection_set_backpressure(connection, &backpressure,
+    (s_ssl_writable_cbk)_s_ssl_server_communication_writable);
+  s_ssl_connection_set_batching(connection, threshold, delay);
+  return connection;
+}
+
+/**
+ * @brief Allocate a connection on a tls bufferevent, the compression is
+ * enabled if the server offers it
+ * @param [in] server: server accepting the connection
+ * @param [in] worker: worker running the connection
+ * @param [in] buffer: tls bufferevent of the accepted socket
+ * @return a valid pointer on success, NULL on error
+ */
+static struct s_ssl_connection *_s_ssl_server_connection_tls(
+  struct s_ssl_server *server, struct s_ssl_worker *worker,
+  struct bufferevent *buffer)
+{
+  struct s_ssl_connection *connection = _s_ssl_server_connection_new(server,
+    worker, buffer);
+  if (connection && server->compress.codecs &&
+      s_ssl_connection_set_compression(connection, &server->compress) != 0)
+    daemon_log(LOG_WARNING, "failed to enable the compression\n");
+  pthread_rwlock_rdlock(&server->lock);
+  if (connection && server->identity &&
+      s_ssl_connection_set_identity(connection, server->identity) != 0)
+    daemon_log(LOG_WARNING, "failed to set the identity\n");
+  pthread_rwlock_unlock(&server->lock);
+  return connection;
+}
+
+/**
+ * @brief Completion of a handshake run by the crypto pool, the established
+ * session gets its connection
+ * @param [in] worker: worker which accepted the socket
+ * @param [in] ssl: established session, NULL on error
+ * @param [in] fd: socket of the session
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+static void _s_ssl_server_handshaked(struct s_ssl_worker *worker, SSL *ssl,
+  int fd, int status)
+{
+  daemon_return_if_fail(worker);
+
+  if (status != 0) {
+    daemon_log(LOG_WARNING, "a handshake failed (%d)\n", status);
+    return;
+  }
+
+  struct bufferevent *buffer = bufferevent_openssl_socket_new(
+    s_loop_tolibevent(s_ssl_worker_get_loop(worker)), fd, ssl,
+    BUFFEREVENT_SSL_OPEN, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+  if (!buffer) {
+    SSL_free(ssl);
+    close(fd);
+    return;
+  }
+  if (!_s_ssl_server_connection_tls(s_ssl_worker_get_server(worker), worker,
+      buffer))
+    return;
+  bufferevent_trigger_event(buffer, BEV_EVENT_CONNECTED,
+    BEV_TRIG_DEFER_CALLBACKS);
+}
+
+/**
+ * @brief Connect event from the evconnect listener object. The handshake runs
+ * on the crypto pool when the server has one, on the loop otherwise
  */
 static void _s_ssl_server_accept(struct evconnlistener *listener,
-  daemon_unused int sockfd, struct sockaddr *sa, daemon_unused int sa_len,
-  struct s_ssl_server *server)
+  int sockfd, struct sockaddr *sa, daemon_unused int sa_len,
+  struct s_ssl_worker *worker)
 {
   daemon_return_if_fail(listener);
   daemon_return_if_fail(sa);
-  daemon_return_if_fail(server);
+  daemon_return_if_fail(worker);
 
   daemon_log(LOG_NOTICE, "incoming connection");
 
+  struct s_ssl_server *server = s_ssl_worker_get_server(worker);
   struct event_base *base = evconnlistener_get_base(listener);
   daemon_return_if_fail(base);
+  /* the session keeps a reference on its context, a reload can swap it */
+  pthread_rwlock_rdlock(&server->lock);
   SSL *context = SSL_new(server->ssl.context);
+  pthread_rwlock_unlock(&server->lock);
   daemon_return_if_fail(context);
 
+  struct s_ssl_handshake_queue *handshakes = s_ssl_worker_get_handshakes(
+    worker);
+  if (handshakes) {
+    SSL_set_fd(context, sockfd);
+    SSL_set_accept_state(context);
+    int ret = s_ssl_handshake_start(handshakes, context, sockfd,
+      (s_ssl_handshake_cbk)_s_ssl_server_handshaked, worker);
+    if (ret != 0) {
+      daemon_log(LOG_WARNING, "handshake refused (%d)\n", ret);
+      SSL_free(context);
+      close(sockfd);
+    }
+    return;
+  }
+
+  /* the bufferevent can be written from any thread through the server */
   struct bufferevent *buffer = bufferevent_openssl_socket_new(base, sockfd,
-    context, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+    context, BUFFEREVENT_SSL_ACCEPTING,
+    BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+  if (!buffer) {
+    daemon_log(LOG_WARNING, "failed to allocate the tls buffer\n");
+    SSL_free(context);
+    close(sockfd);
+    return;
+  }
+  _s_ssl_server_connection_tls(server, worker, buffer);
+}
 
-  /* the connection will be added automatically if it succeed
-   * or delete if not */
-  struct s_ssl_connection *connection = s_ssl_connection_new(server, buffer,
-    (s_ssl_read_cbk)_s_ssl_server_communication_read,
-    (s_ssl_error_cbk)_s_ssl_server_communication_error);
+/**
+ * @brief Check the credentials of a local peer. Root, the daemon user and the
+ * members of the server group are allowed
+ * @param [in] server: server accepting the peer
+ * @param [in] credentials: peer credentials
+ * @return a non zero value if the peer is allowed, 0 otherwise
+ */
+static int _s_ssl_server_local_allowed(struct s_ssl_server *server,
+  const struct ucred *credentials)
+{
+  return credentials->uid == 0 || credentials->uid == geteuid() ||
+    (server->local.group != (gid_t)-1 &&
+     credentials->gid == server->local.group);
+}
+
+/**
+ * @brief Connect event from the local listener object. The peer is
+ * authenticated by its credentials, no tls layer is set up
+ */
+static void _s_ssl_server_accept_local(struct evconnlistener *listener,
+  int sockfd, daemon_unused struct sockaddr *sa, daemon_unused int sa_len,
+  struct s_ssl_worker *worker)
+{
+  daemon_return_if_fail(listener);
+  daemon_return_if_fail(worker);
+
+  struct s_ssl_server *server = s_ssl_worker_get_server(worker);
+  struct ucred credentials;
+  socklen_t len = sizeof(credentials);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) != 0 ||
+      !_s_ssl_server_local_allowed(server, &credentials)) {
+    daemon_log(LOG_WARNING, "local connection refused\n");
+    close(sockfd);
+    return;
+  }
+  daemon_log(LOG_NOTICE, "incoming local connection from uid %u pid %d\n",
+    credentials.uid, credentials.pid);
+
+  struct bufferevent *buffer = bufferevent_socket_new(
+    evconnlistener_get_base(listener), sockfd,
+    BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+  if (!buffer) {
+    close(sockfd);
+    return;
+  }
+  struct s_ssl_connection *connection = _s_ssl_server_connection_new(server,
+    worker, buffer);
   if (!connection)
-    daemon_log(LOG_ERR, "failed to create the connection");
+    return;
+
+  /* a process may open several connections, the socket keeps them apart */
+  char name[64];
+  snprintf(name, sizeof(name), "local:%u:%d:%d", credentials.uid,
+    credentials.pid, sockfd);
+  s_ssl_connection_set_name(connection, name);
+  /* nothing to negotiate, the connection is established right away */
+  bufferevent_trigger_event(buffer, BEV_EVENT_CONNECTED,
+    BEV_TRIG_DEFER_CALLBACKS);
+}
+
+/**
+ * @brief Fill the wildcard address the server listens on
+ * @param [out] sa: address to fill
+ * @param [in] family: AF_INET6 for a dual stack address, AF_INET otherwise
+ * @return the address length
+ */
+static socklen_t _s_ssl_server_address(struct sockaddr_storage *sa,
+  int family)
+{
+  memset(sa, 0, sizeof(struct sockaddr_storage));
+  if (family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    sin6->sin6_port = htons(S_SSL_SERVER_PORT);
+    return sizeof(struct sockaddr_in6);
+  }
+  struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_ANY);
+  sin->sin_port = htons(S_SSL_SERVER_PORT);
+  return sizeof(struct sockaddr_in);
+}
+
+/**
+ * @brief Bind the local socket of the server
+ * @param [in] path: socket path, '@' prefixed for the abstract namespace
+ * @param [in] group: group allowed to connect, (gid_t)-1 for none
+ * @return a listening socket on success, an -errno value on error
+ */
+static int _s_ssl_server_bind_local(const char *path, gid_t group)
+{
+  struct sockaddr_un sun;
+  size_t size = strlen(path);
+  daemon_return_val_if_fail(size < sizeof(sun.sun_path), -ENAMETOOLONG);
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  memcpy(sun.sun_path, path, size);
+  int abstract = path[0] == S_SSL_SERVER_ABSTRACT;
+  if (abstract)
+    sun.sun_path[0] = '\0';
+  /* an abstract name is not nul terminated, its length is significant */
+  socklen_t len = offsetof(struct sockaddr_un, sun_path) + size + !abstract;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  /* a socket left behind by a previous run prevents the bind */
+  struct stat st;
+  if (!abstract && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if (bind(fd, (struct sockaddr *)&sun, len) != 0)
+    goto error;
+  if (!abstract && (chmod(path, group == (gid_t)-1 ? 0600 : 0660) != 0 ||
+      (group != (gid_t)-1 && chown(path, (uid_t)-1, group) != 0)))
+    goto unlink;
+  if (listen(fd, 128) != 0)
+    goto unlink;
+  return fd;
+
+unlink:
+  if (!abstract)
+    unlink(path);
+error:
+  close(fd);
+  return -EBADE;
+}
+
+/**
+ * @brief Listen on a worker, on the next handed over socket if any is left
+ * @param [in] server: server starting its workers
+ * @param [in] worker: worker to start
+ * @param [in] index: index of the worker
+ * @param [in, out] sa: address to bind, may fall back to ipv4
+ * @param [in, out] len: address length
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_ssl_server_listen(struct s_ssl_server *server,
+  struct s_ssl_worker *worker, uint32_t index, struct sockaddr_storage *sa,
+  socklen_t *len)
+{
+  if (index < server->handoff.count) {
+    int ret = s_ssl_worker_adopt(worker,
+      (evconnlistener_cb)_s_ssl_server_accept, server->handoff.fds[index]);
+    if (ret == 0)
+      server->handoff.fds[index] = -1;
+    return ret;
+  }
+
+  int ret = s_ssl_worker_listen(worker, (evconnlistener_cb)_s_ssl_server_accept,
+    (struct sockaddr *)sa, *len);
+  if (ret != 0 && index == 0 && sa->ss_family == AF_INET6) {
+    daemon_log(LOG_WARNING, "ipv6 unavailable, listening on ipv4 only\n");
+    *len = _s_ssl_server_address(sa, AF_INET);
+    ret = s_ssl_worker_listen(worker, (evconnlistener_cb)_s_ssl_server_accept,
+      (struct sockaddr *)sa, *len);
+  }
+  return ret;
+}
+
+/**
+ * @brief Called by each worker once it is drained, from its loop
+ * @param [in] server: server being drained
+ */
+static void _s_ssl_server_worker_drained(struct s_ssl_server *server)
+{
+  if (__atomic_sub_fetch(&server->drain.pending, 1, __ATOMIC_ACQ_REL) == 0)
+    event_active(server->drain.event, EV_TIMEOUT, 0);
+}
+
+/**
+ * @brief Drain completion, runs on the server loop once every worker is
+ * drained
+ */
+static void _s_ssl_server_drained(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_server *server)
+{
+  daemon_return_if_fail(server);
+
+  s_loop_account(server->loop, e_loop_priority_control);
+  daemon_log(LOG_NOTICE, "ssl server drained\n");
+  server->drain.done(server->drain.userdata);
+}
+
+/**
+ * @brief Create the server context, with the server tls settings
+ * @param [in] server: server using the context
+ * @param [in] certificate: certificate path file
+ * @param [in] private_key: private key path file
+ * @return a valid pointer on success, NULL on error
+ */
+static SSL_CTX *_s_ssl_server_context_new(struct s_ssl_server *server,
+  const char *certificate, const char *private_key)
+{
+  SSL_CTX *context = s_ssl_context_server_new(certificate, private_key);
+  daemon_return_val_if_fail(context, NULL);
+#ifdef SSL_OP_ENABLE_KTLS
+  /* OpenSSL installs the negotiated keys in the socket once the handshake is
+   * done, the connections then switch to a plain socket bufferevent */
+  if (server->ssl.ktls)
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif /* !SSL_OP_ENABLE_KTLS */
+  return context;
 }
 
 struct s_ssl_server *s_ssl_server_new(struct s_loop *loop,
@@ -110,9 +510,23 @@ struct s_ssl_server *s_ssl_server_new(struct s_loop *loop,
   daemon_return_val_if_fail(s_ssl_funcs_check(funcs) == 0, NULL);
 
   struct s_ssl_server *server = daemon_malloc(sizeof(struct s_ssl_server));
+  s_ssl_backpressure_init(&server->backpressure);
   server->funcs = *funcs;
+  s_ssl_handoff_init(&server->handoff);
+  server->handshake.depth = S_SSL_HANDSHAKE_DEPTH;
+  server->handshake.threads = S_SSL_HANDSHAKE_THREADS;
+  server->local.group = (gid_t)-1;
+  pthread_rwlock_init(&server->lock, NULL);
   server->loop = loop;
+  server->registry.connections = s_hash_new(s_str_hash, s_str_equal, NULL,
+    NULL);
+  pthread_mutex_init(&server->registry.lock, NULL);
+  server->router = s_ssl_router_new((s_ssl_route_cbk)_s_ssl_server_unrouted,
+    server);
+  server->ssl.cache_size = S_SSL_SESSION_CACHE_SIZE;
   server->userdata = userdata;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  server->workers.count = cpus > 0 ? cpus : 1;
   return server;
 }
 
@@ -120,44 +534,411 @@ void s_ssl_server_free(struct s_ssl_server *server)
 {
   daemon_return_if_fail(server);
 
+  /* the local listener runs on the first worker loop */
+  if (server->local.listener)
+    evconnlistener_free(server->local.listener);
+  if (server->local.path) {
+    unlink(server->local.path);
+    daemon_free(server->local.path);
+  }
+  /* workers are stopped first, nobody uses the context afterwards */
+  for (uint32_t i = 0; server->workers.list && i < server->workers.count; i++)
+    s_ssl_worker_free(server->workers.list[i]);
+  daemon_free(server->workers.list);
+  if (server->handshake.pool)
+    s_ssl_handshake_pool_free(server->handshake.pool);
+  if (server->drain.event)
+    event_free(server->drain.event);
+  s_ssl_handoff_clear(&server->handoff);
+  s_hash_free(server->registry.connections);
+  pthread_mutex_destroy(&server->registry.lock);
+  s_ssl_router_free(server->router);
+  if (server->compress.dictionary)
+    s_ssl_dictionary_unref(server->compress.dictionary);
+  if (server->identity)
+    daemon_free(server->identity);
+
+  if (server->ssl.session)
+    s_ssl_session_free(server->ssl.session);
   if (server->ssl.context) {
     s_ssl_context_deinit();
-    if (server->ssl.listener)
-      evconnlistener_free(server->ssl.listener);
     SSL_CTX_free(server->ssl.context);
   }
-  s_list_free_full(server->connections, (s_destroy_cbk)s_ssl_connection_free);
+  pthread_rwlock_destroy(&server->lock);
   daemon_free(server);
 }
 
+int s_ssl_server_set_workers(struct s_ssl_server *server, uint32_t count)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(!server->workers.list, -EBUSY);
+
+  server->workers.count = count;
+  return 0;
+}
+
+int s_ssl_server_set_handshakes(struct s_ssl_server *server, uint32_t threads,
+  uint32_t depth)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(!threads || depth, -EINVAL);
+  daemon_return_val_if_fail(!server->workers.list, -EBUSY);
+
+  server->handshake.depth = depth;
+  server->handshake.threads = threads;
+  return 0;
+}
+
+int s_ssl_server_set_session_cache(struct s_ssl_server *server,
+  uint32_t size)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(!server->ssl.context, -EBUSY);
+
+  server->ssl.cache_size = size;
+  return 0;
+}
+
+int s_ssl_server_set_backpressure(struct s_ssl_server *server,
+  const struct s_ssl_backpressure *backpressure)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(backpressure, -EINVAL);
+  daemon_return_val_if_fail(!backpressure->high ||
+    backpressure->low < backpressure->high, -EINVAL);
+
+  pthread_rwlock_wrlock(&server->lock);
+  server->backpressure = *backpressure;
+  pthread_rwlock_unlock(&server->lock);
+  return 0;
+}
+
+int s_ssl_server_set_batching(struct s_ssl_server *server, uint32_t threshold,
+  uint32_t delay)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(threshold <= S_SSL_FRAME_MAX_SIZE, -EINVAL);
+
+  pthread_rwlock_wrlock(&server->lock);
+  server->batch.threshold = threshold;
+  server->batch.delay = delay;
+  pthread_rwlock_unlock(&server->lock);
+  return 0;
+}
+
+int s_ssl_server_set_compression(struct s_ssl_server *server,
+  const struct s_ssl_compress_config *config)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(config, -EINVAL);
+  daemon_return_val_if_fail(!server->workers.list, -EBUSY);
+
+  if (config->codecs & ~s_ssl_compress_get_codecs())
+    return -ENOTSUP;
+  if (config->dictionary)
+    s_ssl_dictionary_ref(config->dictionary);
+  if (server->compress.dictionary)
+    s_ssl_dictionary_unref(server->compress.dictionary);
+  server->compress = *config;
+  return 0;
+}
+
+int s_ssl_server_set_identity(struct s_ssl_server *server,
+  const char *identity)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(identity, -EINVAL);
+  daemon_return_val_if_fail(strlen(identity) <= S_SSL_CONNECTION_IDENTITY_SIZE,
+    -EINVAL);
+
+  char *copy = strdup(identity);
+  daemon_return_val_if_fail(copy, -ENOMEM);
+  pthread_rwlock_wrlock(&server->lock);
+  char *previous = server->identity;
+  server->identity = copy;
+  pthread_rwlock_unlock(&server->lock);
+  if (previous)
+    daemon_free(previous);
+  return 0;
+}
+
+int s_ssl_server_set_ktls(struct s_ssl_server *server, int enable)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(!server->ssl.context, -EBUSY);
+
+#ifndef SSL_OP_ENABLE_KTLS
+  if (enable) {
+    daemon_log(LOG_WARNING, "ktls isn't supported by this openssl\n");
+    return -ENOTSUP;
+  }
+#endif /* !SSL_OP_ENABLE_KTLS */
+  server->ssl.ktls = enable != 0;
+  return 0;
+}
+
+int s_ssl_server_get_session_stats(struct s_ssl_server *server,
+  struct s_ssl_session_stats *stats)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(server->ssl.session, -ENOTCONN);
+
+  return s_ssl_session_get_stats(server->ssl.session, stats);
+}
+
+int s_ssl_server_get_handshake_stats(struct s_ssl_server *server,
+  struct s_ssl_handshake_stats *stats)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(server->handshake.pool, -ENOTCONN);
+
+  return s_ssl_handshake_pool_get_stats(server->handshake.pool, stats);
+}
+
+struct s_ssl_router *s_ssl_server_get_router(struct s_ssl_server *server)
+{
+  daemon_return_val_if_fail(server, NULL);
+
+  return server->router;
+}
+
+int s_ssl_server_get_pool_stats(struct s_ssl_server *server,
+  struct s_ssl_pool_stats *stats)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  memset(stats, 0, sizeof(struct s_ssl_pool_stats));
+  for (uint32_t i = 0; server->workers.list && i < server->workers.count;
+       i++) {
+    struct s_ssl_pool_stats pool;
+    if (!server->workers.list[i] || s_ssl_pool_get_stats(
+        s_ssl_worker_get_pool(server->workers.list[i]), &pool) != 0)
+      continue;
+    stats->cached += pool.cached;
+    stats->high_water += pool.high_water;
+    stats->hits += pool.hits;
+    stats->misses += pool.misses;
+    stats->outstanding += pool.outstanding;
+  }
+  return 0;
+}
+
 int s_ssl_server_connect(struct s_ssl_server *server,
   const char *certificate, const char *private_key)
 {
   daemon_return_val_if_fail(server, -EINVAL);
   daemon_return_val_if_fail(certificate, -EINVAL);
   daemon_return_val_if_fail(private_key, -EINVAL);
+  daemon_return_val_if_fail(!server->ssl.context, -EALREADY);
 
-  server->ssl.context = s_ssl_context_server_new(certificate, private_key);
+  server->ssl.context = _s_ssl_server_context_new(server, certificate,
+    private_key);
   daemon_return_val_if_fail(server->ssl.context, -EBADE);
+  server->ssl.session = s_ssl_session_new(server->ssl.context,
+    server->loop, server->ssl.cache_size, S_SSL_SESSION_ROTATION);
+  daemon_return_val_if_fail(server->ssl.session, -EBADE);
+  /* the tickets issued by the previous process stay valid */
+  if (server->handoff.keys[0].valid &&
+      s_ssl_session_import(server->ssl.session, server->handoff.keys) != 0)
+    daemon_log(LOG_WARNING, "failed to import the ticket keys\n");
 
-  struct sockaddr_in sin;
-  memset(&sin, 0, sizeof(sin));
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = htonl(INADDR_ANY);
-  sin.sin_port = htons(8000);
-  /* Convert IPv4 and IPv6 addresses from text to binary form */
-  if (inet_pton(AF_INET, "0.0.0.0", &sin.sin_addr) <= 0) {
-    daemon_log(LOG_ERR, "inet_pton failed");
-    goto error;
+  /* a dual stack listener serves both families, ipv4 only hosts fall back
+   * to a plain ipv4 listener. The workers beyond the handed over sockets
+   * join their reuseport group, on their address */
+  struct sockaddr_storage sa;
+  socklen_t len = _s_ssl_server_address(&sa, AF_INET6);
+  if (server->handoff.count) {
+    len = sizeof(sa);
+    if (getsockname(server->handoff.fds[0], (struct sockaddr *)&sa,
+        &len) != 0)
+      return -errno;
+  }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  /* the context can't be shared between threads without locking callbacks */
+  server->workers.count = 0;
+#endif /* !OPENSSL_VERSION_NUMBER */
+
+  /* the private key operations of the handshakes leave the loops */
+  if (server->handshake.threads) {
+    server->handshake.pool = s_ssl_handshake_pool_new(
+      server->handshake.threads, server->handshake.depth);
+    daemon_return_val_if_fail(server->handshake.pool, -EBADE);
+  }
+
+  /* without worker threads a single worker runs on the main loop */
+  uint32_t count = server->workers.count ? server->workers.count : 1;
+  /* every handed over socket needs a worker, its queue is lost otherwise */
+  if (count < server->handoff.count) {
+    daemon_log(LOG_NOTICE, "%u worker(s) to serve the handed over sockets\n",
+      server->handoff.count);
+    count = server->handoff.count;
+  }
+  server->workers.list = daemon_calloc(count, sizeof(struct s_ssl_worker *));
+  for (uint32_t i = 0; i < count; i++) {
+    struct s_ssl_worker *worker = s_ssl_worker_new(server,
+      server->workers.count ? NULL : server->loop);
+    server->workers.list[i] = worker;
+    if (!worker || (server->handshake.pool && s_ssl_worker_set_handshakes(
+        worker, server->handshake.pool) != 0))
+      goto error;
+    if (_s_ssl_server_listen(server, worker, i, &sa, &len) != 0 ||
+        s_ssl_worker_start(worker) != 0)
+      goto error;
+  }
+  server->workers.count = count;
+  daemon_log(LOG_NOTICE, "ssl server listening with %u worker(s)\n", count);
+  return 0;
+
+error:
+  daemon_log(LOG_ERR, "failed to start the ssl workers\n");
+  server->workers.count = count;
+  return -EBADE;
+}
+
+int s_ssl_server_reload(struct s_ssl_server *server,
+  const char *certificate, const char *private_key)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(certificate, -EINVAL);
+  daemon_return_val_if_fail(private_key, -EINVAL);
+  /* nothing to replace before the first connect */
+  if (!server->ssl.session)
+    return -ENOTCONN;
+
+  /* the files are loaded out of the workers, which only wait for the swap */
+  SSL_CTX *context = _s_ssl_server_context_new(server, certificate,
+    private_key);
+  daemon_return_val_if_fail(context, -EBADE);
+  int ret = s_ssl_session_attach(server->ssl.session, context);
+  if (ret != 0) {
+    SSL_CTX_free(context);
+    return ret;
   }
 
-  server->ssl.listener = evconnlistener_new_bind(
-    s_loop_tolibevent(server->loop), (evconnlistener_cb)_s_ssl_server_accept,
-    server, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 1024,
-    (struct sockaddr *)&sin, sizeof(sin));
+  pthread_rwlock_wrlock(&server->lock);
+  SSL_CTX *previous = server->ssl.context;
+  server->ssl.context = context;
+  pthread_rwlock_unlock(&server->lock);
+
+  /* the established sessions hold a reference until they close */
+  SSL_CTX_free(previous);
+  daemon_log(LOG_NOTICE, "ssl server reloaded '%s'\n", certificate);
+  return 0;
+}
+
+int s_ssl_server_listen_local(struct s_ssl_server *server, const char *path,
+  gid_t group)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(path && path[0], -EINVAL);
+  daemon_return_val_if_fail(server->workers.list, -ENOTCONN);
+  daemon_return_val_if_fail(!server->local.listener, -EBUSY);
+
+  /* a socket handed over is already bound, with its permissions */
+  int fd = server->handoff.local;
+  server->handoff.local = -1;
+  int adopted = fd >= 0;
+  if (!adopted)
+    fd = _s_ssl_server_bind_local(path, group);
+  if (fd < 0)
+    goto error;
+
+  struct s_ssl_worker *worker = server->workers.list[0];
+  server->local.listener = evconnlistener_new(
+    s_loop_tolibevent(s_ssl_worker_get_loop(worker)),
+    (evconnlistener_cb)_s_ssl_server_accept_local, worker,
+    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_THREADSAFE, 0, fd);
+  if (!server->local.listener) {
+    if (!adopted && path[0] != S_SSL_SERVER_ABSTRACT)
+      unlink(path);
+    close(fd);
+    goto error;
+  }
+  server->local.group = group;
+  if (path[0] != S_SSL_SERVER_ABSTRACT)
+    server->local.path = strdup(path);
+  daemon_log(LOG_NOTICE, "local server listening on '%s'%s\n", path,
+    adopted ? " (handed over)" : "");
+  return 0;
 
 error:
-  return server->ssl.listener ? 0 : -EBADE;
+  daemon_log(LOG_ERR, "failed to listen on '%s'\n", path);
+  return -EBADE;
+}
+
+int s_ssl_server_import(struct s_ssl_server *server,
+  struct s_ssl_handoff *handoff)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(handoff, -EINVAL);
+  daemon_return_val_if_fail(!server->workers.list, -EBUSY);
+
+  s_ssl_handoff_clear(&server->handoff);
+  server->handoff = *handoff;
+  s_ssl_handoff_init(handoff);
+  return 0;
+}
+
+int s_ssl_server_export(struct s_ssl_server *server,
+  struct s_ssl_handoff *handoff)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(handoff, -EINVAL);
+  daemon_return_val_if_fail(server->ssl.session, -ENOTCONN);
+  daemon_return_val_if_fail(!server->drain.event, -EALREADY);
+
+  s_ssl_handoff_init(handoff);
+  for (uint32_t i = 0; server->workers.list && i < server->workers.count &&
+       handoff->count < S_SSL_HANDOFF_LISTENERS; i++) {
+    int fd = s_ssl_worker_get_fd(server->workers.list[i]);
+    if (fd >= 0)
+      handoff->fds[handoff->count++] = fd;
+  }
+  daemon_return_val_if_fail(handoff->count, -ENOTCONN);
+  if (server->local.listener)
+    handoff->local = evconnlistener_get_fd(server->local.listener);
+  return s_ssl_session_export(server->ssl.session, handoff->keys);
+}
+
+int s_ssl_server_drain(struct s_ssl_server *server, uint32_t timeout,
+  s_ssl_drained_cbk done, void *userdata)
+{
+  daemon_return_val_if_fail(server, -EINVAL);
+  daemon_return_val_if_fail(done, -EINVAL);
+  daemon_return_val_if_fail(server->workers.list, -ENOTCONN);
+  daemon_return_val_if_fail(!server->drain.event, -EALREADY);
+
+  server->drain.event = event_new(s_loop_tolibevent(server->loop), -1, 0,
+    (event_callback_fn)_s_ssl_server_drained, server);
+  daemon_return_val_if_fail(server->drain.event, -ENOMEM);
+  int ret = s_loop_set_priority(server->drain.event, e_loop_priority_control);
+  if (ret != 0) {
+    event_free(server->drain.event);
+    server->drain.event = NULL;
+    return ret;
+  }
+  server->drain.done = done;
+  server->drain.pending = server->workers.count;
+  server->drain.userdata = userdata;
+
+  /* the socket path may belong to the process which took over, it is kept */
+  if (server->local.listener) {
+    evconnlistener_free(server->local.listener);
+    server->local.listener = NULL;
+  }
+  if (server->local.path) {
+    daemon_free(server->local.path);
+    server->local.path = NULL;
+  }
+
+  daemon_log(LOG_NOTICE, "draining the ssl server within %ums\n", timeout);
+  for (uint32_t i = 0; i < server->workers.count; i++)
+    if (s_ssl_worker_drain(server->workers.list[i], timeout,
+        (s_ssl_worker_drained_cbk)_s_ssl_server_worker_drained, server) != 0)
+      _s_ssl_server_worker_drained(server);
+  return 0;
 }
 
 int s_ssl_server_write(struct s_ssl_server *server,
@@ -167,8 +948,20 @@ int s_ssl_server_write(struct s_ssl_server *server,
   daemon_return_val_if_fail(name, -EINVAL);
   daemon_return_val_if_fail(packet, -EINVAL);
 
-  daemon_log(LOG_WARNING, "not yet implemented");
-  return 0;
+  /* the connection is referenced under the lock, it is written on its
+   * worker once the lock is released */
+  pthread_mutex_lock(&server->registry.lock);
+  struct s_ssl_connection *connection = s_hash_lookup(
+    server->registry.connections, name);
+  if (connection)
+    s_ssl_connection_ref(connection);
+  pthread_mutex_unlock(&server->registry.lock);
+  if (!connection)
+    return -ENOTCONN;
+
+  int ret = s_ssl_connection_write(connection, packet);
+  s_ssl_connection_unref(connection);
+  return ret;
 }
 
 int s_ssl_server_add_connection(struct s_ssl_server *server,
@@ -177,23 +970,82 @@ int s_ssl_server_add_connection(struct s_ssl_server *server,
   daemon_return_val_if_fail(server, -EINVAL);
   daemon_return_val_if_fail(connection, -EINVAL);
 
-  server->connections = s_list_append(server->connections, connection);
-  return 0;
+  const char *name = s_ssl_connection_get_name(connection);
+  daemon_return_val_if_fail(name, -EINVAL);
+
+  /* the newest connection of a peer wins, even on another worker. The key
+   * is the name of the connection, it is replaced with the entry */
+  pthread_mutex_lock(&server->registry.lock);
+  s_hash_steal(server->registry.connections, name);
+  int ret = s_hash_insert(server->registry.connections, (void *)name,
+    connection);
+  pthread_mutex_unlock(&server->registry.lock);
+  return ret;
 }
 
-int s_ssl_server_remove_connection(struct s_ssl_server *server,
+void s_ssl_server_remove_connection(struct s_ssl_server *server,
   struct s_ssl_connection *connection)
+{
+  daemon_return_if_fail(server);
+  daemon_return_if_fail(connection);
+
+  const char *name = s_ssl_connection_get_name(connection);
+  pthread_mutex_lock(&server->registry.lock);
+  if (name && s_hash_lookup(server->registry.connections, name) == connection)
+    s_hash_steal(server->registry.connections, name);
+  pthread_mutex_unlock(&server->registry.lock);
+}
+
+/**
+ * @brief State shared by the broadcast iteration
+ */
+struct s_ssl_server_broadcast {
+  int count;
+  s_ssl_filter_cbk filter;
+  struct s_ssl_payload *payload;
+  void *userdata;
+};
+
+/**
+ * @brief Attach the broadcast payload to a connection accepted by the filter
+ * @param [in] name: name of the connection
+ * @param [in] connection: candidate connection
+ * @param [in] broadcast: broadcast state
+ */
+static void _s_ssl_server_broadcast(daemon_unused void *name,
+  struct s_ssl_connection *connection,
+  struct s_ssl_server_broadcast *broadcast)
+{
+  if (broadcast->filter && !broadcast->filter(connection, broadcast->userdata))
+    return;
+  if (s_ssl_connection_write_payload(connection, broadcast->payload) == 0)
+    broadcast->count++;
+}
+
+int s_ssl_server_broadcast(struct s_ssl_server *server,
+  const struct s_ssl_packet *packet)
+{
+  return s_ssl_server_broadcast_filtered(server, packet, NULL, NULL);
+}
+
+int s_ssl_server_broadcast_filtered(struct s_ssl_server *server,
+  const struct s_ssl_packet *packet, s_ssl_filter_cbk filter, void *userdata)
 {
   daemon_return_val_if_fail(server, -EINVAL);
-  daemon_return_val_if_fail(connection, -EINVAL);
+  daemon_return_val_if_fail(packet, -EINVAL);
 
-  struct s_list *current = s_list_first(server->connections);
-  for (; current; current = s_list_next(current)) {
-    struct s_ssl_connection *data = s_list_data(current);
-    if (data == connection) {
-      server->connections = s_list_remove(server->connections, data);
-      return 0;
-    }
-  }
-  return -EBADE;
+  struct s_ssl_server_broadcast broadcast = {
+    .count = 0,
+    .filter = filter,
+    .payload = s_ssl_payload_new(packet),
+    .userdata = userdata
+  };
+  daemon_return_val_if_fail(broadcast.payload, -EMSGSIZE);
+
+  for (uint32_t i = 0; server->workers.list && i < server->workers.count; i++)
+    s_ssl_worker_foreach(server->workers.list[i],
+      (s_hash_foreach_cbk)_s_ssl_server_broadcast, &broadcast);
+  /* every output buffer holds its own reference now */
+  s_ssl_payload_unref(broadcast.payload);
+  return broadcast.count;
 }
@@ -18,9 +18,41 @@
 #ifndef _SSL_SSL_SERVER_H_
 # define _SSL_SSL_SERVER_H_
 
+# include <stdint.h>
+# include <sys/types.h>
 # include "ssl.h"
+# include "ssl-connection.h"
+# include "ssl-handoff.h"
+# include "ssl-handshake.h"
+# include "ssl-pool.h"
+# include "ssl-router.h"
+# include "ssl-session.h"
 # include "daemon-loop.h"
 
+/**
+ * @brief Port the server listens on
+ */
+# define S_SSL_SERVER_PORT 8000
+
+/**
+ * @brief First character of a local socket path bound in the abstract
+ * namespace instead of the filesystem
+ */
+# define S_SSL_SERVER_ABSTRACT '@'
+
+/**
+ * @brief Default delay, in milliseconds, given to a draining server to close
+ * its connections
+ */
+# define S_SSL_SERVER_DRAIN 30000
+
+/**
+ * @brief Called once a draining server closed its last connection, from the
+ * server loop
+ * @param [in] userdata: userdata passing through #s_ssl_server_drain
+ */
+typedef void (*s_ssl_drained_cbk)(void *userdata);
+
 struct s_ssl_server;
 struct s_ssl_connection;
 
@@ -40,6 +72,140 @@ struct s_ssl_server *s_ssl_server_new(struct s_loop *loop,
  */
 void s_ssl_server_free(struct s_ssl_server *server);
 
+/**
+ * @brief Set the number of worker threads started by #s_ssl_server_connect.
+ * Each worker owns its own loop, its own listener bound with SO_REUSEPORT and
+ * its own connection set. By default, one worker per online cpu is started;
+ * 0 keeps every connection on the server loop
+ * @param [in] server: server to modify
+ * @param [in] count: number of worker threads
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_workers(struct s_ssl_server *server, uint32_t count);
+
+/**
+ * @brief Set the crypto pool started by #s_ssl_server_connect. The handshakes
+ * of the accepted connections, private key operations included, run on the
+ * pool threads; the worker loops only wait for the socket readiness. A
+ * handshake arriving while depth handshakes are already queued is refused.
+ * By default, #S_SSL_HANDSHAKE_THREADS threads are started; 0 keeps the
+ * handshakes on the worker loops
+ * @param [in] server: server to modify
+ * @param [in] threads: number of crypto threads
+ * @param [in] depth: maximum number of queued handshakes
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_handshakes(struct s_ssl_server *server, uint32_t threads,
+  uint32_t depth);
+
+/**
+ * @brief Set the number of sessions kept in the server side cache. Session
+ * tickets are always enabled, a 0 size only disables the cache
+ * @param [in] server: server to modify
+ * @param [in] size: maximum number of cached sessions
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_session_cache(struct s_ssl_server *server,
+  uint32_t size);
+
+/**
+ * @brief Set the output limits applied to every accepted connection. Can be
+ * changed while running, the connections already accepted keep their limits
+ * @param [in] server: server to modify
+ * @param [in] backpressure: output limits, a 0 high watermark disables them
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_backpressure(struct s_ssl_server *server,
+  const struct s_ssl_backpressure *backpressure);
+
+/**
+ * @brief Batch the small frames written to every accepted connection into
+ * full TLS records. Batching is disabled by default. Can be changed while
+ * running, the connections already accepted keep their settings
+ * @param [in] server: server to modify
+ * @param [in] threshold: batch size in bytes, usually
+ * #S_SSL_CONNECTION_BATCH_SIZE, 0 to disable batching
+ * @param [in] delay: flush deadline in microseconds, usually
+ * #S_SSL_CONNECTION_BATCH_DELAY
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_batching(struct s_ssl_server *server, uint32_t threshold,
+  uint32_t delay);
+
+/**
+ * @brief Compress the frames exchanged with every accepted connection. The
+ * codec is negotiated with each peer and every message is compressed on its
+ * own, so a dropped frame never corrupts the following ones. Compression is
+ * disabled by default
+ * @param [in] server: server to modify
+ * @param [in] config: compression settings, the dictionary is referenced
+ * @return 0 on success, -ENOTSUP if a codec isn't available in this build, an
+ * another -errno value on error
+ */
+int s_ssl_server_set_compression(struct s_ssl_server *server,
+  const struct s_ssl_compress_config *config);
+
+/**
+ * @brief Set the identity of the local daemon, advertised to every peer once
+ * its connection is accepted. The peer names the connection after it
+ * @param [in] server: server to modify
+ * @param [in] identity: identity to copy, the host name of the daemon
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_identity(struct s_ssl_server *server,
+  const char *identity);
+
+/**
+ * @brief Enable the kernel TLS offload of established connections. It needs
+ * an OpenSSL built with ktls and the kernel tls module; connections fall back
+ * to the userspace record layer whenever the offload can't be set up. An
+ * offloaded connection drops the session tickets and can't be rekeyed, a key
+ * update from the peer closes it
+ * @param [in] server: server to modify
+ * @param [in] enable: non zero to enable the offload
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_set_ktls(struct s_ssl_server *server, int enable);
+
+/**
+ * @brief Get the counters of the crypto pool: queue depth, refused
+ * handshakes and handshake latency histogram
+ * @param [in] server: server to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, -ENOTCONN without crypto pool, an another -errno
+ * value on error
+ */
+int s_ssl_server_get_handshake_stats(struct s_ssl_server *server,
+  struct s_ssl_handshake_stats *stats);
+
+/**
+ * @brief Get the session resumption counters of the server. The hit ratio
+ * is given by resumed / handshakes
+ * @param [in] server: server to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_get_session_stats(struct s_ssl_server *server,
+  struct s_ssl_session_stats *stats);
+
+/**
+ * @brief Get the router dispatching the received packets by message type.
+ * The packets without a registered handler reach the read callback of the
+ * server
+ * @param [in] server: server to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_router *s_ssl_server_get_router(struct s_ssl_server *server);
+
+/**
+ * @brief Get the packet pool counters of the server, summed over its workers
+ * @param [in] server: server to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_get_pool_stats(struct s_ssl_server *server,
+  struct s_ssl_pool_stats *stats);
+
 /**
  * @brief Attempt a client connection on the address given in parameter
  * @param [in] server: server to connect
@@ -50,10 +216,80 @@ void s_ssl_server_free(struct s_ssl_server *server);
 int s_ssl_server_connect(struct s_ssl_server *server,
   const char *certificate, const char *private_key);
 
+/**
+ * @brief Replace the certificate and the private key of a connected server.
+ * The new context is built by the caller thread then swapped in at once: the
+ * next handshakes use it, the established connections keep the previous one
+ * until they close. The session tickets stay valid across the swap
+ * @param [in] server: server to modify
+ * @param [in] certificate: certificate to authenticate
+ * @param [in] private_key: crypto private key used to autenticate
+ * @return 0 on success, an -errno value on error and the previous context is
+ * kept
+ */
+int s_ssl_server_reload(struct s_ssl_server *server,
+  const char *certificate, const char *private_key);
+
+/**
+ * @brief Listen for the applications running on the same host on a unix
+ * socket. The local connections share the framing, the router and the read
+ * callback of the tls ones, but skip the tls layer: the peers are
+ * authenticated by their credentials (SO_PEERCRED) and named
+ * "local:<uid>:<pid>:<fd>". Root, the daemon user and the members of the group
+ * are allowed. Must be called once #s_ssl_server_connect succeeded
+ * @param [in] server: server to modify
+ * @param [in] path: socket path, a path starting with #S_SSL_SERVER_ABSTRACT
+ * names an abstract socket
+ * @param [in] group: group allowed to connect, (gid_t)-1 for none
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_listen_local(struct s_ssl_server *server, const char *path,
+  gid_t group);
+
+/**
+ * @brief Take over the state of the process this one replaces. Must be called
+ * before #s_ssl_server_connect: the workers adopt the handed over listening
+ * sockets instead of binding new ones, #s_ssl_server_listen_local adopts the
+ * local socket and the ticket keys are imported
+ * @param [in] server: server to modify
+ * @param [in, out] handoff: state to take over, owned by the server on
+ * success
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_import(struct s_ssl_server *server,
+  struct s_ssl_handoff *handoff);
+
+/**
+ * @brief Describe the state handed over to the process replacing this one:
+ * the listening sockets of the workers, the local socket and the ticket keys.
+ * The sockets still belong to the server, which is expected to be drained
+ * once the state is sent
+ * @param [in] server: server to browse
+ * @param [out] handoff: state to fill
+ * @return 0 on success, -ENOTCONN if the server doesn't listen, an another
+ * -errno value on error
+ */
+int s_ssl_server_export(struct s_ssl_server *server,
+  struct s_ssl_handoff *handoff);
+
+/**
+ * @brief Stop accepting and drain the connections: each worker closes its
+ * connections a few at a time, the ones without pending output first, and
+ * the last ones by the deadline
+ * @param [in] server: server to drain
+ * @param [in] timeout: drain delay in milliseconds
+ * @param [in] done: callback called once every connection is closed
+ * @param [in] userdata: userdata to pass to the callback
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_server_drain(struct s_ssl_server *server, uint32_t timeout,
+  s_ssl_drained_cbk done, void *userdata);
+
 /**
  * @brief Write a packet in the socket
  * @param [in] server: server concerned by the packet
- * @param [in] name: name of the client which will receive the packet
+ * @param [in] name: name of the client which will receive the packet, see
+ * #s_ssl_connection_get_name
  * @param [in] packet: payload received
  * @return 0 on success, an -errno value on error
  */
@@ -61,21 +297,54 @@ int s_ssl_server_write(struct s_ssl_server *server,
   const char *name, const struct s_ssl_packet *packet);
 
 /**
- * @brief Add a connection to the server
- * @param [in] server: server to modify
- * @param [in] connection: connection to add
+ * @brief Register a connection added to a worker of the server, so a write
+ * finds it with one lookup. It replaces the previous connection of the same
+ * name, whichever worker runs it
+ * @param [in] server: server owning the worker
+ * @param [in] connection: named connection to register
  * @return 0 on success, an -errno value on error
  */
 int s_ssl_server_add_connection(struct s_ssl_server *server,
   struct s_ssl_connection *connection);
 
 /**
- * @brief Remove a connection from the server
- * @param [in] server: server to modify
- * @param [in] connection: connection to remove
- * @return 0 on success, an -errno value on error
+ * @brief Unregister a connection removed from its worker, unless a newer
+ * connection took its name
+ * @param [in] server: server owning the worker
+ * @param [in] connection: connection to unregister
  */
-int s_ssl_server_remove_connection(struct s_ssl_server *server,
+void s_ssl_server_remove_connection(struct s_ssl_server *server,
   struct s_ssl_connection *connection);
 
+/**
+ * @brief Filter used to select the recipients of a broadcast
+ * @param [in] connection: candidate connection
+ * @param [in] userdata: userdata given to #s_ssl_server_broadcast_filtered
+ * @return a non zero value to send the packet to the connection, 0 otherwise
+ */
+typedef int (*s_ssl_filter_cbk)(struct s_ssl_connection *connection,
+  void *userdata);
+
+/**
+ * @brief Send a packet to every established connection. The packet is encoded
+ * once and its memory is shared by every output buffer
+ * @param [in] server: server concerned by the packet
+ * @param [in] packet: payload to send
+ * @return the number of recipients on success, an -errno value on error
+ */
+int s_ssl_server_broadcast(struct s_ssl_server *server,
+  const struct s_ssl_packet *packet);
+
+/**
+ * @brief Send a packet to the established connections accepted by a filter.
+ * The packet is encoded once and its memory is shared by every output buffer
+ * @param [in] server: server concerned by the packet
+ * @param [in] packet: payload to send
+ * @param [in] filter: recipient selection function
+ * @param [in] userdata: userdata given to the filter
+ * @return the number of recipients on success, an -errno value on error
+ */
+int s_ssl_server_broadcast_filtered(struct s_ssl_server *server,
+  const struct s_ssl_packet *packet, s_ssl_filter_cbk filter, void *userdata);
+
 #endif /* !_SSL_SSL_SERVER_H_ */
@@ -0,0 +1,268 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <event2/event.h>
+#include <libdaemon/dlog.h>
+#include <openssl/hmac.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-session.h"
+
+static const unsigned char _g_session_context[] = "cerebrum";
+
+struct s_ssl_session {
+  struct {
+    uint64_t handshakes;
+    uint64_t resumed;
+  } base;
+  uint32_t cache_size;
+  SSL_CTX *context;
+  struct s_ssl_session_key keys[S_SSL_SESSION_KEYS];
+  pthread_rwlock_t lock;
+  struct event *rotation;
+  uint32_t timeout;
+  uint64_t tickets_issued;
+  uint64_t tickets_unknown;
+};
+
+/**
+ * @brief Ticket key callback, called by OpenSSL on every ticket encryption or
+ * decryption, possibly from several worker threads
+ * @return 1 on success, 2 when the ticket must be renewed, 0 when the ticket
+ * is unknown, -1 on error
+ */
+static int _s_ssl_session_ticket(SSL *ssl, unsigned char *name,
+  unsigned char *iv, EVP_CIPHER_CTX *cipher, HMAC_CTX *hmac, int enc)
+{
+  struct s_ssl_session *session = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  daemon_return_val_if_fail(session, -1);
+
+  int ret = 0;
+  pthread_rwlock_rdlock(&session->lock);
+  if (enc) {
+    struct s_ssl_session_key *key = &session->keys[0];
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1 &&
+        EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv) &&
+        HMAC_Init_ex(hmac, key->hmac, sizeof(key->hmac), EVP_sha256(),
+          NULL)) {
+      memcpy(name, key->name, sizeof(key->name));
+      __atomic_add_fetch(&session->tickets_issued, 1, __ATOMIC_RELAXED);
+      ret = 1;
+    } else {
+      ret = -1;
+    }
+    goto end;
+  }
+
+  for (uint32_t i = 0; i < S_SSL_SESSION_KEYS; i++) {
+    struct s_ssl_session_key *key = &session->keys[i];
+    if (!key->valid || memcmp(name, key->name, sizeof(key->name)) != 0)
+      continue;
+    if (!HMAC_Init_ex(hmac, key->hmac, sizeof(key->hmac), EVP_sha256(),
+          NULL) ||
+        !EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv)) {
+      ret = -1;
+      goto end;
+    }
+    /* a ticket issued with an old key is renewed with the current one */
+    ret = i == 0 ? 1 : 2;
+    goto end;
+  }
+  __atomic_add_fetch(&session->tickets_unknown, 1, __ATOMIC_RELAXED);
+
+end:
+  pthread_rwlock_unlock(&session->lock);
+  return ret;
+}
+
+/**
+ * @brief Rotation timer callback
+ */
+static void _s_ssl_session_rotation(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_session *session)
+{
+  daemon_return_if_fail(session);
+
+  s_ssl_session_rotate(session);
+
+  struct s_ssl_session_stats stats;
+  s_ssl_session_get_stats(session, &stats);
+  daemon_log(LOG_INFO, "ssl sessions: %lu/%lu resumed, %u cached\n",
+    (unsigned long)stats.resumed, (unsigned long)stats.handshakes,
+    stats.cached);
+}
+
+/**
+ * @brief Enable the session resumption on a context
+ * @param [in] session: session manager serving the context
+ * @param [in] context: server context to configure
+ * @return 0 on success, an -errno value on error
+ */
+/* codecheck_ignore[SPACING] */
+static int _s_ssl_session_setup(struct s_ssl_session *session,
+  SSL_CTX *context)
+{
+  SSL_CTX_set_app_data(context, session);
+  SSL_CTX_set_session_id_context(context, _g_session_context,
+    sizeof(_g_session_context) - 1);
+  /* a ticket stays valid as long as its key is kept */
+  SSL_CTX_set_timeout(context, session->timeout);
+  if (session->cache_size) {
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, session->cache_size);
+  } else {
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  }
+  if (!SSL_CTX_set_tlsext_ticket_key_cb(context, _s_ssl_session_ticket))
+    return -EBADE;
+  return 0;
+}
+
+struct s_ssl_session *s_ssl_session_new(SSL_CTX *context,
+  struct s_loop *loop, uint32_t cache_size, uint32_t rotation)
+{
+  daemon_return_val_if_fail(context, NULL);
+  daemon_return_val_if_fail(loop, NULL);
+  daemon_return_val_if_fail(rotation > 0, NULL);
+
+  struct s_ssl_session *session = daemon_malloc(sizeof(struct s_ssl_session));
+  session->cache_size = cache_size;
+  session->context = context;
+  pthread_rwlock_init(&session->lock, NULL);
+  session->rotation = event_new(s_loop_tolibevent(loop), -1, EV_PERSIST,
+    (event_callback_fn)_s_ssl_session_rotation, session);
+  session->timeout = rotation * S_SSL_SESSION_KEYS;
+
+  struct timeval tv = { .tv_sec = rotation, .tv_usec = 0 };
+  if (!session->rotation ||
+      s_loop_set_priority(session->rotation, e_loop_priority_control) != 0 ||
+      evtimer_add(session->rotation, &tv) != 0 ||
+      s_ssl_session_rotate(session) != 0 ||
+      _s_ssl_session_setup(session, context) != 0)
+    goto error;
+
+  return session;
+
+error:
+  daemon_log(LOG_ERR, "failed to enable ssl session resumption\n");
+  s_ssl_session_free(session);
+  return NULL;
+}
+
+void s_ssl_session_free(struct s_ssl_session *session)
+{
+  daemon_return_if_fail(session);
+
+  if (SSL_CTX_get_app_data(session->context) == session) {
+    SSL_CTX_set_tlsext_ticket_key_cb(session->context, NULL);
+    SSL_CTX_set_app_data(session->context, NULL);
+  }
+  if (session->rotation) {
+    event_del(session->rotation);
+    event_free(session->rotation);
+  }
+  OPENSSL_cleanse(session->keys, sizeof(session->keys));
+  pthread_rwlock_destroy(&session->lock);
+  daemon_free(session);
+}
+
+/* codecheck_ignore[SPACING] */
+int s_ssl_session_attach(struct s_ssl_session *session, SSL_CTX *context)
+{
+  daemon_return_val_if_fail(session, -EINVAL);
+  daemon_return_val_if_fail(context, -EINVAL);
+
+  int ret = _s_ssl_session_setup(session, context);
+  if (ret != 0)
+    return ret;
+
+  /* the counters of a context start from zero, the previous ones are kept */
+  pthread_rwlock_wrlock(&session->lock);
+  session->base.handshakes += SSL_CTX_sess_accept_good(session->context);
+  session->base.resumed += SSL_CTX_sess_hits(session->context);
+  session->context = context;
+  pthread_rwlock_unlock(&session->lock);
+  return 0;
+}
+
+int s_ssl_session_rotate(struct s_ssl_session *session)
+{
+  daemon_return_val_if_fail(session, -EINVAL);
+
+  struct s_ssl_session_key key;
+  if (RAND_bytes(key.aes, sizeof(key.aes)) != 1 ||
+      RAND_bytes(key.hmac, sizeof(key.hmac)) != 1 ||
+      RAND_bytes(key.name, sizeof(key.name)) != 1)
+    return -EAGAIN;
+  key.valid = 1;
+
+  pthread_rwlock_wrlock(&session->lock);
+  memmove(&session->keys[1], &session->keys[0],
+    sizeof(struct s_ssl_session_key) * (S_SSL_SESSION_KEYS - 1));
+  session->keys[0] = key;
+  pthread_rwlock_unlock(&session->lock);
+
+  OPENSSL_cleanse(&key, sizeof(key));
+  return 0;
+}
+
+int s_ssl_session_export(struct s_ssl_session *session,
+  struct s_ssl_session_key *keys)
+{
+  daemon_return_val_if_fail(session, -EINVAL);
+  daemon_return_val_if_fail(keys, -EINVAL);
+
+  pthread_rwlock_rdlock(&session->lock);
+  memcpy(keys, session->keys, sizeof(session->keys));
+  pthread_rwlock_unlock(&session->lock);
+  return 0;
+}
+
+int s_ssl_session_import(struct s_ssl_session *session,
+  const struct s_ssl_session_key *keys)
+{
+  daemon_return_val_if_fail(session, -EINVAL);
+  daemon_return_val_if_fail(keys, -EINVAL);
+  daemon_return_val_if_fail(keys[0].valid, -EINVAL);
+
+  pthread_rwlock_wrlock(&session->lock);
+  memcpy(session->keys, keys, sizeof(session->keys));
+  pthread_rwlock_unlock(&session->lock);
+  return 0;
+}
+
+int s_ssl_session_get_stats(struct s_ssl_session *session,
+  struct s_ssl_session_stats *stats)
+{
+  daemon_return_val_if_fail(session, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  pthread_rwlock_rdlock(&session->lock);
+  stats->cached = SSL_CTX_sess_number(session->context);
+  stats->handshakes = session->base.handshakes +
+    SSL_CTX_sess_accept_good(session->context);
+  stats->resumed = session->base.resumed +
+    SSL_CTX_sess_hits(session->context);
+  pthread_rwlock_unlock(&session->lock);
+  stats->tickets_issued = __atomic_load_n(&session->tickets_issued,
+    __ATOMIC_RELAXED);
+  stats->tickets_unknown = __atomic_load_n(&session->tickets_unknown,
+    __ATOMIC_RELAXED);
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_SESSION_H_
+# define _SSL_SSL_SESSION_H_
+
+# include <stdint.h>
+# include "ssl.h"
+# include "daemon-loop.h"
+
+/**
+ * @brief Default period, in seconds, between two ticket key rotations
+ */
+# define S_SSL_SESSION_ROTATION 3600
+
+/**
+ * @brief Default number of sessions kept in the server side cache
+ */
+# define S_SSL_SESSION_CACHE_SIZE 4096
+
+/**
+ * @brief Number of ticket keys kept: the current one used to issue tickets and
+ * the previous ones still accepted to decrypt them
+ */
+# define S_SSL_SESSION_KEYS 2
+
+struct s_ssl_session;
+
+/**
+ * @brief Ticket key, the name identifies the key a ticket was issued with
+ */
+struct s_ssl_session_key {
+  uint8_t aes[32];
+  uint8_t hmac[32];
+  uint8_t name[16];
+  uint8_t valid;
+};
+
+/**
+ * @brief Session resumption counters
+ */
+struct s_ssl_session_stats {
+  uint32_t cached;
+  uint64_t handshakes;
+  uint64_t resumed;
+  uint64_t tickets_issued;
+  uint64_t tickets_unknown;
+};
+
+/**
+ * @brief Enable session resumption on a server context: stateless session
+ * tickets encrypted with in-memory keys rotated by a timer, and an optional
+ * bounded server side session cache
+ * @param [in] context: server context to configure
+ * @param [in] loop: loop running the rotation timer
+ * @param [in] cache_size: number of sessions kept in the server side cache,
+ * 0 to only rely on tickets
+ * @param [in] rotation: period in seconds between two key rotations
+ * @return a valid pointer on success, NULL on error
+ */
+/* codecheck_ignore[SPACING] */
+struct s_ssl_session *s_ssl_session_new(SSL_CTX *context,
+  struct s_loop *loop, uint32_t cache_size, uint32_t rotation);
+
+/**
+ * @brief Deallocate a specific session manager. The ticket keys are wiped
+ * @param [in] session: session manager to delete
+ */
+void s_ssl_session_free(struct s_ssl_session *session);
+
+/**
+ * @brief Enable the session resumption on a context replacing the one of the
+ * session manager, its tickets and settings are shared. The previous context
+ * may still serve established connections, it must be released before the
+ * session manager
+ * @param [in] session: session manager to modify
+ * @param [in] context: server context to configure
+ * @return 0 on success, an -errno value on error
+ */
+/* codecheck_ignore[SPACING] */
+int s_ssl_session_attach(struct s_ssl_session *session, SSL_CTX *context);
+
+/**
+ * @brief Rotate the ticket keys now. Tickets issued with the previous keys
+ * are still accepted and renewed until their key is dropped
+ * @param [in] session: session manager to modify
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_session_rotate(struct s_ssl_session *session);
+
+/**
+ * @brief Copy the ticket keys, so another process can resume the sessions of
+ * this one
+ * @param [in] session: session manager to browse
+ * @param [out] keys: #S_SSL_SESSION_KEYS keys to fill, current one first
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_session_export(struct s_ssl_session *session,
+  struct s_ssl_session_key *keys);
+
+/**
+ * @brief Replace the ticket keys by the ones exported by another process. The
+ * tickets it issued are accepted and the rotation goes on from its keys
+ * @param [in] session: session manager to modify
+ * @param [in] keys: #S_SSL_SESSION_KEYS keys, current one first
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_session_import(struct s_ssl_session *session,
+  const struct s_ssl_session_key *keys);
+
+/**
+ * @brief Get the session resumption counters, from any thread
+ * @param [in] session: session manager to browse
+ * @param [out] stats: counters to fill
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_session_get_stats(struct s_ssl_session *session,
+  struct s_ssl_session_stats *stats);
+
+#endif /* !_SSL_SSL_SESSION_H_ */
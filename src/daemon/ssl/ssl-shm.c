@@ -0,0 +1,232 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* memfd_create */
+#endif /* !_GNU_SOURCE */
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <libdaemon/dlog.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "ssl-ring.h"
+#include "ssl-shm.h"
+
+struct s_ssl_shm {
+  struct {
+    s_ssl_shm_cbk cbk;
+    struct event *event;
+    int fd;
+    int peer;
+    void *userdata;
+  } doorbell;
+  uint32_t flags;
+  struct {
+    int fd;
+    uint8_t *map;
+    size_t size;
+  } memory;
+  struct s_ssl_ring *rx;
+  struct s_ssl_ring *tx;
+};
+
+/**
+ * @brief Ring the doorbell of the client
+ * @param [in] shm: channel concerned
+ */
+static void _s_ssl_shm_ring(struct s_ssl_shm *shm)
+{
+  uint64_t u = 1;
+  if (write(shm->doorbell.peer, &u, sizeof(uint64_t)) != sizeof(uint64_t))
+    daemon_log(LOG_WARNING, "failed to ring a doorbell\n");
+}
+
+/**
+ * @brief Doorbell event callback, the counter is reset before the user
+ * callback runs
+ */
+static void _s_ssl_shm_doorbell(evutil_socket_t fd, short e,
+  struct s_ssl_shm *shm)
+{
+  daemon_return_if_fail(shm);
+
+  uint64_t u;
+  if ((e & EV_READ) && read(fd, &u, sizeof(uint64_t)) != sizeof(uint64_t))
+    daemon_log(LOG_WARNING, "spurious doorbell\n");
+  shm->doorbell.cbk(shm->doorbell.userdata);
+}
+
+struct s_ssl_shm *s_ssl_shm_new(struct event_base *base, uint32_t size,
+  uint32_t flags, s_ssl_shm_cbk doorbell, void *userdata)
+{
+  daemon_return_val_if_fail(base, NULL);
+  daemon_return_val_if_fail(size >= S_SSL_SHM_SIZE_MIN, NULL);
+  daemon_return_val_if_fail(size <= S_SSL_SHM_SIZE_MAX, NULL);
+  daemon_return_val_if_fail(!(size & (size - 1)), NULL);
+  daemon_return_val_if_fail(doorbell, NULL);
+
+  struct s_ssl_shm *shm = daemon_malloc(sizeof(struct s_ssl_shm));
+  shm->doorbell.cbk = doorbell;
+  shm->doorbell.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shm->doorbell.peer = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shm->doorbell.userdata = userdata;
+  shm->flags = flags;
+  shm->memory.fd = memfd_create("cerebrum", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  shm->memory.size = 2 * s_ssl_ring_memory_size(size);
+  shm->memory.map = MAP_FAILED;
+
+  if (shm->doorbell.fd < 0 || shm->doorbell.peer < 0 || shm->memory.fd < 0)
+    goto error;
+  /* the client can't shrink the memory under the daemon feet */
+  if (ftruncate(shm->memory.fd, shm->memory.size) != 0 ||
+      fcntl(shm->memory.fd, F_ADD_SEALS,
+        F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    goto error;
+
+  shm->memory.map = mmap(NULL, shm->memory.size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, shm->memory.fd, 0);
+  if (shm->memory.map == MAP_FAILED)
+    goto error;
+  shm->tx = s_ssl_ring_new(shm->memory.map, size);
+  shm->rx = s_ssl_ring_new(shm->memory.map + s_ssl_ring_memory_size(size),
+    size);
+  shm->doorbell.event = event_new(base, shm->doorbell.fd,
+    EV_READ | EV_PERSIST, (event_callback_fn)_s_ssl_shm_doorbell, shm);
+  if (!shm->tx || !shm->rx || !shm->doorbell.event ||
+      event_add(shm->doorbell.event, NULL) != 0)
+    goto error;
+
+  /* the daemon sleeps in its loop until the client writes */
+  s_ssl_ring_wait(shm->rx, S_SSL_RING_READER);
+  return shm;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a shared memory channel\n");
+  s_ssl_shm_free(shm);
+  return NULL;
+}
+
+void s_ssl_shm_free(struct s_ssl_shm *shm)
+{
+  daemon_return_if_fail(shm);
+
+  if (shm->doorbell.event)
+    event_free(shm->doorbell.event);
+  if (shm->rx)
+    s_ssl_ring_free(shm->rx);
+  if (shm->tx)
+    s_ssl_ring_free(shm->tx);
+  if (shm->memory.map != MAP_FAILED)
+    munmap(shm->memory.map, shm->memory.size);
+  if (shm->memory.fd >= 0)
+    close(shm->memory.fd);
+  if (shm->doorbell.fd >= 0)
+    close(shm->doorbell.fd);
+  if (shm->doorbell.peer >= 0)
+    close(shm->doorbell.peer);
+  daemon_free(shm);
+}
+
+int s_ssl_shm_share(struct s_ssl_shm *shm, int sockfd, const uint8_t *data,
+  size_t size)
+{
+  daemon_return_val_if_fail(shm, -EINVAL);
+  daemon_return_val_if_fail(data, -EINVAL);
+
+  int fds[3] = { shm->memory.fd, shm->doorbell.fd, shm->doorbell.peer };
+  union {
+    struct cmsghdr header;
+    uint8_t data[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+  struct msghdr msg = {
+    .msg_control = control.data,
+    .msg_controllen = sizeof(control.data),
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  ssize_t ret = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  if (ret < 0)
+    return -errno;
+  /* a partial answer would break the framing of the socket */
+  return (size_t)ret == size ? 0 : -EPIPE;
+}
+
+void s_ssl_shm_schedule(struct s_ssl_shm *shm)
+{
+  daemon_return_if_fail(shm);
+
+  event_active(shm->doorbell.event, 0, 0);
+}
+
+int s_ssl_shm_send(struct s_ssl_shm *shm, struct evbuffer *output)
+{
+  daemon_return_val_if_fail(shm, -EINVAL);
+  daemon_return_val_if_fail(output, -EINVAL);
+
+  int count = 0;
+  while (evbuffer_get_length(output)) {
+    int ret = s_ssl_ring_write(shm->tx, output);
+    if (ret < 0)
+      return ret;
+    count += ret;
+    /* a full ring waits for the client to release space */
+    if (!evbuffer_get_length(output) ||
+        s_ssl_ring_wait(shm->tx, S_SSL_RING_WRITER) == 0)
+      break;
+  }
+  if (count && !(shm->flags & S_SSL_SHM_FLAG_POLL) &&
+      s_ssl_ring_notify(shm->tx, S_SSL_RING_READER))
+    _s_ssl_shm_ring(shm);
+  return count;
+}
+
+int s_ssl_shm_receive(struct s_ssl_shm *shm, struct evbuffer *input)
+{
+  daemon_return_val_if_fail(shm, -EINVAL);
+  daemon_return_val_if_fail(input, -EINVAL);
+
+  int count = 0;
+  do {
+    int ret = s_ssl_ring_read(shm->rx, input);
+    if (ret < 0)
+      return ret;
+    count += ret;
+    /* a busy client doesn't hold the loop, the reader stays awake and the
+     * rest is read on the next callback */
+    if (count >= S_SSL_SHM_BUDGET) {
+      s_ssl_shm_schedule(shm);
+      break;
+    }
+  } while (s_ssl_ring_wait(shm->rx, S_SSL_RING_READER) != 0);
+
+  if (count && s_ssl_ring_notify(shm->rx, S_SSL_RING_WRITER))
+    _s_ssl_shm_ring(shm);
+  return count;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_SHM_H_
+# define _SSL_SSL_SHM_H_
+
+# include <stdint.h>
+# include <event2/buffer.h>
+# include <event2/event.h>
+
+/**
+ * @brief Default data size of each ring of a channel
+ */
+# define S_SSL_SHM_SIZE (1 << 20)
+
+/**
+ * @brief Smallest data size of a ring
+ */
+# define S_SSL_SHM_SIZE_MIN (1 << 16)
+
+/**
+ * @brief Largest data size of a ring
+ */
+# define S_SSL_SHM_SIZE_MAX (1 << 26)
+
+/**
+ * @brief Bytes read from the client ring per doorbell callback, the loop
+ * serves its other events in between
+ */
+# define S_SSL_SHM_BUDGET (1 << 20)
+
+/**
+ * @brief Request flag: the client busy polls its receive ring, the daemon
+ * never rings its doorbell for new data
+ */
+# define S_SSL_SHM_FLAG_POLL (1 << 0)
+
+/**
+ * @brief Size of a channel request: the ring size then the flags, both as
+ * network order 32 bits integers
+ */
+# define S_SSL_SHM_REQUEST_SIZE 8
+
+/**
+ * @brief Size of a channel answer: a network order 32 bits status, 0 or a
+ * -errno value
+ */
+# define S_SSL_SHM_ANSWER_SIZE 4
+
+/**
+ * @brief Shared memory channel between the daemon and a local client. A
+ * sealed memfd holds two rings: the daemon to client ring at offset 0, then
+ * the client to daemon ring. Each side owns an eventfd doorbell, rung only
+ * when the other side announced it sleeps. A successful answer carries, in
+ * order, the memfd, the daemon doorbell and the client doorbell
+ */
+struct s_ssl_shm;
+
+/**
+ * @brief Call when the doorbell of the daemon rings, or when output is
+ * queued for the channel
+ * @param [in] userdata: userdata given to #s_ssl_shm_new
+ */
+typedef void (*s_ssl_shm_cbk)(void *userdata);
+
+/**
+ * @brief Allocate a new channel
+ * @param [in] base: loop receiving the doorbell
+ * @param [in] size: data size of each ring, a power of two
+ * @param [in] flags: request flags
+ * @param [in] doorbell: callback called from the loop
+ * @param [in] userdata: userdata given to the callback
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_shm *s_ssl_shm_new(struct event_base *base, uint32_t size,
+  uint32_t flags, s_ssl_shm_cbk doorbell, void *userdata);
+
+/**
+ * @brief Deallocate a specific channel, the shared memory is unmapped
+ * @param [in] shm: channel to delete
+ */
+void s_ssl_shm_free(struct s_ssl_shm *shm);
+
+/**
+ * @brief Send the channel answer over a unix socket, with the file
+ * descriptors of the channel attached
+ * @param [in] shm: channel to share
+ * @param [in] sockfd: unix socket of the client
+ * @param [in] data: answer frame, sent in a single message
+ * @param [in] size: answer frame size
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_shm_share(struct s_ssl_shm *shm, int sockfd, const uint8_t *data,
+  size_t size);
+
+/**
+ * @brief Schedule the doorbell callback on the loop, from any thread
+ * @param [in] shm: channel concerned
+ */
+void s_ssl_shm_schedule(struct s_ssl_shm *shm);
+
+/**
+ * @brief Move an output buffer to the daemon to client ring. What doesn't fit
+ * stays in the buffer until the client releases space
+ * @param [in] shm: channel to use
+ * @param [in] output: buffer to drain
+ * @return the number of bytes moved on success, an -errno value on error
+ */
+int s_ssl_shm_send(struct s_ssl_shm *shm, struct evbuffer *output);
+
+/**
+ * @brief Move the content of the client to daemon ring to an input buffer, up
+ * to #S_SSL_SHM_BUDGET bytes: the doorbell is scheduled again for the rest
+ * @param [in] shm: channel to use
+ * @param [in] input: buffer to fill
+ * @return the number of bytes moved on success, an -errno value on error
+ */
+int s_ssl_shm_receive(struct s_ssl_shm *shm, struct evbuffer *input);
+
+#endif /* !_SSL_SSL_SHM_H_ */
@@ -0,0 +1,372 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+#include "daemon-list.h"
+#include "ssl-frame.h"
+#include "ssl-stream.h"
+
+/**
+ * @brief Stream to the peer
+ */
+struct s_ssl_stream {
+  uint32_t credit;
+  uint32_t deficit;
+  uint8_t fin;
+  uint32_t id;
+  struct evbuffer *queue;
+  uint8_t scheduled;
+  struct s_ssl_stream_stats stats;
+  uint16_t type;
+  uint8_t weight;
+};
+
+/**
+ * @brief Stream from the peer
+ */
+struct s_ssl_stream_peer {
+  uint32_t consumed;
+  uint8_t fin;
+  uint32_t id;
+  uint32_t window;
+};
+
+struct s_ssl_streams {
+  struct s_list *active;
+  struct s_hash *incoming;
+  struct s_hash *outgoing;
+  uint32_t window;
+};
+
+/**
+ * @brief Hash a stream id
+ * @param [in] key: pointer to the 32 bits id
+ * @return the hash value
+ */
+static uint32_t _s_ssl_stream_hash(const void *key)
+{
+  return *(const uint32_t *)key * 0x9e3779b1U;
+}
+
+/**
+ * @brief Compare two stream ids
+ * @return a non zero value if both ids are equal, 0 otherwise
+ */
+static int _s_ssl_stream_equal(const void *a, const void *b)
+{
+  return *(const uint32_t *)a == *(const uint32_t *)b;
+}
+
+/**
+ * @brief Deallocate a stream to the peer
+ * @param [in] stream: stream to delete
+ */
+static void _s_ssl_stream_free(struct s_ssl_stream *stream)
+{
+  if (stream->queue)
+    evbuffer_free(stream->queue);
+  daemon_free(stream);
+}
+
+/**
+ * @brief Put a stream at the end of the round if it can send something: data
+ * with credit, or its fin once drained
+ * @param [in] streams: streams to modify
+ * @param [in] stream: stream to check
+ * @return 1 if the stream is scheduled, 0 otherwise
+ */
+static int _s_ssl_stream_schedule(struct s_ssl_streams *streams,
+  struct s_ssl_stream *stream)
+{
+  size_t queued = evbuffer_get_length(stream->queue);
+  if (stream->scheduled)
+    return 1;
+  if (!(queued && stream->credit) && !(stream->fin && !queued))
+    return 0;
+
+  streams->active = s_list_append(streams->active, stream);
+  stream->scheduled = 1;
+  return 1;
+}
+
+/**
+ * @brief Serve a stream for one round
+ * @param [in] streams: streams to modify
+ * @param [in] stream: stream to serve
+ * @param [in] output: buffer receiving the frames
+ * @param [in] budget: number of bytes the output may still take
+ * @return the number of bytes moved
+ */
+static size_t _s_ssl_stream_serve(struct s_ssl_streams *streams,
+  struct s_ssl_stream *stream, struct evbuffer *output, size_t budget)
+{
+  uint8_t data[S_SSL_FRAME_HEADER_SIZE + S_SSL_STREAM_ID_SIZE];
+  uint32_t id = htonl(stream->id);
+  size_t written = 0;
+
+  stream->deficit += S_SSL_STREAM_QUANTUM * stream->weight;
+  while (stream->deficit && written + sizeof(data) < budget) {
+    size_t queued = evbuffer_get_length(stream->queue);
+    size_t size = queued;
+    if (size > stream->credit)
+      size = stream->credit;
+    if (size > stream->deficit)
+      size = stream->deficit;
+    if (size > S_SSL_STREAM_QUANTUM)
+      size = S_SSL_STREAM_QUANTUM;
+    if (size > budget - written - sizeof(data))
+      size = budget - written - sizeof(data);
+    if (!size && !(stream->fin && !queued))
+      break;
+
+    uint8_t fin = stream->fin && size == queued;
+    struct s_ssl_frame_header header = {
+      .size = size + S_SSL_STREAM_ID_SIZE,
+      .type = stream->type,
+      .flags = S_SSL_FRAME_FLAG_STREAM | (fin ? S_SSL_FRAME_FLAG_FIN : 0)
+    };
+    s_ssl_frame_header_encode(&header, data);
+    memcpy(data + S_SSL_FRAME_HEADER_SIZE, &id, sizeof(id));
+    if (evbuffer_add(output, data, sizeof(data)) != 0 ||
+        evbuffer_remove_buffer(stream->queue, output, size) != (int)size) {
+      daemon_log(LOG_ERR, "failed to queue the stream %u\n", stream->id);
+      break;
+    }
+    stream->credit -= size;
+    stream->deficit = stream->deficit > size ? stream->deficit - size : 0;
+    stream->stats.sent += size;
+    written += sizeof(data) + size;
+
+    if (fin) {
+      s_hash_remove(streams->outgoing, &stream->id);
+      return written;
+    }
+  }
+
+  /* an idle stream doesn't save its unused quantum for later */
+  size_t queued = evbuffer_get_length(stream->queue);
+  if (!queued || !stream->credit)
+    stream->deficit = 0;
+  if (queued && !stream->credit)
+    stream->stats.stalls++;
+  _s_ssl_stream_schedule(streams, stream);
+  return written;
+}
+
+struct s_ssl_streams *s_ssl_streams_new(uint32_t window)
+{
+  daemon_return_val_if_fail(window, NULL);
+
+  struct s_ssl_streams *streams = daemon_malloc(sizeof(struct s_ssl_streams));
+  streams->incoming = s_hash_new(_s_ssl_stream_hash, _s_ssl_stream_equal, NULL,
+    (s_destroy_cbk)daemon_free);
+  streams->outgoing = s_hash_new(_s_ssl_stream_hash, _s_ssl_stream_equal, NULL,
+    (s_destroy_cbk)_s_ssl_stream_free);
+  streams->window = window;
+  if (!streams->incoming || !streams->outgoing) {
+    daemon_log(LOG_ERR, "failed to allocate the streams\n");
+    s_ssl_streams_free(streams);
+    return NULL;
+  }
+  return streams;
+}
+
+void s_ssl_streams_free(struct s_ssl_streams *streams)
+{
+  daemon_return_if_fail(streams);
+
+  s_list_free(streams->active);
+  if (streams->incoming)
+    s_hash_free(streams->incoming);
+  if (streams->outgoing)
+    s_hash_free(streams->outgoing);
+  daemon_free(streams);
+}
+
+int s_ssl_streams_open(struct s_ssl_streams *streams, uint32_t id,
+  uint16_t type, uint8_t weight)
+{
+  daemon_return_val_if_fail(streams, -EINVAL);
+  daemon_return_val_if_fail(id, -EINVAL);
+  daemon_return_val_if_fail(weight, -EINVAL);
+
+  if (s_hash_lookup(streams->outgoing, &id))
+    return -EEXIST;
+
+  struct s_ssl_stream *stream = daemon_malloc(sizeof(struct s_ssl_stream));
+  stream->credit = streams->window;
+  stream->id = id;
+  stream->queue = evbuffer_new();
+  stream->type = type;
+  stream->weight = weight;
+  int ret = stream->queue ? s_hash_insert(streams->outgoing, &stream->id,
+    stream) : -ENOMEM;
+  if (ret != 0)
+    _s_ssl_stream_free(stream);
+  return ret;
+}
+
+int s_ssl_streams_close(struct s_ssl_streams *streams, uint32_t id)
+{
+  daemon_return_val_if_fail(streams, -EINVAL);
+
+  struct s_ssl_stream *stream = s_hash_lookup(streams->outgoing, &id);
+  if (!stream || stream->fin)
+    return -ENOENT;
+
+  stream->fin = 1;
+  _s_ssl_stream_schedule(streams, stream);
+  return 0;
+}
+
+int s_ssl_streams_push(struct s_ssl_streams *streams, uint32_t id,
+  const uint8_t *data, size_t size)
+{
+  daemon_return_val_if_fail(streams, -EINVAL);
+  daemon_return_val_if_fail(data || !size, -EINVAL);
+
+  struct s_ssl_stream *stream = s_hash_lookup(streams->outgoing, &id);
+  if (!stream)
+    return -ENOENT;
+  if (stream->fin)
+    return -EPIPE;
+  if (evbuffer_get_length(stream->queue) + size > S_SSL_STREAM_BACKLOG)
+    return -ENOBUFS;
+  if (evbuffer_add(stream->queue, data, size) != 0)
+    return -ENOMEM;
+
+  _s_ssl_stream_schedule(streams, stream);
+  return 0;
+}
+
+size_t s_ssl_streams_pop(struct s_ssl_streams *streams, struct evbuffer *output,
+  size_t budget)
+{
+  daemon_return_val_if_fail(streams, 0);
+  daemon_return_val_if_fail(output, 0);
+
+  size_t written = 0;
+  while (streams->active && written < budget) {
+    struct s_list *head = streams->active;
+    struct s_ssl_stream *stream = s_list_data(head);
+    streams->active = s_list_delete_link(streams->active, head);
+    stream->scheduled = 0;
+
+    size_t size = _s_ssl_stream_serve(streams, stream, output,
+      budget - written);
+    /* not even a header fits anymore */
+    if (!size && stream->scheduled)
+      break;
+    written += size;
+  }
+  return written;
+}
+
+int s_ssl_streams_credit(struct s_ssl_streams *streams, const uint8_t *data)
+{
+  daemon_return_val_if_fail(streams, 0);
+  daemon_return_val_if_fail(data, 0);
+
+  uint32_t id, increment;
+  memcpy(&id, data, sizeof(uint32_t));
+  memcpy(&increment, data + 4, sizeof(uint32_t));
+  id = ntohl(id);
+  increment = ntohl(increment);
+
+  /* the stream may be closed while the update was on its way */
+  struct s_ssl_stream *stream = s_hash_lookup(streams->outgoing, &id);
+  if (!stream)
+    return 0;
+  stream->credit = UINT32_MAX - stream->credit < increment ? UINT32_MAX :
+    stream->credit + increment;
+  return _s_ssl_stream_schedule(streams, stream);
+}
+
+int s_ssl_streams_received(struct s_ssl_streams *streams, uint32_t id,
+  uint32_t size, uint16_t flags)
+{
+  daemon_return_val_if_fail(streams, -EINVAL);
+
+  struct s_ssl_stream_peer *peer = s_hash_lookup(streams->incoming, &id);
+  if (!peer) {
+    if (!id || s_hash_size(streams->incoming) >= S_SSL_STREAM_MAX)
+      return -EPROTO;
+    peer = daemon_malloc(sizeof(struct s_ssl_stream_peer));
+    peer->id = id;
+    peer->window = streams->window;
+    if (s_hash_insert(streams->incoming, &peer->id, peer) != 0) {
+      daemon_free(peer);
+      return -ENOMEM;
+    }
+  }
+  if (peer->fin || size > peer->window)
+    return -EPROTO;
+
+  peer->window -= size;
+  peer->fin = !!(flags & S_SSL_FRAME_FLAG_FIN);
+  return 0;
+}
+
+int s_ssl_streams_consumed(struct s_ssl_streams *streams, uint32_t id,
+  uint32_t size, uint8_t *data)
+{
+  daemon_return_val_if_fail(streams, 0);
+  daemon_return_val_if_fail(data, 0);
+
+  struct s_ssl_stream_peer *peer = s_hash_lookup(streams->incoming, &id);
+  if (!peer)
+    return 0;
+  if (peer->fin) {
+    s_hash_remove(streams->incoming, &id);
+    return 0;
+  }
+
+  /* small updates would cost more than the frames they unblock */
+  peer->consumed += size;
+  if (peer->consumed < streams->window / 2)
+    return 0;
+
+  uint32_t value = htonl(id);
+  memcpy(data, &value, sizeof(uint32_t));
+  value = htonl(peer->consumed);
+  memcpy(data + 4, &value, sizeof(uint32_t));
+  peer->window += peer->consumed;
+  peer->consumed = 0;
+  return 1;
+}
+
+int s_ssl_streams_get_stats(struct s_ssl_streams *streams, uint32_t id,
+  struct s_ssl_stream_stats *stats)
+{
+  daemon_return_val_if_fail(streams, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  struct s_ssl_stream *stream = s_hash_lookup(streams->outgoing, &id);
+  if (!stream)
+    return -ENOENT;
+
+  *stats = stream->stats;
+  stats->credit = stream->credit;
+  stats->queued = evbuffer_get_length(stream->queue);
+  return 0;
+}
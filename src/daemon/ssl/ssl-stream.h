@@ -0,0 +1,179 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_STREAM_H_
+# define _SSL_SSL_STREAM_H_
+
+# include <stdint.h>
+# include <event2/buffer.h>
+
+/**
+ * @brief Credit, in bytes, a stream starts with and the receiver grants back
+ */
+# define S_SSL_STREAM_WINDOW (256 * 1024)
+
+/**
+ * @brief Bytes a stream of weight 1 may send per scheduling round, also the
+ * biggest stream frame payload
+ */
+# define S_SSL_STREAM_QUANTUM (16 * 1024)
+
+/**
+ * @brief Output, in bytes, the scheduler keeps queued on the connection. The
+ * rest waits in the stream queues, so a frame written outside of a stream is
+ * never queued behind more than this
+ */
+# define S_SSL_STREAM_DEPTH (64 * 1024)
+
+/**
+ * @brief Bytes a stream may keep queued before its writes are refused
+ */
+# define S_SSL_STREAM_BACKLOG (4 * 1024 * 1024)
+
+/**
+ * @brief Maximum number of streams opened by the peer at once
+ */
+# define S_SSL_STREAM_MAX 256
+
+/**
+ * @brief Size of the stream id prefixing a stream frame payload
+ */
+# define S_SSL_STREAM_ID_SIZE 4
+
+/**
+ * @brief Size of a window update: stream id and increment
+ */
+# define S_SSL_STREAM_UPDATE_SIZE 8
+
+struct s_ssl_streams;
+
+/**
+ * @brief Stream counters
+ */
+struct s_ssl_stream_stats {
+  uint32_t credit;
+  uint32_t queued;
+  uint64_t sent;
+  uint64_t stalls;
+};
+
+/**
+ * @brief Allocate the streams of a connection. A stream is a one way flow of
+ * messages of the same type, identified by a non zero id chosen by the
+ * sender; both peers may use the same id for their own direction. The
+ * structure isn't locked, its owner serializes the calls
+ * @param [in] window: initial credit of each stream, in bytes
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_streams *s_ssl_streams_new(uint32_t window);
+
+/**
+ * @brief Deallocate the streams, queued data is discarded
+ * @param [in] streams: streams to delete
+ */
+void s_ssl_streams_free(struct s_ssl_streams *streams);
+
+/**
+ * @brief Open a stream to the peer
+ * @param [in] streams: streams to modify
+ * @param [in] id: stream id, not 0
+ * @param [in] type: message type of the stream frames
+ * @param [in] weight: share of the link the stream gets when several are
+ * busy, from 1 to 255
+ * @return 0 on success, -EEXIST if the stream is already open, an another
+ * -errno value on error
+ */
+int s_ssl_streams_open(struct s_ssl_streams *streams, uint32_t id,
+  uint16_t type, uint8_t weight);
+
+/**
+ * @brief Close a stream to the peer. The data already queued is sent, the
+ * last frame carrying #S_SSL_FRAME_FLAG_FIN
+ * @param [in] streams: streams to modify
+ * @param [in] id: stream id
+ * @return 0 on success, -ENOENT if the stream isn't open
+ */
+int s_ssl_streams_close(struct s_ssl_streams *streams, uint32_t id);
+
+/**
+ * @brief Queue data on a stream. The data is cut in frames by
+ * #s_ssl_streams_pop
+ * @param [in] streams: streams to modify
+ * @param [in] id: stream id
+ * @param [in] data: bytes to send
+ * @param [in] size: number of bytes
+ * @return 0 on success, -ENOENT if the stream isn't open, -EPIPE if it is
+ * closing, -ENOBUFS if its queue is full
+ */
+int s_ssl_streams_push(struct s_ssl_streams *streams, uint32_t id,
+  const uint8_t *data, size_t size);
+
+/**
+ * @brief Move stream frames to the output. The streams holding data and
+ * credit are served in turn, each getting a quantum proportional to its
+ * weight per round (deficit round robin)
+ * @param [in] streams: streams to browse
+ * @param [in] output: buffer receiving the frames
+ * @param [in] budget: number of bytes the output may still take
+ * @return the number of bytes moved
+ */
+size_t s_ssl_streams_pop(struct s_ssl_streams *streams, struct evbuffer *output,
+  size_t budget);
+
+/**
+ * @brief Apply a window update sent by the peer
+ * @param [in] streams: streams to modify
+ * @param [in] data: #S_SSL_STREAM_UPDATE_SIZE bytes update
+ * @return 1 if a stream has something to send again, 0 otherwise
+ */
+int s_ssl_streams_credit(struct s_ssl_streams *streams, const uint8_t *data);
+
+/**
+ * @brief Account a stream frame received from the peer
+ * @param [in] streams: streams to modify
+ * @param [in] id: stream id
+ * @param [in] size: payload size, stream id excluded
+ * @param [in] flags: frame flags
+ * @return 0 on success, -EPROTO if the peer went over its credit or opened
+ * too many streams
+ */
+int s_ssl_streams_received(struct s_ssl_streams *streams, uint32_t id,
+  uint32_t size, uint16_t flags);
+
+/**
+ * @brief Account a stream frame consumed by the application. The credit is
+ * granted back by batches of half a window
+ * @param [in] streams: streams to modify
+ * @param [in] id: stream id
+ * @param [in] size: payload size, stream id excluded
+ * @param [out] data: #S_SSL_STREAM_UPDATE_SIZE bytes update to send
+ * @return 1 if the update must be sent, 0 otherwise
+ */
+int s_ssl_streams_consumed(struct s_ssl_streams *streams, uint32_t id,
+  uint32_t size, uint8_t *data);
+
+/**
+ * @brief Get the counters of a stream to the peer
+ * @param [in] streams: streams to browse
+ * @param [in] id: stream id
+ * @param [out] stats: counters to fill
+ * @return 0 on success, -ENOENT if the stream isn't open
+ */
+int s_ssl_streams_get_stats(struct s_ssl_streams *streams, uint32_t id,
+  struct s_ssl_stream_stats *stats);
+
+#endif /* !_SSL_SSL_STREAM_H_ */
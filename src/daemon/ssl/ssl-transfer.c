@@ -0,0 +1,1271 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <libdaemon/dlog.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-hash.h"
+#include "daemon-list.h"
+#include "ssl-frame.h"
+#include "ssl-transfer.h"
+
+/**
+ * @brief Size of an offer: id, size and chunk size
+ */
+#define S_SSL_TRANSFER_OFFER_SIZE 24
+
+/**
+ * @brief Size of an accept or of an ack: id, offset and status
+ */
+#define S_SSL_TRANSFER_ANSWER_SIZE 20
+
+/**
+ * @brief Size of the header prefixing the data of a chunk: id, offset and
+ * crc32
+ */
+#define S_SSL_TRANSFER_HEADER_SIZE 24
+
+/**
+ * @brief Smallest chunk size accepted
+ */
+#define S_SSL_TRANSFER_CHUNK_MIN 4096
+
+/**
+ * @brief Number of received chunks waiting for the storage thread before the
+ * next ones are refused with -EBUSY, and sent again by the peer
+ */
+#define S_SSL_TRANSFER_QUEUE 64
+
+/**
+ * @brief Chunk states, a chunk in flight holds its lane index plus one
+ */
+#define S_SSL_TRANSFER_PENDING 0
+#define S_SSL_TRANSFER_ACKED 0xff
+
+enum e_ssl_transfer_state {
+  e_ssl_transfer_offering,
+  e_ssl_transfer_running,
+  e_ssl_transfer_done
+};
+
+/**
+ * @brief Connection a transfer is striped on, referenced by the transfer
+ */
+struct s_ssl_transfer_lane {
+  uint8_t alive;
+  struct s_ssl_connection *connection;
+  uint32_t inflight;
+  uint64_t last;
+};
+
+struct s_ssl_transfer {
+  uint32_t acked;
+  uint32_t chunk;
+  uint32_t count;
+  const uint8_t *data;
+  uint32_t done;
+  int fd;
+  uint64_t id;
+  struct {
+    uint8_t count;
+    struct s_ssl_transfer_lane list[S_SSL_TRANSFER_LANES];
+    uint8_t offer;
+  } lanes;
+  uint32_t next;
+  uint64_t offered;
+  uint64_t size;
+  enum e_ssl_transfer_state state;
+  uint8_t *states;
+  struct s_ssl_transfer_stats stats;
+  struct s_ssl_transfers *transfers;
+};
+
+/**
+ * @brief Transfer received from a peer
+ */
+struct s_ssl_transfer_incoming {
+  uint8_t *bitmap;
+  uint32_t chunk;
+  uint32_t contiguous;
+  uint32_t count;
+  int fd;
+  uint64_t id;
+  uint64_t last;
+  uint32_t received;
+  uint64_t size;
+  uint8_t storing;
+};
+
+struct s_ssl_transfers {
+  struct s_ssl_transfer_funcs funcs;
+  struct s_hash *incoming;
+  pthread_mutex_t lock;
+  struct s_hash *outgoing;
+  struct {
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    struct s_list *jobs;
+    uint32_t queued;
+    struct s_ssl_transfer_job *running;
+    uint8_t started;
+    uint8_t stop;
+    pthread_t thread;
+  } storage;
+  struct event *timer;
+  void *userdata;
+};
+
+enum e_ssl_transfer_job {
+  e_ssl_transfer_job_send,
+  e_ssl_transfer_job_store
+};
+
+/**
+ * @brief Chunk handed to the storage thread: a chunk to read and send, its
+ * source being copied from the transfer, or a received chunk to check and
+ * store
+ */
+struct s_ssl_transfer_job {
+  struct evbuffer *body;
+  struct s_ssl_connection *connection;
+  uint32_t crc;
+  const uint8_t *data;
+  int fd;
+  uint64_t id;
+  uint32_t index;
+  uint8_t lane;
+  uint32_t length;
+  uint64_t offset;
+  enum e_ssl_transfer_job type;
+};
+
+/**
+ * @brief Get the monotonic time
+ * @return the time in milliseconds
+ */
+static uint64_t _s_ssl_transfer_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Hash a transfer id
+ * @param [in] key: pointer to the 64 bits id
+ * @return the hash value
+ */
+static uint32_t _s_ssl_transfer_hash(const void *key)
+{
+  uint64_t id = *(const uint64_t *)key;
+  return (uint32_t)(id ^ (id >> 32));
+}
+
+/**
+ * @brief Compare two transfer ids
+ * @return a non zero value if both ids are equal, 0 otherwise
+ */
+static int _s_ssl_transfer_equal(const void *a, const void *b)
+{
+  return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+/**
+ * @brief Compute the crc32 of the first bytes of a buffer, without copying
+ * them
+ * @param [in] buffer: buffer to browse
+ * @param [in] length: number of bytes
+ * @return the crc32 value
+ */
+static uint32_t _s_ssl_transfer_crc(struct evbuffer *buffer, size_t length)
+{
+  uLong crc = crc32(0L, Z_NULL, 0);
+  struct evbuffer_ptr ptr;
+  struct evbuffer_iovec vec;
+
+  evbuffer_ptr_set(buffer, &ptr, 0, EVBUFFER_PTR_SET);
+  while (length && evbuffer_peek(buffer, length, &ptr, &vec, 1) > 0) {
+    size_t size = vec.iov_len < length ? vec.iov_len : length;
+    crc = crc32(crc, vec.iov_base, size);
+    length -= size;
+    evbuffer_ptr_set(buffer, &ptr, size, EVBUFFER_PTR_ADD);
+  }
+  return crc;
+}
+
+/**
+ * @brief Write the first bytes of a buffer in a file
+ * @param [in] buffer: buffer to browse
+ * @param [in] length: number of bytes
+ * @param [in] fd: file to write
+ * @param [in] offset: offset in the file
+ * @return 0 on success, an -errno value on error
+ */
+static int _s_ssl_transfer_write(struct evbuffer *buffer, size_t length,
+  int fd, uint64_t offset)
+{
+  struct evbuffer_ptr ptr;
+  struct evbuffer_iovec vec;
+
+  evbuffer_ptr_set(buffer, &ptr, 0, EVBUFFER_PTR_SET);
+  while (length && evbuffer_peek(buffer, length, &ptr, &vec, 1) > 0) {
+    size_t size = vec.iov_len < length ? vec.iov_len : length;
+    ssize_t ret = pwrite(fd, vec.iov_base, size, offset);
+    if (ret <= 0)
+      return ret < 0 ? -errno : -EIO;
+    length -= ret;
+    offset += ret;
+    evbuffer_ptr_set(buffer, &ptr, ret, EVBUFFER_PTR_ADD);
+  }
+  return length ? -EIO : 0;
+}
+
+/**
+ * @brief Write a 32 bits value in network order
+ */
+static void _s_ssl_transfer_encode(uint32_t value, uint8_t *data)
+{
+  value = htonl(value);
+  memcpy(data, &value, sizeof(uint32_t));
+}
+
+/**
+ * @brief Read a 32 bits value in network order
+ */
+static uint32_t _s_ssl_transfer_decode(const uint8_t *data)
+{
+  uint32_t value;
+  memcpy(&value, data, sizeof(uint32_t));
+  return ntohl(value);
+}
+
+/**
+ * @brief Send an accept or an ack to the peer
+ * @param [in] connection: connection of the peer
+ * @param [in] type: #S_SSL_TRANSFER_TYPE_ACCEPT or #S_SSL_TRANSFER_TYPE_ACK
+ * @param [in] id: transfer id
+ * @param [in] offset: offset answered
+ * @param [in] status: 0 or an -errno value
+ */
+static void _s_ssl_transfer_answer(struct s_ssl_connection *connection,
+  uint16_t type, uint64_t id, uint64_t offset, int32_t status)
+{
+  uint8_t data[S_SSL_TRANSFER_ANSWER_SIZE];
+  s_ssl_frame_id_encode(id, data);
+  s_ssl_frame_id_encode(offset, data + 8);
+  _s_ssl_transfer_encode((uint32_t)status, data + 16);
+
+  struct s_ssl_packet packet = {
+    .flags = 0,
+    .payload = data,
+    .pool = NULL,
+    .size = sizeof(data),
+    .type = type
+  };
+  if (s_ssl_connection_write(connection, &packet) != 0)
+    daemon_log(LOG_WARNING, "failed to answer a transfer\n");
+}
+
+/**
+ * @brief Size of a chunk, the last one may be shorter
+ */
+static uint32_t _s_ssl_transfer_length(uint64_t size, uint32_t chunk,
+  uint32_t index)
+{
+  uint64_t offset = (uint64_t)index * chunk;
+  return size - offset < chunk ? size - offset : chunk;
+}
+
+/**
+ * @brief Build the payload of a chunk: its header then its data. File data is
+ * mapped by libevent, the descriptor being closed with the chain
+ * @param [in] job: chunk to read
+ * @return a valid pointer on success, NULL on error
+ */
+static struct evbuffer *_s_ssl_transfer_body(struct s_ssl_transfer_job *job)
+{
+  struct evbuffer *body = evbuffer_new();
+  daemon_return_val_if_fail(body, NULL);
+
+  int ret = -1;
+  if (job->data) {
+    ret = evbuffer_add(body, job->data, job->length);
+  } else {
+    int fd = dup(job->fd);
+    if (fd >= 0)
+      ret = evbuffer_add_file(body, fd, job->offset, job->length);
+  }
+
+  uint8_t header[S_SSL_TRANSFER_HEADER_SIZE] = { 0 };
+  s_ssl_frame_id_encode(job->id, header);
+  s_ssl_frame_id_encode(job->offset, header + 8);
+  if (ret == 0) {
+    _s_ssl_transfer_encode(_s_ssl_transfer_crc(body, job->length),
+      header + 16);
+    ret = evbuffer_prepend(body, header, sizeof(header));
+  }
+  if (ret != 0) {
+    daemon_log(LOG_ERR, "failed to read a chunk\n");
+    evbuffer_free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/**
+ * @brief Deallocate a job
+ * @param [in] job: job to delete
+ */
+static void _s_ssl_transfer_job_free(struct s_ssl_transfer_job *job)
+{
+  daemon_return_if_fail(job);
+
+  if (job->body)
+    evbuffer_free(job->body);
+  s_ssl_connection_unref(job->connection);
+  daemon_free(job);
+}
+
+/**
+ * @brief Hand a job to the storage thread. The engine must be locked
+ * @param [in] transfers: engine running the job
+ * @param [in] job: job to queue, owned by the engine
+ */
+static void _s_ssl_transfer_queue(struct s_ssl_transfers *transfers,
+  struct s_ssl_transfer_job *job)
+{
+  transfers->storage.jobs = s_list_append(transfers->storage.jobs, job);
+  if (job->type == e_ssl_transfer_job_store)
+    transfers->storage.queued++;
+  pthread_cond_broadcast(&transfers->storage.cond);
+}
+
+/**
+ * @brief Put a chunk in flight back in the pending ones
+ * @param [in] transfer: transfer to modify
+ * @param [in] index: chunk index
+ */
+static void _s_ssl_transfer_revert(struct s_ssl_transfer *transfer,
+  uint32_t index)
+{
+  uint8_t state = transfer->states[index];
+  if (state == S_SSL_TRANSFER_PENDING || state == S_SSL_TRANSFER_ACKED)
+    return;
+
+  transfer->lanes.list[state - 1].inflight--;
+  transfer->states[index] = S_SSL_TRANSFER_PENDING;
+  if (index < transfer->next)
+    transfer->next = index;
+}
+
+/**
+ * @brief Fill the window of a lane with pending chunks, they are read and
+ * sent by the storage thread. The engine must be locked
+ * @param [in] transfer: transfer to send
+ * @param [in] lane: lane index
+ */
+static void _s_ssl_transfer_pick(struct s_ssl_transfer *transfer, uint8_t lane)
+{
+  struct s_ssl_transfer_lane *l = &transfer->lanes.list[lane];
+
+  while (transfer->state == e_ssl_transfer_running && l->alive &&
+         l->inflight < S_SSL_TRANSFER_WINDOW &&
+         transfer->next < transfer->count) {
+    uint32_t index = transfer->next++;
+    if (transfer->states[index] != S_SSL_TRANSFER_PENDING)
+      continue;
+    if (!l->inflight)
+      l->last = _s_ssl_transfer_now();
+    l->inflight++;
+    transfer->states[index] = lane + 1;
+
+    struct s_ssl_transfer_job *job = daemon_malloc(
+      sizeof(struct s_ssl_transfer_job));
+    job->connection = s_ssl_connection_ref(l->connection);
+    job->fd = transfer->fd;
+    job->id = transfer->id;
+    job->index = index;
+    job->lane = lane;
+    job->length = _s_ssl_transfer_length(transfer->size, transfer->chunk,
+      index);
+    job->offset = (uint64_t)index * transfer->chunk;
+    job->data = transfer->data ? transfer->data + job->offset : NULL;
+    job->type = e_ssl_transfer_job_send;
+    _s_ssl_transfer_queue(transfer->transfers, job);
+  }
+}
+
+/**
+ * @brief Read a chunk and write it to its lane, from the storage thread. A
+ * chunk which couldn't be written goes back to the pending ones
+ * @param [in] transfers: engine running the transfer
+ * @param [in] job: chunk to send
+ */
+static void _s_ssl_transfer_send(struct s_ssl_transfers *transfers,
+  struct s_ssl_transfer_job *job)
+{
+  struct evbuffer *body = _s_ssl_transfer_body(job);
+  int ret = body ? s_ssl_connection_write_buffer(job->connection,
+    S_SSL_TRANSFER_TYPE_CHUNK, body) : -EIO;
+  if (body)
+    evbuffer_free(body);
+
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer *transfer = s_hash_lookup(transfers->outgoing,
+    &job->id);
+  if (transfer && transfer->states[job->index] == job->lane + 1) {
+    transfer->lanes.list[job->lane].alive = ret != -ENOTCONN;
+    if (ret == 0)
+      transfer->stats.sent++;
+    else
+      _s_ssl_transfer_revert(transfer, job->index);
+  }
+  pthread_mutex_unlock(&transfers->lock);
+}
+
+/**
+ * @brief Mark a transfer done once every chunk is acknowledged. The engine
+ * must be locked
+ * @param [in] transfer: transfer to check
+ * @return 1 if the transfer just completed, 0 otherwise
+ */
+static int _s_ssl_transfer_complete(struct s_ssl_transfer *transfer)
+{
+  while (transfer->acked < transfer->count &&
+         transfer->states[transfer->acked] == S_SSL_TRANSFER_ACKED)
+    transfer->acked++;
+  uint64_t acknowledged = (uint64_t)transfer->acked * transfer->chunk;
+  transfer->stats.acknowledged = acknowledged < transfer->size ?
+    acknowledged : transfer->size;
+
+  if (transfer->state != e_ssl_transfer_running ||
+      transfer->done < transfer->count)
+    return 0;
+  transfer->state = e_ssl_transfer_done;
+  return 1;
+}
+
+/**
+ * @brief Offer handler: an incoming transfer is created, or the one known
+ * answers the offset it reached
+ */
+static void _s_ssl_transfer_offer(struct s_ssl_transfers *transfers,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
+{
+  if (view->size < S_SSL_TRANSFER_OFFER_SIZE) {
+    s_ssl_packet_view_release(view);
+    return;
+  }
+  const uint8_t *data = s_ssl_packet_view_pullup(view);
+  uint64_t id = s_ssl_frame_id_decode(data);
+  uint64_t size = s_ssl_frame_id_decode(data + 8);
+  uint32_t chunk = _s_ssl_transfer_decode(data + 16);
+  s_ssl_packet_view_release(view);
+
+  uint64_t count = chunk ? (size + chunk - 1) / chunk : 0;
+  if (chunk < S_SSL_TRANSFER_CHUNK_MIN || chunk > S_SSL_FRAME_MAX_SIZE -
+      S_SSL_TRANSFER_HEADER_SIZE || count > UINT32_MAX) {
+    _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACCEPT, id, 0,
+      -EINVAL);
+    return;
+  }
+
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer_incoming *incoming = s_hash_lookup(
+    transfers->incoming, &id);
+  uint64_t offset = incoming ? (uint64_t)incoming->contiguous * chunk : 0;
+  if (incoming)
+    incoming->last = _s_ssl_transfer_now();
+  pthread_mutex_unlock(&transfers->lock);
+  if (incoming) {
+    daemon_log(LOG_NOTICE, "transfer %016llx resumed at %llu\n",
+      (unsigned long long)id, (unsigned long long)offset);
+    _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACCEPT, id,
+      offset, 0);
+    return;
+  }
+
+  int fd = transfers->funcs.offer(transfers->userdata, id, size, &offset);
+  if (fd < 0) {
+    _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACCEPT, id, 0, fd);
+    return;
+  }
+
+  incoming = daemon_malloc(sizeof(struct s_ssl_transfer_incoming));
+  incoming->bitmap = daemon_calloc(count / 8 + 1, sizeof(uint8_t));
+  incoming->chunk = chunk;
+  incoming->count = count;
+  incoming->contiguous = offset / chunk < count ? offset / chunk : count;
+  incoming->fd = fd;
+  incoming->id = id;
+  incoming->last = _s_ssl_transfer_now();
+  incoming->received = incoming->contiguous;
+  incoming->size = size;
+  for (uint32_t i = 0; i < incoming->contiguous; i++)
+    incoming->bitmap[i / 8] |= 1 << (i % 8);
+  offset = (uint64_t)incoming->contiguous * chunk;
+
+  pthread_mutex_lock(&transfers->lock);
+  int ret = s_hash_insert(transfers->incoming, &incoming->id, incoming);
+  pthread_mutex_unlock(&transfers->lock);
+  if (ret != 0) {
+    daemon_free(incoming->bitmap);
+    daemon_free(incoming);
+    transfers->funcs.received(transfers->userdata, id, fd, ret);
+    _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACCEPT, id, 0,
+      ret);
+    return;
+  }
+  daemon_log(LOG_NOTICE, "transfer %016llx of %llu bytes accepted\n",
+    (unsigned long long)id, (unsigned long long)size);
+  _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACCEPT, id, offset,
+    0);
+  /* an empty transfer, or one already stored, completes with its first
+   * offer */
+  if (incoming->received == incoming->count) {
+    pthread_mutex_lock(&transfers->lock);
+    incoming = s_hash_steal(transfers->incoming, &id);
+    pthread_mutex_unlock(&transfers->lock);
+    if (incoming) {
+      transfers->funcs.received(transfers->userdata, id, incoming->fd, 0);
+      daemon_free(incoming->bitmap);
+      daemon_free(incoming);
+    }
+  }
+}
+
+/**
+ * @brief Accept handler: the transfer runs from the offset the peer answered
+ */
+static void _s_ssl_transfer_accept(struct s_ssl_transfers *transfers,
+  daemon_unused struct s_ssl_connection *connection,
+  struct s_ssl_packet_view *view)
+{
+  if (view->size < S_SSL_TRANSFER_ANSWER_SIZE) {
+    s_ssl_packet_view_release(view);
+    return;
+  }
+  const uint8_t *data = s_ssl_packet_view_pullup(view);
+  uint64_t id = s_ssl_frame_id_decode(data);
+  uint64_t offset = s_ssl_frame_id_decode(data + 8);
+  int32_t status = (int32_t)_s_ssl_transfer_decode(data + 16);
+  s_ssl_packet_view_release(view);
+
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer *transfer = s_hash_lookup(transfers->outgoing, &id);
+  if (!transfer || transfer->state != e_ssl_transfer_offering) {
+    pthread_mutex_unlock(&transfers->lock);
+    return;
+  }
+
+  int notify = 0;
+  if (status < 0) {
+    transfer->state = e_ssl_transfer_done;
+    notify = 1;
+  } else {
+    /* whatever was in flight is sent again, the peer kept what it acked */
+    uint32_t first = offset / transfer->chunk < transfer->count ?
+      offset / transfer->chunk : transfer->count;
+    for (uint32_t i = 0; i < transfer->count; i++)
+      transfer->states[i] = i < first ? S_SSL_TRANSFER_ACKED :
+        S_SSL_TRANSFER_PENDING;
+    for (uint8_t i = 0; i < transfer->lanes.count; i++)
+      transfer->lanes.list[i].inflight = 0;
+    transfer->acked = first;
+    transfer->done = first;
+    transfer->next = first;
+    transfer->state = e_ssl_transfer_running;
+    notify = _s_ssl_transfer_complete(transfer);
+  }
+  pthread_mutex_unlock(&transfers->lock);
+
+  if (notify)
+    transfers->funcs.sent(transfers->userdata, id, status < 0 ? status : 0);
+  else
+    /* the lanes run on other loops, they are filled from the engine one */
+    event_active(transfers->timer, EV_TIMEOUT, 0);
+}
+
+/**
+ * @brief Chunk handler: the chunk is checked, then handed to the storage
+ * thread. Its data is moved out of the view, so the connection keeps parsing
+ * while the chunk is stored
+ */
+static void _s_ssl_transfer_chunk(struct s_ssl_transfers *transfers,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
+{
+  if (view->size < S_SSL_TRANSFER_HEADER_SIZE) {
+    s_ssl_packet_view_release(view);
+    return;
+  }
+  uint8_t header[S_SSL_TRANSFER_HEADER_SIZE];
+  evbuffer_remove(view->buffer, header, sizeof(header));
+  view->size -= sizeof(header);
+  uint64_t id = s_ssl_frame_id_decode(header);
+  uint64_t offset = s_ssl_frame_id_decode(header + 8);
+
+  int status = 1;
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer_incoming *incoming = s_hash_lookup(
+    transfers->incoming, &id);
+  uint32_t index = incoming ? offset / incoming->chunk : 0;
+  if (!incoming)
+    status = -ENOENT;
+  else if (offset % incoming->chunk || offset >= incoming->size ||
+      index >= incoming->count ||
+      view->size != _s_ssl_transfer_length(incoming->size, incoming->chunk,
+        index))
+    status = -EBADMSG;
+  else if (incoming->bitmap[index / 8] & (1 << (index % 8)))
+    status = 0;
+  else if (transfers->storage.queued >= S_SSL_TRANSFER_QUEUE)
+    status = -EBUSY;
+  if (incoming)
+    incoming->last = _s_ssl_transfer_now();
+
+  if (status == 1) {
+    struct s_ssl_transfer_job *job = daemon_malloc(
+      sizeof(struct s_ssl_transfer_job));
+    job->body = evbuffer_new();
+    job->connection = s_ssl_connection_ref(connection);
+    job->crc = _s_ssl_transfer_decode(header + 16);
+    job->id = id;
+    job->index = index;
+    job->length = view->size;
+    job->offset = offset;
+    job->type = e_ssl_transfer_job_store;
+    /* the chains are moved, the data isn't copied */
+    if (job->body &&
+        evbuffer_remove_buffer(view->buffer, job->body, view->size) ==
+        (int)view->size) {
+      view->size = 0;
+      _s_ssl_transfer_queue(transfers, job);
+    } else {
+      _s_ssl_transfer_job_free(job);
+      status = -ENOMEM;
+    }
+  }
+  if (status == -EBADMSG)
+    daemon_log(LOG_WARNING, "transfer %016llx: bad chunk at %llu\n",
+      (unsigned long long)id, (unsigned long long)offset);
+  pthread_mutex_unlock(&transfers->lock);
+
+  s_ssl_packet_view_release(view);
+  if (status != 1)
+    _s_ssl_transfer_answer(connection, S_SSL_TRANSFER_TYPE_ACK, id, offset,
+      status);
+}
+
+/**
+ * @brief Check a received chunk and write it in the file of its transfer,
+ * from the storage thread, then acknowledge it. The transfer isn't abandoned
+ * while its chunk is stored
+ * @param [in] transfers: engine running the transfer
+ * @param [in] job: chunk to store
+ */
+static void _s_ssl_transfer_store(struct s_ssl_transfers *transfers,
+  struct s_ssl_transfer_job *job)
+{
+  uint32_t index = job->index;
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer_incoming *incoming = s_hash_lookup(
+    transfers->incoming, &job->id);
+  int fd = incoming ? incoming->fd : -1;
+  int stored = incoming && (incoming->bitmap[index / 8] & (1 << (index % 8)));
+  if (incoming)
+    incoming->storing = 1;
+  pthread_mutex_unlock(&transfers->lock);
+
+  int status = 0;
+  if (!incoming)
+    status = -ENOENT;
+  else if (stored)
+    status = 0;
+  else if (_s_ssl_transfer_crc(job->body, job->length) != job->crc)
+    status = -EBADMSG;
+  else
+    status = _s_ssl_transfer_write(job->body, job->length, fd, job->offset);
+
+  pthread_mutex_lock(&transfers->lock);
+  incoming = s_hash_lookup(transfers->incoming, &job->id);
+  if (incoming)
+    incoming->storing = 0;
+  if (incoming && status == 0 &&
+      !(incoming->bitmap[index / 8] & (1 << (index % 8)))) {
+    incoming->bitmap[index / 8] |= 1 << (index % 8);
+    incoming->received++;
+    while (incoming->contiguous < incoming->count &&
+           (incoming->bitmap[incoming->contiguous / 8] &
+            (1 << (incoming->contiguous % 8))))
+      incoming->contiguous++;
+    if (incoming->received == incoming->count)
+      s_hash_steal(transfers->incoming, &job->id);
+    else
+      incoming = NULL;
+  } else {
+    incoming = NULL;
+  }
+  pthread_mutex_unlock(&transfers->lock);
+
+  if (status == -EBADMSG)
+    daemon_log(LOG_WARNING, "transfer %016llx: bad chunk at %llu\n",
+      (unsigned long long)job->id, (unsigned long long)job->offset);
+  _s_ssl_transfer_answer(job->connection, S_SSL_TRANSFER_TYPE_ACK, job->id,
+    job->offset, status);
+
+  if (incoming) {
+    daemon_log(LOG_NOTICE, "transfer %016llx received\n",
+      (unsigned long long)job->id);
+    transfers->funcs.received(transfers->userdata, job->id, incoming->fd, 0);
+    daemon_free(incoming->bitmap);
+    daemon_free(incoming);
+  }
+}
+
+/**
+ * @brief Ack handler: the chunk is released, or sent again, and the window
+ * of the lane is filled
+ */
+static void _s_ssl_transfer_ack(struct s_ssl_transfers *transfers,
+  struct s_ssl_connection *connection, struct s_ssl_packet_view *view)
+{
+  if (view->size < S_SSL_TRANSFER_ANSWER_SIZE) {
+    s_ssl_packet_view_release(view);
+    return;
+  }
+  const uint8_t *data = s_ssl_packet_view_pullup(view);
+  uint64_t id = s_ssl_frame_id_decode(data);
+  uint64_t offset = s_ssl_frame_id_decode(data + 8);
+  int32_t status = (int32_t)_s_ssl_transfer_decode(data + 16);
+  s_ssl_packet_view_release(view);
+
+  int notify = 0;
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer *transfer = s_hash_lookup(transfers->outgoing, &id);
+  uint32_t index = transfer ? offset / transfer->chunk : 0;
+  if (!transfer || transfer->state != e_ssl_transfer_running ||
+      index >= transfer->count) {
+    pthread_mutex_unlock(&transfers->lock);
+    return;
+  }
+
+  uint8_t state = transfer->states[index];
+  if (state != S_SSL_TRANSFER_PENDING && state != S_SSL_TRANSFER_ACKED)
+    transfer->lanes.list[state - 1].last = _s_ssl_transfer_now();
+  if (status == 0 && state != S_SSL_TRANSFER_ACKED) {
+    _s_ssl_transfer_revert(transfer, index);
+    transfer->states[index] = S_SSL_TRANSFER_ACKED;
+    transfer->done++;
+    notify = _s_ssl_transfer_complete(transfer);
+  } else if (status == -ENOENT) {
+    /* the peer forgot the transfer, it is offered again */
+    for (uint32_t i = 0; i < transfer->count; i++)
+      _s_ssl_transfer_revert(transfer, i);
+    transfer->offered = 0;
+    transfer->state = e_ssl_transfer_offering;
+  } else if (status != 0) {
+    _s_ssl_transfer_revert(transfer, index);
+    transfer->stats.retransmits++;
+  }
+
+  for (uint8_t i = 0; i < transfer->lanes.count; i++)
+    if (transfer->lanes.list[i].connection == connection)
+      _s_ssl_transfer_pick(transfer, i);
+  pthread_mutex_unlock(&transfers->lock);
+
+  if (notify) {
+    daemon_log(LOG_NOTICE, "transfer %016llx sent\n", (unsigned long long)id);
+    transfers->funcs.sent(transfers->userdata, id, 0);
+  }
+}
+
+/**
+ * @brief Run the timer of an outgoing transfer: the chunks of a silent lane
+ * are sent again, every lane is filled, and a transfer without any lane left
+ * ends on -ENOTCONN
+ * @param [in] transfers: engine running the transfer
+ * @param [in] id: transfer id
+ * @param [in] now: current time
+ */
+static void _s_ssl_transfer_tick(struct s_ssl_transfers *transfers,
+  uint64_t id, uint64_t now)
+{
+  struct s_ssl_connection *connection = NULL;
+  uint8_t offer = 0;
+  uint8_t data[S_SSL_TRANSFER_OFFER_SIZE];
+
+  pthread_mutex_lock(&transfers->lock);
+  struct s_ssl_transfer *transfer = s_hash_lookup(transfers->outgoing, &id);
+  if (!transfer || !transfer->lanes.count) {
+    pthread_mutex_unlock(&transfers->lock);
+    return;
+  }
+
+  if (transfer->state == e_ssl_transfer_running) {
+    for (uint8_t i = 0; i < transfer->lanes.count; i++) {
+      struct s_ssl_transfer_lane *lane = &transfer->lanes.list[i];
+      if (!lane->inflight || now - lane->last < S_SSL_TRANSFER_TIMEOUT)
+        continue;
+      daemon_log(LOG_WARNING, "transfer %016llx: lane %u timed out\n",
+        (unsigned long long)id, i);
+      transfer->stats.retransmits += lane->inflight;
+      for (uint32_t j = 0; j < transfer->count; j++)
+        if (transfer->states[j] == i + 1)
+          _s_ssl_transfer_revert(transfer, j);
+    }
+    for (uint8_t i = 0; i < transfer->lanes.count; i++)
+      _s_ssl_transfer_pick(transfer, i);
+  } else if (transfer->state == e_ssl_transfer_offering &&
+      now - transfer->offered >= S_SSL_TRANSFER_TICK) {
+    /* the lanes are tried in turn until one answers */
+    offer = transfer->lanes.offer++ % transfer->lanes.count;
+    connection = s_ssl_connection_ref(transfer->lanes.list[offer].connection);
+    transfer->offered = now;
+    s_ssl_frame_id_encode(transfer->id, data);
+    s_ssl_frame_id_encode(transfer->size, data + 8);
+    _s_ssl_transfer_encode(transfer->chunk, data + 16);
+    _s_ssl_transfer_encode(0, data + 20);
+  }
+  pthread_mutex_unlock(&transfers->lock);
+
+  int ret = 0;
+  if (connection) {
+    struct s_ssl_packet packet = {
+      .flags = 0,
+      .payload = data,
+      .pool = NULL,
+      .size = sizeof(data),
+      .type = S_SSL_TRANSFER_TYPE_OFFER
+    };
+    ret = s_ssl_connection_write(connection, &packet);
+    if (ret != 0)
+      daemon_log(LOG_INFO, "transfer %016llx: lane %u unreachable\n",
+        (unsigned long long)id, offer);
+    s_ssl_connection_unref(connection);
+  }
+
+  int notify = 1;
+  pthread_mutex_lock(&transfers->lock);
+  transfer = s_hash_lookup(transfers->outgoing, &id);
+  if (transfer && connection && offer < transfer->lanes.count &&
+      transfer->lanes.list[offer].connection == connection)
+    transfer->lanes.list[offer].alive = ret != -ENOTCONN;
+  for (uint8_t i = 0; transfer && i < transfer->lanes.count; i++)
+    if (transfer->lanes.list[i].alive || transfer->lanes.list[i].inflight)
+      notify = 0;
+  notify = notify && transfer && transfer->state != e_ssl_transfer_done;
+  if (notify) {
+    /* the lanes are closed for good, new ones resume the transfer */
+    for (uint8_t i = 0; i < transfer->lanes.count; i++)
+      s_ssl_connection_unref(transfer->lanes.list[i].connection);
+    transfer->lanes.count = 0;
+    transfer->state = e_ssl_transfer_done;
+  }
+  pthread_mutex_unlock(&transfers->lock);
+  if (notify) {
+    daemon_log(LOG_WARNING, "transfer %016llx lost its lanes\n",
+      (unsigned long long)id);
+    transfers->funcs.sent(transfers->userdata, id, -ENOTCONN);
+  }
+}
+
+/**
+ * @brief Collect the key of an outgoing transfer
+ */
+static void _s_ssl_transfers_collect(uint64_t *id,
+  daemon_unused struct s_ssl_transfer *transfer, struct s_list **ids)
+{
+  *ids = s_list_append(*ids, id);
+}
+
+/**
+ * @brief Collect an incoming transfer left without any chunk for too long,
+ * unless the storage thread is writing its file
+ */
+static void _s_ssl_transfers_abandoned(daemon_unused uint64_t *id,
+  struct s_ssl_transfer_incoming *incoming, struct s_list **abandoned)
+{
+  if (!incoming->storing &&
+      _s_ssl_transfer_now() - incoming->last >= S_SSL_TRANSFER_ABANDON)
+    *abandoned = s_list_append(*abandoned, incoming);
+}
+
+/**
+ * @brief Engine timer callback
+ */
+static void _s_ssl_transfers_timer(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_transfers *transfers)
+{
+  daemon_return_if_fail(transfers);
+
+  struct s_list *ids = NULL;
+  struct s_list *abandoned = NULL;
+  uint64_t now = _s_ssl_transfer_now();
+
+  pthread_mutex_lock(&transfers->lock);
+  s_hash_foreach(transfers->outgoing,
+    (s_hash_foreach_cbk)_s_ssl_transfers_collect, &ids);
+  s_hash_foreach(transfers->incoming,
+    (s_hash_foreach_cbk)_s_ssl_transfers_abandoned, &abandoned);
+  for (struct s_list *it = abandoned; it; it = s_list_next(it))
+    s_hash_steal(transfers->incoming,
+      &((struct s_ssl_transfer_incoming *)s_list_data(it))->id);
+  /* the keys are copied, a transfer may be freed once unlocked */
+  for (struct s_list *it = ids; it; it = s_list_next(it)) {
+    uint64_t *id = daemon_malloc(sizeof(uint64_t));
+    *id = *(uint64_t *)s_list_data(it);
+    it->data = id;
+  }
+  pthread_mutex_unlock(&transfers->lock);
+
+  for (struct s_list *it = abandoned; it; it = s_list_next(it)) {
+    struct s_ssl_transfer_incoming *incoming = s_list_data(it);
+    daemon_log(LOG_WARNING, "transfer %016llx abandoned\n",
+      (unsigned long long)incoming->id);
+    transfers->funcs.received(transfers->userdata, incoming->id,
+      incoming->fd, -ETIMEDOUT);
+    daemon_free(incoming->bitmap);
+    daemon_free(incoming);
+  }
+  s_list_free(abandoned);
+  for (struct s_list *it = ids; it; it = s_list_next(it))
+    _s_ssl_transfer_tick(transfers, *(uint64_t *)s_list_data(it), now);
+  s_list_free_full(ids, (s_destroy_cbk)daemon_free);
+}
+
+/**
+ * @brief Storage thread: the chunks are read and checksummed, or checked and
+ * written, away from the loops
+ * @param [in] transfers: engine running the jobs
+ * @return NULL
+ */
+static void *_s_ssl_transfers_run(struct s_ssl_transfers *transfers)
+{
+  pthread_mutex_lock(&transfers->lock);
+  while (!transfers->storage.stop) {
+    struct s_list *first = transfers->storage.jobs;
+    if (!first) {
+      pthread_cond_wait(&transfers->storage.cond, &transfers->lock);
+      continue;
+    }
+    struct s_ssl_transfer_job *job = s_list_data(first);
+    transfers->storage.jobs = s_list_delete_link(transfers->storage.jobs,
+      first);
+    if (job->type == e_ssl_transfer_job_store)
+      transfers->storage.queued--;
+    transfers->storage.running = job;
+    pthread_mutex_unlock(&transfers->lock);
+
+    if (job->type == e_ssl_transfer_job_send)
+      _s_ssl_transfer_send(transfers, job);
+    else
+      _s_ssl_transfer_store(transfers, job);
+
+    pthread_mutex_lock(&transfers->lock);
+    transfers->storage.running = NULL;
+    pthread_cond_broadcast(&transfers->storage.idle);
+    pthread_mutex_unlock(&transfers->lock);
+    _s_ssl_transfer_job_free(job);
+    pthread_mutex_lock(&transfers->lock);
+  }
+  pthread_mutex_unlock(&transfers->lock);
+  return NULL;
+}
+
+/**
+ * @brief Deallocate an incoming transfer left when the engine is freed
+ * @param [in] incoming: transfer to delete
+ */
+static void _s_ssl_transfer_incoming_free(
+  struct s_ssl_transfer_incoming *incoming)
+{
+  close(incoming->fd);
+  daemon_free(incoming->bitmap);
+  daemon_free(incoming);
+}
+
+struct s_ssl_transfers *s_ssl_transfers_new(struct s_loop *loop,
+  const struct s_ssl_transfer_funcs *funcs, void *userdata)
+{
+  daemon_return_val_if_fail(loop, NULL);
+  daemon_return_val_if_fail(funcs, NULL);
+  daemon_return_val_if_fail(funcs->offer, NULL);
+  daemon_return_val_if_fail(funcs->received, NULL);
+  daemon_return_val_if_fail(funcs->sent, NULL);
+
+  struct s_ssl_transfers *transfers = daemon_malloc(
+    sizeof(struct s_ssl_transfers));
+  transfers->funcs = *funcs;
+  transfers->incoming = s_hash_new(_s_ssl_transfer_hash, _s_ssl_transfer_equal,
+    NULL, (s_destroy_cbk)_s_ssl_transfer_incoming_free);
+  pthread_mutex_init(&transfers->lock, NULL);
+  transfers->outgoing = s_hash_new(_s_ssl_transfer_hash, _s_ssl_transfer_equal,
+    NULL, NULL);
+  pthread_cond_init(&transfers->storage.cond, NULL);
+  pthread_cond_init(&transfers->storage.idle, NULL);
+  transfers->timer = event_new(s_loop_tolibevent(loop), -1, EV_PERSIST,
+    (event_callback_fn)_s_ssl_transfers_timer, transfers);
+  transfers->userdata = userdata;
+
+  struct timeval tv = { .tv_sec = S_SSL_TRANSFER_TICK / 1000,
+    .tv_usec = (S_SSL_TRANSFER_TICK % 1000) * 1000 };
+  if (!transfers->incoming || !transfers->outgoing || !transfers->timer ||
+      event_add(transfers->timer, &tv) != 0)
+    goto error;
+
+  int ret = pthread_create(&transfers->storage.thread, NULL,
+    (void *(*)(void *))_s_ssl_transfers_run, transfers);
+  if (ret != 0) {
+    daemon_log(LOG_ERR, "failed to start the storage thread '%s'\n",
+      strerror(ret));
+    goto error;
+  }
+  transfers->storage.started = 1;
+  return transfers;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate the transfers\n");
+  s_ssl_transfers_free(transfers);
+  return NULL;
+}
+
+void s_ssl_transfers_free(struct s_ssl_transfers *transfers)
+{
+  daemon_return_if_fail(transfers);
+
+  if (transfers->timer)
+    event_free(transfers->timer);
+  /* the running job completes, the queued ones are dropped */
+  pthread_mutex_lock(&transfers->lock);
+  transfers->storage.stop = 1;
+  pthread_cond_broadcast(&transfers->storage.cond);
+  pthread_mutex_unlock(&transfers->lock);
+  if (transfers->storage.started)
+    pthread_join(transfers->storage.thread, NULL);
+  s_list_free_full(transfers->storage.jobs,
+    (s_destroy_cbk)_s_ssl_transfer_job_free);
+
+  if (transfers->incoming)
+    s_hash_free(transfers->incoming);
+  if (transfers->outgoing)
+    s_hash_free(transfers->outgoing);
+  pthread_cond_destroy(&transfers->storage.idle);
+  pthread_cond_destroy(&transfers->storage.cond);
+  pthread_mutex_destroy(&transfers->lock);
+  daemon_free(transfers);
+}
+
+int s_ssl_transfers_register(struct s_ssl_transfers *transfers,
+  struct s_ssl_router *router)
+{
+  daemon_return_val_if_fail(transfers, -EINVAL);
+  daemon_return_val_if_fail(router, -EINVAL);
+
+  static const struct {
+    uint16_t type;
+    s_ssl_route_cbk handler;
+  } routes[] = {
+    { S_SSL_TRANSFER_TYPE_OFFER, (s_ssl_route_cbk)_s_ssl_transfer_offer },
+    { S_SSL_TRANSFER_TYPE_ACCEPT, (s_ssl_route_cbk)_s_ssl_transfer_accept },
+    { S_SSL_TRANSFER_TYPE_CHUNK, (s_ssl_route_cbk)_s_ssl_transfer_chunk },
+    { S_SSL_TRANSFER_TYPE_ACK, (s_ssl_route_cbk)_s_ssl_transfer_ack }
+  };
+  for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+    int ret = s_ssl_router_register(router, routes[i].type,
+      routes[i].handler, transfers);
+    if (ret != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/**
+ * @brief Allocate a transfer, its source is set by the caller
+ * @param [in] transfers: engine running the transfer
+ * @param [in] size: number of bytes to send
+ * @param [in] chunk: chunk size, 0 for the default one
+ * @return a valid pointer on success, NULL on error
+ */
+static struct s_ssl_transfer *_s_ssl_transfer_new(
+  struct s_ssl_transfers *transfers, uint64_t size, uint32_t chunk)
+{
+  chunk = chunk ? chunk : S_SSL_TRANSFER_CHUNK;
+  daemon_return_val_if_fail(chunk >= S_SSL_TRANSFER_CHUNK_MIN, NULL);
+  daemon_return_val_if_fail(chunk <= S_SSL_FRAME_MAX_SIZE -
+    S_SSL_TRANSFER_HEADER_SIZE, NULL);
+  uint64_t count = (size + chunk - 1) / chunk;
+  daemon_return_val_if_fail(count <= UINT32_MAX, NULL);
+
+  struct s_ssl_transfer *transfer = daemon_malloc(
+    sizeof(struct s_ssl_transfer));
+  transfer->chunk = chunk;
+  transfer->count = count;
+  transfer->fd = -1;
+  transfer->size = size;
+  transfer->state = e_ssl_transfer_done;
+  transfer->states = daemon_calloc(count + 1, sizeof(uint8_t));
+  transfer->stats.size = size;
+  transfer->transfers = transfers;
+  if (RAND_bytes((unsigned char *)&transfer->id, sizeof(uint64_t)) != 1)
+    goto error;
+
+  pthread_mutex_lock(&transfers->lock);
+  int ret = s_hash_insert(transfers->outgoing, &transfer->id, transfer);
+  pthread_mutex_unlock(&transfers->lock);
+  if (ret != 0)
+    goto error;
+  return transfer;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a transfer\n");
+  daemon_free(transfer->states);
+  daemon_free(transfer);
+  return NULL;
+}
+
+struct s_ssl_transfer *s_ssl_transfer_new_file(
+  struct s_ssl_transfers *transfers, int fd, uint64_t size, uint32_t chunk)
+{
+  daemon_return_val_if_fail(transfers, NULL);
+  daemon_return_val_if_fail(fd >= 0, NULL);
+
+  struct s_ssl_transfer *transfer = _s_ssl_transfer_new(transfers, size,
+    chunk);
+  if (transfer)
+    transfer->fd = fd;
+  return transfer;
+}
+
+struct s_ssl_transfer *s_ssl_transfer_new_buffer(
+  struct s_ssl_transfers *transfers, const uint8_t *data, uint64_t size,
+  uint32_t chunk)
+{
+  daemon_return_val_if_fail(transfers, NULL);
+  daemon_return_val_if_fail(data || !size, NULL);
+
+  struct s_ssl_transfer *transfer = _s_ssl_transfer_new(transfers, size,
+    chunk);
+  if (transfer)
+    transfer->data = data ? data : (const uint8_t *)"";
+  return transfer;
+}
+
+void s_ssl_transfer_free(struct s_ssl_transfer *transfer)
+{
+  daemon_return_if_fail(transfer);
+
+  /* the chunks already written own their data, the queued ones are dropped
+   * and the one being read is waited for */
+  struct s_ssl_transfers *transfers = transfer->transfers;
+  struct s_list *dropped = NULL;
+  pthread_mutex_lock(&transfers->lock);
+  s_hash_steal(transfers->outgoing, &transfer->id);
+  struct s_list *it = transfers->storage.jobs;
+  while (it) {
+    struct s_list *next = s_list_next(it);
+    struct s_ssl_transfer_job *job = s_list_data(it);
+    if (job->type == e_ssl_transfer_job_send && job->id == transfer->id) {
+      transfers->storage.jobs = s_list_delete_link(transfers->storage.jobs,
+        it);
+      dropped = s_list_prepend(dropped, job);
+    }
+    it = next;
+  }
+  while (transfers->storage.running &&
+         transfers->storage.running->type == e_ssl_transfer_job_send &&
+         transfers->storage.running->id == transfer->id)
+    pthread_cond_wait(&transfers->storage.idle, &transfers->lock);
+  pthread_mutex_unlock(&transfers->lock);
+  s_list_free_full(dropped, (s_destroy_cbk)_s_ssl_transfer_job_free);
+
+  for (uint8_t i = 0; i < transfer->lanes.count; i++)
+    s_ssl_connection_unref(transfer->lanes.list[i].connection);
+  daemon_free(transfer->states);
+  daemon_free(transfer);
+}
+
+int s_ssl_transfer_add_lane(struct s_ssl_transfer *transfer,
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(transfer, -EINVAL);
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  daemon_return_val_if_fail(s_ssl_connection_get_name(connection),
+    -ENOTCONN);
+
+  int ret = 0;
+  pthread_mutex_lock(&transfer->transfers->lock);
+  for (uint8_t i = 0; i < transfer->lanes.count; i++)
+    if (transfer->lanes.list[i].connection == connection)
+      ret = -EEXIST;
+  if (ret == 0 && transfer->lanes.count < S_SSL_TRANSFER_LANES) {
+    struct s_ssl_transfer_lane *lane =
+      &transfer->lanes.list[transfer->lanes.count++];
+    lane->alive = 1;
+    lane->connection = s_ssl_connection_ref(connection);
+    lane->inflight = 0;
+  } else if (ret == 0) {
+    ret = -ENOSPC;
+  }
+  pthread_mutex_unlock(&transfer->transfers->lock);
+  return ret;
+}
+
+int s_ssl_transfer_start(struct s_ssl_transfer *transfer)
+{
+  daemon_return_val_if_fail(transfer, -EINVAL);
+
+  struct s_ssl_transfers *transfers = transfer->transfers;
+  pthread_mutex_lock(&transfers->lock);
+  int ret = transfer->lanes.count ? 0 : -ENOTCONN;
+  if (ret == 0) {
+    transfer->offered = 0;
+    transfer->state = e_ssl_transfer_offering;
+  }
+  pthread_mutex_unlock(&transfers->lock);
+
+  if (ret == 0)
+    event_active(transfers->timer, EV_TIMEOUT, 0);
+  return ret;
+}
+
+uint64_t s_ssl_transfer_get_id(struct s_ssl_transfer *transfer)
+{
+  daemon_return_val_if_fail(transfer, 0);
+
+  return transfer->id;
+}
+
+int s_ssl_transfer_get_stats(struct s_ssl_transfer *transfer,
+  struct s_ssl_transfer_stats *stats)
+{
+  daemon_return_val_if_fail(transfer, -EINVAL);
+  daemon_return_val_if_fail(stats, -EINVAL);
+
+  pthread_mutex_lock(&transfer->transfers->lock);
+  *stats = transfer->stats;
+  pthread_mutex_unlock(&transfer->transfers->lock);
+  return 0;
+}
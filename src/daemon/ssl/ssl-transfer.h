@@ -0,0 +1,225 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_TRANSFER_H_
+# define _SSL_SSL_TRANSFER_H_
+
+# include <stdint.h>
+
+# include "daemon-loop.h"
+# include "ssl-connection.h"
+# include "ssl-router.h"
+
+/**
+ * @brief Message types used by the bulk transfers, registered by
+ * #s_ssl_transfers_register
+ */
+# define S_SSL_TRANSFER_TYPE_OFFER 0xf0
+# define S_SSL_TRANSFER_TYPE_ACCEPT 0xf1
+# define S_SSL_TRANSFER_TYPE_CHUNK 0xf2
+# define S_SSL_TRANSFER_TYPE_ACK 0xf3
+
+/**
+ * @brief Default chunk size
+ */
+# define S_SSL_TRANSFER_CHUNK (1 << 20)
+
+/**
+ * @brief Number of chunks in flight on each lane
+ */
+# define S_SSL_TRANSFER_WINDOW 4
+
+/**
+ * @brief Maximum number of connections a transfer is striped across
+ */
+# define S_SSL_TRANSFER_LANES 8
+
+/**
+ * @brief Period, in milliseconds, of the transfers timer: offers are resent,
+ * idle lanes are filled
+ */
+# define S_SSL_TRANSFER_TICK 1000
+
+/**
+ * @brief Time, in milliseconds, a lane may keep chunks in flight without any
+ * acknowledgement before they are sent again
+ */
+# define S_SSL_TRANSFER_TIMEOUT 10000
+
+/**
+ * @brief Time, in milliseconds, an incoming transfer may stay without any
+ * chunk before it is abandoned
+ */
+# define S_SSL_TRANSFER_ABANDON (10 * 60 * 1000)
+
+struct s_ssl_transfer;
+struct s_ssl_transfers;
+
+/**
+ * @brief Transfer counters
+ */
+struct s_ssl_transfer_stats {
+  uint64_t acknowledged;
+  uint64_t retransmits;
+  uint64_t sent;
+  uint64_t size;
+};
+
+/**
+ * @brief Call when a peer offers a transfer
+ * @param [in] userdata: userdata given to #s_ssl_transfers_new
+ * @param [in] id: transfer identifier
+ * @param [in] size: transfer size
+ * @param [in,out] offset: bytes already stored from a previous attempt, 0 by
+ * default; rounded down to a chunk boundary
+ * @return a file descriptor to write the transfer into, owned by the engine
+ * until the received callback, or an -errno value to refuse the transfer
+ */
+typedef int (*s_ssl_transfer_offer_cbk)(void *userdata, uint64_t id,
+  uint64_t size, uint64_t *offset);
+
+/**
+ * @brief Call when an incoming transfer is over, from the storage thread of
+ * the engine or from its loop
+ * @param [in] userdata: userdata given to #s_ssl_transfers_new
+ * @param [in] id: transfer identifier
+ * @param [in] fd: file descriptor returned by the offer callback, to close
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+typedef void (*s_ssl_transfer_received_cbk)(void *userdata, uint64_t id,
+  int fd, int status);
+
+/**
+ * @brief Call when an outgoing transfer is over: acknowledged, refused by the
+ * peer, or left without any connected lane (-ENOTCONN). The transfer keeps
+ * its id: once given new lanes, #s_ssl_transfer_start offers it again and it
+ * resumes from the offset the peer stored
+ * @param [in] userdata: userdata given to #s_ssl_transfers_new
+ * @param [in] id: transfer identifier, see #s_ssl_transfer_get_id
+ * @param [in] status: 0 on success, an -errno value on error
+ */
+typedef void (*s_ssl_transfer_sent_cbk)(void *userdata, uint64_t id,
+  int status);
+
+struct s_ssl_transfer_funcs {
+  s_ssl_transfer_offer_cbk offer;
+  s_ssl_transfer_received_cbk received;
+  s_ssl_transfer_sent_cbk sent;
+};
+
+/**
+ * @brief Allocate a new transfer engine. Large payloads are streamed in
+ * chunks, each one carrying its crc32, and acknowledged by the receiver once
+ * stored. The chunks are read, checksummed and written by a storage thread
+ * of the engine, never by the loops
+ * @param [in] loop: loop running the engine timer
+ * @param [in] funcs: behavior functions
+ * @param [in] userdata: userdata given to the functions
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_transfers *s_ssl_transfers_new(struct s_loop *loop,
+  const struct s_ssl_transfer_funcs *funcs, void *userdata);
+
+/**
+ * @brief Deallocate a specific engine, the transfers still running are
+ * abandoned. Must not be called from the engine callbacks
+ * @param [in] transfers: engine to delete
+ */
+void s_ssl_transfers_free(struct s_ssl_transfers *transfers);
+
+/**
+ * @brief Register the transfer message handlers on a router. An engine can
+ * serve the routers of a server and of a client
+ * @param [in] transfers: engine to register
+ * @param [in] router: router to modify
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_transfers_register(struct s_ssl_transfers *transfers,
+  struct s_ssl_router *router);
+
+/**
+ * @brief Allocate a transfer streaming a file. The chunks are mapped from the
+ * file when they are sent, never loaded up front
+ * @param [in] transfers: engine running the transfer
+ * @param [in] fd: file to send, still owned by the caller
+ * @param [in] size: number of bytes to send
+ * @param [in] chunk: chunk size, 0 for #S_SSL_TRANSFER_CHUNK
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_transfer *s_ssl_transfer_new_file(
+  struct s_ssl_transfers *transfers, int fd, uint64_t size, uint32_t chunk);
+
+/**
+ * @brief Allocate a transfer streaming a buffer
+ * @param [in] transfers: engine running the transfer
+ * @param [in] data: buffer to send, kept by the caller until the transfer is
+ * freed
+ * @param [in] size: number of bytes to send
+ * @param [in] chunk: chunk size, 0 for #S_SSL_TRANSFER_CHUNK
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_transfer *s_ssl_transfer_new_buffer(
+  struct s_ssl_transfers *transfers, const uint8_t *data, uint64_t size,
+  uint32_t chunk);
+
+/**
+ * @brief Deallocate a specific transfer, cancelling it if needed. A chunk
+ * being read by the storage thread is waited for
+ * @param [in] transfer: transfer to delete
+ */
+void s_ssl_transfer_free(struct s_ssl_transfer *transfer);
+
+/**
+ * @brief Add a connection to the lanes of a transfer. The chunks are striped
+ * over the lanes, each one keeping its own window in flight. The connection
+ * is referenced by the transfer: a lane is that connection, and a lane closed
+ * isn't replaced by a connection reopened to the same peer
+ * @param [in] transfer: transfer to modify
+ * @param [in] connection: established connection
+ * @return 0 on success, -EEXIST if the connection already is a lane,
+ * -ENOSPC if the transfer has too many lanes, an another -errno value on
+ * error
+ */
+int s_ssl_transfer_add_lane(struct s_ssl_transfer *transfer,
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Offer the transfer to the peer, the chunks are streamed once it
+ * accepted from the offset it answered
+ * @param [in] transfer: transfer to start
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_transfer_start(struct s_ssl_transfer *transfer);
+
+/**
+ * @brief Get the identifier of a transfer, chosen randomly
+ * @param [in] transfer: transfer to browse
+ * @return the transfer identifier
+ */
+uint64_t s_ssl_transfer_get_id(struct s_ssl_transfer *transfer);
+
+/**
+ * @brief Get the counters of a transfer, from any thread
+ * @param [in] transfer: transfer to browse
+ * @param [out] stats: counters to fill, the acknowledged bytes being the
+ * offset a resume starts from
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_transfer_get_stats(struct s_ssl_transfer *transfer,
+  struct s_ssl_transfer_stats *stats);
+
+#endif /* !_SSL_SSL_TRANSFER_H_ */
@@ -0,0 +1,503 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <sys/socket.h>
+#include <libdaemon/dlog.h>
+
+#include "daemon-alloc.h"
+#include "daemon-cond.h"
+#include "daemon-list.h"
+#include "ssl-connection.h"
+#include "ssl-server.h"
+#include "ssl-worker.h"
+
+/**
+ * @brief Period, in milliseconds, between two closings of a draining worker
+ */
+#define S_SSL_WORKER_DRAIN_TICK 100
+
+struct s_ssl_worker {
+  struct {
+    evconnlistener_cb cbk;
+    struct s_loop_accept *ring;
+  } accept;
+  struct s_hash *connections;
+  struct {
+    uint32_t credit;
+    s_ssl_worker_drained_cbk done;
+    struct event *event;
+    uint32_t left;
+    void *userdata;
+  } drain;
+  struct s_ssl_handshake_queue *handshakes;
+  struct evconnlistener *listener;
+  pthread_mutex_t lock;
+  struct s_loop *loop;
+  struct s_ssl_pool *pool;
+  struct s_ssl_server *server;
+  struct {
+    uint8_t owned;
+    uint8_t running;
+    pthread_t thread;
+  } thread;
+};
+
+/**
+ * @brief Worker thread entry point, run the worker loop until it is stopped
+ * @param [in] worker: worker to run
+ * @return always NULL
+ */
+static void *_s_ssl_worker_run(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, NULL);
+
+  s_loop_run(worker->loop);
+  return NULL;
+}
+
+/**
+ * @brief Peer accepted through the loop ring, handed to the listener callback
+ * as if the listener had accepted it
+ */
+static void _s_ssl_worker_accept(int fd, struct s_ssl_worker *worker)
+{
+  daemon_return_if_fail(worker);
+
+  if (fd < 0) {
+    /* the kernel refused the multishot accept, the listener takes over */
+    s_loop_accept_free(worker->accept.ring);
+    worker->accept.ring = NULL;
+    evconnlistener_enable(worker->listener);
+    return;
+  }
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (getpeername(fd, (struct sockaddr *)&ss, &len) != 0) {
+    close(fd);
+    return;
+  }
+  worker->accept.cbk(worker->listener, fd, (struct sockaddr *)&ss, len,
+    worker);
+}
+
+/**
+ * @brief Move the accepts of a fresh listener to the loop ring when the loop
+ * has one, the listener is kept as the fallback
+ * @param [in] worker: worker listening
+ * @param [in] accept: callback of the listener
+ * @return 0 on success, -EBADE if the listener couldn't be allocated
+ */
+static int _s_ssl_worker_accept_setup(struct s_ssl_worker *worker,
+  evconnlistener_cb accept)
+{
+  if (!worker->listener)
+    return -EBADE;
+
+  worker->accept.cbk = accept;
+  worker->accept.ring = s_loop_accept_new(worker->loop,
+    evconnlistener_get_fd(worker->listener),
+    (s_loop_accept_cbk)_s_ssl_worker_accept, worker);
+  if (worker->accept.ring)
+    evconnlistener_disable(worker->listener);
+  return 0;
+}
+
+/**
+ * @brief Release the listener of a worker, the ring accept first
+ * @param [in] worker: worker to modify
+ */
+static void _s_ssl_worker_accept_release(struct s_ssl_worker *worker)
+{
+  if (worker->accept.ring)
+    s_loop_accept_free(worker->accept.ring);
+  worker->accept.ring = NULL;
+  if (worker->listener)
+    evconnlistener_free(worker->listener);
+  worker->listener = NULL;
+}
+
+struct s_ssl_worker *s_ssl_worker_new(struct s_ssl_server *server,
+  struct s_loop *loop)
+{
+  struct s_ssl_worker *worker = daemon_malloc(sizeof(struct s_ssl_worker));
+  worker->connections = s_hash_new(s_str_hash, s_str_equal, NULL,
+    (s_destroy_cbk)s_ssl_connection_free);
+  pthread_mutex_init(&worker->lock, NULL);
+  worker->loop = loop ? loop : s_loop_new();
+  worker->pool = s_ssl_pool_new(S_SSL_POOL_LIMIT);
+  worker->server = server;
+  worker->thread.owned = loop == NULL;
+
+  if (!worker->loop || !worker->pool)
+    goto error;
+
+  return worker;
+
+error:
+  daemon_log(LOG_ERR, "failed to allocate a worker\n");
+  s_ssl_worker_free(worker);
+  return NULL;
+}
+
+void s_ssl_worker_free(struct s_ssl_worker *worker)
+{
+  daemon_return_if_fail(worker);
+
+  if (worker->thread.running) {
+    s_loop_quit(worker->loop);
+    pthread_join(worker->thread.thread, NULL);
+  }
+  if (worker->drain.event)
+    event_free(worker->drain.event);
+  if (worker->handshakes)
+    s_ssl_handshake_queue_free(worker->handshakes);
+  _s_ssl_worker_accept_release(worker);
+  s_hash_free(worker->connections);
+  if (worker->thread.owned && worker->loop)
+    s_loop_free(worker->loop);
+  if (worker->pool)
+    s_ssl_pool_free(worker->pool);
+  pthread_mutex_destroy(&worker->lock);
+  daemon_free(worker);
+}
+
+int s_ssl_worker_listen(struct s_ssl_worker *worker, evconnlistener_cb accept,
+  const struct sockaddr *sa, int len)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(accept, -EINVAL);
+  daemon_return_val_if_fail(sa, -EINVAL);
+
+  unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE |
+    LEV_OPT_REUSEABLE_PORT;
+#ifdef LEV_OPT_BIND_IPV4_AND_IPV6
+  /* an ipv6 listener also accepts the ipv4 peers, whatever bindv6only is */
+  if (sa->sa_family == AF_INET6)
+    flags |= LEV_OPT_BIND_IPV4_AND_IPV6;
+#endif /* !LEV_OPT_BIND_IPV4_AND_IPV6 */
+
+  worker->listener = evconnlistener_new_bind(s_loop_tolibevent(worker->loop),
+    accept, worker, flags, 1024, sa, len);
+  return _s_ssl_worker_accept_setup(worker, accept);
+}
+
+int s_ssl_worker_adopt(struct s_ssl_worker *worker, evconnlistener_cb accept,
+  int fd)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(accept, -EINVAL);
+  daemon_return_val_if_fail(fd >= 0, -EINVAL);
+  daemon_return_val_if_fail(!worker->listener, -EBUSY);
+
+  /* the socket is already listening, its accept queue is kept as is */
+  if (evutil_make_socket_nonblocking(fd) != 0)
+    return -EBADE;
+  worker->listener = evconnlistener_new(s_loop_tolibevent(worker->loop),
+    accept, worker, LEV_OPT_CLOSE_ON_FREE, 0, fd);
+  return _s_ssl_worker_accept_setup(worker, accept);
+}
+
+int s_ssl_worker_get_fd(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+
+  return worker->listener ? evconnlistener_get_fd(worker->listener) : -ENOENT;
+}
+
+int s_ssl_worker_start(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+
+  if (!worker->thread.owned || worker->thread.running)
+    return 0;
+
+  int ret = pthread_create(&worker->thread.thread, NULL,
+    (void *(*)(void *))_s_ssl_worker_run, worker);
+  if (ret != 0) {
+    daemon_log(LOG_ERR, "failed to start a worker '%s'\n", strerror(ret));
+    return -ret;
+  }
+  worker->thread.running = 1;
+  return 0;
+}
+
+int s_ssl_worker_set_handshakes(struct s_ssl_worker *worker,
+  struct s_ssl_handshake_pool *pool)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(pool, -EINVAL);
+  daemon_return_val_if_fail(!worker->thread.running, -EBUSY);
+  daemon_return_val_if_fail(!worker->handshakes, -EALREADY);
+
+  worker->handshakes = s_ssl_handshake_queue_new(pool, worker->loop);
+  return worker->handshakes ? 0 : -ENOMEM;
+}
+
+struct s_ssl_handshake_queue *s_ssl_worker_get_handshakes(
+  struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, NULL);
+
+  return worker->handshakes;
+}
+
+struct s_ssl_server *s_ssl_worker_get_server(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, NULL);
+
+  return worker->server;
+}
+
+struct s_loop *s_ssl_worker_get_loop(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, NULL);
+
+  return worker->loop;
+}
+
+struct s_ssl_pool *s_ssl_worker_get_pool(struct s_ssl_worker *worker)
+{
+  daemon_return_val_if_fail(worker, NULL);
+
+  return worker->pool;
+}
+
+int s_ssl_worker_add_connection(struct s_ssl_worker *worker,
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  const char *name = s_ssl_connection_get_name(connection);
+  daemon_return_val_if_fail(name, -EINVAL);
+
+  pthread_mutex_lock(&worker->lock);
+  /* the peer reconnected before its previous session was closed, the newest
+   * session wins. The stale one is taken out of the table first, so it is
+   * closed like any other connection once the lock is released */
+  struct s_ssl_connection *stale = s_hash_steal(worker->connections, name);
+  int ret = s_hash_insert(worker->connections, (void *)name, connection);
+  pthread_mutex_unlock(&worker->lock);
+
+  /* the server registry drops the stale connection before it is freed */
+  if (ret == 0 && worker->server)
+    ret = s_ssl_server_add_connection(worker->server, connection);
+  if (stale) {
+    daemon_log(LOG_WARNING, "'%s' replaces its previous connection\n", name);
+    s_ssl_connection_close(stale);
+  }
+  return ret;
+}
+
+int s_ssl_worker_remove_connection(struct s_ssl_worker *worker,
+  struct s_ssl_connection *connection)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(connection, -EINVAL);
+
+  const char *name = s_ssl_connection_get_name(connection);
+  int ret = -EBADE;
+
+  pthread_mutex_lock(&worker->lock);
+  if (name && s_hash_lookup(worker->connections, name) == connection) {
+    s_hash_steal(worker->connections, name);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  if (ret == 0 && worker->server)
+    s_ssl_server_remove_connection(worker->server, connection);
+  return ret;
+}
+
+/**
+ * @brief Look a connection of the worker up and reference it. The set lock is
+ * released before the connection is written, a loop callback holds the
+ * connection lock while it adds or removes a connection
+ * @param [in] worker: worker to browse
+ * @param [in] name: name of the connection
+ * @return a referenced connection, NULL if the worker doesn't know the name
+ */
+static struct s_ssl_connection *_s_ssl_worker_lookup(
+  struct s_ssl_worker *worker, const char *name)
+{
+  pthread_mutex_lock(&worker->lock);
+  struct s_ssl_connection *connection = s_hash_lookup(worker->connections,
+    name);
+  if (connection)
+    s_ssl_connection_ref(connection);
+  pthread_mutex_unlock(&worker->lock);
+  return connection;
+}
+
+int s_ssl_worker_write(struct s_ssl_worker *worker, const char *name,
+  const struct s_ssl_packet *packet)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(name, -EINVAL);
+  daemon_return_val_if_fail(packet, -EINVAL);
+
+  struct s_ssl_connection *connection = _s_ssl_worker_lookup(worker, name);
+  if (!connection)
+    return -ENOTCONN;
+  int ret = s_ssl_connection_write(connection, packet);
+  s_ssl_connection_unref(connection);
+  return ret;
+}
+
+/**
+ * @brief Reference a connection of the worker set
+ * @param [in] name: name of the connection
+ * @param [in] connection: connection to reference
+ * @param [in] list: list of the referenced connections
+ */
+static void _s_ssl_worker_collect(daemon_unused void *name,
+  struct s_ssl_connection *connection, struct s_list **list)
+{
+  *list = s_list_prepend(*list, s_ssl_connection_ref(connection));
+}
+
+void s_ssl_worker_foreach(struct s_ssl_worker *worker, s_hash_foreach_cbk func,
+  void *userdata)
+{
+  daemon_return_if_fail(worker);
+  daemon_return_if_fail(func);
+
+  struct s_list *list = NULL;
+  pthread_mutex_lock(&worker->lock);
+  s_hash_foreach(worker->connections,
+    (s_hash_foreach_cbk)_s_ssl_worker_collect, &list);
+  pthread_mutex_unlock(&worker->lock);
+
+  for (struct s_list *it = list; it; it = it->next) {
+    func((void *)s_ssl_connection_get_name(it->data), it->data, userdata);
+    s_ssl_connection_unref(it->data);
+  }
+  s_list_free(list);
+}
+
+/**
+ * @brief Connections of a draining worker, sorted by their output state
+ */
+struct s_ssl_worker_drain {
+  struct s_list *busy;
+  uint32_t count;
+  struct s_list *idle;
+};
+
+/**
+ * @brief Sort a connection of a draining worker, a connection without pending
+ * output can be closed without losing anything
+ * @param [in] name: name of the connection
+ * @param [in] connection: connection to sort
+ * @param [in] drain: sorted connections
+ */
+static void _s_ssl_worker_drain_sort(daemon_unused void *name,
+  struct s_ssl_connection *connection, struct s_ssl_worker_drain *drain)
+{
+  struct s_ssl_connection_stats stats;
+  if (s_ssl_connection_get_stats(connection, &stats) == 0 && !stats.queued &&
+      !stats.backlog)
+    drain->idle = s_list_prepend(drain->idle, connection);
+  else
+    drain->busy = s_list_prepend(drain->busy, connection);
+  drain->count++;
+}
+
+/**
+ * @brief Drain timer callback, runs on the worker loop. The closings are
+ * spread over the drain delay, so the peers don't reconnect all at once; the
+ * connections still busy at the deadline are closed anyway
+ */
+static void _s_ssl_worker_drain(daemon_unused evutil_socket_t fd,
+  daemon_unused short e, struct s_ssl_worker *worker)
+{
+  daemon_return_if_fail(worker);
+
+  s_loop_account(worker->loop, e_loop_priority_control);
+  _s_ssl_worker_accept_release(worker);
+
+  struct s_ssl_worker_drain drain = { .busy = NULL, .count = 0, .idle = NULL };
+  pthread_mutex_lock(&worker->lock);
+  s_hash_foreach(worker->connections,
+    (s_hash_foreach_cbk)_s_ssl_worker_drain_sort, &drain);
+  pthread_mutex_unlock(&worker->lock);
+
+  /* the closings are spread evenly over the ticks left, in thousandths of
+   * connection. Closing a connection removes it from the set, the lock is
+   * released */
+  uint32_t quota = drain.count;
+  if (worker->drain.left > 1) {
+    worker->drain.credit += drain.count * 1000 / worker->drain.left;
+    quota = worker->drain.credit / 1000;
+    worker->drain.credit -= quota * 1000;
+  }
+  uint32_t closed = 0;
+  for (struct s_list *it = drain.idle; it && closed < quota; it = it->next) {
+    s_ssl_connection_close(it->data);
+    closed++;
+  }
+  for (struct s_list *it = drain.busy; it && worker->drain.left <= 1;
+       it = it->next) {
+    s_ssl_connection_close(it->data);
+    closed++;
+  }
+  s_list_free(drain.idle);
+  s_list_free(drain.busy);
+  if (worker->drain.left)
+    worker->drain.left--;
+
+  if (closed < drain.count || !worker->drain.done)
+    return;
+  event_del(worker->drain.event);
+  s_ssl_worker_drained_cbk done = worker->drain.done;
+  worker->drain.done = NULL;
+  done(worker->drain.userdata);
+}
+
+int s_ssl_worker_drain(struct s_ssl_worker *worker, uint32_t timeout,
+  s_ssl_worker_drained_cbk done, void *userdata)
+{
+  daemon_return_val_if_fail(worker, -EINVAL);
+  daemon_return_val_if_fail(done, -EINVAL);
+  daemon_return_val_if_fail(!worker->drain.event, -EALREADY);
+
+  worker->drain.done = done;
+  worker->drain.left = timeout / S_SSL_WORKER_DRAIN_TICK + 1;
+  worker->drain.userdata = userdata;
+  worker->drain.event = event_new(s_loop_tolibevent(worker->loop), -1,
+    EV_PERSIST, (event_callback_fn)_s_ssl_worker_drain, worker);
+  daemon_return_val_if_fail(worker->drain.event, -ENOMEM);
+  int ret = s_loop_set_priority(worker->drain.event, e_loop_priority_control);
+  if (ret != 0) {
+    event_free(worker->drain.event);
+    worker->drain.event = NULL;
+    return ret;
+  }
+
+  /* the first tick releases the listener right away */
+  struct timeval tv = {
+    .tv_sec = S_SSL_WORKER_DRAIN_TICK / 1000,
+    .tv_usec = (S_SSL_WORKER_DRAIN_TICK % 1000) * 1000
+  };
+  if (evtimer_add(worker->drain.event, &tv) != 0)
+    return -EBADE;
+  event_active(worker->drain.event, EV_TIMEOUT, 0);
+  return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * This file is part of cerebrum.
+ *
+ * cerebrum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cerebrum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with cerebrum.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SSL_SSL_WORKER_H_
+# define _SSL_SSL_WORKER_H_
+
+# include <event2/buffer.h>
+# include <event2/listener.h>
+# include <sys/socket.h>
+
+# include "daemon-hash.h"
+# include "daemon-loop.h"
+# include "ssl-handshake.h"
+# include "ssl-packet.h"
+# include "ssl-pool.h"
+
+struct s_ssl_connection;
+struct s_ssl_server;
+struct s_ssl_worker;
+
+/**
+ * @brief Called once a draining worker closed its last connection, from the
+ * worker loop
+ * @param [in] userdata: userdata passing through #s_ssl_worker_drain
+ */
+typedef void (*s_ssl_worker_drained_cbk)(void *userdata);
+
+/**
+ * @brief Allocate a new worker. A worker owns a listener and the set of
+ * connections accepted by it, or the outbound connections of a client.
+ * @param [in] server: server owning the worker, NULL for a client
+ * @param [in] loop: loop to run on, NULL to let the worker create its own loop
+ * and run it in a dedicated thread
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_worker *s_ssl_worker_new(struct s_ssl_server *server,
+  struct s_loop *loop);
+
+/**
+ * @brief Deallocate a specific worker. A threaded worker is stopped and
+ * joined first, then its connections are closed
+ * @param [in] worker: worker to delete
+ */
+void s_ssl_worker_free(struct s_ssl_worker *worker);
+
+/**
+ * @brief Bind the worker listener. Several workers can listen on the same
+ * address, the kernel spreads the incoming connections (SO_REUSEPORT). An
+ * ipv6 address is bound dual stack. When the loop has an io_uring ring, the
+ * peers are accepted through it, see #s_loop_accept_new
+ * @param [in] worker: worker to modify
+ * @param [in] accept: callback called with the worker as userdata
+ * @param [in] sa: address to listen on
+ * @param [in] len: address length
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_listen(struct s_ssl_worker *worker, evconnlistener_cb accept,
+  const struct sockaddr *sa, int len);
+
+/**
+ * @brief Listen on an already bound and listening socket, handed over by
+ * another process
+ * @param [in] worker: worker to modify
+ * @param [in] accept: callback called with the worker as userdata
+ * @param [in] fd: listening socket, owned by the worker on success
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_adopt(struct s_ssl_worker *worker, evconnlistener_cb accept,
+  int fd);
+
+/**
+ * @brief Get the listening socket of a worker
+ * @param [in] worker: worker to browse
+ * @return the socket on success, an -errno value on error
+ */
+int s_ssl_worker_get_fd(struct s_ssl_worker *worker);
+
+/**
+ * @brief Start the worker thread. Does nothing for a worker running on an
+ * external loop
+ * @param [in] worker: worker to start
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_start(struct s_ssl_worker *worker);
+
+/**
+ * @brief Run the handshakes of the worker on a crypto pool instead of its
+ * loop. Must be called before the worker starts
+ * @param [in] worker: worker to modify
+ * @param [in] pool: pool running the handshake steps
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_set_handshakes(struct s_ssl_worker *worker,
+  struct s_ssl_handshake_pool *pool);
+
+/**
+ * @brief Get the handshake queue of a worker
+ * @param [in] worker: worker to browse
+ * @return a valid pointer if the handshakes run on a crypto pool, NULL
+ * otherwise
+ */
+struct s_ssl_handshake_queue *s_ssl_worker_get_handshakes(
+  struct s_ssl_worker *worker);
+
+/**
+ * @brief Get the server owning a worker
+ * @param [in] worker: worker to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_server *s_ssl_worker_get_server(struct s_ssl_worker *worker);
+
+/**
+ * @brief Get the loop a worker runs on
+ * @param [in] worker: worker to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_loop *s_ssl_worker_get_loop(struct s_ssl_worker *worker);
+
+/**
+ * @brief Get the packet pool of a worker, shared by the connections running
+ * on its loop
+ * @param [in] worker: worker to browse
+ * @return a valid pointer on success, NULL on error
+ */
+struct s_ssl_pool *s_ssl_worker_get_pool(struct s_ssl_worker *worker);
+
+/**
+ * @brief Add a connection to the worker set
+ * @param [in] worker: worker to modify
+ * @param [in] connection: connection to add
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_add_connection(struct s_ssl_worker *worker,
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Remove a connection from the worker set
+ * @param [in] worker: worker to modify
+ * @param [in] connection: connection to remove
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_remove_connection(struct s_ssl_worker *worker,
+  struct s_ssl_connection *connection);
+
+/**
+ * @brief Write a packet to a connection of the worker, from any thread
+ * @param [in] worker: worker to browse
+ * @param [in] name: name of the client which will receive the packet
+ * @param [in] packet: payload to send
+ * @return 0 on success, -ENOTCONN if the worker doesn't know the client, an
+ * another -errno value on error
+ */
+int s_ssl_worker_write(struct s_ssl_worker *worker, const char *name,
+  const struct s_ssl_packet *packet);
+
+/**
+ * @brief Call a function for each connection of the worker, from any thread.
+ * The connections are referenced during the iteration instead of locking the
+ * worker set, so the function may write to them; a connection closed
+ * meanwhile refuses the writes
+ * @param [in] worker: worker to browse
+ * @param [in] func: function called with the name and the connection
+ * @param [in] userdata: userdata to pass to the function
+ */
+void s_ssl_worker_foreach(struct s_ssl_worker *worker, s_hash_foreach_cbk func,
+  void *userdata);
+
+/**
+ * @brief Drain a worker, from any thread. The listener is released at once,
+ * then the connections are closed a few at a time, the ones without pending
+ * output first, so that the last one is closed by the deadline
+ * @param [in] worker: worker to drain
+ * @param [in] timeout: drain delay in milliseconds
+ * @param [in] done: callback called once the worker has no connection left
+ * @param [in] userdata: userdata to pass to the callback
+ * @return 0 on success, an -errno value on error
+ */
+int s_ssl_worker_drain(struct s_ssl_worker *worker, uint32_t timeout,
+  s_ssl_worker_drained_cbk done, void *userdata);
+
+#endif /* !_SSL_SSL_WORKER_H_ */
@@ -61,12 +61,24 @@ typedef void (*s_ssl_error_cbk)(void *userdata, enum e_ssl_error type,
   int error, const struct s_ssl_packet *packet);
 
 /**
- * @brief Read callback, called whenever a packet is received
+ * @brief Read callback, called whenever a packet is received. The view stays
+ * valid, and the connection stops parsing, until the view is released with
+ * #s_ssl_packet_view_release
  * @param [in] userdata: userdata passing through the allocator
- * @param [in] packet: payload received
+ * @param [in] view: payload received
  */
 typedef void (*s_ssl_read_cbk)(void *userdata,
-  const struct s_ssl_packet *packet);
+  struct s_ssl_packet_view *view);
+
+/**
+ * @brief Writable callback, called when the output of a connection crosses
+ * its high watermark, then once it drained below its low watermark. It may be
+ * called from the thread writing to the connection
+ * @param [in] userdata: userdata passing through the allocator
+ * @param [in] writable: 0 when the connection blocks, 1 when it accepts data
+ * again
+ */
+typedef void (*s_ssl_writable_cbk)(void *userdata, int writable);
 
 /**
  * @brief Ssl socket behavior callback
@@ -121,11 +133,16 @@ static inline SSL_CTX *s_ssl_context_server_new(const char *certificate,
 }
 
 /**
- * @brief Create a client openssl context
+ * @brief Create a client openssl context. The server certificate is verified
+ * against the authority, or pinned to the daemon certificate when there is no
+ * authority: the daemons share the same one
  * @param certificate: certificate path file
+ * @param authority: certificate authority path file, NULL to pin the
+ * certificate
  * @return a valid pointer on success, NULL on error
  */
-static inline SSL_CTX *s_ssl_context_client_new(const char *certificate)
+static inline SSL_CTX *s_ssl_context_client_new(const char *certificate,
+  const char *authority)
 {
   daemon_return_val_if_fail(certificate, NULL);
 
@@ -136,11 +153,18 @@ static inline SSL_CTX *s_ssl_context_client_new(const char *certificate)
   SSL_CTX *context = SSL_CTX_new(SSLv23_client_method());
   daemon_return_val_if_fail(context, NULL);
 
-  if (!SSL_CTX_use_certificate_chain_file(context, certificate)) {
+  if (!SSL_CTX_use_certificate_chain_file(context, certificate) ||
+      !SSL_CTX_load_verify_locations(context,
+        authority ? authority : certificate, NULL)) {
     daemon_log(LOG_ERR, "failed to initialize the ssl layer\n");
     SSL_CTX_free(context);
     return NULL;
   }
+  /* a pinned certificate is trusted without its issuer */
+  if (!authority)
+    X509_STORE_set_flags(SSL_CTX_get_cert_store(context),
+      X509_V_FLAG_PARTIAL_CHAIN);
+  SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
   SSL_CTX_set_options(context, SSL_OP_NO_SSLv2);
   return context;
 }